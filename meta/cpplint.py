@@ -243,6 +243,9 @@ _CPP_HEADERS = frozenset([
     'ropeimpl.h', 'SFile.h', 'slist', 'slist.h', 'stack.h', 'stdexcept',
     'stdiostream.h', 'streambuf.h', 'stream.h', 'strfile.h', 'string',
     'strstream', 'strstream.h', 'tempbuf.h', 'tree.h', 'typeinfo', 'valarray',
+    # C++11 headers.
+    'array', 'atomic', 'chrono', 'condition_variable', 'cstdint', 'future',
+    'mutex', 'random', 'thread', 'tuple', 'unordered_set',
     ])
 
 
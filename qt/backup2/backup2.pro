@@ -61,9 +61,9 @@ RESOURCES += \
 win32: SOURCES += vss_proxy.cpp
 win32: HEADERS += vss_proxy.h
 
-win32:CONFIG(release, debug|release): LIBS += -L$$PWD/../../src/release/ -lbackup_library -lfileset -lfile -lbackup_volume -lmd5_generator -lgzip_encoder -lstatus
-else:win32:CONFIG(debug, debug|release): LIBS += -L$$PWD/../../src/debug/ -lbackup_library -lfileset -lfile -lbackup_volume -lmd5_generator -lgzip_encoder -lstatus
-else:unix: LIBS += -L$$PWD/../../src/ -lbackup_library -lfileset -lfile -lbackup_volume -lmd5_generator -lgzip_encoder -lstatus -lcrypto
+win32:CONFIG(release, debug|release): LIBS += -L$$PWD/../../src/release/ -lverify_engine -lrestore_engine -lbackup_library -lchunk_cache -lvolume_cache -lfile_state_cache -lextent_map -lfileset -lpath_table -lfile -lbackup_volume -lcrc32c -lmd5_generator -lgzip_encoder -lstatus
+else:win32:CONFIG(debug, debug|release): LIBS += -L$$PWD/../../src/debug/ -lverify_engine -lrestore_engine -lbackup_library -lchunk_cache -lvolume_cache -lfile_state_cache -lextent_map -lfileset -lpath_table -lfile -lbackup_volume -lcrc32c -lmd5_generator -lgzip_encoder -lstatus
+else:unix: LIBS += -L$$PWD/../../src/ -lverify_engine -lrestore_engine -lbackup_library -lchunk_cache -lvolume_cache -lfile_state_cache -lextent_map -lfileset -lpath_table -lfile -lbackup_volume -lcrc32c -lmd5_generator -lgzip_encoder -lstatus -lcrypto
 DEPENDPATH += $$PWD/../../src/Release
 
 win32:CONFIG(release, debug|release): LIBS += -L$$PWD/../../../boost_1_53_0/stage/lib/ -lboost_filesystem-vc110-mt-1_53
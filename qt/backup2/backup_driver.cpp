@@ -4,6 +4,7 @@
 #include <QElapsedTimer>
 #include <QFileDialog>
 
+#include <algorithm>
 #include <iostream>
 #include <map>
 #include <memory>
@@ -24,7 +25,9 @@
 #include "src/callback.h"
 #include "src/file.h"
 #include "src/file_interface.h"
+#include "src/file_state_cache.h"
 #include "src/fileset.h"
+#include "src/path.h"
 #include "src/status.h"
 #include "src/md5_generator.h"
 #include "src/gzip_encoder.h"
@@ -35,11 +38,15 @@ using backup2::BackupVolumeFactory;
 using backup2::GzipEncoder;
 using backup2::File;
 using backup2::FileEntry;
+using backup2::FileExtent;
 using backup2::FileInterface;
 using backup2::FileSet;
+using backup2::FileStateCache;
+using backup2::FileStateRecord;
 using backup2::Label;
 using backup2::Md5Generator;
 using backup2::NewPermanentCallback;
+using backup2::ProperPath;
 using backup2::Status;
 using backup2::StatusOr;
 using std::make_pair;
@@ -134,6 +141,9 @@ StatusOr<QVector<BackupItem> > BackupDriver::GetHistory(
       case backup2::kBackupTypeDifferential:
         item.type = "Differential";
         break;
+      case backup2::kBackupTypeSyntheticFull:
+        item.type = "Synthetic Full";
+        break;
       default:
         item.type = "** Invalid **";
         break;
@@ -189,6 +199,10 @@ void BackupDriver::PerformBackup() {
   LOG(INFO) << "Performing backup.";
   backup2::BackupOptions options;
   options.set_enable_compression(options_.enable_compression);
+  options.set_update_file_state_cache(true);
+  options.set_append_detection(options_.append_detection);
+  options.set_track_extents(options_.track_extents);
+  options.set_max_file_set_memory_mb(256);
   options.set_description(options_.description);
   options.set_max_volume_size_mb(
       options_.split_volumes ? options_.volume_size_mb : 0);
@@ -210,6 +224,9 @@ void BackupDriver::PerformBackup() {
     case kBackupTypeDifferential:
       options.set_type(backup2::kBackupTypeDifferential);
       break;
+    case kBackupTypeSyntheticFull:
+      options.set_type(backup2::kBackupTypeSyntheticFull);
+      break;
     default:
       LOG(FATAL) << "Invalid backup type";
       break;
@@ -222,7 +239,7 @@ void BackupDriver::PerformBackup() {
       file, NewPermanentCallback(this, &BackupDriver::GetBackupVolume),
       new Md5Generator(), new GzipEncoder(),
       new BackupVolumeFactory());
-  Status retval = library.Init();
+  Status retval = library.InitForBackup();
   if (!retval.ok()) {
     emit LogEntry("Error opening library:");
     emit LogEntry(retval.ToString().c_str());
@@ -258,6 +275,16 @@ void BackupDriver::PerformBackup() {
       break;
 
     case kBackupTypeFull:
+      // Full backups read every file, so they can be trusted after suspected
+      // corruption.
+      total_size = LoadFullFilelist(&filelist);
+      break;
+
+    case kBackupTypeSyntheticFull:
+      if (!LoadCarryForwardBase(&library)) {
+        emit LogEntry("No synthetic full base found, assuming full backup.");
+        options.set_type(backup2::kBackupTypeFull);
+      }
       total_size = LoadFullFilelist(&filelist);
       break;
 
@@ -296,7 +323,7 @@ void BackupDriver::PerformBackup() {
   uint64_t size_since_last_update = 0;
   for (string filename : filelist) {
     VLOG(3) << "Processing " << filename;
-    filename = File(filename).ProperName();
+    filename = ProperPath(filename);
 
     // Convert the filename
     string converted_filename = vss_->ConvertFilename(filename);
@@ -322,14 +349,34 @@ void BackupDriver::PerformBackup() {
       continue;
     }
 
-    FileEntry* entry = library.CreateNewFile(filename, metadata);
-    if (metadata.file_type == BackupFile::kFileTypeSymlink) {
-      entry->set_symlink_target(symlink_target);
+    // Unchanged files just point at the chunks already in the library.
+    auto base_iter = base_files_.find(filename);
+    FileEntry* entry = NULL;
+    if (base_iter != base_files_.end() &&
+        !FileChanged(file.get(), base_iter->second)) {
+      entry = library.CarryForwardFile(*base_iter->second, metadata);
+    }
+    if (entry) {
+      completed_size += metadata.file_size;
+      Status retval = library.FinishFile(entry);
+      LOG_IF(FATAL, !retval.ok())
+          << "Could not finish file: " << retval.ToString();
+      if (cancelled_) {
+        break;
+      }
+      continue;
     }
 
     // If the file type is not a normal file, we don't store any chunks or try
     // and read from it.
     if (metadata.file_type != BackupFile::kFileTypeRegularFile) {
+      entry = library.CreateNewFile(filename, metadata);
+      if (metadata.file_type == BackupFile::kFileTypeSymlink) {
+        entry->set_symlink_target(symlink_target);
+      }
+      Status retval = library.FinishFile(entry);
+      LOG_IF(FATAL, !retval.ok())
+          << "Could not finish file: " << retval.ToString();
       if (cancelled_) {
         break;
       }
@@ -342,11 +389,50 @@ void BackupDriver::PerformBackup() {
       emit LogEntry(
           string("Skipping file " + converted_filename + ": " +
                  status.ToString()).c_str());
-      library.AbortFile(entry);
       continue;
     }
     status = Status::OK;
 
+    // The extents are taken before reading, so that changes made while we read
+    // show up as changed extents next time.
+    vector<FileExtent> extents;
+    bool have_extents =
+        options_.track_extents && file->GetExtents(&extents).ok();
+
+    // Files that were only appended to keep their previous chunks, and we
+    // just read the new data.  Other changed files keep the chunks whose
+    // extents didn't change, and we read the regions in between.
+    uint64_t resume_offset = 0;
+    vector<pair<uint64_t, uint64_t> > read_ranges;
+    if (base_iter != base_files_.end()) {
+      entry = library.CarryForwardAppendedFile(
+          *base_iter->second, metadata, file.get(), &resume_offset);
+      if (!entry && have_extents) {
+        entry = library.CarryForwardUnchangedExtents(
+            *base_iter->second, metadata, extents, &read_ranges);
+        if (entry) {
+          resume_offset = metadata.file_size;
+        }
+      }
+    }
+    if (entry) {
+      completed_size += resume_offset;
+    } else {
+      entry = library.CreateNewFile(filename, metadata);
+    }
+
+    status = BackupRanges(&library, file.get(), entry, read_ranges);
+    if (!status.ok()) {
+      LOG(WARNING) << "Error reading file " << converted_filename << ": "
+                   << status.ToString();
+      emit LogEntry(string("Error reading file " + converted_filename +
+                           ": " + status.ToString()).c_str());
+      library.AbortFile(entry);
+      file->Close();
+      continue;
+    }
+    file->Seek(resume_offset);
+
     string data;
     uint64_t current_offset = 0;
     uint64_t string_offset = 0;
@@ -365,21 +451,24 @@ void BackupDriver::PerformBackup() {
           emit LogEntry(string("Error reading file " + converted_filename +
                                ": " + status.ToString()).c_str());
           library.AbortFile(entry);
+          entry = NULL;
           break;
         }
         data.resize(read);
       }
 
-      // Grab another chunk from the read data and write it out.
-      string to_write(data, string_offset, 64*1024);
+      // Write out another chunk of the read data, straight from the buffer.
+      size_t chunk_size = std::min<size_t>(data.size() - string_offset,
+                                           64*1024);
 
-      Status retval = library.AddChunk(to_write, current_offset, entry);
+      Status retval = library.AddChunk(data.data() + string_offset,
+                                       chunk_size, current_offset, entry);
       LOG_IF(FATAL, !retval.ok())
           << "Could not add chunk to volume: " << retval.ToString();
-      string_offset += to_write.size();
-      current_offset += to_write.size();
-      completed_size += to_write.size();
-      size_since_last_update += to_write.size();
+      string_offset += chunk_size;
+      current_offset += chunk_size;
+      completed_size += chunk_size;
+      size_since_last_update += chunk_size;
       if (size_since_last_update > 1048576) {
         size_since_last_update = 0;
         emit StatusUpdated(
@@ -407,6 +496,15 @@ void BackupDriver::PerformBackup() {
                (string_offset == data.size() &&
                 status.code() == backup2::kStatusShortRead)));
 
+    // Only keep the extents if the file was read completely, and wasn't moved
+    // around while we read it.
+    vector<FileExtent> extents_after;
+    if (have_extents && !cancelled_ &&
+        status.code() == backup2::kStatusShortRead &&
+        file->GetExtents(&extents_after).ok() && extents_after == extents) {
+      library.RecordFileExtents(*entry, extents);
+    }
+
     // We've reached the end of the file (or cancelled).  Close it out and
     // start the next one.
     file->Close();
@@ -414,6 +512,11 @@ void BackupDriver::PerformBackup() {
     if (cancelled_) {
       break;
     }
+    if (entry) {
+      Status retval = library.FinishFile(entry);
+      LOG_IF(FATAL, !retval.ok())
+          << "Could not finish file: " << retval.ToString();
+    }
   }
 
   // All done with the backup, close out the file set.
@@ -431,22 +534,19 @@ bool BackupDriver::LoadIncrementalFilelist(
     uint64_t* size_out) {
   uint64_t total_size = 0;
 
-  // Read the filesets from the library leading up to the last full backup.
-  // Filesets are in order of most recent backup to least recent, and the least
-  // recent one should be a full backup.
-  StatusOr<vector<FileSet*> > filesets = library->LoadFileSetsFromLabel(
-      false, options_.label_id);
-  if (!filesets.ok()) {
-    if (filesets.status().code() == backup2::kStatusNoSuchFile) {
-      // New backup, we're doing a full backup.
-      return false;
+  // Incremental backups only need to know which files changed since the last
+  // backup, which the file state cache can tell us without loading any file
+  // sets.  Differential backups compare against the full backup, so they
+  // always need the file sets.
+  unique_ptr<FileStateCache> cache;
+  if (!differential) {
+    StatusOr<FileStateCache*> cache_result =
+        library->LoadFileStateCache(options_.label_id);
+    if (cache_result.ok()) {
+      cache.reset(cache_result.value());
+    } else {
+      LOG(INFO) << "No file state cache, loading previous backups";
     }
-    LOG(FATAL) << "Unhandled error: " << filesets.status().ToString();
-  }
-
-  if (filesets.value().size() == 0) {
-    // No suitable base, the backup driver should assume a full backup.
-    return false;
   }
 
   // Extract out the filenames and directories from each set from most recent to
@@ -455,24 +555,44 @@ bool BackupDriver::LoadIncrementalFilelist(
   // to determine which files we actually need to backup.
   unordered_map<string, const FileEntry*> combined_files;
 
-  // If this is to be a differential backup, just use the full backup at the
-  // bottom.
-  if (differential) {
-    for (const FileEntry* entry :
-         filesets.value()[filesets.value().size() - 1]->GetFiles()) {
-      auto iter = combined_files.find(entry->proper_filename());
-      if (iter == combined_files.end()) {
-        combined_files.insert(make_pair(entry->proper_filename(), entry));
+  if (!cache.get()) {
+    // Read the filesets from the library leading up to the last full backup.
+    // Filesets are in order of most recent backup to least recent, and the
+    // least recent one should be a full backup.
+    StatusOr<vector<FileSet*> > filesets = library->LoadFileSetsFromLabel(
+        false, options_.label_id);
+    if (!filesets.ok()) {
+      if (filesets.status().code() == backup2::kStatusNoSuchFile) {
+        // New backup, we're doing a full backup.
+        return false;
       }
+      LOG(FATAL) << "Unhandled error: " << filesets.status().ToString();
     }
-  } else {
-    for (FileSet* fileset : filesets.value()) {
-      for (const FileEntry* entry : fileset->GetFiles()) {
+
+    if (filesets.value().size() == 0) {
+      // No suitable base, the backup driver should assume a full backup.
+      return false;
+    }
+
+    // If this is to be a differential backup, just use the full backup at the
+    // bottom.
+    if (differential) {
+      for (const FileEntry* entry :
+           filesets.value()[filesets.value().size() - 1]->GetFiles()) {
         auto iter = combined_files.find(entry->proper_filename());
         if (iter == combined_files.end()) {
           combined_files.insert(make_pair(entry->proper_filename(), entry));
         }
       }
+    } else {
+      for (FileSet* fileset : filesets.value()) {
+        for (const FileEntry* entry : fileset->GetFiles()) {
+          auto iter = combined_files.find(entry->proper_filename());
+          if (iter == combined_files.end()) {
+            combined_files.insert(make_pair(entry->proper_filename(), entry));
+          }
+        }
+      }
     }
   }
 
@@ -480,6 +600,8 @@ bool BackupDriver::LoadIncrementalFilelist(
   // each file.  We include any files that don't exist in our set, or that do
   // and have their modification date, size, attributes, or permissions
   // changed.
+  base_files_.clear();
+  vector<pair<string, const FileStateRecord*> > reuse_files;
   for (QString filename : paths_) {
     unique_ptr<File> file(new File(filename.toStdString()));
 
@@ -490,9 +612,40 @@ bool BackupDriver::LoadIncrementalFilelist(
       continue;
     }
 
-    // Look for the file in our map.
-    auto iter = combined_files.find(filename.toStdString());
-    if (iter == combined_files.end()) {
+    // Look for the file in the previous backups.
+    bool found = false;
+    bool changed = false;
+    if (cache.get()) {
+      const FileStateRecord* record = cache->Find(file->GenericName());
+      if (record) {
+        found = true;
+        BackupFile disk_metadata;
+        file->FillBackupFile(&disk_metadata, NULL);
+        changed = FileStateCache::RecordChanged(*record, disk_metadata);
+        if (changed &&
+            disk_metadata.file_type == BackupFile::kFileTypeRegularFile &&
+            MayReuseChunks(disk_metadata.file_size, record->file_size)) {
+          reuse_files.push_back(make_pair(filename.toStdString(), record));
+        }
+      }
+    } else {
+      auto iter = combined_files.find(filename.toStdString());
+      if (iter != combined_files.end()) {
+        found = true;
+        changed = FileChanged(file.get(), iter->second);
+
+        // Changed files may still be able to use some of their previous
+        // chunks.
+        uint64_t file_size = 0;
+        if (changed && file->IsRegularFile() && file->size(&file_size).ok() &&
+            MayReuseChunks(file_size,
+                           iter->second->GetBackupFile()->file_size)) {
+          base_files_.insert(*iter);
+        }
+      }
+    }
+
+    if (!found) {
       // Not found, add it to the final filelist.
       if (!file->IsDirectory()) {
         uint64_t file_size = 0;
@@ -511,7 +664,7 @@ bool BackupDriver::LoadIncrementalFilelist(
     }
 
     // If modification dates or sizes change, we add it.
-    if (FileChanged(file.get(), iter->second)) {
+    if (changed) {
       // File changed, add it.
       if (file->IsRegularFile()) {
         uint64_t file_size = 0;
@@ -528,6 +681,15 @@ bool BackupDriver::LoadIncrementalFilelist(
     }
   }
 
+  // The cache records which backup has each file's chunk list, so only those
+  // backups are loaded for the changed files to re-use chunks from.
+  if (!reuse_files.empty()) {
+    Status retval =
+        library->LoadFilesFromStateRecords(reuse_files, &base_files_);
+    LOG_IF(FATAL, !retval.ok())
+        << "Could not load previous files: " << retval.ToString();
+  }
+
   // We don't care about deleted files, because the user always has access to
   // load those files.  Plus, the UI should only be passing in files that
   // actually exist.
@@ -535,6 +697,77 @@ bool BackupDriver::LoadIncrementalFilelist(
   return true;
 }
 
+bool BackupDriver::MayReuseChunks(uint64_t size,
+                                  uint64_t previous_size) const {
+  // Any changed file may have regions that weren't rewritten, but only grown
+  // files can have been appended to.
+  return options_.track_extents ||
+         (options_.append_detection != backup2::kAppendDetectionOff &&
+          size > previous_size);
+}
+
+Status BackupDriver::BackupRanges(
+    BackupLibrary* library, File* file, FileEntry* entry,
+    const vector<pair<uint64_t, uint64_t> >& ranges) {
+  for (const pair<uint64_t, uint64_t>& range : ranges) {
+    file->Seek(range.first);
+    uint64_t offset = range.first;
+    uint64_t remaining = range.second;
+    while (remaining > 0) {
+      size_t read = 0;
+      string data;
+      data.resize(std::min(remaining, static_cast<uint64_t>(64*1024)));
+      Status status = file->Read(&data.at(0), data.size(), &read);
+      if (!status.ok() && status.code() != backup2::kStatusShortRead) {
+        return status;
+      }
+      if (read == 0) {
+        break;
+      }
+      data.resize(read);
+      Status retval = library->AddChunk(data, offset, entry);
+      LOG_IF(FATAL, !retval.ok())
+          << "Could not add chunk to volume: " << retval.ToString();
+      if (status.code() == backup2::kStatusShortRead) {
+        break;
+      }
+      offset += read;
+      remaining -= read;
+    }
+  }
+  return Status::OK;
+}
+
+bool BackupDriver::LoadCarryForwardBase(BackupLibrary* library) {
+  // Read the filesets from the library leading up to the last full backup.
+  StatusOr<vector<FileSet*> > filesets = library->LoadFileSetsFromLabel(
+      false, options_.label_id);
+  if (!filesets.ok()) {
+    if (filesets.status().code() == backup2::kStatusNoSuchFile) {
+      // New backup, we're doing a full backup.
+      return false;
+    }
+    LOG(FATAL) << "Unhandled error: " << filesets.status().ToString();
+  }
+
+  if (filesets.value().size() == 0) {
+    return false;
+  }
+
+  // Filesets are in order of most recent to least recent, so the first entry
+  // we see for a file is its latest state.  Files deleted since the last
+  // backup aren't in paths_, and so are dropped from the new backup.
+  base_files_.clear();
+  for (FileSet* fileset : filesets.value()) {
+    for (const FileEntry* entry : fileset->GetFiles()) {
+      if (base_files_.find(entry->proper_filename()) == base_files_.end()) {
+        base_files_.insert(make_pair(entry->proper_filename(), entry));
+      }
+    }
+  }
+  return true;
+}
+
 uint64_t BackupDriver::LoadFullFilelist(vector<string>* filelist) {
   uint64_t total_size = 0;
   for (QString file : paths_) {
@@ -584,18 +817,6 @@ bool BackupDriver::FileChanged(File* file, const FileEntry* backup_file) {
     return true;
   }
 
-  // Check regular file stats.
-  if (disk_metadata.file_type == BackupFile::kFileTypeRegularFile && (
-          disk_metadata.modify_date != backup_metadata->modify_date ||
-          disk_metadata.file_size != backup_metadata->file_size)) {
-    return true;
-  }
-
-  // Check directory stats.
-  if (disk_metadata.file_type == BackupFile::kFileTypeDirectory &&
-      disk_metadata.modify_date != backup_metadata->modify_date) {
-    return true;
-  }
-
-  return false;
+  // Everything else is tested as with the file state cache.
+  return backup2::BackupFileChanged(*backup_metadata, disk_metadata);
 }
@@ -7,6 +7,7 @@
 #include <QVector>
 
 #include <string>
+#include <unordered_map>
 #include <vector>
 
 #include "qt/backup2/file_selector_model.h"
@@ -27,6 +28,7 @@ enum BackupType {
   kBackupTypeFull,
   kBackupTypeIncremental,
   kBackupTypeDifferential,
+  kBackupTypeSyntheticFull,
 };
 
 struct BackupOptions {
@@ -38,6 +40,13 @@ struct BackupOptions {
   bool use_vss;
   uint64_t volume_size_mb;
 
+  // How to detect files that were only appended to.
+  backup2::AppendDetection append_detection;
+
+  // Whether to record file extents, and only read the changed regions of
+  // changed files.
+  bool track_extents;
+
   // Label information.
   bool label_set;
   uint64_t label_id;
@@ -86,11 +95,28 @@ class BackupDriver : public QObject {
   // is no suitable base to create a filelist off of, this function returns
   // false, indicating the backup driver should use a full backup.  Otherwise,
   // the filelist is returned, along with the size in bytes of all the files,
-  // in the out parameters.
+  // in the out parameters.  Changed files that may re-use some of their
+  // previous chunks are put in base_files_.
   bool LoadIncrementalFilelist(
       backup2::BackupLibrary* library, std::vector<std::string>* filelist,
       bool differential, uint64_t *size_out);
 
+  // Load the backup chain leading back to the last full backup into
+  // base_files_.  Returns false if there is no previous backup to build from,
+  // in which case a synthetic full backup should become a regular full backup.
+  bool LoadCarryForwardBase(backup2::BackupLibrary* library);
+
+  // Return whether a changed file of the given size, previously of
+  // previous_size, may re-use some of its previous chunks.
+  bool MayReuseChunks(uint64_t size, uint64_t previous_size) const;
+
+  // Read the given (offset, length) ranges of the file and add them to the
+  // entry.  Returns the status of the first failed read.
+  backup2::Status BackupRanges(
+      backup2::BackupLibrary* library, backup2::File* file,
+      backup2::FileEntry* entry,
+      const std::vector<std::pair<uint64_t, uint64_t> >& ranges);
+
   // Callback in case the backup library needs to load a volume it can't find.
   std::string GetBackupVolume(std::string orig_filename);
 
@@ -102,6 +128,11 @@ class BackupDriver : public QObject {
   PathList paths_;
   BackupOptions options_;
 
+  // Latest FileEntry for each file in the previous backup chain, keyed by
+  // filename.  Synthetic full backups carry unchanged files forward from these
+  // instead of reading them.
+  std::unordered_map<std::string, const backup2::FileEntry*> base_files_;
+
   // If set to true, a running backup is aborted.
   bool cancelled_;
 };
@@ -27,11 +27,11 @@
 #endif
 #include "qt/backup2/vss_proxy_interface.h"
 #include "src/common.h"
-#include "src/file.h"
+#include "src/path.h"
 
 #include "ui_mainwindow.h"  // NOLINT
 
-using backup2::File;
+using backup2::ProperPath;
 using std::make_pair;
 using std::string;
 using std::unique_ptr;
@@ -119,6 +119,12 @@ void BackupHelper::UpdateBackupComboDescription(int index) {
               "changed since the last full backup.";
       summary_backup_type = "Differential";
       break;
+    case 4:
+      label = "A synthetic full backup is a full backup built from the "
+              "previous backups.  Only files that have changed since the last "
+              "backup are read.";
+      summary_backup_type = "Synthetic Full";
+      break;
     default:
       break;
   }
@@ -135,7 +141,7 @@ void BackupHelper::LoadScript() {
   QStringList filenames;
   if (dialog.exec()) {
     filenames = dialog.selectedFiles();
-    string filename = File(filenames[0].toStdString()).ProperName();
+    string filename = ProperPath(filenames[0].toStdString());
     boost::property_tree::ptree pt;
     read_xml(filename, pt);
 
@@ -145,6 +151,8 @@ void BackupHelper::LoadScript() {
     string backup_description = pt.get<string>("backup.description");
     string backup_destination = pt.get<string>("backup.destination");
     bool enable_compression = pt.get<bool>("backup.enable_compression");
+    bool detect_appends = pt.get<bool>("backup.detect_appends", false);
+    bool track_extents = pt.get<bool>("backup.track_extents", false);
     bool split_volumes = pt.get<bool>("backup.split");
     bool use_vss = pt.get<bool>("backup.use_vss");
     int volume_size_index = pt.get<int>("backup.volume_size_index");
@@ -158,6 +166,8 @@ void BackupHelper::LoadScript() {
     ui_->backup_description->setText(tr(backup_description.c_str()));
     ui_->backup_dest->setText(tr(backup_destination.c_str()));
     ui_->enable_compression_checkbox->setChecked(enable_compression);
+    ui_->detect_appends_checkbox->setChecked(detect_appends);
+    ui_->track_extents_checkbox->setChecked(track_extents);
     ui_->split_fixed_check->setChecked(split_volumes);
     ui_->backup_use_vss->setChecked(use_vss);
     ui_->fixed_size_combo->setCurrentIndex(volume_size_index);
@@ -187,7 +197,7 @@ void BackupHelper::SaveScript() {
   QStringList filenames;
   if (dialog.exec()) {
     filenames = dialog.selectedFiles();
-    string filename = File(filenames[0].toStdString()).ProperName();
+    string filename = ProperPath(filenames[0].toStdString());
     boost::property_tree::ptree pt;
 
     // Grab the backup information.
@@ -196,6 +206,8 @@ void BackupHelper::SaveScript() {
     pt.put("backup.destination", ui_->backup_dest->text().toStdString());
     pt.put("backup.enable_compression",
            ui_->enable_compression_checkbox->isChecked());
+    pt.put("backup.detect_appends", ui_->detect_appends_checkbox->isChecked());
+    pt.put("backup.track_extents", ui_->track_extents_checkbox->isChecked());
     pt.put("backup.split", ui_->split_fixed_check->isChecked());
     pt.put("backup.use_vss", ui_->backup_use_vss->isChecked());
     pt.put("backup.volume_size_index", ui_->fixed_size_combo->currentIndex());
@@ -275,7 +287,7 @@ void BackupHelper::BackupLocationBrowse() {
   if (dialog.exec()) {
     filenames = dialog.selectedFiles();
     ui_->backup_dest->setText(
-        tr(File(filenames[0].toStdString()).ProperName().c_str()));
+        tr(ProperPath(filenames[0].toStdString()).c_str()));
   }
 }
 
@@ -370,6 +382,8 @@ void BackupHelper::CancelOrCloseBackup() {
     ui_->backup_dest->setText("");
     ui_->backup_description->setText("");
     ui_->enable_compression_checkbox->setChecked(false);
+    ui_->detect_appends_checkbox->setChecked(false);
+    ui_->track_extents_checkbox->setChecked(false);
     ui_->split_fixed_check->setChecked(false);
     ui_->fixed_size_combo->setCurrentIndex(0);
     ui_->fixed_size_combo->setEnabled(false);
@@ -417,6 +431,9 @@ void BackupHelper::BackupFilesLoaded(PathList paths) {
   BackupOptions options;
   options.filename = ui_->backup_dest->text().toStdString();
   options.enable_compression = ui_->enable_compression_checkbox->isChecked();
+  options.append_detection = ui_->detect_appends_checkbox->isChecked() ?
+      backup2::kAppendDetectionLastChunk : backup2::kAppendDetectionOff;
+  options.track_extents = ui_->track_extents_checkbox->isChecked();
   options.description = ui_->backup_description->text().toStdString();
   options.use_vss = ui_->backup_use_vss->isChecked();
   options.label_set = current_label_set_;
@@ -434,6 +451,9 @@ void BackupHelper::BackupFilesLoaded(PathList paths) {
     case 3:
       options.backup_type = kBackupTypeDifferential;
       break;
+    case 4:
+      options.backup_type = kBackupTypeSyntheticFull;
+      break;
     default:
       options.backup_type = kBackupTypeInvalid;
       break;
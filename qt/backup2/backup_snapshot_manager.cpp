@@ -37,17 +37,24 @@ using backup2::Md5Generator;
 using backup2::NewPermanentCallback;
 using backup2::Status;
 using backup2::StatusOr;
+using std::set;
 using std::string;
 using std::vector;
 
-FileInfo::FileInfo(FileEntry* entry, string filename) {
-  const backup2::BackupFile* metadata = entry->GetBackupFile();
-  file_size = metadata->file_size;
-  this->filename = filename;
-  vector<FileChunk> chunks = entry->GetChunks();
-  for (FileChunk chunk : chunks) {
-    volumes_needed.insert(chunk.volume_num);
+string FileInfo::filename() const {
+  return entry->proper_filename();
+}
+
+uint64_t FileInfo::file_size() const {
+  return entry->GetBackupFile()->file_size;
+}
+
+set<uint64_t> FileInfo::volumes_needed() const {
+  set<uint64_t> volumes;
+  for (const FileChunk& chunk : entry->GetChunks()) {
+    volumes.insert(chunk.volume_num);
   }
+  return volumes;
 }
 
 BackupSnapshotManager::BackupSnapshotManager(QObject* parent)
@@ -116,6 +123,9 @@ BackupItem BackupSnapshotManager::GetBackupItem(uint64_t snapshot) {
     case backup2::kBackupTypeDifferential:
       item.type = "Differential";
       break;
+    case backup2::kBackupTypeSyntheticFull:
+      item.type = "Synthetic Full";
+      break;
     default:
       item.type = "** Invalid **";
       break;
@@ -191,8 +201,7 @@ Status BackupSnapshotManager::GetBackupSets() {
     LOG(INFO) << "Loading index: " << index;
     FileSet* fileset = backup_sets.value().at(index);
     for (FileEntry* entry : fileset->GetFiles()) {
-      FileInfo info(entry, entry->proper_filename());
-      files.insert(tr(entry->proper_filename().c_str()), info);
+      files.insert(tr(entry->proper_filename().c_str()), FileInfo(entry));
     }
     cached_backup_sets_.prepend(files);
   }
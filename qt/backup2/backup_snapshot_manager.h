@@ -27,16 +27,20 @@ class FileEntry;
 class FileSet;
 }  // namespace backup2
 
-// A simple structure to contain information about files for the UI.
+// A simple structure to contain information about files for the UI.  This
+// refers to the file's entry in the loaded filesets rather than copying from
+// it, so that each snapshot's view costs a pointer per file.  It's only valid
+// while the snapshot manager's library and filesets are.
 struct FileInfo {
-  FileInfo()
-      : filename(""),
-        file_size(0) {}
-  FileInfo(backup2::FileEntry* entry, std::string filename);
-
-  std::string filename;
-  uint64_t file_size;
-  std::set<uint64_t> volumes_needed;
+  FileInfo() : entry(NULL) {}
+  explicit FileInfo(const backup2::FileEntry* entry) : entry(entry) {}
+
+  // Details of the file, read from its entry.
+  std::string filename() const;
+  uint64_t file_size() const;
+  std::set<uint64_t> volumes_needed() const;
+
+  const backup2::FileEntry* entry;
 };
 
 // The BackupSnapshotManager manages filelists in a various backup label and can
@@ -15,8 +15,10 @@
 
 #include "glog/logging.h"
 #include "src/file.h"
+#include "src/path.h"
 
 using backup2::File;
+using backup2::ProperPath;
 using std::make_pair;
 using std::pair;
 using std::set;
@@ -114,7 +116,7 @@ bool FileSelectorModel::setData(const QModelIndex& index, const QVariant& value,
     // Store checked paths, remove unchecked paths.
     if (value.toInt() != Qt::PartiallyChecked) {
       user_log_.push_back(
-          make_pair(File(filePath(index).toStdString()).ProperName(),
+          make_pair(ProperPath(filePath(index).toStdString()),
                     value.toInt()));
     } else {
       LOG(FATAL) << "BUG: We shouldn't be getting partially checked here!";
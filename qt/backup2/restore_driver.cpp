@@ -9,7 +9,6 @@
 #include <map>
 #include <set>
 #include <string>
-#include <utility>
 #include <vector>
 
 #include "boost/filesystem.hpp"
@@ -18,13 +17,16 @@
 #include "src/backup_volume_defs.h"
 #include "src/file.h"
 #include "src/fileset.h"
+#include "src/restore_engine.h"
 #include "src/status.h"
 
 using backup2::BackupFile;
 using backup2::File;
-using backup2::FileChunk;
 using backup2::FileSet;
 using backup2::FileEntry;
+using backup2::FileEntrySet;
+using backup2::RestoreChunk;
+using backup2::RestoreEngine;
 using backup2::Status;
 using std::map;
 using std::set;
@@ -63,7 +65,7 @@ void RestoreDriver::VolumeChanged(QString new_volume) {
 void RestoreDriver::PerformRestore() {
   // Determine the files to restore.  We do this in reverse order, starting
   // at the given snapshot ID and going back to the last full backup.
-  set<FileEntry*> files_to_restore;
+  FileEntrySet files_to_restore;
   for (int snapshot_id = snapshot_id_;
        snapshot_id < static_cast<int>(filesets_.size()); ++snapshot_id) {
     FileSet* fileset = filesets_.at(snapshot_id);
@@ -81,7 +83,7 @@ void RestoreDriver::PerformRestore() {
   // Find all the directories, symlinks, and other special files in the list --
   // these are created first, and differently from other files (since there's no
   // chunks to restore).
-  set<FileEntry*> special_files;
+  FileEntrySet special_files;
   for (FileEntry* entry : files_to_restore) {
     if (entry->GetBackupFile()->file_type != BackupFile::kFileTypeRegularFile) {
       special_files.insert(entry);
@@ -92,23 +94,26 @@ void RestoreDriver::PerformRestore() {
     files_to_restore.erase(files_to_restore.find(entry));
   }
 
-  // Now that we have the file sets we need to use, sort the chunks by offset
-  // and volume number to optimize the reads.  Happily, the library already
-  // knows how to do this for us!
-  vector<std::pair<FileChunk, const FileEntry*> > chunks_to_restore =
-      library_->OptimizeChunksForRestore(files_to_restore);
+  // Now that we have the file sets we need to use, find the unique chunks and
+  // sort them by offset and volume number to optimize the reads.  Happily, the
+  // library already knows how to do this for us!
+  vector<uint64_t> volumes;
+  vector<RestoreChunk> chunks_to_restore =
+      library_->PlanRestore(files_to_restore, &volumes);
+  emit LogEntry(QString("Restore needs %1 volume(s)").arg(volumes.size()));
 
   // Estimate the size of the restore.
   uint64_t restore_size = 0;
-  for (auto chunk_pair : chunks_to_restore) {
-    restore_size += chunk_pair.first.unencoded_size;
+  for (const RestoreChunk& restore_chunk : chunks_to_restore) {
+    restore_size += restore_chunk.chunk.unencoded_size *
+                    restore_chunk.destinations.size();
   }
 
   // Start the restore process by iterating through the restore sets.
   emit LogEntry("Restoring files...");
   library_->set_volume_change_callback(vol_change_cb_.get());
-  QElapsedTimer timer;
-  timer.start();
+  restore_size_ = restore_size;
+  restore_timer_.start();
 
   // Start by creating any directories and special files necessary.
   for (FileEntry* entry : special_files) {
@@ -159,95 +164,21 @@ void RestoreDriver::PerformRestore() {
     }
   }
 
-  string last_filename = "";
-  File* file = NULL;
-  uint64_t completed_size = 0;
-  uint64_t size_since_last_update = 0;
-  for (auto chunk_pair : chunks_to_restore) {
-    if (cancelled_) {
-      break;
-    }
-    FileChunk chunk = chunk_pair.first;
-    const FileEntry* entry = chunk_pair.second;
-    if (entry->proper_filename() != last_filename) {
-      if (file) {
-        file->Close();
-        delete file;
-        file = NULL;
-      }
-
-      string dest = CreateRestorePath(*entry);
-
-      // Create the destination directories if they don't exist, and open the
-      // destination file.
-      file = new File(dest);
-      Status retval = file->CreateDirectories(true);
-      if (!retval.ok()) {
-        string error_str = "Failed to create directories for " + dest +
-                           ": " + retval.ToString();
-        LOG(WARNING) << error_str;
-        emit LogEntry(error_str.c_str());
-        delete file;
-        file = NULL;
-        continue;
-      }
-
-      retval = file->Open(File::Mode::kModeReadWrite);
-      if (!retval.ok()) {
-        string error_str = "Failed to open for write " + dest +
-                           ": " + retval.ToString();
-        LOG(WARNING) << error_str;
-        emit LogEntry(error_str.c_str());
-        delete file;
-        file = NULL;
-        continue;
-      }
-
-      last_filename = entry->proper_filename();
-    }
-
-    string data;
-    Status retval = library_->ReadChunk(chunk, &data);
-    CHECK(retval.ok()) << retval.ToString();
-
-    if (data.size() == 0) {
-      // Skip empty files.
-      // TODO(darkstar62): We need a better way to handle this.
-      continue;
-    }
-    // Seek to the location for this chunk.
-    file->Seek(chunk.chunk_offset);
-    file->Write(&data.at(0), data.size());
-
-    completed_size += data.size();
-    size_since_last_update += data.size();
-    if (size_since_last_update > 1048576) {
-      size_since_last_update = 0;
-      emit StatusUpdated(
-          "Restore in progress...",
-          static_cast<int>(
-              static_cast<float>(completed_size) / restore_size * 100.0));
-
-      qint64 msecs_elapsed = timer.elapsed();
-      if (msecs_elapsed / 1000 > 0) {
-        qint64 mb_per_sec =
-            (completed_size / 1048576) / (msecs_elapsed / 1000);
-        if (mb_per_sec > 0) {
-          qint64 sec_remaining =
-              ((restore_size - completed_size) / 1048576) / mb_per_sec;
-
-          emit EstimatedTimeUpdated(
-                QString("Elapsed: " +
-                        QTime(0, 0, 0).addMSecs(msecs_elapsed).toString() +
-                        ", Remaining: " +
-                        QTime(0, 0, 0).addSecs(sec_remaining).toString()));
-        }
-      }
-    }
+  // Restore the chunks, reading, decoding and writing them in parallel.
+  RestoreEngine engine(library_.get(), path_cb_.get(), 0,
+                       RestoreEngine::kDefaultNumWriters,
+                       RestoreEngine::kDefaultMaxBytesInFlight);
+  Status retval = engine.Restore(chunks_to_restore, progress_cb_.get());
+  for (const string& filename : engine.failed_files()) {
+    string error_str = "Failed to restore " + filename;
+    LOG(WARNING) << error_str;
+    emit LogEntry(error_str.c_str());
   }
-  if (file) {
-    file->Close();
-    delete file;
+  if (!retval.ok() && !cancelled_) {
+    emit LogEntry("Error restoring files:");
+    emit LogEntry(retval.ToString().c_str());
+    emit StatusUpdated("Error encountered.", 100);
+    return;
   }
 
   // Go back through all the restored files and restore their modification
@@ -289,6 +220,30 @@ string RestoreDriver::CreateRestorePath(const FileEntry& entry) {
   return dest.string();
 }
 
+bool RestoreDriver::OnRestoreProgress(uint64_t completed_size) {
+  emit StatusUpdated(
+      "Restore in progress...",
+      static_cast<int>(
+          static_cast<float>(completed_size) / restore_size_ * 100.0));
+
+  qint64 msecs_elapsed = restore_timer_.elapsed();
+  if (msecs_elapsed / 1000 > 0) {
+    qint64 mb_per_sec =
+        (completed_size / 1048576) / (msecs_elapsed / 1000);
+    if (mb_per_sec > 0) {
+      qint64 sec_remaining =
+          ((restore_size_ - completed_size) / 1048576) / mb_per_sec;
+
+      emit EstimatedTimeUpdated(
+            QString("Elapsed: " +
+                    QTime(0, 0, 0).addMSecs(msecs_elapsed).toString() +
+                    ", Remaining: " +
+                    QTime(0, 0, 0).addSecs(sec_remaining).toString()));
+    }
+  }
+  return !cancelled_;
+}
+
 string RestoreDriver::OnVolumeChange(string orig_path) {
   LOG(INFO) << "Volume change!";
 
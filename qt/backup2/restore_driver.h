@@ -3,6 +3,7 @@
 #ifndef BACKUP2_QT_BACKUP2_RESTORE_DRIVER_H_
 #define BACKUP2_QT_BACKUP2_RESTORE_DRIVER_H_
 
+#include <QElapsedTimer>
 #include <QMutex>
 #include <QObject>
 #include <QString>
@@ -16,6 +17,7 @@
 #include "src/backup_library.h"
 #include "src/callback.h"
 #include "src/common.h"
+#include "src/restore_engine.h"
 
 namespace backup2 {
 class FileEntry;
@@ -38,9 +40,16 @@ class RestoreDriver : public QObject {
         library_(library),
         filesets_(filesets),
         cancelled_(false),
+        restore_size_(0),
         vol_change_cb_(
             backup2::NewPermanentCallback(
-                this, &RestoreDriver::OnVolumeChange)) {
+                this, &RestoreDriver::OnVolumeChange)),
+        path_cb_(
+            backup2::NewPermanentCallback(
+                this, &RestoreDriver::CreateRestorePath)),
+        progress_cb_(
+            backup2::NewPermanentCallback(
+                this, &RestoreDriver::OnRestoreProgress)) {
   }
 
   void CancelBackup() { cancelled_ = true; }
@@ -58,9 +67,13 @@ class RestoreDriver : public QObject {
   void PerformRestore();
 
  private:
-  // Construct a restore path.
+  // Construct a restore path.  This is called from the restore engine's
+  // writer threads.
   std::string CreateRestorePath(const backup2::FileEntry& entry);
 
+  // Update the restore progress.  Returns false if the restore was cancelled.
+  bool OnRestoreProgress(uint64_t completed_size);
+
   // Get a backup volume.
   std::string OnVolumeChange(std::string orig_path);
 
@@ -70,7 +83,11 @@ class RestoreDriver : public QObject {
   std::unique_ptr<backup2::BackupLibrary> library_;
   std::vector<backup2::FileSet*> filesets_;
   bool cancelled_;
+  uint64_t restore_size_;
+  QElapsedTimer restore_timer_;
   std::unique_ptr<backup2::BackupLibrary::VolumeChangeCallback> vol_change_cb_;
+  std::unique_ptr<backup2::RestoreEngine::PathCallback> path_cb_;
+  std::unique_ptr<backup2::RestoreEngine::ProgressCallback> progress_cb_;
 
   QMutex mutex_;
   QWaitCondition volume_changed_;
@@ -28,12 +28,12 @@
 #include "qt/backup2/restore_selector_model.h"
 #include "src/backup_volume_defs.h"
 #include "src/common.h"
-#include "src/file.h"
+#include "src/path.h"
 #include "src/status.h"
 
 #include "ui_mainwindow.h"  // NOLINT
 
-using backup2::File;
+using backup2::ProperPath;
 using backup2::StatusOr;
 using std::set;
 using std::string;
@@ -306,7 +306,7 @@ void RestoreHelper::OnRestoreToBrowse() {
   if (dialog.exec()) {
     filenames = dialog.selectedFiles();
     ui_->restore_to_location_2->setText(
-        tr(File(filenames[0].toStdString()).ProperName().c_str()));
+        tr(ProperPath(filenames[0].toStdString()).c_str()));
   }
 }
 
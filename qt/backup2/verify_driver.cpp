@@ -9,6 +9,7 @@
 #include <QTime>
 
 #include <map>
+#include <memory>
 #include <set>
 #include <string>
 #include <utility>
@@ -21,6 +22,7 @@
 #include "src/file.h"
 #include "src/fileset.h"
 #include "src/status.h"
+#include "src/verify_engine.h"
 
 using backup2::BackupFile;
 using backup2::BackupLibrary;
@@ -28,10 +30,15 @@ using backup2::File;
 using backup2::FileChunk;
 using backup2::FileSet;
 using backup2::FileEntry;
+using backup2::FileEntrySet;
 using backup2::Status;
+using backup2::VerifyEngine;
 using std::map;
+using std::pair;
 using std::set;
+using std::shared_ptr;
 using std::string;
+using std::unique_ptr;
 using std::vector;
 
 namespace {
@@ -82,13 +89,10 @@ void VerifyDriver::VolumeChanged(QString new_volume) {
   volume_changed_.wakeAll();
 }
 
-void VerifyDriver::PerformFilesystemVerify() {
-  completed_size_ = 0;
-  timer_.start();
-
+FileEntrySet VerifyDriver::FindFilesToVerify() {
   // Determine the files to verify.  We do this in reverse order, starting
   // at the given snapshot ID and going back to the last full backup.
-  set<FileEntry*> files_to_verify;
+  FileEntrySet files_to_verify;
   for (int snapshot_id = snapshot_id_;
        snapshot_id < static_cast<int>(filesets_.size()); ++snapshot_id) {
     FileSet* fileset = filesets_.at(snapshot_id);
@@ -100,10 +104,18 @@ void VerifyDriver::PerformFilesystemVerify() {
       }
     }
   }
+  return files_to_verify;
+}
+
+void VerifyDriver::PerformFilesystemVerify() {
+  completed_size_ = 0;
+  timer_.start();
+
+  FileEntrySet files_to_verify = FindFilesToVerify();
 
   // Find all the directories, symlinks, and other special files in the list --
   // these should be verified first.
-  set<FileEntry*> special_files;
+  FileEntrySet special_files;
   for (FileEntry* entry : files_to_verify) {
     if (entry->GetBackupFile()->file_type != BackupFile::kFileTypeRegularFile) {
       special_files.insert(entry);
@@ -192,11 +204,11 @@ void VerifyDriver::PerformFilesystemVerify() {
       continue;
     }
 
-    string data;
+    shared_ptr<const string> data;
     Status retval = library_->ReadChunk(chunk, &data);
     CHECK(retval.ok()) << retval.ToString();
 
-    if (data.size() == 0) {
+    if (data->size() == 0) {
       // Skip empty files.
       // TODO(darkstar62): We need a better way to handle this.
       continue;
@@ -204,7 +216,7 @@ void VerifyDriver::PerformFilesystemVerify() {
     // Seek to the location for this chunk.
     file->Seek(chunk.chunk_offset);
     string read_data;
-    read_data.resize(data.size());
+    read_data.resize(data->size());
     size_t read = 0;
     retval = file->Read(&read_data.at(0), read_data.size(), &read);
     completed_size_ += chunk.unencoded_size;
@@ -225,7 +237,7 @@ void VerifyDriver::PerformFilesystemVerify() {
       }
     }
 
-    if (data != read_data) {
+    if (*data != read_data) {
       emit LogEntry(
           string("Files different: " + entry->proper_filename()).c_str());
       different_files.insert(entry->proper_filename());
@@ -239,6 +251,47 @@ void VerifyDriver::PerformFilesystemVerify() {
   }
 }
 
+void VerifyDriver::PerformChecksumVerify() {
+  completed_size_ = 0;
+  timer_.start();
+
+  FileEntrySet files_to_verify = FindFilesToVerify();
+  total_size_ = 0;
+  for (FileEntry* entry : files_to_verify) {
+    total_size_ += entry->GetBackupFile()->file_size;
+  }
+
+  emit LogEntry("Verifying files against their checksums...");
+  unique_ptr<VerifyEngine::PathCallback> path_callback(
+      backup2::NewPermanentCallback(this, &VerifyDriver::CreatePath));
+  unique_ptr<VerifyEngine::ProgressCallback> progress_callback(
+      backup2::NewPermanentCallback(
+          this, &VerifyDriver::OnChecksumVerifyProgress));
+  VerifyEngine engine(library_.get(), path_callback.get(), 0);
+  Status retval = engine.Verify(files_to_verify, progress_callback.get());
+  if (!retval.ok()) {
+    emit LogEntry(string("Verify stopped: " + retval.ToString()).c_str());
+  }
+
+  for (const string& path : engine.missing_files()) {
+    emit LogEntry(
+        string("File in backup but not on filesystem: " + path).c_str());
+  }
+  for (const pair<const string, string>& unreadable :
+           engine.unreadable_files()) {
+    emit LogEntry(string("Could not read file: " + unreadable.first + ": " +
+                         unreadable.second).c_str());
+  }
+  for (const string& path : engine.different_files()) {
+    emit LogEntry(string("Files different: " + path).c_str());
+  }
+}
+
+bool VerifyDriver::OnChecksumVerifyProgress(uint64_t bytes_verified) {
+  completed_size_ = bytes_verified;
+  return !cancelled_;
+}
+
 void VerifyDriver::PerformIntegrityCheck() {
 }
 
@@ -55,7 +55,18 @@ class VerifyDriver : public QObject {
   // them with what's in the backup archive.
   void PerformFilesystemVerify();
 
+  // Perform a filesystem verify against the checksums recorded in the backup.
+  // Only the files on disk are read, in parallel; the backup volumes aren't
+  // touched.
+  void PerformChecksumVerify();
+
  private:
+  // Find the entries of the files selected for verifying.
+  backup2::FileEntrySet FindFilesToVerify();
+
+  // Progress callback for the checksum verify.  Returns false if cancelled.
+  bool OnChecksumVerifyProgress(uint64_t bytes_verified);
+
   // Construct a path from a file entry.
   std::string CreatePath(const backup2::FileEntry& entry);
 
@@ -26,12 +26,12 @@
 #include "qt/backup2/restore_selector_model.h"
 #include "qt/backup2/verify_driver.h"
 #include "src/backup_volume_defs.h"
-#include "src/file.h"
+#include "src/path.h"
 #include "src/status.h"
 
 #include "ui_mainwindow.h"  // NOLINT
 
-using backup2::File;
+using backup2::ProperPath;
 using backup2::StatusOr;
 using std::set;
 using std::string;
@@ -344,7 +344,7 @@ void VerifyHelper::OnCompareAgainstBrowse() {
   if (dialog.exec()) {
     filenames = dialog.selectedFiles();
     ui_->verify_compare_against->setText(
-        tr(File(filenames[0].toStdString()).ProperName().c_str()));
+        tr(ProperPath(filenames[0].toStdString()).c_str()));
   }
 }
 
@@ -373,8 +373,13 @@ void VerifyHelper::OnRunVerify() {
       verify_paths, destination, snapshot_id, library, filesets);
 
   verify_thread_ = new QThread(this);
-  QObject::connect(verify_thread_, SIGNAL(started()), verify_driver_,
-                   SLOT(PerformFilesystemVerify()));
+  if (ui_->verify_checksums_only_check->isChecked()) {
+    QObject::connect(verify_thread_, SIGNAL(started()), verify_driver_,
+                     SLOT(PerformChecksumVerify()));
+  } else {
+    QObject::connect(verify_thread_, SIGNAL(started()), verify_driver_,
+                     SLOT(PerformFilesystemVerify()));
+  }
   QObject::connect(verify_thread_, SIGNAL(finished()), this,
                    SLOT(VerifyComplete()));
   QObject::connect(verify_thread_, SIGNAL(finished()), verify_driver_,
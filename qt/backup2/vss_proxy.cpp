@@ -10,7 +10,7 @@
 #include <vector>
 
 #include "glog/logging.h"
-#include "src/file.h"
+#include "src/path.h"
 #include "src/status.h"
 
 // These headers have to be included here because of the ridiculous namespace
@@ -19,7 +19,8 @@
 #include <vswriter.h>  // NOLINT
 #include <vsbackup.h>  // NOLINT
 
-using backup2::File;
+using backup2::ProperPath;
+using backup2::RootPath;
 using backup2::Status;
 using std::make_pair;
 using std::map;
@@ -105,7 +106,7 @@ Status VssProxy::CreateShadowCopies(const vector<string>& filelist) {
   // for.
   set<string> volumes;
   for (string filename : filelist) {
-    volumes.insert(backup2::File(filename).RootName());
+    volumes.insert(backup2::RootPath(filename));
   }
 
   vector<pair<string, VSS_ID> > snapshot_ids;
@@ -183,7 +184,7 @@ Status VssProxy::CreateShadowCopies(const vector<string>& filelist) {
 
 string VssProxy::ConvertFilename(string filename) {
   // Get the volume name so we can match it against the shadow volumes.
-  string volume_name = File(filename).RootName();
+  string volume_name = RootPath(filename);
   auto volume_iter = snapshot_paths_.find(volume_name);
   CHECK(snapshot_paths_.end() != volume_iter) << "BUG: Volume not found";
 
@@ -192,5 +193,5 @@ string VssProxy::ConvertFilename(string filename) {
     mapped_volume += '\\';
   }
   filename.replace(0, volume_name.size(), mapped_volume);
-  return File(filename).ProperName();
+  return ProperPath(filename);
 }
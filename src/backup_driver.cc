@@ -3,9 +3,11 @@
 
 #include "src/backup_driver.h"
 
+#include <algorithm>
 #include <memory>
 #include <string>
 #include <unordered_map>
+#include <utility>
 #include <vector>
 
 #include "glog/logging.h"
@@ -14,10 +16,13 @@
 #include "src/backup_volume_defs.h"
 #include "src/callback.h"
 #include "src/file.h"
+#include "src/file_state_cache.h"
 #include "src/md5_generator.h"
 #include "src/gzip_encoder.h"
+#include "src/path.h"
 #include "src/status.h"
 
+using std::pair;
 using std::string;
 using std::vector;
 using std::unique_ptr;
@@ -31,13 +36,23 @@ BackupDriver::BackupDriver(
     const string& backup_description,
     const uint64_t max_volume_size_mb,
     const bool enable_compression,
-    const string& filelist_filename)
+    const string& filelist_filename,
+    const AppendDetection append_detection,
+    const uint64_t append_verify_samples,
+    const bool track_extents,
+    const uint64_t max_file_set_memory_mb,
+    const bool pack_volumes)
     : backup_filename_(backup_filename),
       backup_type_(backup_type),
       description_(backup_description),
       max_volume_size_mb_(max_volume_size_mb),
       enable_compression_(enable_compression),
       filelist_filename_(filelist_filename),
+      append_detection_(append_detection),
+      append_verify_samples_(append_verify_samples),
+      track_extents_(track_extents),
+      max_file_set_memory_mb_(max_file_set_memory_mb),
+      pack_volumes_(pack_volumes),
       volume_change_callback_(
           NewPermanentCallback(this, &BackupDriver::ChangeBackupVolume)) {
 }
@@ -49,7 +64,7 @@ int BackupDriver::Run() {
                         new Md5Generator(),
                         new GzipEncoder(),
                         new BackupVolumeFactory());
-  Status retval = library.Init();
+  Status retval = library.InitForBackup();
   LOG_IF(FATAL, !retval.ok())
       << "Could not init library: " << retval.ToString();
 
@@ -57,21 +72,36 @@ int BackupDriver::Run() {
   // backup type.
   vector<string> filelist;
 
+  // Files that can be carried forward from previous backups without reading
+  // them, or at least without reading all of them.
+  unordered_map<string, const FileEntry*> base_files;
+  BackupType backup_type = backup_type_;
+
   // If this is an incremental backup, we need to use the FileSets from the
   // previous backups to determine what to back up.
   switch (backup_type_) {
     case kBackupTypeIncremental:
-      LoadIncrementalFilelist(&library, &filelist, false);
+      LoadIncrementalFilelist(&library, &filelist, false, &base_files);
       break;
 
     case kBackupTypeDifferential:
-      LoadIncrementalFilelist(&library, &filelist, true);
+      LoadIncrementalFilelist(&library, &filelist, true, &base_files);
       break;
 
     case kBackupTypeFull:
+      // Full backups read every file, so they can be trusted after suspected
+      // corruption.
       LoadFullFilelist(&filelist);
       break;
 
+    case kBackupTypeSyntheticFull:
+      LoadFullFilelist(&filelist);
+      if (!LoadCarryForwardBase(&library, &base_files)) {
+        LOG(INFO) << "No previous backups found, performing a full backup.";
+        backup_type = kBackupTypeFull;
+      }
+      break;
+
     default:
       LOG(FATAL) << "Invalid backup type: " << backup_type_;
   }
@@ -84,9 +114,15 @@ int BackupDriver::Run() {
   // Create and initialize the backup.
   retval = library.CreateBackup(
       BackupOptions().set_description(description_)
-                     .set_type(backup_type_)
+                     .set_type(backup_type)
                      .set_max_volume_size_mb(max_volume_size_mb_)
-                     .set_enable_compression(enable_compression_));
+                     .set_enable_compression(enable_compression_)
+                     .set_update_file_state_cache(true)
+                     .set_append_detection(append_detection_)
+                     .set_append_verify_samples(append_verify_samples_)
+                     .set_track_extents(track_extents_)
+                     .set_max_file_set_memory_mb(max_file_set_memory_mb_)
+                     .set_pack_volumes(pack_volumes_));
   LOG_IF(FATAL, !retval.ok())
       << "Couldn't create backup: " << retval.ToString();
 
@@ -100,31 +136,111 @@ int BackupDriver::Run() {
     BackupFile metadata;
     file->FillBackupFile(&metadata, NULL);
 
-    FileEntry* entry = library.CreateNewFile(relative_filename, metadata);
+    // Unchanged files just point at the chunks already in the library.
+    auto base_iter = base_files.find(relative_filename);
+    FileEntry* entry = NULL;
+    if (base_iter != base_files.end()) {
+      entry = library.CarryForwardFile(*base_iter->second, metadata);
+    }
+    if (entry) {
+      VLOG(3) << "Unchanged, carrying forward " << filename;
+      retval = library.FinishFile(entry);
+      LOG_IF(FATAL, !retval.ok())
+          << "Could not finish file: " << retval.ToString();
+      continue;
+    }
 
     // If the file type is a directory, we don't store any chunks or try and
     // read from it.
+    if (metadata.file_type != BackupFile::kFileTypeRegularFile) {
+      retval = library.FinishFile(
+          library.CreateNewFile(relative_filename, metadata));
+      LOG_IF(FATAL, !retval.ok())
+          << "Could not finish file: " << retval.ToString();
+      continue;
+    }
 
-    if (metadata.file_type == BackupFile::kFileTypeRegularFile) {
-      file->Open(File::Mode::kModeRead);
-      Status status = Status::OK;
-
-      do {
-        uint64_t current_offset = file->Tell();
-        size_t read = 0;
-        string data;
-        data.resize(64*1024);
-        status = file->Read(&data.at(0), data.size(), &read);
-        data.resize(read);
-        Status retval = library.AddChunk(data, current_offset, entry);
+    file->Open(File::Mode::kModeRead);
+
+    // The extents are taken before reading, so that changes made while we read
+    // show up as changed extents next time.
+    vector<FileExtent> extents;
+    bool have_extents = track_extents_ && file->GetExtents(&extents).ok();
+
+    // Files that were only appended to keep their previous chunks, and we
+    // just read the new data.  Other changed files keep the chunks whose
+    // extents didn't change, and we read the regions in between.
+    uint64_t resume_offset = 0;
+    vector<pair<uint64_t, uint64_t> > read_ranges;
+    if (base_iter != base_files.end()) {
+      entry = library.CarryForwardAppendedFile(
+          *base_iter->second, metadata, file.get(), &resume_offset);
+      if (entry) {
+        VLOG(3) << "Appended, reading from " << resume_offset << " of "
+                << filename;
+      } else if (have_extents) {
+        entry = library.CarryForwardUnchangedExtents(
+            *base_iter->second, metadata, extents, &read_ranges);
+        if (entry) {
+          VLOG(3) << "Reading " << read_ranges.size()
+                  << " changed regions of " << filename;
+          resume_offset = metadata.file_size;
+        }
+      }
+    }
+    if (!entry) {
+      entry = library.CreateNewFile(relative_filename, metadata);
+    }
+    for (const pair<uint64_t, uint64_t>& range : read_ranges) {
+      BackupRange(&library, file.get(), entry, range.first, range.second);
+    }
+
+    // Chunks lying entirely in a hole of a sparse file are zeros, and aren't
+    // read.
+    vector<pair<uint64_t, uint64_t> > holes;
+    file->GetHoles(&holes);
+    auto hole_iter = holes.begin();
+    file->Seek(resume_offset);
+
+    Status status = Status::OK;
+    do {
+      uint64_t current_offset = file->Tell();
+      while (hole_iter != holes.end() &&
+             hole_iter->first + hole_iter->second <= current_offset) {
+        ++hole_iter;
+      }
+      if (hole_iter != holes.end() && hole_iter->first <= current_offset &&
+          hole_iter->first + hole_iter->second >= current_offset + 64*1024) {
+        Status retval = library.AddZeroChunk(64*1024, current_offset, entry);
         LOG_IF(FATAL, !retval.ok())
             << "Could not add chunk to volume: " << retval.ToString();
-      } while (status.code() != kStatusShortRead);
+        file->Seek(current_offset + 64*1024);
+        continue;
+      }
 
-      // We've reached the end of the file.  Close it out and start the next
-      // one.
-      file->Close();
+      size_t read = 0;
+      string data;
+      data.resize(64*1024);
+      status = file->Read(&data.at(0), data.size(), &read);
+      data.resize(read);
+      Status retval = library.AddChunk(data, current_offset, entry);
+      LOG_IF(FATAL, !retval.ok())
+          << "Could not add chunk to volume: " << retval.ToString();
+    } while (status.code() != kStatusShortRead);
+
+    // Only keep the extents if the file wasn't moved around while we read it.
+    vector<FileExtent> extents_after;
+    if (have_extents && file->GetExtents(&extents_after).ok() &&
+        extents_after == extents) {
+      library.RecordFileExtents(*entry, extents);
     }
+
+    // We've reached the end of the file.  Close it out and start the next
+    // one.
+    file->Close();
+    retval = library.FinishFile(entry);
+    LOG_IF(FATAL, !retval.ok())
+        << "Could not finish file: " << retval.ToString();
   }
 
   // All done with the backup, close out the file set.
@@ -141,7 +257,8 @@ string BackupDriver::ChangeBackupVolume(string /* needed_filename */) {
 }
 
 void BackupDriver::LoadIncrementalFilelist(
-    BackupLibrary* library, vector<string>* filelist, bool differential) {
+    BackupLibrary* library, vector<string>* filelist, bool differential,
+    unordered_map<string, const FileEntry*>* base_files) {
   // Open the filelist and grab the files to read.
   vector<string> full_filelist;
   FileInterface* file = new File(filelist_filename_);
@@ -150,6 +267,45 @@ void BackupDriver::LoadIncrementalFilelist(
   file->Close();
   delete file;
 
+  // Incremental backups only need to know which files changed since the last
+  // backup, which the file state cache can tell us without loading any file
+  // sets.  Backups from this driver always go to the default label.
+  if (!differential) {
+    StatusOr<FileStateCache*> cache_result = library->LoadFileStateCache(1);
+    if (cache_result.ok()) {
+      unique_ptr<FileStateCache> cache(cache_result.value());
+      vector<pair<string, const FileStateRecord*> > reuse_files;
+      for (string filename : full_filelist) {
+        File file(filename);
+        string relative_filename = file.RelativePath();
+        BackupFile disk_metadata;
+        file.FillBackupFile(&disk_metadata, NULL);
+
+        const FileStateRecord* record =
+            cache->Find(GenericPath(relative_filename));
+        if (!record) {
+          filelist->push_back(filename);
+        } else if (FileStateCache::RecordChanged(*record, disk_metadata)) {
+          filelist->push_back(filename);
+          if (MayReuseChunks(disk_metadata.file_size, record->file_size)) {
+            reuse_files.push_back(make_pair(relative_filename, record));
+          }
+        }
+      }
+
+      // The cache records which backup has each file's chunk list, so only
+      // those backups are loaded for the changed files to re-use chunks from.
+      if (!reuse_files.empty()) {
+        Status retval =
+            library->LoadFilesFromStateRecords(reuse_files, base_files);
+        LOG_IF(FATAL, !retval.ok())
+            << "Could not load previous files: " << retval.ToString();
+      }
+      return;
+    }
+    LOG(INFO) << "No file state cache, loading previous backups";
+  }
+
   // Read the filesets from the library leading up to the last full backup.
   // Filesets are in order of most recent backup to least recent, and the least
   // recent one should be a full backup.
@@ -165,28 +321,16 @@ void BackupDriver::LoadIncrementalFilelist(
   // If this is to be a differential backup, just use the full backup at the
   // bottom.
   if (differential) {
-    for (const FileEntry* entry :
-         filesets.value()[filesets.value().size() - 1]->GetFiles()) {
-      auto iter = combined_files.find(entry->proper_filename());
-      if (iter == combined_files.end()) {
-        combined_files.insert(make_pair(entry->proper_filename(), entry));
-      }
-    }
+    CombineFileSets(
+        vector<FileSet*>(1, filesets.value()[filesets.value().size() - 1]),
+        &combined_files);
   } else {
-    for (FileSet* fileset : filesets.value()) {
-      for (const FileEntry* entry : fileset->GetFiles()) {
-        auto iter = combined_files.find(entry->proper_filename());
-        if (iter == combined_files.end()) {
-          combined_files.insert(make_pair(entry->proper_filename(), entry));
-        }
-      }
-    }
+    CombineFileSets(filesets.value(), &combined_files);
   }
 
   // Now, we need to go through the passed-in filelist and grab metadata for
   // each file.  We include any files that don't exist in our set, or that do
-  // and have their modification date, size, attributes, or permissions
-  // changed.
+  // and have changed, tested the same way as with the file state cache.
   for (string filename : full_filelist) {
     unique_ptr<File> file(new File(filename));
     string relative_filename = file->RelativePath();
@@ -204,11 +348,14 @@ void BackupDriver::LoadIncrementalFilelist(
     BackupFile disk_metadata;
     file->FillBackupFile(&disk_metadata, NULL);
 
-    // If modification dates or sizes change, we add it.
-    if (disk_metadata.modify_date != backup_metadata->modify_date ||
-        disk_metadata.file_size != backup_metadata->file_size) {
-      // File changed, add it.
+    if (BackupFileChanged(*backup_metadata, disk_metadata)) {
+      // File changed, add it.  It may still be able to use some of its
+      // previous chunks.
       filelist->push_back(filename);
+      if (MayReuseChunks(disk_metadata.file_size,
+                         backup_metadata->file_size)) {
+        base_files->insert(*iter);
+      }
       continue;
     }
   }
@@ -218,6 +365,77 @@ void BackupDriver::LoadIncrementalFilelist(
   // actually exist.
 }
 
+bool BackupDriver::LoadCarryForwardBase(
+    BackupLibrary* library,
+    unordered_map<string, const FileEntry*>* base_files) {
+  // Read the filesets leading up to the last full backup.  Backups from this
+  // driver always go to the default label.
+  StatusOr<vector<FileSet*> > filesets =
+      library->LoadFileSetsFromLabel(false, 1);
+  if (!filesets.ok()) {
+    if (filesets.status().code() == kStatusNoSuchFile) {
+      // New library, there's nothing to build from.
+      return false;
+    }
+    LOG(FATAL) << "Could not load file sets: "
+               << filesets.status().ToString();
+  }
+
+  if (filesets.value().size() == 0) {
+    return false;
+  }
+
+  // Files deleted since the last backup simply won't be found when we walk the
+  // current filelist, and so are dropped from the new backup.
+  CombineFileSets(filesets.value(), base_files);
+  return true;
+}
+
+void BackupDriver::CombineFileSets(
+    const vector<FileSet*>& filesets,
+    unordered_map<string, const FileEntry*>* combined_files) {
+  for (FileSet* fileset : filesets) {
+    for (const FileEntry* entry : fileset->GetFiles()) {
+      auto iter = combined_files->find(entry->proper_filename());
+      if (iter == combined_files->end()) {
+        combined_files->insert(make_pair(entry->proper_filename(), entry));
+      }
+    }
+  }
+}
+
+bool BackupDriver::MayReuseChunks(uint64_t size,
+                                  uint64_t previous_size) const {
+  // Any changed file may have regions that weren't rewritten, but only grown
+  // files can have been appended to.
+  return track_extents_ ||
+         (append_detection_ != kAppendDetectionOff && size > previous_size);
+}
+
+void BackupDriver::BackupRange(BackupLibrary* library, FileInterface* file,
+                               FileEntry* entry, uint64_t offset,
+                               uint64_t length) {
+  file->Seek(offset);
+  while (length > 0) {
+    size_t read = 0;
+    string data;
+    data.resize(std::min(length, static_cast<uint64_t>(64*1024)));
+    Status status = file->Read(&data.at(0), data.size(), &read);
+    if (read == 0) {
+      break;
+    }
+    data.resize(read);
+    Status retval = library->AddChunk(data, offset, entry);
+    LOG_IF(FATAL, !retval.ok())
+        << "Could not add chunk to volume: " << retval.ToString();
+    if (status.code() == kStatusShortRead) {
+      break;
+    }
+    offset += read;
+    length -= read;
+  }
+}
+
 void BackupDriver::LoadFullFilelist(vector<string>* filelist) {
   // Open the filelist and grab the files to read.
   FileInterface* file = new File(filelist_filename_);
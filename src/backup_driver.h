@@ -4,6 +4,7 @@
 #define BACKUP2_SRC_BACKUP_DRIVER_H_
 
 #include <string>
+#include <unordered_map>
 #include <vector>
 
 #include "src/backup_library.h"
@@ -12,6 +13,9 @@
 
 namespace backup2 {
 class BackupVolume;
+class FileEntry;
+class FileInterface;
+class FileSet;
 
 // The BackupDriver does all the work of actually coordinating backup
 // activities.
@@ -25,7 +29,12 @@ class BackupDriver {
       const std::string& backup_description,
       const uint64_t max_volume_size_mb,
       const bool enable_compression,
-      const std::string& filelist_filename);
+      const std::string& filelist_filename,
+      const AppendDetection append_detection,
+      const uint64_t append_verify_samples,
+      const bool track_extents,
+      const uint64_t max_file_set_memory_mb,
+      const bool pack_volumes);
 
   // Run the driver.  The return value is suitable for return from main().
   int Run();
@@ -33,18 +42,52 @@ class BackupDriver {
  private:
   std::string ChangeBackupVolume(std::string needed_filename);
 
-  void LoadIncrementalFilelist(BackupLibrary* library,
-                               std::vector<std::string>* filelist,
-                               bool differential);
+  // Load the files changed since the last backup (or the last full backup, if
+  // differential is true) into filelist.  The previous FileEntry for changed
+  // files that may re-use some of their previous chunks is returned in
+  // base_files.  This is left empty if append detection and extent tracking
+  // are off.
+  void LoadIncrementalFilelist(
+      BackupLibrary* library, std::vector<std::string>* filelist,
+      bool differential,
+      std::unordered_map<std::string, const FileEntry*>* base_files);
 
   void LoadFullFilelist(std::vector<std::string>* filelist);
 
+  // Return whether a changed file of the given size, previously of
+  // previous_size, may re-use some of its previous chunks.
+  bool MayReuseChunks(uint64_t size, uint64_t previous_size) const;
+
+  // Read length bytes of the file from offset, and add them to the entry.
+  // Stops early if the file is shorter than expected.
+  static void BackupRange(BackupLibrary* library, FileInterface* file,
+                          FileEntry* entry, uint64_t offset, uint64_t length);
+
+  // Load the backup chain leading back to the last full backup, returning the
+  // latest FileEntry for each file in it keyed by filename.  Synthetic full
+  // backups carry unchanged files forward from these rather than reading them.
+  // Returns false if there are no previous backups to build from.
+  bool LoadCarryForwardBase(
+      BackupLibrary* library,
+      std::unordered_map<std::string, const FileEntry*>* base_files);
+
+  // Combine the given filesets (ordered most to least recent) into a map of
+  // filename to the most recent FileEntry for that file.
+  static void CombineFileSets(
+      const std::vector<FileSet*>& filesets,
+      std::unordered_map<std::string, const FileEntry*>* combined_files);
+
   const std::string backup_filename_;
   const BackupType backup_type_;
   const std::string description_;
   const uint64_t max_volume_size_mb_;
   const bool enable_compression_;
   const std::string filelist_filename_;
+  const AppendDetection append_detection_;
+  const uint64_t append_verify_samples_;
+  const bool track_extents_;
+  const uint64_t max_file_set_memory_mb_;
+  const bool pack_volumes_;
   std::unique_ptr<BackupLibrary::VolumeChangeCallback> volume_change_callback_;
 
   DISALLOW_COPY_AND_ASSIGN(BackupDriver);
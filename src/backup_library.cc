@@ -3,35 +3,180 @@
 
 #include "src/backup_library.h"
 
+#if defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#endif  // __SSE2__ || _M_X64
+
 #include <algorithm>
 #include <map>
 #include <memory>
+#include <mutex>
 #include <set>
 #include <sstream>
 #include <string>
+#include <unordered_map>
 #include <utility>
 #include <vector>
 
+#include "boost/filesystem.hpp"
 #include "src/backup_volume_defs.h"
 #include "src/backup_volume.h"
 #include "src/encoding_interface.h"
+#include "src/extent_map.h"
 #include "src/file_interface.h"
+#include "src/file_state_cache.h"
 #include "src/fileset.h"
 #include "src/md5_generator_interface.h"
 #include "src/msvc/unix_time.h"
 #include "src/status.h"
 
+using std::lock_guard;
 using std::make_pair;
+using std::mutex;
 using std::ostringstream;
 using std::pair;
 using std::set;
+using std::shared_ptr;
 using std::stoull;
 using std::string;
 using std::unique_ptr;
+using std::unordered_map;
 using std::map;
 using std::vector;
 
 namespace backup2 {
+namespace {
+
+// Return whether the given data is all zeros.  Empty data isn't.
+bool IsAllZero(const char* bytes, size_t size) {
+  if (size == 0) {
+    return false;
+  }
+  uint64_t position = 0;
+#if defined(__SSE2__) || defined(_M_X64)
+  // Check 64 bytes at a time, stopping at the first block with a bit set.
+  const __m128i zero = _mm_setzero_si128();
+  for (; position + 64 <= size; position += 64) {
+    const __m128i* block = reinterpret_cast<const __m128i*>(bytes + position);
+    __m128i bits = _mm_or_si128(
+        _mm_or_si128(_mm_loadu_si128(block), _mm_loadu_si128(block + 1)),
+        _mm_or_si128(_mm_loadu_si128(block + 2), _mm_loadu_si128(block + 3)));
+    if (_mm_movemask_epi8(_mm_cmpeq_epi8(bits, zero)) != 0xFFFF) {
+      return false;
+    }
+  }
+#endif  // __SSE2__ || _M_X64
+  for (; position < size; ++position) {
+    if (bytes[position] != '\0') {
+      return false;
+    }
+  }
+  return true;
+}
+
+// Journal written before a backup is appended to a volume, recording the
+// volume and its size beforehand.
+struct RefillJournal {
+  RefillJournal() {
+    memset(this, 0, sizeof(RefillJournal));
+  }
+
+  char version[8];
+  uint64_t volume_number;
+  uint64_t volume_size;
+};
+
+const char kRefillJournalVersion[] = "BKPR0001";
+
+// Sort keys pack a chunk's volume number into their top bits and its offset
+// in the volume into the rest, so ordering the keys orders the chunks by
+// volume, then by offset within the volume.
+const int kSortKeyOffsetBits = 40;
+
+// Bits of the sort key handled by each pass of the radix sort.
+const int kRadixBits = 11;
+
+// Sort (key, position) pairs by key with an LSD radix sort.  The sort is
+// stable, and passes over digits all keys share are skipped, so keys that only
+// use their low bits sort in few passes.
+void RadixSort(vector<pair<uint64_t, uint64_t> >* items) {
+  const uint64_t kBuckets = 1ULL << kRadixBits;
+  vector<pair<uint64_t, uint64_t> > scratch(items->size());
+  vector<uint64_t> counts(kBuckets);
+  for (int shift = 0; shift < 64; shift += kRadixBits) {
+    std::fill(counts.begin(), counts.end(), 0);
+    for (const pair<uint64_t, uint64_t>& item : *items) {
+      ++counts[(item.first >> shift) & (kBuckets - 1)];
+    }
+    if (counts[(items->front().first >> shift) & (kBuckets - 1)] ==
+        items->size()) {
+      continue;
+    }
+
+    uint64_t position = 0;
+    for (uint64_t bucket = 0; bucket < kBuckets; ++bucket) {
+      uint64_t count = counts[bucket];
+      counts[bucket] = position;
+      position += count;
+    }
+    for (const pair<uint64_t, uint64_t>& item : *items) {
+      scratch[counts[(item.first >> shift) & (kBuckets - 1)]++] = item;
+    }
+    items->swap(scratch);
+  }
+}
+
+// Order chunks by volume, then by offset within the volume.
+bool ChunkLocationLessThan(const FileChunk* lhs, const FileChunk* rhs) {
+  if (lhs->volume_num != rhs->volume_num) {
+    return lhs->volume_num < rhs->volume_num;
+  }
+  return lhs->volume_offset < rhs->volume_offset;
+}
+
+// Return the positions of the given chunks in the order to read them: volume
+// by volume, and straight through each volume.  Ties keep their given order.
+vector<uint64_t> ChunkReadOrder(const vector<const FileChunk*>& chunks) {
+  vector<uint64_t> order;
+  order.reserve(chunks.size());
+  if (chunks.empty()) {
+    return order;
+  }
+
+  // Build the sort keys up front, so the sort touches nothing but them.
+  vector<pair<uint64_t, uint64_t> > keys;
+  keys.reserve(chunks.size());
+  for (const FileChunk* chunk : chunks) {
+    if (chunk->volume_num >> (64 - kSortKeyOffsetBits) != 0 ||
+        chunk->volume_offset >> kSortKeyOffsetBits != 0) {
+      break;
+    }
+    keys.push_back(make_pair(
+        (chunk->volume_num << kSortKeyOffsetBits) | chunk->volume_offset,
+        keys.size()));
+  }
+
+  if (keys.size() == chunks.size()) {
+    RadixSort(&keys);
+    for (const pair<uint64_t, uint64_t>& key : keys) {
+      order.push_back(key.second);
+    }
+    return order;
+  }
+
+  // Some chunk is too far into its volume, or in too high a volume, for the
+  // keys.  Compare the chunks directly instead.
+  for (uint64_t index = 0; index < chunks.size(); ++index) {
+    order.push_back(index);
+  }
+  std::stable_sort(order.begin(), order.end(),
+                   [&chunks](uint64_t lhs, uint64_t rhs) {
+    return ChunkLocationLessThan(chunks[lhs], chunks[rhs]);
+  });
+  return order;
+}
+
+}  // namespace
 
 BackupLibrary::BackupLibrary(
     FileInterface* file,
@@ -49,17 +194,27 @@ BackupLibrary::BackupLibrary(
       basename_(""),
       file_set_(),
       current_backup_volume_(NULL),
-      read_cached_data_(""),
-      cached_backup_volume_(),
-      volume_bytes_remaining_(0) {
-  read_cached_md5sum_.hi = 0;
-  read_cached_md5sum_.lo = 0;
+      chunk_cache_(new ChunkCache(kDefaultChunkCacheMb * 1048576)),
+      volume_cache_(new VolumeCache(kDefaultVolumeCacheSize,
+                                    kDefaultVolumeCacheMb * 1048576)),
+      volume_bytes_remaining_(0),
+      appending_(false),
+      append_volume_(0),
+      append_volume_size_(0) {
 }
 
 BackupLibrary::~BackupLibrary() {
 }
 
 Status BackupLibrary::Init() {
+  return InitLibrary(false);
+}
+
+Status BackupLibrary::InitForBackup() {
+  return InitLibrary(true);
+}
+
+Status BackupLibrary::InitLibrary(bool undo_interrupted_append) {
   // Try and figure out how many backup volumes we have, based on the filename
   // given.  All backup volumes are of the form "/path/to/backup_file.xxx.bkp"
   // where "xxx" is a number corresponding to the backup volume number.
@@ -84,6 +239,18 @@ Status BackupLibrary::Init() {
   num_volumes_ = num_vols;
   basename_ = basename;
 
+  // A backup appended to the last volume that never finished leaves the
+  // volume without a valid header at its end, so it has to be undone before
+  // the volume can be read.  The journal is also there while a backup is
+  // still running, so only a library opened to back up may undo it.
+  if (undo_interrupted_append) {
+    retval = RecoverInterruptedAppend();
+    LOG_RETURN_IF_ERROR(retval, "Error undoing interrupted backup");
+  } else if (File(RefillJournalFilename()).Exists()) {
+    LOG(WARNING) << "A backup is being appended to the last volume, or was "
+                 << "interrupted; the next backup will undo it";
+  }
+
   // Try and load the labels.  Only do this if we have some number of volumes to
   // read from.
   retval = Status::OK;
@@ -99,21 +266,30 @@ StatusOr<vector<FileSet*> > BackupLibrary::LoadFileSets(bool load_all) {
   vector<FileSet*> filesets;
   LOG(INFO) << filesets.size() << " filesets total (beginning)";
   int64_t next_volume = last_volume_;
+  uint64_t next_offset = 0;
   while (next_volume != -1) {
     StatusOr<BackupVolumeInterface*> volume_result =
         GetBackupVolume(next_volume, false);
     LOG_RETURN_IF_ERROR(volume_result.status(), "Error getting backup volume");
     BackupVolumeInterface* volume = volume_result.value();
 
-    StatusOr<FileSet*> fileset_result = volume->LoadFileSet(&next_volume);
+    // Each backup records where the one before it is, which for volumes
+    // appended to needn't be the last in its volume.  Without an offset, the
+    // volume's last backup is the one.
+    StatusOr<FileSet*> fileset_result =
+        next_offset == 0 ?
+        volume->LoadFileSet(&next_volume) :
+        volume->LoadFileSetAtOffset(next_offset, &next_volume);
     LOG_RETURN_IF_ERROR(fileset_result.status(), "Error getting file sets");
 
+    next_offset = 0;
     if (fileset_result.value()) {
       filesets.push_back(fileset_result.value());
       if (!load_all &&
-          fileset_result.value()->backup_type() == kBackupTypeFull) {
+          IsFullBackupType(fileset_result.value()->backup_type())) {
         break;
       }
+      next_offset = fileset_result.value()->previous_backup_offset();
     }
     LOG(INFO) << filesets.size() << " filesets total";
   }
@@ -137,18 +313,33 @@ StatusOr<vector<FileSet*> > BackupLibrary::LoadFileSetsFromLabel(
   }
   BackupVolumeInterface* volume = volume_result.value();
 
+  // After the label's last backup, each backup's parent is found by its
+  // location, as in LoadFileSets().
   int64_t next_volume = last_volume_;
+  uint64_t next_offset = 0;
   do {
-    StatusOr<FileSet*> fileset_result = volume->LoadFileSetFromLabel(
-        label_id, &next_volume);
+    StatusOr<FileSet*> fileset_result =
+        next_offset == 0 ?
+        volume->LoadFileSetFromLabel(label_id, &next_volume) :
+        volume->LoadFileSetAtOffset(next_offset, &next_volume);
     LOG_RETURN_IF_ERROR(fileset_result.status(), "Error getting file sets");
 
-    if (fileset_result.value()) {
-      filesets.push_back(fileset_result.value());
-      if (!load_all &&
-          fileset_result.value()->backup_type() == kBackupTypeFull) {
+    next_offset = 0;
+    FileSet* fileset = fileset_result.value();
+    if (fileset) {
+      filesets.push_back(fileset);
+      if (!load_all && IsFullBackupType(fileset->backup_type())) {
         break;
       }
+
+      // 0 / 0 means the label's lineage ends here.
+      if (fileset->parent_backup_volume() == 0 &&
+          fileset->parent_backup_offset() == 0) {
+        next_volume = -1;
+      } else {
+        next_volume = fileset->parent_backup_volume();
+        next_offset = fileset->parent_backup_offset();
+      }
     }
     LOG(INFO) << filesets.size() << " filesets total";
 
@@ -163,6 +354,61 @@ StatusOr<vector<FileSet*> > BackupLibrary::LoadFileSetsFromLabel(
   return filesets;
 }
 
+StatusOr<FileStateCache*> BackupLibrary::LoadFileStateCache(
+    uint64_t label_id) {
+  auto label_iter = labels_.find(label_id);
+  if (label_iter == labels_.end()) {
+    return Status(kStatusNoSuchFile, "No backups for label");
+  }
+
+  unique_ptr<FileStateCache> cache(new FileStateCache(md5_maker_.get()));
+  Status retval = cache->Load(FileStateCacheFilename(label_id));
+  if (!retval.ok()) {
+    return retval;
+  }
+
+  // A cache left behind by an older backup, or by a backup that failed after
+  // the volume was written, doesn't describe the label's last backup.
+  const FileStateCacheHeader& header = cache->header();
+  if (header.label_id != label_id ||
+      header.backup_volume != label_iter->second.last_volume() ||
+      header.backup_offset != label_iter->second.last_offset()) {
+    LOG(INFO) << "File state cache for label " << label_id << " is stale";
+    return Status(kStatusNoSuchFile, "File state cache is out of date");
+  }
+  return cache.release();
+}
+
+Status BackupLibrary::LoadFilesFromStateRecords(
+    const vector<pair<string, const FileStateRecord*> >& files,
+    unordered_map<string, const FileEntry*>* entries_out) {
+  // Group the files by the backup holding their chunk lists.
+  map<pair<uint64_t, uint64_t>, set<string> > backups;
+  for (const pair<string, const FileStateRecord*>& file : files) {
+    backups[make_pair(file.second->backup_volume,
+                      file.second->backup_offset)].insert(file.first);
+  }
+
+  for (const pair<const pair<uint64_t, uint64_t>, set<string> >& backup :
+           backups) {
+    StatusOr<BackupVolumeInterface*> volume_result =
+        GetBackupVolume(backup.first.first, false);
+    LOG_RETURN_IF_ERROR(volume_result.status(), "Error getting backup volume");
+    int64_t next_volume = 0;
+    StatusOr<FileSet*> fileset_result =
+        volume_result.value()->LoadFileSetAtOffset(backup.first.second,
+                                                   &next_volume);
+    LOG_RETURN_IF_ERROR(fileset_result.status(), "Error getting file set");
+
+    for (const FileEntry* entry : fileset_result.value()->GetFiles()) {
+      if (backup.second.count(entry->proper_filename()) > 0) {
+        entries_out->insert(make_pair(entry->proper_filename(), entry));
+      }
+    }
+  }
+  return Status::OK;
+}
+
 Status BackupLibrary::GetLabels(vector<Label>* out_labels) {
   for (auto label_iter : labels_) {
     out_labels->push_back(label_iter.second);
@@ -171,6 +417,12 @@ Status BackupLibrary::GetLabels(vector<Label>* out_labels) {
 }
 
 Status BackupLibrary::CreateBackup(BackupOptions options) {
+  // A new journal would replace the one needed to undo the interrupted backup.
+  if (File(RefillJournalFilename()).Exists()) {
+    return Status(kStatusGenericError,
+                  "Interrupted backup not undone; use InitForBackup()");
+  }
+
   timeval tv;
   gettimeofday(&tv, NULL);
 
@@ -181,9 +433,28 @@ Status BackupLibrary::CreateBackup(BackupOptions options) {
   file_set->set_label_id(options.label_id());
   file_set->set_label_name(options.label_name());
   file_set->set_date(tv.tv_sec);
+  if (options.max_file_set_memory_mb() > 0) {
+    file_set->set_spill_file(new File(SpillFilename()),
+                             options.max_file_set_memory_mb() * 1048576ULL);
+  }
   file_set_.reset(file_set);
   options_ = options;
 
+  // Load the extents recorded by previous backups to the label.  Without them
+  // we can still record extents for the next backup.
+  extent_map_.reset();
+  if (options.track_extents()) {
+    extent_map_.reset(new ExtentMap(md5_maker_.get()));
+    uint64_t label_id =
+        options.use_default_label() ? 1 : options.label_id();
+    if (label_id != 0) {
+      Status retval = extent_map_->Load(ExtentMapFilename(label_id));
+      if (!retval.ok() && retval.code() != kStatusNoSuchFile) {
+        LOG(WARNING) << "Could not load extent map: " << retval.ToString();
+      }
+    }
+  }
+
   // If we have no backup volumes, no use in trying to load chunk data.  Just
   // skip to the next step.
   if (num_volumes_ > 0) {
@@ -214,42 +485,285 @@ Status BackupLibrary::CreateBackup(BackupOptions options) {
     num_volumes_++;
     current_backup_volume_ = volume_result.value();
   } else {
-    // We need to make a new backup volume to contain our new data.
-    volume_result.value()->Close();
-
-    // Create a new backup volume to contain this backup, and limit it in size
-    // to our max minus the cumulative total of all last backup volumes we have
-    // that are smaller than the max size (i.e. bin-pack our volumes).
-    // TODO(darkstar62): implement bin-packing.  For now, we just create a new
-    // set.
-    last_volume_++;
-    num_volumes_++;
-    volume_result = GetBackupVolume(last_volume_, true);
-    LOG_RETURN_IF_ERROR(volume_result.status(), "Error creating volume");
-    current_backup_volume_ = volume_result.value();
+    // When packing volumes, the last volume takes this backup too if it has
+    // room.
+    bool appended = false;
+    if (options.pack_volumes() &&
+        options.max_volume_size_mb() > kMaxSizeThresholdMb) {
+      StatusOr<bool> append_result = AppendToLastVolume(volume_result.value());
+      LOG_RETURN_IF_ERROR(append_result.status(),
+                          "Error appending to last volume");
+      appended = append_result.value();
+    }
+
+    if (!appended) {
+      // We need to make a new backup volume to contain our new data.  Once
+      // closed, the last volume has to be opened afresh to be read again.
+      volume_result.value()->Close();
+      volume_cache_->Erase(last_volume_);
+
+      // Create a new backup volume to contain this backup, and limit it in
+      // size to our max minus the cumulative total of all last backup volumes
+      // we have that are smaller than the max size.
+      last_volume_++;
+      num_volumes_++;
+      volume_result = GetBackupVolume(last_volume_, true);
+      LOG_RETURN_IF_ERROR(volume_result.status(), "Error creating volume");
+      current_backup_volume_ = volume_result.value();
+    }
   }
+
+  // The volume being written must stay open until the backup is done.
+  volume_cache_->SetPinned(last_volume_, true);
   return Status::OK;
 }
 
 FileEntry* BackupLibrary::CreateNewFile(
     const string& filename, BackupFile metadata) {
-  FileEntry* entry = new FileEntry(filename, new BackupFile(metadata));
-  file_set_->AddFile(entry);
+  return file_set_->AddFile(filename, metadata);
+}
+
+FileEntry* BackupLibrary::CarryForwardFile(
+    const FileEntry& previous, BackupFile metadata) {
+  const BackupFile* previous_metadata = previous.GetBackupFile();
+
+  // Files from older backups don't have their inode and change date recorded,
+  // so they're compared on size and date alone.
+  if (BackupFileChanged(*previous_metadata, metadata)) {
+    return NULL;
+  }
+
+  FileEntry* entry = AddCarriedForwardFile(previous.generic_filename(),
+                                           metadata, previous.GetChunks());
+  if (metadata.file_type == BackupFile::kFileTypeSymlink) {
+    entry->set_symlink_target(previous.symlink_target());
+  }
+  return entry;
+}
+
+FileEntry* BackupLibrary::CarryForwardAppendedFile(
+    const FileEntry& previous, BackupFile metadata, FileInterface* file,
+    uint64_t* resume_offset) {
+  const BackupFile* previous_metadata = previous.GetBackupFile();
+  if (options_.append_detection() == kAppendDetectionOff ||
+      metadata.file_type != BackupFile::kFileTypeRegularFile ||
+      previous_metadata->file_type != BackupFile::kFileTypeRegularFile ||
+      previous_metadata->file_size == 0 ||
+      metadata.file_size <= previous_metadata->file_size) {
+    return NULL;
+  }
+
+  // A different inode means the file was replaced, not appended to.
+  if (previous_metadata->change_date != 0 && metadata.change_date != 0 &&
+      (metadata.device_id != previous_metadata->device_id ||
+       metadata.inode != previous_metadata->inode)) {
+    return NULL;
+  }
+
+  vector<FileChunk> chunks;
+  if (!GetDataChunks(previous, &chunks)) {
+    return NULL;
+  }
+
+  // The last chunk is the one most likely to have been rewritten, so it's
+  // always checked.
+  set<uint64_t> verify_chunks;
+  verify_chunks.insert(chunks.size() - 1);
+  if (options_.append_detection() == kAppendDetectionSampled) {
+    uint64_t samples = options_.append_verify_samples();
+    for (uint64_t sample = 0; sample < samples; ++sample) {
+      verify_chunks.insert(sample * (chunks.size() - 1) / samples);
+    }
+  }
+
+  for (uint64_t index : verify_chunks) {
+    const FileChunk& chunk = chunks[index];
+    Status retval = file->Seek(chunk.chunk_offset);
+    if (!retval.ok()) {
+      return NULL;
+    }
+
+    string data;
+    data.resize(chunk.unencoded_size);
+    size_t read = 0;
+    retval = file->Read(&data.at(0), data.size(), &read);
+    if ((!retval.ok() && retval.code() != kStatusShortRead) ||
+        read != data.size()) {
+      return NULL;
+    }
+
+    if (md5_maker_->Checksum(data) != chunk.md5sum) {
+      VLOG(3) << "Chunk at " << chunk.chunk_offset << " of "
+              << previous.generic_filename() << " changed";
+      return NULL;
+    }
+  }
+
+  FileEntry* entry = AddCarriedForwardFile(
+      previous.generic_filename(), metadata,
+      FileChunkSpan(chunks.data(), chunks.size()));
+  *resume_offset = previous_metadata->file_size;
+  return entry;
+}
+
+FileEntry* BackupLibrary::CarryForwardUnchangedExtents(
+    const FileEntry& previous, BackupFile metadata,
+    const vector<FileExtent>& extents,
+    vector<pair<uint64_t, uint64_t> >* read_ranges) {
+  const BackupFile* previous_metadata = previous.GetBackupFile();
+  if (!extent_map_ ||
+      metadata.file_type != BackupFile::kFileTypeRegularFile ||
+      previous_metadata->file_type != BackupFile::kFileTypeRegularFile ||
+      previous_metadata->file_size == 0 ||
+      metadata.device_id != previous_metadata->device_id ||
+      metadata.inode != previous_metadata->inode) {
+    return NULL;
+  }
+
+  // The recorded extents only describe the previous chunks if they were taken
+  // when the file was in the state it was backed up in.
+  const FileExtentRecord* record =
+      extent_map_->Find(previous.generic_filename());
+  if (!record ||
+      record->device_id != previous_metadata->device_id ||
+      record->inode != previous_metadata->inode ||
+      record->file_size != previous_metadata->file_size ||
+      record->modify_date != previous_metadata->modify_date ||
+      record->change_date != previous_metadata->change_date) {
+    return NULL;
+  }
+  vector<FileExtent> previous_extents;
+  extent_map_->GetExtents(*record, &previous_extents);
+
+  vector<FileChunk> chunks;
+  if (!GetDataChunks(previous, &chunks)) {
+    return NULL;
+  }
+
+  // Keep the chunks still within the file whose data hasn't moved.
+  vector<FileChunk> unchanged_chunks;
+  for (const FileChunk& chunk : chunks) {
+    if (chunk.chunk_offset + chunk.unencoded_size <= metadata.file_size &&
+        ExtentMap::RangeUnchanged(previous_extents, extents,
+                                  chunk.chunk_offset, chunk.unencoded_size)) {
+      unchanged_chunks.push_back(chunk);
+    }
+  }
+  if (unchanged_chunks.empty()) {
+    return NULL;
+  }
+
+  // Everything between the unchanged chunks has to be read.
+  FileEntry* entry = AddCarriedForwardFile(
+      previous.generic_filename(), metadata,
+      FileChunkSpan(unchanged_chunks.data(), unchanged_chunks.size()));
+  read_ranges->clear();
+  uint64_t next_offset = 0;
+  for (const FileChunk& chunk : unchanged_chunks) {
+    if (chunk.chunk_offset > next_offset) {
+      read_ranges->push_back(
+          make_pair(next_offset, chunk.chunk_offset - next_offset));
+    }
+    next_offset = chunk.chunk_offset + chunk.unencoded_size;
+  }
+  if (metadata.file_size > next_offset) {
+    read_ranges->push_back(
+        make_pair(next_offset, metadata.file_size - next_offset));
+  }
+  return entry;
+}
+
+FileEntry* BackupLibrary::AddCarriedForwardFile(
+    const string& filename, BackupFile metadata, FileChunkSpan chunks) {
+  // The chunks are already stored somewhere in the library, so everything we
+  // reference here counts as deduplicated data.
+  metadata.num_chunks = 0;
+  FileEntry* entry = CreateNewFile(filename, metadata);
+  for (const FileChunk& chunk : chunks) {
+    entry->AddChunk(chunk);
+    file_set_->IncrementDedupCount(chunk.unencoded_size);
+  }
   return entry;
 }
 
+bool BackupLibrary::GetDataChunks(const FileEntry& previous,
+                                  vector<FileChunk>* chunks) {
+  // Empty chunks carry no data, and are left behind.  What's left must cover
+  // the previous contents exactly.
+  chunks->clear();
+  uint64_t covered_size = 0;
+  for (const FileChunk& chunk : previous.GetChunks()) {
+    if (chunk.unencoded_size > 0) {
+      chunks->push_back(chunk);
+      covered_size += chunk.unencoded_size;
+    }
+  }
+  if (chunks->empty() ||
+      covered_size != previous.GetBackupFile()->file_size) {
+    return false;
+  }
+  std::sort(chunks->begin(), chunks->end(), ChunkOffsetLessThan);
+  return true;
+}
+
+void BackupLibrary::RecordFileExtents(const FileEntry& entry,
+                                      const vector<FileExtent>& extents) {
+  if (extent_map_) {
+    extent_map_->AddFile(entry.generic_filename(), *entry.GetBackupFile(),
+                         extents);
+  }
+}
+
 void BackupLibrary::AbortFile(FileEntry* entry) {
   file_set_->RemoveFile(entry);
 }
 
+Status BackupLibrary::FinishFile(FileEntry* entry) {
+  return file_set_->FinishFile(entry);
+}
+
 Status BackupLibrary::AddChunk(const string& data, const uint64_t chunk_offset,
                                FileEntry* file) {
+  return AddChunk(data.data(), data.size(), chunk_offset, file);
+}
+
+Status BackupLibrary::AddChunk(const char* data, size_t size,
+                               const uint64_t chunk_offset, FileEntry* file) {
+  if (IsAllZero(data, size)) {
+    return AddZeroChunk(size, chunk_offset, file);
+  }
+
   // Create the chunk checksum.
-  Uint128 md5 = md5_maker_->Checksum(data);
+  Uint128 md5 = md5_maker_->Checksum(data, size);
+  return StoreChunk(data, md5, size, false, chunk_offset, file);
+}
+
+Status BackupLibrary::AddZeroChunk(uint64_t size, const uint64_t chunk_offset,
+                                   FileEntry* file) {
+  return StoreChunk(NULL, ZeroChunkMd5(size), size, true, chunk_offset, file);
+}
+
+bool BackupLibrary::IsZeroChunk(const FileChunk& chunk) const {
+  return chunk.unencoded_size > 0 &&
+         chunk.md5sum == ZeroChunkMd5(chunk.unencoded_size);
+}
+
+Uint128 BackupLibrary::ZeroChunkMd5(uint64_t size) const {
+  lock_guard<mutex> lock(zero_md5s_mutex_);
+  auto md5_iter = zero_md5s_.find(size);
+  if (md5_iter == zero_md5s_.end()) {
+    md5_iter = zero_md5s_.insert(
+        make_pair(size, md5_maker_->Checksum(string(size, '\0')))).first;
+  }
+  return md5_iter->second;
+}
 
+Status BackupLibrary::StoreChunk(const char* data, const Uint128& md5,
+                                 uint64_t size, bool zero,
+                                 const uint64_t chunk_offset, FileEntry* file) {
   FileChunk chunk;
   chunk.chunk_offset = chunk_offset;
-  chunk.unencoded_size = data.size();
+  chunk.unencoded_size = size;
   chunk.md5sum = md5;
   chunk.volume_num = current_backup_volume_->volume_number();
 
@@ -260,7 +774,7 @@ Status BackupLibrary::AddChunk(const string& data, const uint64_t chunk_offset,
     chunk.volume_num = chunk_data.volume_number;
     chunk.volume_offset = chunk_data.offset;
     file->AddChunk(chunk);
-    file_set_->IncrementDedupCount(data.size());
+    file_set_->IncrementDedupCount(size);
     return Status::OK;
   } else if (current_backup_volume_->HasChunk(chunk.md5sum)) {
     BackupDescriptor1Chunk chunk_data;
@@ -268,39 +782,43 @@ Status BackupLibrary::AddChunk(const string& data, const uint64_t chunk_offset,
     chunk.volume_num = chunk_data.volume_number;
     chunk.volume_offset = chunk_data.offset;
     file->AddChunk(chunk);
-    file_set_->IncrementDedupCount(data.size());
+    file_set_->IncrementDedupCount(size);
     return Status::OK;
   }
 
-  // If compression is enabled, compress the data.
+  // Zero chunks need no data.  Otherwise, if compression is enabled, compress
+  // the data.
   uint64_t volume_offset = 0;
-  if (options_.enable_compression() && data.size() > 0) {
+  if (zero) {
+    current_backup_volume_->WriteChunk(
+        chunk.md5sum, NULL, 0, size, kEncodingTypeZero, &volume_offset);
+  } else if (options_.enable_compression() && size > 0) {
     string compressed_data;
-    Status status = gzip_encoder_->Encode(data, &compressed_data);
+    Status status = gzip_encoder_->Encode(data, size, &compressed_data);
     if (!status.ok()) {
       LOG(ERROR) << "Failed to compress data";
       return status;
     }
 
-    VLOG(5) << "Compressed " << data.size() << " to " << compressed_data.size();
+    VLOG(5) << "Compressed " << size << " to " << compressed_data.size();
 
-    if (compressed_data.size() >= data.size()) {
+    if (compressed_data.size() >= size) {
       VLOG(5)
           << "Compressed larger than or equal to raw, using raw encoding for "
           << "chunk";
       current_backup_volume_->WriteChunk(
-          chunk.md5sum, data, data.size(), kEncodingTypeRaw, &volume_offset);
-      file_set_->IncrementEncodedSize(data.size());
+          chunk.md5sum, data, size, size, kEncodingTypeRaw, &volume_offset);
+      file_set_->IncrementEncodedSize(size);
     } else {
       current_backup_volume_->WriteChunk(
-          chunk.md5sum, compressed_data, data.size(), kEncodingTypeZlib,
+          chunk.md5sum, compressed_data, size, kEncodingTypeZlib,
           &volume_offset);
       file_set_->IncrementEncodedSize(compressed_data.size());
     }
   } else {
     current_backup_volume_->WriteChunk(
-        chunk.md5sum, data, data.size(), kEncodingTypeRaw, &volume_offset);
-    file_set_->IncrementEncodedSize(data.size());
+        chunk.md5sum, data, size, size, kEncodingTypeRaw, &volume_offset);
+    file_set_->IncrementEncodedSize(size);
   }
   chunk.volume_offset = volume_offset;
   file->AddChunk(chunk);
@@ -324,6 +842,7 @@ Status BackupLibrary::AddChunk(const string& data, const uint64_t chunk_offset,
     // volume so we can continue to de-dup.
     current_backup_volume_->Close();
     current_backup_volume_->GetChunks(&chunks_);
+    volume_cache_->Erase(last_volume_);
 
     // Start a new volume.
     last_volume_++;
@@ -331,6 +850,7 @@ Status BackupLibrary::AddChunk(const string& data, const uint64_t chunk_offset,
         last_volume_, true);
     CHECK(volume_result.ok()) << volume_result.status().ToString();
     current_backup_volume_ = volume_result.value();
+    volume_cache_->SetPinned(last_volume_, true);
 
     volume_bytes_remaining_ = 0;
   }
@@ -339,46 +859,209 @@ Status BackupLibrary::AddChunk(const string& data, const uint64_t chunk_offset,
 }
 
 Status BackupLibrary::ReadChunk(const FileChunk& chunk, string* data_out) {
-  // Load up the volume needed for this chunk and read the data out.
-  if (chunk.md5sum == read_cached_md5sum_) {
-    *data_out = read_cached_data_;
+  shared_ptr<const string> data;
+  Status retval = ReadChunk(chunk, &data);
+  if (!retval.ok()) {
+    return retval;
+  }
+  *data_out = *data;
+  return Status::OK;
+}
+
+Status BackupLibrary::ReadChunk(const FileChunk& chunk,
+                                shared_ptr<const string>* data_out) {
+  *data_out = chunk_cache_->Find(chunk.md5sum);
+  if (*data_out) {
     return Status::OK;
   }
 
-  StatusOr<BackupVolumeInterface*> volume_result = GetBackupVolume(
+  // Load up the volume needed for this chunk and read the data out.
+  string* data = new string;
+  shared_ptr<const string> shared_data(data);
+  EncodingType encoding_type;
+  Status retval = ReadEncodedChunk(chunk, data, &encoding_type);
+  LOG_RETURN_IF_ERROR(retval, "Error reading chunk");
+
+  retval = DecodeChunk(chunk, encoding_type, data);
+  LOG_RETURN_IF_ERROR(retval, "Error decoding chunk");
+
+  chunk_cache_->Insert(chunk.md5sum, shared_data);
+  *data_out = shared_data;
+  return Status::OK;
+}
+
+Status BackupLibrary::ReadEncodedChunk(const FileChunk& chunk,
+                                       string* encoded_out,
+                                       EncodingType* encoding_type_out) {
+  StatusOr<shared_ptr<CachedVolume> > volume_result = OpenBackupVolume(
       chunk.volume_num, false);
   LOG_RETURN_IF_ERROR(volume_result.status(), "Could not get backup volume");
-  BackupVolumeInterface* volume = volume_result.value();
+  shared_ptr<CachedVolume> volume = volume_result.value();
 
-  EncodingType encoding_type;
-  string encoded_data;
-  Status retval = volume->ReadChunk(chunk, &encoded_data, &encoding_type);
+  lock_guard<mutex> lock(volume->mutex);
+  Status retval = volume->volume->ReadChunk(chunk, encoded_out,
+                                            encoding_type_out);
   LOG_RETURN_IF_ERROR(retval, "Error reading chunk");
+  return Status::OK;
+}
 
-  // Decompress if encoded.
-  if (encoding_type == kEncodingTypeZlib) {
-    data_out->resize(chunk.unencoded_size);
-    Status retval = gzip_encoder_->Decode(encoded_data, data_out);
-    LOG_RETURN_IF_ERROR(retval, "Error decompressing chunk");
-  } else {
-    *data_out = encoded_data;
+Status BackupLibrary::ReadEncodedChunks(
+    const vector<FileChunk>& chunks, vector<string>* encoded_out,
+    vector<EncodingType>* encoding_types_out) {
+  encoded_out->clear();
+  encoding_types_out->clear();
+  if (chunks.empty()) {
+    return Status::OK;
+  }
+
+  StatusOr<shared_ptr<CachedVolume> > volume_result = OpenBackupVolume(
+      chunks[0].volume_num, false);
+  LOG_RETURN_IF_ERROR(volume_result.status(), "Could not get backup volume");
+  shared_ptr<CachedVolume> volume = volume_result.value();
+
+  lock_guard<mutex> lock(volume->mutex);
+  Status retval = volume->volume->ReadChunks(chunks, encoded_out,
+                                             encoding_types_out);
+  LOG_RETURN_IF_ERROR(retval, "Error reading chunks");
+  return Status::OK;
+}
+
+Status BackupLibrary::ReadStoredChunks(uint64_t volume_number,
+                                      uint64_t first_chunk,
+                                      uint64_t max_bytes,
+                                      vector<StoredChunk>* chunks_out) {
+  chunks_out->clear();
+  StatusOr<shared_ptr<CachedVolume> > volume_result = OpenBackupVolume(
+      volume_number, false);
+  LOG_RETURN_IF_ERROR(volume_result.status(), "Could not get backup volume");
+  shared_ptr<CachedVolume> volume = volume_result.value();
+
+  lock_guard<mutex> lock(volume->mutex);
+  Status retval = volume->volume->ReadStoredChunks(first_chunk, max_bytes,
+                                                   chunks_out);
+  LOG_RETURN_IF_ERROR(retval, "Error reading stored chunks");
+  return Status::OK;
+}
+
+StatusOr<bool> BackupLibrary::ChunksHaveCrcs(uint64_t volume_number) {
+  StatusOr<shared_ptr<CachedVolume> > volume_result = OpenBackupVolume(
+      volume_number, false);
+  LOG_RETURN_IF_ERROR(volume_result.status(), "Could not get backup volume");
+  shared_ptr<CachedVolume> volume = volume_result.value();
+
+  lock_guard<mutex> lock(volume->mutex);
+  return volume->volume->has_chunk_crcs();
+}
+
+Status BackupLibrary::LocateEncodedChunks(const vector<FileChunk>& chunks,
+                                          string* volume_filename_out,
+                                          vector<uint64_t>* data_offsets_out,
+                                          vector<ChunkHeader>* headers_out) {
+  data_offsets_out->clear();
+  headers_out->clear();
+  if (chunks.empty()) {
+    return Status::OK;
+  }
+
+  StatusOr<shared_ptr<CachedVolume> > volume_result = OpenBackupVolume(
+      chunks[0].volume_num, false);
+  LOG_RETURN_IF_ERROR(volume_result.status(), "Could not get backup volume");
+  shared_ptr<CachedVolume> volume = volume_result.value();
+
+  Status retval = Status::OK;
+  {
+    lock_guard<mutex> lock(volume->mutex);
+    retval = volume->volume->LocateChunksData(chunks, headers_out,
+                                              data_offsets_out);
+  }
+  if (!retval.ok()) {
+    return retval;
+  }
+
+  // Getting the volume may have moved the library to new media, so build
+  // the filename after.
+  lock_guard<mutex> lock(volumes_mutex_);
+  *volume_filename_out = FilenameFromVolume(chunks[0].volume_num);
+  return Status::OK;
+}
+
+Status BackupLibrary::DecodeChunk(const FileChunk& chunk,
+                                  EncodingType encoding_type,
+                                  string* data) const {
+  Status retval = DecodeChunkData(chunk, encoding_type, data);
+  if (!retval.ok() || encoding_type == kEncodingTypeZero) {
+    return retval;
   }
 
   // Validate the MD5.
-  Uint128 md5 = md5_maker_->Checksum(*data_out);
+  Uint128 md5 = md5_maker_->Checksum(*data);
   if (md5 != chunk.md5sum) {
     LOG(ERROR) << "Chunk MD5 mismatch: expected " << std::hex
                << chunk.md5sum.hi << chunk.md5sum.lo << ", got "
                << md5.hi << md5.lo;
     return Status(kStatusCorruptBackup, "Chunk MD5 mismatch");
   }
+  return Status::OK;
+}
+
+Status BackupLibrary::DecodeCheckedChunk(const FileChunk& chunk,
+                                         EncodingType encoding_type,
+                                         string* data) const {
+  Status retval = DecodeChunkData(chunk, encoding_type, data);
+  if (!retval.ok()) {
+    return retval;
+  }
 
-  read_cached_md5sum_ = md5;
-  read_cached_data_ = *data_out;
+  // Without the MD5, the size is all that's left to check the decoding by.
+  if (data->size() != chunk.unencoded_size) {
+    LOG(ERROR) << "Chunk size mismatch: " << data->size() << " / "
+               << chunk.unencoded_size;
+    return Status(kStatusCorruptBackup, "Chunk size mismatch");
+  }
   return Status::OK;
 }
 
+Status BackupLibrary::DecodeChunkData(const FileChunk& chunk,
+                                      EncodingType encoding_type,
+                                      string* data) const {
+  // Zero chunks carry no data, so there's nothing to check but their MD5.
+  if (encoding_type == kEncodingTypeZero) {
+    if (!IsZeroChunk(chunk)) {
+      LOG(ERROR) << "Zero chunk MD5 mismatch: " << std::hex
+                 << chunk.md5sum.hi << chunk.md5sum.lo;
+      return Status(kStatusCorruptBackup, "Chunk MD5 mismatch");
+    }
+    data->assign(chunk.unencoded_size, '\0');
+    return Status::OK;
+  }
+
+  // Decompress if encoded.
+  if (encoding_type == kEncodingTypeZlib) {
+    string decoded(chunk.unencoded_size, '\0');
+    Status retval = gzip_encoder_->Decode(*data, &decoded);
+    LOG_RETURN_IF_ERROR(retval, "Error decompressing chunk");
+    data->swap(decoded);
+  }
+  return Status::OK;
+}
+
+bool BackupLibrary::MatchesChunk(const FileChunk& chunk,
+                                 const string& data) const {
+  return data.size() == chunk.unencoded_size &&
+         md5_maker_->Checksum(data) == chunk.md5sum;
+}
+
 Status BackupLibrary::CloseBackup() {
+  // Remember where the label's previous backup was, so we can tell whether the
+  // existing file state cache can be updated.  New labels have no previous
+  // backup.
+  uint64_t label_id =
+      file_set_->use_default_label() ? 1 : file_set_->label_id();
+  auto previous_iter = labels_.find(label_id);
+  const Label* previous_label =
+      (label_id != 0 && previous_iter != labels_.end()) ?
+      &previous_iter->second : NULL;
+
   Status retval = current_backup_volume_->CloseWithFileSetAndLabels(
       file_set_.get(), labels_);
   LOG_RETURN_IF_ERROR(retval, "Could not close backup volume");
@@ -387,37 +1070,158 @@ Status BackupLibrary::CloseBackup() {
   // data we need if the user decides to initiate a second backup with this
   // library still open.
   current_backup_volume_->GetChunks(&chunks_);
+
+  // The cache is only an optimization -- if we can't write it, the next backup
+  // just falls back to loading the file sets.
+  if (options_.update_file_state_cache()) {
+    retval = UpdateFileStateCache(previous_label);
+    if (!retval.ok()) {
+      LOG(WARNING) << "Could not update file state cache: "
+                   << retval.ToString();
+    }
+  }
+
+  // Likewise, without the extent map the next backup reads changed files in
+  // full.
+  if (extent_map_) {
+    retval = UpdateExtentMap();
+    if (!retval.ok()) {
+      LOG(WARNING) << "Could not update extent map: " << retval.ToString();
+    }
+    extent_map_.reset();
+  }
+
+  // The spilled files are in descriptor 2 now.
+  retval = file_set_->DiscardSpilledFiles();
+  if (!retval.ok()) {
+    LOG(WARNING) << "Could not remove spill file: " << retval.ToString();
+  }
+
+  // The backup is complete, so there's nothing left to undo.  It must be on
+  // the disk before the journal goes, or a power loss could leave a damaged
+  // volume that can't be undone.
+  if (appending_) {
+    appending_ = false;
+    retval = SyncAppendedBackup(label_id);
+    LOG_RETURN_IF_ERROR(retval, "Could not sync backup");
+    retval = File(RefillJournalFilename()).Unlink();
+    if (retval.ok()) {
+      retval = SyncVolumeDirectory();
+    }
+    if (!retval.ok()) {
+      LOG(WARNING) << "Could not remove refill journal: " << retval.ToString();
+    }
+  }
+
+  // The volume can be evicted like any other, now that it's complete.
+  volume_cache_->SetPinned(last_volume_, false);
   return Status::OK;
 }
 
 Status BackupLibrary::CancelBackup() {
   Status retval = current_backup_volume_->Cancel();
   LOG_RETURN_IF_ERROR(retval, "Could not close backup volume");
+  extent_map_.reset();
+
+  retval = file_set_->DiscardSpilledFiles();
+  if (!retval.ok()) {
+    LOG(WARNING) << "Could not remove spill file: " << retval.ToString();
+  }
+
+  if (appending_) {
+    // The chunks written are thrown away with the rest of the backup, and
+    // those already merged into ours point at them, so our chunk data is
+    // loaded afresh for the next backup.
+    appending_ = false;
+    volume_cache_->SetPinned(last_volume_, false);
+    current_backup_volume_ = NULL;
+    chunks_.Clear();
+    retval = RollBackAppend(append_volume_, append_volume_size_);
+    LOG_RETURN_IF_ERROR(retval, "Could not undo appended backup");
+    return Status::OK;
+  }
 
   // Merge the backup volume's chunk data with ours.  This way we have all the
   // data we need if the user decides to initiate a second backup with this
   // library still open.
   current_backup_volume_->GetChunks(&chunks_);
+  volume_cache_->SetPinned(last_volume_, false);
   return Status::OK;
 }
 
 vector<pair<FileChunk, const FileEntry*> >
-    BackupLibrary::OptimizeChunksForRestore(set<FileEntry*> files) {
-  // Construct a vector containing every chunk in the FileEntry vector given.
-  vector<pair<FileChunk, const FileEntry*> > chunk_list;
+    BackupLibrary::OptimizeChunksForRestore(const FileEntrySet& files) {
+  // Gather every chunk of the files given.
+  vector<pair<const FileChunk*, const FileEntry*> > references;
+  vector<const FileChunk*> chunks;
   for (FileEntry* entry : files) {
-    for (FileChunk chunk : entry->GetChunks()) {
-      chunk_list.push_back(make_pair(chunk, entry));
+    for (const FileChunk& chunk : entry->GetChunks()) {
+      references.push_back(make_pair(&chunk, entry));
+      chunks.push_back(&chunk);
     }
   }
 
   // Sort the list by volume number, then by offset in the volume.
-  ChunkComparator comparator(&chunks_);
-  std::sort(chunk_list.begin(), chunk_list.end(), comparator);
-
+  vector<pair<FileChunk, const FileEntry*> > chunk_list;
+  chunk_list.reserve(references.size());
+  for (uint64_t index : ChunkReadOrder(chunks)) {
+    chunk_list.push_back(make_pair(*references[index].first,
+                                   references[index].second));
+  }
   return chunk_list;
 }
 
+vector<RestoreChunk> BackupLibrary::PlanRestore(const FileEntrySet& files,
+                                                vector<uint64_t>* volumes_out) {
+  // Group every reference to a chunk under the first one seen.  Any copy of a
+  // chunk will do, as they all hold the same data.
+  vector<RestoreChunk> unordered_plan;
+  unordered_map<Uint128, uint64_t, boost::hash<Uint128> > plan_index;
+  for (FileEntry* entry : files) {
+    for (const FileChunk& chunk : entry->GetChunks()) {
+      auto index_iter = plan_index.find(chunk.md5sum);
+      if (index_iter == plan_index.end()) {
+        index_iter = plan_index.insert(
+            make_pair(chunk.md5sum, unordered_plan.size())).first;
+        unordered_plan.push_back(RestoreChunk());
+        unordered_plan.back().chunk = chunk;
+      }
+
+      ChunkDestination destination;
+      destination.entry = entry;
+      destination.chunk_offset = chunk.chunk_offset;
+      unordered_plan[index_iter->second].destinations.push_back(destination);
+    }
+  }
+
+  // Read the volumes one at a time, straight through.
+  vector<const FileChunk*> chunks;
+  chunks.reserve(unordered_plan.size());
+  for (const RestoreChunk& restore_chunk : unordered_plan) {
+    chunks.push_back(&restore_chunk.chunk);
+  }
+  vector<RestoreChunk> plan(unordered_plan.size());
+  vector<uint64_t> order = ChunkReadOrder(chunks);
+  for (uint64_t position = 0; position < order.size(); ++position) {
+    RestoreChunk& restore_chunk = unordered_plan[order[position]];
+    plan[position].chunk = restore_chunk.chunk;
+    plan[position].destinations.swap(restore_chunk.destinations);
+  }
+
+  // Each volume is visited once, so the volumes needed are those of the plan
+  // with repeats dropped.
+  if (volumes_out) {
+    volumes_out->clear();
+    for (const RestoreChunk& restore_chunk : plan) {
+      if (volumes_out->empty() ||
+          volumes_out->back() != restore_chunk.chunk.volume_num) {
+        volumes_out->push_back(restore_chunk.chunk.volume_num);
+      }
+    }
+  }
+  return plan;
+}
+
 Status BackupLibrary::LoadAllChunkData() {
   // Iterate through all backup volumes loading the chunk data from each.
   volume_bytes_remaining_ = 0;
@@ -447,13 +1251,196 @@ Status BackupLibrary::LoadAllChunkData() {
   return Status::OK;
 }
 
+ConfigOptions BackupLibrary::VolumeOptions(uint64_t volume) const {
+  ConfigOptions options;
+  options.max_volume_size_mb = options_.max_volume_size_mb();
+  options.volume_number = volume;
+  options.enable_compression = options_.enable_compression();
+  return options;
+}
+
+StatusOr<bool> BackupLibrary::AppendToLastVolume(
+    BackupVolumeInterface* volume) {
+  uint64_t volume_size = volume->DiskSize();
+  uint64_t threshold_bytes =
+      (options_.max_volume_size_mb() - kMaxSizeThresholdMb) * 1048576;
+  if (!volume->is_completed_volume() || volume->was_cancelled() ||
+      volume_size >= threshold_bytes) {
+    return false;
+  }
+
+  // Record the volume's size before it's touched, so that if the backup never
+  // finishes, the volume can be truncated back to end with the backup before.
+  RefillJournal journal;
+  memcpy(journal.version, kRefillJournalVersion, sizeof(journal.version));
+  journal.volume_number = last_volume_;
+  journal.volume_size = volume_size;
+
+  File journal_file(RefillJournalFilename());
+  Status retval = journal_file.Open(File::Mode::kModeReadWrite);
+  LOG_RETURN_IF_ERROR(retval, "Error opening refill journal");
+  retval = journal_file.Write(&journal, sizeof(journal));
+  if (retval.ok()) {
+    retval = journal_file.Sync();
+  }
+  if (retval.ok()) {
+    retval = journal_file.Close();
+  } else {
+    journal_file.Close();
+  }
+  LOG_RETURN_IF_ERROR(retval, "Error writing refill journal");
+
+  // The journal has to be on the disk before the volume is touched, or a power
+  // loss could leave the volume changed with nothing to undo it.
+  retval = SyncVolumeDirectory();
+  LOG_RETURN_IF_ERROR(retval, "Error syncing refill journal");
+
+  retval = volume->Append(VolumeOptions(last_volume_));
+  if (retval.code() == kStatusInvalidArgument) {
+    // Volumes of older versions can't be appended to.  The volume is
+    // untouched, so just start a new one.
+    LOG(INFO) << "Not appending to volume " << last_volume_ << ": "
+              << retval.ToString();
+    File(RefillJournalFilename()).Unlink();
+    return false;
+  }
+  LOG_RETURN_IF_ERROR(retval, "Error appending to volume");
+
+  LOG(INFO) << "Appending backup to volume " << last_volume_ << " ("
+            << volume_size << " bytes)";
+  appending_ = true;
+  append_volume_ = last_volume_;
+  append_volume_size_ = volume_size;
+  current_backup_volume_ = volume;
+
+  // The volume is filled up to the usual limit, whatever room was left in
+  // earlier volumes.
+  volume_bytes_remaining_ = 0;
+  return true;
+}
+
+Status BackupLibrary::RollBackAppend(uint64_t volume, uint64_t volume_size) {
+  LOG(WARNING) << "Undoing backup appended to volume " << volume
+               << ", truncating it to " << volume_size << " bytes";
+
+  // Volumes after the one appended to were started by the same backup.
+  for (uint64_t later_volume = last_volume_; later_volume > volume;
+       --later_volume) {
+    volume_cache_->Erase(later_volume);
+    File later_file(FilenameFromVolume(later_volume));
+    if (later_file.Exists()) {
+      Status retval = later_file.Unlink();
+      LOG_RETURN_IF_ERROR(retval, "Error removing volume");
+      --num_volumes_;
+    }
+  }
+  volume_cache_->Erase(volume);
+  last_volume_ = volume;
+
+  File file(FilenameFromVolume(volume));
+  Status retval = file.Open(File::Mode::kModeReadWrite);
+  LOG_RETURN_IF_ERROR(retval, "Error opening volume");
+  retval = file.Truncate(volume_size);
+  if (retval.ok()) {
+    retval = file.Sync();
+  }
+  Status close_retval = file.Close();
+  LOG_RETURN_IF_ERROR(retval, "Error truncating volume");
+  LOG_RETURN_IF_ERROR(close_retval, "Error closing volume");
+
+  // The removed volumes have to stay removed before the journal goes too.
+  retval = SyncVolumeDirectory();
+  LOG_RETURN_IF_ERROR(retval, "Error syncing volume directory");
+  retval = File(RefillJournalFilename()).Unlink();
+  LOG_RETURN_IF_ERROR(retval, "Error removing refill journal");
+  return SyncVolumeDirectory();
+}
+
+Status BackupLibrary::SyncAppendedBackup(uint64_t label_id) {
+  for (uint64_t volume = append_volume_; volume <= last_volume_; ++volume) {
+    Status retval = File(FilenameFromVolume(volume)).Sync();
+    LOG_RETURN_IF_ERROR(retval, "Error syncing volume");
+  }
+
+  // The file state cache and extent map are only written for labels.
+  if (label_id != 0) {
+    vector<string> sidecars = {
+      FileStateCacheFilename(label_id), ExtentMapFilename(label_id) };
+    for (const string& sidecar : sidecars) {
+      File sidecar_file(sidecar);
+      if (sidecar_file.Exists()) {
+        Status retval = sidecar_file.Sync();
+        LOG_RETURN_IF_ERROR(retval, "Error syncing " + sidecar);
+      }
+    }
+  }
+  return SyncVolumeDirectory();
+}
+
+Status BackupLibrary::SyncVolumeDirectory() {
+  boost::filesystem::path directory =
+      boost::filesystem::path(basename_).parent_path();
+  if (directory.empty()) {
+    directory = ".";
+  }
+  return File(directory.string()).Sync();
+}
+
+Status BackupLibrary::RecoverInterruptedAppend() {
+  File journal_file(RefillJournalFilename());
+  if (!journal_file.Exists()) {
+    return Status::OK;
+  }
+
+  RefillJournal journal;
+  Status retval = journal_file.Open(File::Mode::kModeRead);
+  LOG_RETURN_IF_ERROR(retval, "Error opening refill journal");
+  retval = journal_file.Read(&journal, sizeof(journal), NULL);
+  journal_file.Close();
+
+  // The volume isn't touched until the journal is written, so a journal cut
+  // short has nothing to undo.
+  if (!retval.ok() ||
+      memcmp(journal.version, kRefillJournalVersion,
+             sizeof(journal.version)) != 0) {
+    LOG(WARNING) << "Removing incomplete refill journal";
+    return journal_file.Unlink();
+  }
+  if (num_volumes_ == 0 || journal.volume_number > last_volume_) {
+    LOG(WARNING) << "Removing refill journal for missing volume "
+                 << journal.volume_number;
+    return journal_file.Unlink();
+  }
+  return RollBackAppend(journal.volume_number, journal.volume_size);
+}
+
 StatusOr<BackupVolumeInterface*> BackupLibrary::GetBackupVolume(
     uint64_t volume_num, bool create_if_not_exist) {
-  if (cached_backup_volume_.get() &&
-      cached_backup_volume_->volume_number() == volume_num) {
-    return cached_backup_volume_.get();
+  StatusOr<shared_ptr<CachedVolume> > volume_result = OpenBackupVolume(
+      volume_num, create_if_not_exist);
+  LOG_RETURN_IF_ERROR(volume_result.status(), "Could not open backup volume");
+  shared_ptr<CachedVolume> volume = volume_result.value();
+
+  lock_guard<mutex> lock(volume->mutex);
+  Status retval = volume->volume->LoadDescriptor1();
+  LOG_RETURN_IF_ERROR(retval, "Could not load backup volume");
+  return volume->volume.get();
+}
+
+StatusOr<shared_ptr<CachedVolume> > BackupLibrary::OpenBackupVolume(
+    uint64_t volume_num, bool create_if_not_exist) {
+  // The lock is held while opening, so two threads wanting the same volume
+  // don't both open it.
+  lock_guard<mutex> lock(volumes_mutex_);
+  shared_ptr<CachedVolume> volume = volume_cache_->Find(volume_num);
+  if (volume) {
+    return volume;
   }
+  return OpenBackupVolumeLocked(volume_num, create_if_not_exist);
+}
 
+StatusOr<shared_ptr<CachedVolume> > BackupLibrary::OpenBackupVolumeLocked(
+    uint64_t volume_num, bool create_if_not_exist) {
   string filename = FilenameFromVolume(volume_num);
   LOG(INFO) << "Loading backup volume: " << filename;
   unique_ptr<BackupVolumeInterface> volume(
@@ -496,19 +1483,14 @@ StatusOr<BackupVolumeInterface*> BackupLibrary::GetBackupVolume(
       basename_ = basename;
 
       // Attempt to load the backup again.
-      return GetBackupVolume(volume_num, create_if_not_exist);
+      return OpenBackupVolumeLocked(volume_num, create_if_not_exist);
     }
 
     // Initialize the file.
-    ConfigOptions options;
-    options.max_volume_size_mb = options_.max_volume_size_mb();
-    options.volume_number = volume_num;
-    options.enable_compression = options_.enable_compression();
-    retval = volume->Create(options);
+    retval = volume->Create(VolumeOptions(volume_num));
     LOG_RETURN_IF_ERROR(retval, "Could not create backup volume");
   }
-  cached_backup_volume_.reset(volume.release());
-  return cached_backup_volume_.get();
+  return volume_cache_->Insert(volume_num, volume.release());
 }
 
 StatusOr<BackupVolumeInterface*> BackupLibrary::GetLastCompletedBackupVolume() {
@@ -518,15 +1500,18 @@ StatusOr<BackupVolumeInterface*> BackupLibrary::GetLastCompletedBackupVolume() {
 
   for (int64_t vol_num = last_volume_; vol_num >= 0; --vol_num) {
     LOG(INFO) << "Trying vol " << vol_num;
-    StatusOr<BackupVolumeInterface*> volume = GetBackupVolume(vol_num, false);
+    StatusOr<shared_ptr<CachedVolume> > volume = OpenBackupVolume(vol_num,
+                                                                  false);
     LOG_RETURN_IF_ERROR(volume.status(), "Could not load volume");
 
+    // Only the descriptor header is needed to tell, so the volumes passed
+    // over are never fully loaded.
     if (static_cast<uint64_t>(vol_num) == last_volume_ &&
-        volume.value()->was_cancelled()) {
+        volume.value()->volume->was_cancelled()) {
       cancelled_was_last = true;
     }
 
-    if (volume.value()->is_completed_volume()) {
+    if (volume.value()->volume->is_completed_volume()) {
       if (static_cast<uint64_t>(vol_num) != last_volume_ &&
           !cancelled_was_last) {
         // We may have an incomplete set -- alert the user that they should
@@ -535,7 +1520,7 @@ StatusOr<BackupVolumeInterface*> BackupLibrary::GetLastCompletedBackupVolume() {
         LOG(FATAL)
             << "Last volume was not cancelled -- do you have all volumes?";
       }
-      return volume;
+      return GetBackupVolume(vol_num, false);
     }
   }
 
@@ -552,6 +1537,78 @@ std::string BackupLibrary::FilenameFromVolume(uint64_t volume) {
   return file_str.str();
 }
 
+string BackupLibrary::FileStateCacheFilename(uint64_t label_id) {
+  ostringstream file_str;
+  file_str << basename_ << "." << label_id << ".fsc";
+  return file_str.str();
+}
+
+string BackupLibrary::ExtentMapFilename(uint64_t label_id) {
+  ostringstream file_str;
+  file_str << basename_ << "." << label_id << ".fem";
+  return file_str.str();
+}
+
+string BackupLibrary::SpillFilename() {
+  return basename_ + ".spill";
+}
+
+string BackupLibrary::RefillJournalFilename() {
+  return basename_ + ".refill";
+}
+
+Status BackupLibrary::UpdateExtentMap() {
+  // New labels only get their ID when the volume is closed.
+  LabelMap labels;
+  current_backup_volume_->GetLabels(&labels);
+  auto label_iter = labels.find(file_set_->label_id());
+  if (label_iter == labels.end()) {
+    return Status(kStatusGenericError, "Backup label not found");
+  }
+  uint64_t label_id = label_iter->second.id();
+
+  // Records from an extent map for a different label are useless.
+  if (extent_map_->size() > 0 && extent_map_->header().label_id != label_id) {
+    extent_map_.reset(new ExtentMap(md5_maker_.get()));
+  }
+
+  // Files not in a full backup were deleted, so their records can go.
+  // Incremental backups only have the files that changed.
+  const FileSet* live_files =
+      IsFullBackupType(file_set_->backup_type()) ? file_set_.get() : NULL;
+  return extent_map_->Write(ExtentMapFilename(label_id), label_id,
+                            live_files);
+}
+
+Status BackupLibrary::UpdateFileStateCache(const Label* previous_label) {
+  // The volume has the labels as updated by this backup, pointing at it.
+  LabelMap labels;
+  current_backup_volume_->GetLabels(&labels);
+  auto label_iter = labels.find(file_set_->label_id());
+  if (label_iter == labels.end()) {
+    return Status(kStatusGenericError, "Backup label not found");
+  }
+  const Label& label = label_iter->second;
+
+  FileStateCache cache(md5_maker_.get());
+  string filename = FileStateCacheFilename(label.id());
+  bool merge = !IsFullBackupType(file_set_->backup_type());
+  if (merge) {
+    // Only changed files are in this backup, so the rest of the state has to
+    // come from the cache of the previous one.  Without it, we leave the cache
+    // to be rebuilt by the next full backup.
+    Status retval = cache.Load(filename);
+    if (!retval.ok() || !previous_label ||
+        cache.header().backup_volume != previous_label->last_volume() ||
+        cache.header().backup_offset != previous_label->last_offset()) {
+      LOG(INFO) << "No up-to-date file state cache to update";
+      return Status::OK;
+    }
+  }
+  return cache.Write(filename, *file_set_, label.id(), label.last_volume(),
+                     label.last_offset(), merge);
+}
+
 Status BackupLibrary::LoadLabels() {
   // To load the labels, we need to find the last non-cancelled backup set.
   StatusOr<BackupVolumeInterface*> volume_result =
@@ -574,17 +1631,4 @@ Status BackupLibrary::LoadLabels() {
   return Status::OK;
 }
 
-bool BackupLibrary::ChunkComparator::operator()(
-    pair<FileChunk, const FileEntry*> lhs,
-    pair<FileChunk, const FileEntry*> rhs) {
-  if (lhs.first.volume_num < rhs.first.volume_num) {
-    return true;
-  } else if (lhs.first.volume_num > rhs.first.volume_num) {
-    return false;
-  }
-
-  // Volumes equal, compare the offsets.
-  return lhs.first.volume_offset < rhs.first.volume_offset;
-}
-
 }  // namespace backup2
@@ -3,9 +3,12 @@
 #ifndef BACKUP2_SRC_BACKUP_LIBRARY_H_
 #define BACKUP2_SRC_BACKUP_LIBRARY_H_
 
+#include <map>
 #include <memory>
+#include <mutex>
 #include <set>
 #include <string>
+#include <unordered_map>
 #include <utility>
 #include <vector>
 
@@ -13,17 +16,51 @@
 #include "src/backup_volume_interface.h"
 #include "src/callback.h"
 #include "src/common.h"
+#include "src/chunk_cache.h"
 #include "src/chunk_map.h"
+#include "src/file_interface.h"
 #include "src/fileset.h"
 #include "src/status.h"
+#include "src/volume_cache.h"
 
 namespace backup2 {
 class BackupVolumeFactoryInterface;
 class EncodingInterface;
+class ExtentMap;
 class FileEntry;
 class FileInterface;
 class FileSet;
+class FileStateCache;
 class Md5GeneratorInterface;
+struct FileStateRecord;
+
+// How BackupLibrary::CarryForwardAppendedFile() treats files that grew since
+// the last backup.  Growing files are usually only appended to, in which case
+// their previous chunks can be re-used and only the new data read.  The mode
+// decides how much of the previous contents is re-read to confirm that.
+enum AppendDetection {
+  // Grown files are always backed up in full.
+  kAppendDetectionOff = 0,
+
+  // Only the last chunk of the previous contents is checked.
+  kAppendDetectionLastChunk,
+
+  // The last chunk is checked, as well as a sample of earlier chunks spread
+  // evenly through the file.
+  kAppendDetectionSampled,
+};
+
+// A place restored chunk data is written to: a file, and the offset in it.
+struct ChunkDestination {
+  const FileEntry* entry;
+  uint64_t chunk_offset;
+};
+
+// A unique chunk to restore, along with every place its data is written to.
+struct RestoreChunk {
+  FileChunk chunk;
+  std::vector<ChunkDestination> destinations;
+};
 
 #define PROPERTY(type, name) \
   public: \
@@ -49,7 +86,13 @@ class BackupOptions {
         type_(kBackupTypeInvalid),
         use_default_label_(false),
         label_id_(1),
-        label_name_("Default") {}
+        label_name_("Default"),
+        update_file_state_cache_(false),
+        append_detection_(kAppendDetectionOff),
+        append_verify_samples_(8),
+        track_extents_(false),
+        max_file_set_memory_mb_(0),
+        pack_volumes_(false) {}
 
   // Description of the backup.  Used purely for user friendliness.
   PROPERTY(std::string, description);
@@ -73,6 +116,34 @@ class BackupOptions {
   // Label name.  If an existing label ID is specified, this property can be
   // used to rename the label.
   PROPERTY(std::string, label_name);
+
+  // Whether to update the label's file state cache when the backup is closed.
+  // The cache lets later incremental backups find changed files without
+  // loading previous file sets.
+  PROPERTY(bool, update_file_state_cache);
+
+  // How to detect files that were appended to.
+  PROPERTY(AppendDetection, append_detection);
+
+  // Number of earlier chunks to check with kAppendDetectionSampled.
+  PROPERTY(uint64_t, append_verify_samples);
+
+  // Whether to keep an extent map of the files backed up, so later backups
+  // can skip regions of changed files that weren't rewritten.  See
+  // CarryForwardUnchangedExtents().
+  PROPERTY(bool, track_extents);
+
+  // Memory in MB the backup's finished files may use before they're spilled to
+  // a temporary file next to the volumes, or 0 to keep them all in memory.
+  // See FinishFile().
+  PROPERTY(uint64_t, max_file_set_memory_mb);
+
+  // Whether to append the backup to the last volume, if it ends a completed
+  // backup and is under max_volume_size_mb, rather than always starting a new
+  // volume.  Until the backup is closed, the volume's previous size is kept in
+  // a journal next to the volumes, so an interrupted or cancelled backup can
+  // be undone.
+  PROPERTY(bool, pack_volumes);
 };
 
 // A BackupLibrary manages an entire series of backups across many different
@@ -84,6 +155,14 @@ class BackupLibrary {
   // Margin around the maximum volume size to leave.
   static const uint64_t kMaxSizeThresholdMb = 2;
 
+  // Default size of the cache of decoded chunks read with ReadChunk().
+  static const uint64_t kDefaultChunkCacheMb = 64;
+
+  // Default limits of the cache of open backup volumes: the number kept open,
+  // and the memory their chunk maps may take.
+  static const uint64_t kDefaultVolumeCacheSize = 16;
+  static const uint64_t kDefaultVolumeCacheMb = 64;
+
   // Volume change callback.  This is used whenever the backup library needs to
   // load a volume but can't figure out the correct filename to use.
   // BackupLibrary supplies the filename and path it was looking for, and
@@ -108,9 +187,15 @@ class BackupLibrary {
   ~BackupLibrary();
 
   // Initialize the library.  This does cursory checks, like determining how
-  // many backup volumes are in the library.
+  // many backup volumes are in the library.  The volumes are not modified.
   Status Init();
 
+  // Like Init(), but for a library opened to back up.  A backup that was
+  // appended to the last volume and never closed is undone here; see
+  // BackupOptions::pack_volumes().  This must not be used while another backup
+  // is running on the same volumes.
+  Status InitForBackup();
+
   // Load the filesets for the backup library.  If load_all is true, this will
   // work backward through the entire backup library (all volumes) and load the
   // complete backup set history.  Otherwise, only the backup sets going back to
@@ -129,13 +214,31 @@ class BackupLibrary {
   StatusOr<std::vector<FileSet*> > LoadFileSetsFromLabel(
       bool load_all, uint64_t label_id);
 
+  // Load the file state cache for the given label.  The cache describes the
+  // state of every file in the label as of its last backup, and can be used to
+  // find changed files without loading any file sets.  Returns
+  // kStatusNoSuchFile if there is no cache for the label, or if it doesn't
+  // describe the label's last backup.  Ownership passes to the caller, and the
+  // cache must not outlive the library.
+  StatusOr<FileStateCache*> LoadFileStateCache(uint64_t label_id);
+
+  // Load the FileEntry of each of the given files, keyed by filename, from the
+  // backup its file state cache record points at.  Only the file sets of those
+  // backups are loaded, each of them once.  Files not found in their backup
+  // are left out.  Ownership of the file sets remains with the library.
+  Status LoadFilesFromStateRecords(
+      const std::vector<std::pair<std::string, const FileStateRecord*> >&
+          files,
+      std::unordered_map<std::string, const FileEntry*>* entries_out);
+
   // Load the labels from the backup library.  Returned label objects retain
   // ownership with the library.  There is no sorting order to the vector.
   Status GetLabels(std::vector<Label>* out_labels);
 
   // Create a new backup.  This instantiates a new FileSet internally, and gets
   // it ready for backing up.  If this is the first time this is called, the
-  // backup library will scan the volumes to populate its list of chunks.
+  // backup library will scan the volumes to populate its list of chunks.  An
+  // interrupted backup left for InitForBackup() to undo is an error.
   Status CreateBackup(BackupOptions options);
 
   // Create a file in the current backup.  The returned FileEntry can be used to
@@ -143,53 +246,197 @@ class BackupLibrary {
   // BackupLibrary.
   FileEntry* CreateNewFile(const std::string& filename, BackupFile metadata);
 
+  // Create a file in the current backup that re-uses the chunks of a file from
+  // a previous backup in the library, without reading any file data.  The
+  // metadata given is that of the file as it currently exists on disk; if its
+  // size, modification date, inode or change date differ from |previous|,
+  // nothing is added and NULL is returned, and the caller must back the file
+  // up normally with CreateNewFile() and AddChunk().  Ownership of the returned
+  // FileEntry remains with the BackupLibrary.
+  FileEntry* CarryForwardFile(const FileEntry& previous, BackupFile metadata);
+
+  // Create a file in the current backup that re-uses the chunks of a file from
+  // a previous backup which has since grown, presumably by being appended to.
+  // Chunks chosen by the backup's append detection mode are re-read from
+  // |file|, which must be open for reading, and checked against their
+  // checksums.  If append detection is off, the file didn't grow, or any chunk
+  // differs, nothing is added and NULL is returned.  Otherwise, the returned
+  // entry has the previous chunks, and the caller must add the rest of the
+  // file with AddChunk(), starting from *resume_offset.  The position of
+  // |file| is undefined afterwards.  Ownership of the returned FileEntry
+  // remains with the BackupLibrary.
+  FileEntry* CarryForwardAppendedFile(
+      const FileEntry& previous, BackupFile metadata, FileInterface* file,
+      uint64_t* resume_offset);
+
+  // Create a file in the current backup that re-uses the chunks of a file from
+  // a previous backup wherever its data is still in the same place on disk.
+  // |extents| are the current extents of the file, from
+  // FileInterface::GetExtents(), and are compared against those recorded when
+  // |previous| was backed up.  If extent tracking is off, no extents were
+  // recorded for |previous|, or no chunks can be re-used, nothing is added and
+  // NULL is returned.  Otherwise, the returned entry has the re-used chunks,
+  // and the caller must add the rest of the file with AddChunk(), reading the
+  // (offset, length) ranges returned in read_ranges.  Ownership of the
+  // returned FileEntry remains with the BackupLibrary.
+  FileEntry* CarryForwardUnchangedExtents(
+      const FileEntry& previous, BackupFile metadata,
+      const std::vector<FileExtent>& extents,
+      std::vector<std::pair<uint64_t, uint64_t> >* read_ranges);
+
+  // Record the extents of a file in the current backup, taken before it was
+  // read, for later backups to compare against.  Does nothing if extent
+  // tracking is off.
+  void RecordFileExtents(const FileEntry& entry,
+                         const std::vector<FileExtent>& extents);
+
   // Abort the creation of a file in the current backup.  This is used to back
   // out when an error reading or accessing the file occurs.
   void AbortFile(FileEntry* entry);
 
+  // Mark a file in the current backup as complete, once all of its chunks have
+  // been added.  The file may be spilled from memory, so the entry must not be
+  // used after this call.
+  Status FinishFile(FileEntry* entry);
+
   // Add a chunk to the given FileEntry.  The entry must have been created by
   // CreateNewFile().  Compression and checksumming are done with this function
   // before handing off to the backup volume for storage.
   Status AddChunk(const std::string& data, const uint64_t chunk_offset,
                   FileEntry* file);
 
+  // Like AddChunk() above, but for the size bytes at data, such as a piece of
+  // a larger read buffer.  The data is only read, and is copied at most once,
+  // into the volume.
+  Status AddChunk(const char* data, size_t size, const uint64_t chunk_offset,
+                  FileEntry* file);
+
+  // Add a chunk of size zero bytes to the given FileEntry without the data,
+  // such as for a hole in a sparse file.  Chunks of all zeros are stored as a
+  // header alone, with kEncodingTypeZero, and are never read back; AddChunk()
+  // does the same for data it finds to be all zeros.
+  Status AddZeroChunk(uint64_t size, const uint64_t chunk_offset,
+                      FileEntry* file);
+
+  // Return whether the given chunk is all zeros, and so can be restored
+  // without reading it.  This is safe to call from multiple threads at once.
+  bool IsZeroChunk(const FileChunk& chunk) const;
+
   // Read a chunk from the library.  If successful, the chunk data is returned
   // in the passed string.  We undo any compression and encoding.
   Status ReadChunk(const FileChunk& chunk, std::string* data_out);
 
+  // Like ReadChunk() above, but returns the library's shared copy of the chunk
+  // data rather than copying it.  Chunks are read through the chunk cache, so
+  // chunks requested repeatedly are only read and decoded once.
+  Status ReadChunk(const FileChunk& chunk,
+                   std::shared_ptr<const std::string>* data_out);
+
+  // Read a chunk from its backup volume as it is stored, without decoding or
+  // validating it.  Volumes are opened through the volume cache, so this is
+  // safe to call from multiple threads at once, though reads of the same
+  // volume are done one at a time.
+  Status ReadEncodedChunk(const FileChunk& chunk, std::string* encoded_out,
+                          EncodingType* encoding_type_out);
+
+  // Like ReadEncodedChunk(), but reads a batch of chunks, all of which must be
+  // in the same volume.  Nearby chunks are fetched together in large reads, so
+  // batches of chunks in volume order read the volume nearly sequentially.
+  Status ReadEncodedChunks(const std::vector<FileChunk>& chunks,
+                           std::vector<std::string>* encoded_out,
+                           std::vector<EncodingType>* encoding_types_out);
+
+  // Read the chunks stored in the given volume in the order they're stored, as
+  // BackupVolumeInterface::ReadStoredChunks() does, for checking the volume
+  // end to end.  Like ReadEncodedChunk(), this is safe to call from multiple
+  // threads at once.
+  Status ReadStoredChunks(uint64_t volume_number, uint64_t first_chunk,
+                          uint64_t max_bytes,
+                          std::vector<StoredChunk>* chunks_out);
+
+  // Return whether the chunks read from the given volume by
+  // ReadEncodedChunk() and ReadEncodedChunks() have been checked against CRCs
+  // stored with them.  Like ReadEncodedChunk(), this is safe to call from
+  // multiple threads at once.
+  StatusOr<bool> ChunksHaveCrcs(uint64_t volume_number);
+
+  // Return the number of volumes in the library.
+  uint64_t num_volumes() const { return num_volumes_; }
+
+  // Find where a batch of chunks, all in the same volume, is stored, without
+  // reading their data: the filename of their volume, and the offset of each
+  // chunk's data in the volume and its header.  Like ReadEncodedChunks(),
+  // this is safe to call from multiple threads at once.  Returns
+  // kStatusNotImplemented if the volume isn't stored in a file.
+  Status LocateEncodedChunks(const std::vector<FileChunk>& chunks,
+                             std::string* volume_filename_out,
+                             std::vector<uint64_t>* data_offsets_out,
+                             std::vector<ChunkHeader>* headers_out);
+
+  // Decode a chunk returned by ReadEncodedChunk() in place, and validate it
+  // against the chunk's MD5.  This touches no library state, and is safe to
+  // call from multiple threads at once.
+  Status DecodeChunk(const FileChunk& chunk, EncodingType encoding_type,
+                     std::string* data) const;
+
+  // Return whether the given data is the content of the given chunk.  Like
+  // DecodeChunk(), this is safe to call from multiple threads at once.
+  bool MatchesChunk(const FileChunk& chunk, const std::string& data) const;
+
+  // Like DecodeChunk(), but for chunks whose encoded data was already checked
+  // against a CRC when read, so the MD5 isn't recomputed.  Only the decoded
+  // size is checked.
+  Status DecodeCheckedChunk(const FileChunk& chunk, EncodingType encoding_type,
+                            std::string* data) const;
+
   // Close the current backup set.  This is called when a backup is finished,
   // and finalizes the backup volumes.
   Status CloseBackup();
 
   // Cancel an open backup set.  Chunks written are still there, but the backup
-  // set content is not written.
+  // set content is not written.  A backup appended to the last volume is
+  // undone entirely instead, as the volume must still end the backup before
+  // it.
   Status CancelBackup();
 
   // Given a list of files to restore, optimize the chunk ordering to minimize
-  // reads and volume changes.
+  // reads and volume changes.  Only the locations stored in the chunks are
+  // used, so the library's chunk data need not be loaded.
   std::vector<std::pair<FileChunk, const FileEntry*> >
-      OptimizeChunksForRestore(std::set<FileEntry*> files);
+      OptimizeChunksForRestore(const FileEntrySet& files);
+
+  // Given a list of files to restore, return each unique chunk they need once,
+  // along with every file and offset its data goes to.  Chunks shared between
+  // files, or repeated within one, are then only read and decoded once.  The
+  // chunks are ordered by volume and offset, like OptimizeChunksForRestore().
+  // If volumes_out is not NULL, it's filled with the volumes the plan reads,
+  // in the order it reads them; each is needed exactly once.
+  std::vector<RestoreChunk> PlanRestore(const FileEntrySet& files,
+                                        std::vector<uint64_t>* volumes_out);
 
   void set_volume_change_callback(VolumeChangeCallback* cb) {
     volume_change_callback_ = cb;
   }
 
- private:
-  // Chunk comparison functor.  This comparator is used in sorting file chunks
-  // for optimal performance, and sorts by volume first, then by offset within
-  // the volume.  This way, we read volumes one at a time, straight through,
-  // rather than bouncing back and forth randomly.
-  class ChunkComparator {
-   public:
-    explicit ChunkComparator(ChunkMap* chunk_map) : chunks_(chunk_map) {}
-    bool operator()(
-        std::pair<FileChunk, const FileEntry*> lhs,
-        std::pair<FileChunk, const FileEntry*> rhs);
-
-   private:
-    ChunkMap* chunks_;
-  };
+  // Change the size of the chunk cache.  This drops all cached chunks.
+  void set_chunk_cache_mb(uint64_t chunk_cache_mb) {
+    chunk_cache_->Reset(chunk_cache_mb * 1048576);
+  }
+
+  // Return the chunk cache, for its counters.
+  const ChunkCache& chunk_cache() const { return *chunk_cache_; }
+
+  // Change the limits of the volume cache: the number of volumes kept open,
+  // and the memory their chunk maps may take.  This closes all cached volumes,
+  // and so must not be called during a backup.
+  void set_volume_cache_limits(uint64_t max_volumes, uint64_t max_mb) {
+    volume_cache_->Reset(max_volumes, max_mb * 1048576);
+  }
+
+  // Return the volume cache, for its counters.
+  const VolumeCache& volume_cache() const { return *volume_cache_; }
 
+ private:
   // Scan through the library and load all the chunk data.  This gives the
   // library knowledge of all available chunks in the library which can be
   // subsequently used for deduping in new backups.  The VolumeChangeCallback
@@ -201,10 +448,22 @@ class BackupLibrary {
   Status LoadAllChunkData();
 
   // Find and initialize a BackupVolume for the given volume number, optionally
-  // creating a new one if the requested one doesn't already exist.
+  // creating a new one if the requested one doesn't already exist.  Its
+  // descriptor 1 is loaded.  The volume is only guaranteed to stay open until
+  // the next volume is requested, so this is only for use from one thread.
   StatusOr<BackupVolumeInterface*> GetBackupVolume(
       uint64_t volume, bool create_if_not_exist);
 
+  // Like GetBackupVolume(), but returns the volume as shared by the volume
+  // cache, and only reads its descriptor header.  The volume's mutex must be
+  // held while using it.  This is safe to call from multiple threads at once.
+  StatusOr<std::shared_ptr<CachedVolume> > OpenBackupVolume(
+      uint64_t volume, bool create_if_not_exist);
+
+  // Body of OpenBackupVolume().  Must be called with volumes_mutex_ held.
+  StatusOr<std::shared_ptr<CachedVolume> > OpenBackupVolumeLocked(
+      uint64_t volume, bool create_if_not_exist);
+
   // Find the last backup volume that represents a completed backup.  If the
   // user aborted a backup, certain things won't be available in the last
   // volume, so this gets the last volume with useful information.  If the very
@@ -212,13 +471,89 @@ class BackupLibrary {
   // we don't have the last volume available.
   StatusOr<BackupVolumeInterface*> GetLastCompletedBackupVolume();
 
+  // Undo the encoding of a chunk's data in place, for DecodeChunk() and
+  // DecodeCheckedChunk().  Zero chunks are checked against their MD5 here.
+  Status DecodeChunkData(const FileChunk& chunk, EncodingType encoding_type,
+                         std::string* data) const;
+
+  // Implements Init() and InitForBackup().
+  Status InitLibrary(bool undo_interrupted_append);
+
   // Load the labels from the last backup volume.  This needs to be kept in here
   // to allow us to write it back at the conclusion of a backup.
   Status LoadLabels();
 
+  // Add a chunk with the given checksum to the given FileEntry, re-using a
+  // stored chunk if there is one, and otherwise storing the size bytes at data.
+  // Zero chunks are stored with no data, and data may be NULL.
+  Status StoreChunk(const char* data, const Uint128& md5, uint64_t size,
+                    bool zero, const uint64_t chunk_offset, FileEntry* file);
+
+  // Return the MD5 of a chunk of size zero bytes.
+  Uint128 ZeroChunkMd5(uint64_t size) const;
+
+  // Return the options to create or append to the given backup volume with.
+  ConfigOptions VolumeOptions(uint64_t volume) const;
+
+  // Add a file with the given name and metadata to the current backup,
+  // referencing the given chunks already stored in the library.
+  FileEntry* AddCarriedForwardFile(const std::string& filename,
+                                   BackupFile metadata, FileChunkSpan chunks);
+
+  // Return the chunks of a previous file that hold data, in offset order.
+  // Returns false if there are none, or they don't cover the file's previous
+  // contents exactly.
+  static bool GetDataChunks(const FileEntry& previous,
+                            std::vector<FileChunk>* chunks);
+
+  // Start appending the current backup to the last volume, if it ends a
+  // completed backup and has room left.  Returns false if a new volume should
+  // be started instead, in which case the volume is left as it was.
+  StatusOr<bool> AppendToLastVolume(BackupVolumeInterface* volume);
+
+  // Undo a backup appended to the given volume: remove any volumes it went on
+  // to start, and truncate the volume back to the given size.  The refill
+  // journal is removed once done.
+  Status RollBackAppend(uint64_t volume, uint64_t volume_size);
+
+  // Undo the backup recorded in a refill journal left by a backup that was
+  // never closed, if there is one.
+  Status RecoverInterruptedAppend();
+
+  // Sync the volumes written by a backup appended to a volume, along with the
+  // label's file state cache and extent map, so the refill journal can go.
+  Status SyncAppendedBackup(uint64_t label_id);
+
+  // Sync the directory holding the volumes, so files created in or removed
+  // from it survive a power loss.
+  Status SyncVolumeDirectory();
+
   // Convert the base name and volume number to a path.
   std::string FilenameFromVolume(uint64_t volume);
 
+  // Return the path of the file state cache for the given label.
+  std::string FileStateCacheFilename(uint64_t label_id);
+
+  // Return the path of the extent map for the given label.
+  std::string ExtentMapFilename(uint64_t label_id);
+
+  // Return the path of the file the current backup's files are spilled to.
+  std::string SpillFilename();
+
+  // Return the path of the journal kept while a backup is appended to a
+  // volume.
+  std::string RefillJournalFilename();
+
+  // Write the extent map for the backup just closed.  Full backups drop files
+  // no longer backed up.
+  Status UpdateExtentMap();
+
+  // Write the file state cache for the backup just closed.  Full backups
+  // replace the cache; other backups are merged into the cache for
+  // previous_label, the state of the label before the backup, if it's up to
+  // date.
+  Status UpdateFileStateCache(const Label* previous_label);
+
   // File originally supplied to the constructor.  This is used only to
   // identify backup sets -- then filename handling is done more intelligently.
   // NOTE: After Init() this will be NULL!
@@ -256,26 +591,43 @@ class BackupLibrary {
   // from each backup volume before performing a backup.
   ChunkMap chunks_;
 
+  // Extents recorded for the label of the current backup, and those of files
+  // in it.  This is only set if the backup tracks extents.
+  std::unique_ptr<ExtentMap> extent_map_;
+
   // Map of labels obtained from the last backup volume in the library.  This is
   // carried through backups so accurate information can be kept.
   LabelMap labels_;
 
-  // Cached MD5 and data for reading chunks.  This greatly speeds up reads of
-  // the same chunks, especially when used with an optimized chunk list, as the
-  // same chunk may be requested many times (to re-duplicate data).  This way
-  // we're not hitting the disk every time (or worse, the network).
-  Uint128 read_cached_md5sum_;
-  std::string read_cached_data_;
+  // Cache of decoded chunks for reading chunks.  This greatly speeds up reads
+  // of the same chunks, as the same chunk may be requested many times (to
+  // re-duplicate data).  This way we're not hitting the disk every time (or
+  // worse, the network).
+  std::unique_ptr<ChunkCache> chunk_cache_;
+
+  // MD5s of chunks of zeros, by size.  Nearly every zero chunk is the full
+  // chunk size, so this rarely holds more than a couple.
+  mutable std::mutex zero_md5s_mutex_;
+  mutable std::map<uint64_t, Uint128> zero_md5s_;
 
-  // Currently active backup volume.  This only changes when we need to
-  // request a different volume than we currently have.
-  std::unique_ptr<BackupVolumeInterface> cached_backup_volume_;
+  // Volumes opened recently, by volume number.  The volume being written by a
+  // backup is pinned in the cache.  volumes_mutex_ is held while opening a
+  // volume, and protects basename_ and user_file_ as the volume change
+  // callback may change them.
+  std::mutex volumes_mutex_;
+  std::unique_ptr<VolumeCache> volume_cache_;
 
   // Amount of bytes remaining in the current backup volume before we need to
   // start a new one.  This is normally not populated until right before a new
   // backup.
   uint64_t volume_bytes_remaining_;
 
+  // Whether the current backup was appended to the last volume, and if so,
+  // the volume it started in and that volume's size beforehand.
+  bool appending_;
+  uint64_t append_volume_;
+  uint64_t append_volume_size_;
+
   DISALLOW_COPY_AND_ASSIGN(BackupLibrary);
 };
 
@@ -1,12 +1,19 @@
 // Copyright (C) 2013, All Rights Reserved.
 // Author: Cory Maccarrone <darkstar6262@gmail.com>
 
+#include <memory>
+#include <unordered_map>
+#include <utility>
 #include <vector>
 
+#include "boost/filesystem.hpp"
 #include "src/backup_library.h"
 #include "src/callback.h"
 #include "src/fileset.h"
 #include "src/fake_backup_volume.h"
+#include "src/fake_file.h"
+#include "src/file.h"
+#include "src/file_state_cache.h"
 #include "src/mock_backup_volume_factory.h"
 #include "src/mock_encoder.h"
 #include "src/mock_file.h"
@@ -16,7 +23,10 @@
 #include "gmock/gmock.h"
 #include "gtest/gtest.h"
 
+using std::pair;
+using std::shared_ptr;
 using std::string;
+using std::unordered_map;
 using std::vector;
 using testing::_;
 using testing::DoAll;
@@ -135,6 +145,85 @@ TEST_F(BackupLibraryTest, CreateBackupWriteFiles) {
   delete cb;
 }
 
+TEST_F(BackupLibraryTest, CreateBackupWriteZeroChunks) {
+  // This test verifies that chunks of zeros are stored without their data.
+  MockFile* file = new MockFile;
+  MockMd5Generator* md5_generator = new MockMd5Generator;
+  auto cb = NewPermanentCallback(
+      static_cast<BackupLibraryTest*>(this),
+      &BackupLibraryTest::GetNextFilename);
+
+  MockBackupVolumeFactory* volume_factory = new MockBackupVolumeFactory();
+
+  EXPECT_CALL(*file, FindBasenameAndLastVolume(_, _, _))
+      .WillOnce(DoAll(
+          SetArgPointee<0>("/foo/bar"),
+          SetArgPointee<1>(0),
+          SetArgPointee<2>(0),
+          Return(Status::OK)));
+  BackupLibrary library(
+      file, cb,
+      md5_generator,
+      new MockEncoder(),
+      volume_factory);
+
+  FakeBackupVolume* volume = new FakeBackupVolume(file);
+  volume->InitializeForNewVolume();
+  EXPECT_CALL(*volume_factory, Create("/foo/bar.0.bkp")).WillOnce(
+      Return(volume));
+
+  EXPECT_TRUE(library.Init().ok());
+  Status retval = library.CreateBackup(
+      BackupOptions().set_description("Foo")
+                     .set_enable_compression(true)
+                     .set_max_volume_size_mb(0)
+                     .set_type(kBackupTypeFull));
+  EXPECT_TRUE(retval.ok()) << retval.ToString();
+
+  BackupFile metadata;
+  FileEntry* entry = library.CreateNewFile("/foo/bar/bleh", metadata);
+
+  // The checksum of zeros is only computed once per size, and the zero chunk
+  // is never compressed.  Found zeros and holes share the chunk.
+  string data(200, '\0');
+  Uint128 md5sum;
+  md5sum.hi = 0x834671;
+  md5sum.lo = 0x892376;
+  EXPECT_CALL(*md5_generator, Checksum(data)).WillOnce(Return(md5sum));
+
+  retval = library.AddChunk(data, 0, entry);
+  EXPECT_TRUE(retval.ok()) << retval.ToString();
+  retval = library.AddZeroChunk(200, 200, entry);
+  EXPECT_TRUE(retval.ok()) << retval.ToString();
+  ASSERT_EQ(2, entry->GetChunks().size());
+  EXPECT_EQ(md5sum, entry->GetChunks()[1].md5sum);
+  EXPECT_EQ(200, entry->GetChunks()[1].unencoded_size);
+  EXPECT_TRUE(library.IsZeroChunk(entry->GetChunks()[1]));
+
+  retval = library.CloseBackup();
+  EXPECT_TRUE(retval.ok()) << retval.ToString();
+
+  // The volume holds only the chunk's header.
+  FileChunk chunk = entry->GetChunks()[0];
+  string written_data;
+  EncodingType encoding;
+  retval = volume->ReadChunk(chunk, &written_data, &encoding);
+  EXPECT_TRUE(retval.ok()) << retval.ToString();
+  EXPECT_EQ("", written_data);
+  EXPECT_EQ(kEncodingTypeZero, encoding);
+
+  // Decoding fills in the zeros.
+  retval = library.DecodeChunk(chunk, encoding, &written_data);
+  EXPECT_TRUE(retval.ok()) << retval.ToString();
+  EXPECT_EQ(data, written_data);
+
+  // Chunks of other data aren't zero chunks.
+  chunk.md5sum.lo = 0x1234;
+  EXPECT_FALSE(library.IsZeroChunk(chunk));
+
+  delete cb;
+}
+
 TEST_F(BackupLibraryTest, CreateBackupWriteFilesDedup) {
   // This test verifies that creating a backup and writing files works
   // correctly.
@@ -298,6 +387,454 @@ TEST_F(BackupLibraryTest, CreateBackupWriteFilesWithCompression) {
   delete cb;
 }
 
+TEST_F(BackupLibraryTest, CreateBackupCarryForwardFiles) {
+  // This test verifies that unchanged files from a previous backup can be
+  // added to a new backup without reading their data.
+  MockFile* file = new MockFile;
+  MockMd5Generator* md5_generator = new MockMd5Generator;
+  auto cb = NewPermanentCallback(
+      static_cast<BackupLibraryTest*>(this),
+      &BackupLibraryTest::GetNextFilename);
+
+  MockBackupVolumeFactory* volume_factory = new MockBackupVolumeFactory();
+
+  EXPECT_CALL(*file, FindBasenameAndLastVolume(_, _, _))
+      .WillOnce(DoAll(
+          SetArgPointee<0>("/foo/bar"),
+          SetArgPointee<1>(0),
+          SetArgPointee<2>(0),
+          Return(Status::OK)));
+  BackupLibrary library(
+      file, cb,
+      md5_generator,
+      new MockEncoder(),
+      volume_factory);
+  EXPECT_TRUE(library.Init().ok());
+
+  FakeBackupVolume* volume = new FakeBackupVolume(file);
+  volume->InitializeForNewVolume();
+  EXPECT_CALL(*volume_factory, Create("/foo/bar.0.bkp")).WillOnce(
+      Return(volume));
+
+  Status retval = library.CreateBackup(
+      BackupOptions().set_description("Foo")
+                     .set_enable_compression(false)
+                     .set_max_volume_size_mb(0)
+                     .set_type(kBackupTypeSyntheticFull));
+  EXPECT_TRUE(retval.ok()) << retval.ToString();
+
+  // Build the file as it was recorded in a previous backup.
+  BackupFile previous_metadata;
+  previous_metadata.file_type = BackupFile::kFileTypeRegularFile;
+  previous_metadata.file_size = 16;
+  previous_metadata.modify_date = 12345;
+  FileEntry previous("/foo/bar/bleh", previous_metadata);
+
+  FileChunk chunk;
+  chunk.md5sum.hi = 0x834671;
+  chunk.md5sum.lo = 0x892376;
+  chunk.volume_num = 3;
+  chunk.volume_offset = 1024;
+  chunk.unencoded_size = 16;
+  previous.AddChunk(chunk);
+
+  // No checksums or reads should happen for an unchanged file -- the chunks
+  // are simply referenced again.
+  EXPECT_CALL(*md5_generator, Checksum(_)).Times(0);
+  BackupFile metadata = *previous.GetBackupFile();
+  metadata.num_chunks = 0;
+  FileEntry* entry = library.CarryForwardFile(previous, metadata);
+  ASSERT_TRUE(entry != NULL);
+  ASSERT_EQ(1U, entry->GetChunks().size());
+  EXPECT_EQ(1U, entry->GetBackupFile()->num_chunks);
+  EXPECT_EQ(chunk.md5sum, entry->GetChunks()[0].md5sum);
+  EXPECT_EQ(3U, entry->GetChunks()[0].volume_num);
+  EXPECT_EQ(1024U, entry->GetChunks()[0].volume_offset);
+
+  // A file whose metadata changed can't be carried forward.
+  metadata.modify_date = 12346;
+  EXPECT_TRUE(library.CarryForwardFile(previous, metadata) == NULL);
+
+  // Nor can one that was replaced or touched with its modification date
+  // preserved, once the inode and change date are known.
+  previous_metadata.inode = 42;
+  previous_metadata.change_date = 23456;
+  FileEntry identified("/foo/bar/bleh", previous_metadata);
+  identified.AddChunk(chunk);
+  metadata = *identified.GetBackupFile();
+  metadata.num_chunks = 0;
+  EXPECT_TRUE(library.CarryForwardFile(identified, metadata) != NULL);
+  metadata.change_date = 23457;
+  EXPECT_TRUE(library.CarryForwardFile(identified, metadata) == NULL);
+  metadata.change_date = 23456;
+  metadata.inode = 43;
+  EXPECT_TRUE(library.CarryForwardFile(identified, metadata) == NULL);
+
+  // Or one with the same inode on another device.
+  previous_metadata.device_id = 7;
+  FileEntry on_device("/foo/bar/bleh", previous_metadata);
+  on_device.AddChunk(chunk);
+  metadata = *on_device.GetBackupFile();
+  metadata.num_chunks = 0;
+  EXPECT_TRUE(library.CarryForwardFile(on_device, metadata) != NULL);
+  metadata.device_id = 8;
+  EXPECT_TRUE(library.CarryForwardFile(on_device, metadata) == NULL);
+
+  retval = library.CloseBackup();
+  EXPECT_TRUE(retval.ok()) << retval.ToString();
+
+  // All created objects should delete themselves through the library.
+  delete cb;
+}
+
+TEST_F(BackupLibraryTest, CreateBackupCarryForwardAppendedFiles) {
+  // This test verifies that files which were only appended to re-use their
+  // previous chunks, once the last chunk is found to be unchanged.
+  MockFile* file = new MockFile;
+  MockMd5Generator* md5_generator = new MockMd5Generator;
+  auto cb = NewPermanentCallback(
+      static_cast<BackupLibraryTest*>(this),
+      &BackupLibraryTest::GetNextFilename);
+
+  MockBackupVolumeFactory* volume_factory = new MockBackupVolumeFactory();
+
+  EXPECT_CALL(*file, FindBasenameAndLastVolume(_, _, _))
+      .WillOnce(DoAll(
+          SetArgPointee<0>("/foo/bar"),
+          SetArgPointee<1>(0),
+          SetArgPointee<2>(0),
+          Return(Status::OK)));
+  BackupLibrary library(
+      file, cb,
+      md5_generator,
+      new MockEncoder(),
+      volume_factory);
+  EXPECT_TRUE(library.Init().ok());
+
+  FakeBackupVolume* volume = new FakeBackupVolume(file);
+  volume->InitializeForNewVolume();
+  EXPECT_CALL(*volume_factory, Create("/foo/bar.0.bkp")).WillOnce(
+      Return(volume));
+
+  Status retval = library.CreateBackup(
+      BackupOptions().set_description("Foo")
+                     .set_enable_compression(false)
+                     .set_max_volume_size_mb(0)
+                     .set_type(kBackupTypeIncremental)
+                     .set_append_detection(kAppendDetectionLastChunk));
+  EXPECT_TRUE(retval.ok()) << retval.ToString();
+
+  // Build the file as it was recorded in a previous backup: three chunks, with
+  // an empty one at the end.
+  BackupFile previous_metadata;
+  previous_metadata.file_type = BackupFile::kFileTypeRegularFile;
+  previous_metadata.file_size = 12;
+  previous_metadata.modify_date = 12345;
+  FileEntry previous("/foo/bar/bleh", previous_metadata);
+
+  const string previous_data[] = { "AAAA", "BBBB", "CCCC", "" };
+  for (uint64_t i = 0; i < 4; ++i) {
+    FileChunk chunk;
+    chunk.md5sum.hi = 0x834671 + i;
+    chunk.md5sum.lo = 0x892376;
+    chunk.volume_num = 3;
+    chunk.chunk_offset = i * 4;
+    chunk.unencoded_size = previous_data[i].size();
+    previous.AddChunk(chunk);
+  }
+
+  FakeFile appended_file;
+  appended_file.Write("AAAABBBBCCCCDDDD", 16);
+
+  BackupFile metadata = *previous.GetBackupFile();
+  metadata.num_chunks = 0;
+  metadata.file_size = 16;
+  metadata.modify_date = 12346;
+
+  // Only the last chunk with data is read back and checked.
+  Uint128 md5sum;
+  md5sum.hi = 0x834671 + 2;
+  md5sum.lo = 0x892376;
+  EXPECT_CALL(*md5_generator, Checksum("CCCC")).WillOnce(Return(md5sum));
+
+  uint64_t resume_offset = 0;
+  FileEntry* entry = library.CarryForwardAppendedFile(
+      previous, metadata, &appended_file, &resume_offset);
+  ASSERT_TRUE(entry != NULL);
+  EXPECT_EQ(12U, resume_offset);
+  ASSERT_EQ(3U, entry->GetChunks().size());
+  EXPECT_EQ(3U, entry->GetBackupFile()->num_chunks);
+  EXPECT_EQ(16U, entry->GetBackupFile()->file_size);
+  EXPECT_EQ(8U, entry->GetChunks()[2].chunk_offset);
+
+  // A changed last chunk means the file was rewritten.
+  Uint128 changed_md5sum;
+  changed_md5sum.hi = 0x1234;
+  changed_md5sum.lo = 0x5678;
+  FakeFile rewritten_file;
+  rewritten_file.Write("AAAABBBBCCCXDDDD", 16);
+  EXPECT_CALL(*md5_generator, Checksum("CCCX"))
+      .WillOnce(Return(changed_md5sum));
+  EXPECT_TRUE(library.CarryForwardAppendedFile(
+      previous, metadata, &rewritten_file, &resume_offset) == NULL);
+
+  // Files that didn't grow, or were replaced, aren't checked at all.
+  metadata.file_size = 12;
+  EXPECT_TRUE(library.CarryForwardAppendedFile(
+      previous, metadata, &appended_file, &resume_offset) == NULL);
+
+  previous_metadata.inode = 42;
+  previous_metadata.change_date = 23456;
+  FileEntry identified("/foo/bar/bleh", previous_metadata);
+  identified.AddChunks(&previous.GetChunks().at(0),
+                       previous.GetChunks().size());
+  metadata.file_size = 16;
+  metadata.inode = 43;
+  metadata.change_date = 23457;
+  EXPECT_TRUE(library.CarryForwardAppendedFile(
+      identified, metadata, &appended_file, &resume_offset) == NULL);
+
+  retval = library.CloseBackup();
+  EXPECT_TRUE(retval.ok()) << retval.ToString();
+
+  // All created objects should delete themselves through the library.
+  delete cb;
+}
+
+TEST_F(BackupLibraryTest, CreateBackupCarryForwardAppendedFilesSampled) {
+  // This test verifies that sampled append detection checks chunks spread
+  // through the file as well as the last one, and that append detection is
+  // off unless asked for.
+  MockFile* file = new MockFile;
+  MockMd5Generator* md5_generator = new MockMd5Generator;
+  auto cb = NewPermanentCallback(
+      static_cast<BackupLibraryTest*>(this),
+      &BackupLibraryTest::GetNextFilename);
+
+  MockBackupVolumeFactory* volume_factory = new MockBackupVolumeFactory();
+
+  EXPECT_CALL(*file, FindBasenameAndLastVolume(_, _, _))
+      .WillOnce(DoAll(
+          SetArgPointee<0>("/foo/bar"),
+          SetArgPointee<1>(0),
+          SetArgPointee<2>(0),
+          Return(Status::OK)));
+  BackupLibrary library(
+      file, cb,
+      md5_generator,
+      new MockEncoder(),
+      volume_factory);
+  EXPECT_TRUE(library.Init().ok());
+
+  FakeBackupVolume* volume = new FakeBackupVolume(file);
+  volume->InitializeForNewVolume();
+  EXPECT_CALL(*volume_factory, Create("/foo/bar.0.bkp")).WillOnce(
+      Return(volume));
+
+  Status retval = library.CreateBackup(
+      BackupOptions().set_description("Foo")
+                     .set_enable_compression(false)
+                     .set_max_volume_size_mb(0)
+                     .set_type(kBackupTypeIncremental)
+                     .set_append_detection(kAppendDetectionSampled)
+                     .set_append_verify_samples(2));
+  EXPECT_TRUE(retval.ok()) << retval.ToString();
+
+  BackupFile previous_metadata;
+  previous_metadata.file_type = BackupFile::kFileTypeRegularFile;
+  previous_metadata.file_size = 20;
+  FileEntry previous("/foo/bar/bleh", previous_metadata);
+
+  const string previous_data[] = { "AAAA", "BBBB", "CCCC", "DDDD", "EEEE" };
+  for (uint64_t i = 0; i < 5; ++i) {
+    FileChunk chunk;
+    chunk.md5sum.hi = 0x834671 + i;
+    chunk.md5sum.lo = 0x892376;
+    chunk.chunk_offset = i * 4;
+    chunk.unencoded_size = previous_data[i].size();
+    previous.AddChunk(chunk);
+
+    // The first, middle and last chunks are sampled.
+    if (i % 2 == 0) {
+      EXPECT_CALL(*md5_generator, Checksum(previous_data[i]))
+          .WillOnce(Return(chunk.md5sum));
+    }
+  }
+
+  FakeFile appended_file;
+  appended_file.Write("AAAABBBBCCCCDDDDEEEEFF", 22);
+
+  BackupFile metadata = *previous.GetBackupFile();
+  metadata.num_chunks = 0;
+  metadata.file_size = 22;
+
+  uint64_t resume_offset = 0;
+  FileEntry* entry = library.CarryForwardAppendedFile(
+      previous, metadata, &appended_file, &resume_offset);
+  ASSERT_TRUE(entry != NULL);
+  EXPECT_EQ(20U, resume_offset);
+  EXPECT_EQ(5U, entry->GetChunks().size());
+
+  retval = library.CloseBackup();
+  EXPECT_TRUE(retval.ok()) << retval.ToString();
+
+  // With the default options, grown files are never carried forward.
+  FakeBackupVolume* volume1 = new FakeBackupVolume(file);
+  volume1->InitializeForNewVolume();
+  volume1->set_volume_number(1);
+  EXPECT_CALL(*volume_factory, Create("/foo/bar.1.bkp")).WillOnce(
+      Return(volume1));
+  retval = library.CreateBackup(
+      BackupOptions().set_description("Foo")
+                     .set_type(kBackupTypeIncremental));
+  EXPECT_TRUE(retval.ok()) << retval.ToString();
+  EXPECT_TRUE(library.CarryForwardAppendedFile(
+      previous, metadata, &appended_file, &resume_offset) == NULL);
+
+  // All created objects should delete themselves through the library.
+  delete cb;
+}
+
+TEST_F(BackupLibraryTest, CreateBackupCarryForwardUnchangedExtents) {
+  // This test verifies that the extents of files are recorded with a backup,
+  // and that the next backup re-uses the chunks of a changed file wherever its
+  // extents didn't change.
+  boost::filesystem::remove(boost::filesystem::path("__test__.1.fem"));
+  MockFile* file = new MockFile;
+  MockMd5Generator* md5_generator = new MockMd5Generator;
+  auto cb = NewPermanentCallback(
+      static_cast<BackupLibraryTest*>(this),
+      &BackupLibraryTest::GetNextFilename);
+
+  MockBackupVolumeFactory* volume_factory = new MockBackupVolumeFactory();
+
+  EXPECT_CALL(*file, FindBasenameAndLastVolume(_, _, _))
+      .WillOnce(DoAll(
+          SetArgPointee<0>("__test__"),
+          SetArgPointee<1>(0),
+          SetArgPointee<2>(0),
+          Return(Status::OK)));
+  BackupLibrary library(
+      file, cb,
+      md5_generator,
+      new MockEncoder(),
+      volume_factory);
+  EXPECT_TRUE(library.Init().ok());
+
+  Uint128 path_md5sum;
+  path_md5sum.hi = 0x1234;
+  path_md5sum.lo = 0x5678;
+  EXPECT_CALL(*md5_generator, Checksum("/foo/bar/bleh"))
+      .WillRepeatedly(Return(path_md5sum));
+
+  FakeBackupVolume* volume = new FakeBackupVolume(file);
+  volume->InitializeForNewVolume();
+  EXPECT_CALL(*volume_factory, Create("__test__.0.bkp")).WillOnce(
+      Return(volume));
+
+  Status retval = library.CreateBackup(
+      BackupOptions().set_description("Foo")
+                     .set_type(kBackupTypeFull)
+                     .set_track_extents(true));
+  EXPECT_TRUE(retval.ok()) << retval.ToString();
+
+  // Build the file as it was backed up: four chunks in two extents.
+  BackupFile previous_metadata;
+  previous_metadata.file_type = BackupFile::kFileTypeRegularFile;
+  previous_metadata.file_size = 16;
+  previous_metadata.modify_date = 12345;
+  previous_metadata.device_id = 7;
+  previous_metadata.inode = 42;
+  previous_metadata.change_date = 23456;
+  FileEntry previous("/foo/bar/bleh", previous_metadata);
+
+  for (uint64_t i = 0; i < 4; ++i) {
+    FileChunk chunk;
+    chunk.md5sum.hi = 0x834671 + i;
+    chunk.md5sum.lo = 0x892376;
+    chunk.volume_num = 0;
+    chunk.chunk_offset = i * 4;
+    chunk.unencoded_size = 4;
+    previous.AddChunk(chunk);
+  }
+
+  vector<FileExtent> previous_extents(2);
+  previous_extents[0].logical_offset = 0;
+  previous_extents[0].physical_offset = 4096;
+  previous_extents[0].length = 8;
+  previous_extents[1].logical_offset = 8;
+  previous_extents[1].physical_offset = 8192;
+  previous_extents[1].length = 8;
+
+  // Nothing is recorded yet, so nothing can be re-used.
+  BackupFile metadata = *previous.GetBackupFile();
+  metadata.num_chunks = 0;
+  vector<pair<uint64_t, uint64_t> > read_ranges;
+  EXPECT_TRUE(library.CarryForwardUnchangedExtents(
+      previous, metadata, previous_extents, &read_ranges) == NULL);
+
+  library.RecordFileExtents(previous, previous_extents);
+  retval = library.CloseBackup();
+  EXPECT_TRUE(retval.ok()) << retval.ToString();
+
+  // Since then, the second extent was rewritten and the file grew.
+  FakeBackupVolume* volume1 = new FakeBackupVolume(file);
+  volume1->InitializeForNewVolume();
+  volume1->set_volume_number(1);
+  EXPECT_CALL(*volume_factory, Create("__test__.1.bkp")).WillOnce(
+      Return(volume1));
+  retval = library.CreateBackup(
+      BackupOptions().set_description("Foo")
+                     .set_type(kBackupTypeIncremental)
+                     .set_track_extents(true));
+  EXPECT_TRUE(retval.ok()) << retval.ToString();
+
+  vector<FileExtent> extents = previous_extents;
+  extents[1].physical_offset = 16384;
+  extents[1].length = 12;
+  metadata.file_size = 20;
+  metadata.modify_date = 12346;
+  metadata.change_date = 23457;
+
+  FileEntry* entry = library.CarryForwardUnchangedExtents(
+      previous, metadata, extents, &read_ranges);
+  ASSERT_TRUE(entry != NULL);
+  ASSERT_EQ(2U, entry->GetChunks().size());
+  EXPECT_EQ(2U, entry->GetBackupFile()->num_chunks);
+  EXPECT_EQ(20U, entry->GetBackupFile()->file_size);
+  EXPECT_EQ(0U, entry->GetChunks()[0].chunk_offset);
+  EXPECT_EQ(4U, entry->GetChunks()[1].chunk_offset);
+  ASSERT_EQ(1U, read_ranges.size());
+  EXPECT_EQ(8U, read_ranges[0].first);
+  EXPECT_EQ(12U, read_ranges[0].second);
+
+  // If everything moved, there's nothing to re-use.
+  extents[0].physical_offset = 32768;
+  EXPECT_TRUE(library.CarryForwardUnchangedExtents(
+      previous, metadata, extents, &read_ranges) == NULL);
+
+  // Nor is there for a replaced file.
+  extents = previous_extents;
+  metadata.inode = 43;
+  EXPECT_TRUE(library.CarryForwardUnchangedExtents(
+      previous, metadata, extents, &read_ranges) == NULL);
+
+  // Or one whose recorded extents are from a different version of it.
+  metadata.inode = 42;
+  previous_metadata.modify_date = 12340;
+  FileEntry older("/foo/bar/bleh", previous_metadata);
+  older.AddChunks(&previous.GetChunks().at(0), previous.GetChunks().size());
+  EXPECT_TRUE(library.CarryForwardUnchangedExtents(
+      older, metadata, extents, &read_ranges) == NULL);
+
+  retval = library.CancelBackup();
+  EXPECT_TRUE(retval.ok()) << retval.ToString();
+  boost::filesystem::remove(boost::filesystem::path("__test__.1.fem"));
+
+  // All created objects should delete themselves through the library.
+  delete cb;
+}
+
 TEST_F(BackupLibraryTest, CreateBackupMultiSet) {
   // This test verifies that creating a backup works correctly when this isn't
   // the first backup set.
@@ -479,10 +1016,6 @@ TEST_F(BackupLibraryTest, CreateBackupWriteFilesPartialMultiVolume) {
   volume2->set_volume_number(1);
   volume2->InitializeForExistingWithDescriptor2();
 
-  FakeBackupVolume* volume2_2 = new FakeBackupVolume(file);
-  volume2_2->set_volume_number(1);
-  volume2_2->InitializeForExistingWithDescriptor2();
-
   FakeBackupVolume* volume3 = new FakeBackupVolume(file);
   volume3->set_volume_number(2);
   volume3->InitializeForNewVolume();
@@ -493,15 +1026,14 @@ TEST_F(BackupLibraryTest, CreateBackupWriteFilesPartialMultiVolume) {
 
   uint64_t amount_remaining =
       (20 - BackupLibrary::kMaxSizeThresholdMb) * 1048576 -
-          volume->DiskSize() - volume2_2->DiskSize();
+          volume->DiskSize() - volume2->DiskSize();
   EXPECT_GT((20 - BackupLibrary::kMaxSizeThresholdMb) * 1048576,
             amount_remaining);
 
-  // Expectation: The first thing that's done is to read the chunk data from the
-  // backup volumes, so volume 0 will be opened first.
+  // Expectation: The labels are loaded from volume 1, and then the chunk data
+  // is read from the backup volumes.  Volume 1 stays open in between.
   EXPECT_CALL(*volume_factory, Create("/foo/bar.1.bkp"))
-      .WillOnce(Return(volume2))
-      .WillOnce(Return(volume2_2));
+      .WillOnce(Return(volume2));
   EXPECT_CALL(*volume_factory, Create("/foo/bar.0.bkp")).WillOnce(
       Return(volume));
   EXPECT_TRUE(library.Init().ok());
@@ -566,6 +1098,175 @@ TEST_F(BackupLibraryTest, CreateBackupWriteFilesPartialMultiVolume) {
   delete cb;
 }
 
+TEST_F(BackupLibraryTest, CreateBackupPackVolumes) {
+  // This test verifies that with volume packing, a backup is appended to a
+  // last volume with room left, and that cancelling it truncates the volume
+  // back to end with the backup before.
+  boost::filesystem::remove(boost::filesystem::path("__test__.refill"));
+  File volume_file("__test__.0.bkp");
+  ASSERT_TRUE(volume_file.Open(File::Mode::kModeReadWrite).ok());
+  ASSERT_TRUE(volume_file.Write(string(0x400, 'x').data(), 0x400).ok());
+  ASSERT_TRUE(volume_file.Close().ok());
+
+  MockFile* file = new MockFile;
+  auto cb = NewPermanentCallback(
+      static_cast<BackupLibraryTest*>(this),
+      &BackupLibraryTest::GetNextFilename);
+
+  MockBackupVolumeFactory* volume_factory = new MockBackupVolumeFactory();
+
+  EXPECT_CALL(*file, FindBasenameAndLastVolume(_, _, _))
+      .WillOnce(DoAll(
+          SetArgPointee<0>("__test__"),
+          SetArgPointee<1>(0),
+          SetArgPointee<2>(1),
+          Return(Status::OK)));
+  BackupLibrary library(
+      file, cb,
+      new MockMd5Generator(),
+      new MockEncoder(),
+      volume_factory);
+
+  // The existing volume ends a backup, and its size (0x323) leaves room.  No
+  // new volume is created.
+  FakeBackupVolume* volume0 = new FakeBackupVolume(file);
+  volume0->InitializeForExistingWithDescriptor2();
+  EXPECT_CALL(*volume_factory, Create("__test__.0.bkp")).WillOnce(
+      Return(volume0));
+
+  EXPECT_TRUE(library.Init().ok());
+
+  Status retval = library.CreateBackup(
+      BackupOptions().set_description("Foo")
+                     .set_max_volume_size_mb(10)
+                     .set_pack_volumes(true)
+                     .set_type(kBackupTypeFull));
+  EXPECT_TRUE(retval.ok()) << retval.ToString();
+  EXPECT_EQ(1, library.num_volumes());
+  EXPECT_TRUE(boost::filesystem::exists("__test__.refill"));
+
+  retval = library.CancelBackup();
+  EXPECT_TRUE(retval.ok()) << retval.ToString();
+  EXPECT_FALSE(boost::filesystem::exists("__test__.refill"));
+  EXPECT_EQ(0x323, boost::filesystem::file_size("__test__.0.bkp"));
+  boost::filesystem::remove(boost::filesystem::path("__test__.0.bkp"));
+
+  // All created objects should delete themselves through the library.
+  delete cb;
+}
+
+TEST_F(BackupLibraryTest, InitForBackupUndoesInterruptedAppend) {
+  // This test verifies that a backup appended to a volume that never finished
+  // is left alone when the library is opened to read, and undone when it's
+  // next opened to back up, along with any volumes it started.
+  boost::filesystem::remove(boost::filesystem::path("__test__.refill"));
+  File volume_file("__test__.0.bkp");
+  ASSERT_TRUE(volume_file.Open(File::Mode::kModeReadWrite).ok());
+  ASSERT_TRUE(volume_file.Write(string(0x400, 'x').data(), 0x400).ok());
+  ASSERT_TRUE(volume_file.Close().ok());
+
+  auto cb = NewPermanentCallback(
+      static_cast<BackupLibraryTest*>(this),
+      &BackupLibraryTest::GetNextFilename);
+
+  {
+    MockFile* file = new MockFile;
+    MockBackupVolumeFactory* volume_factory = new MockBackupVolumeFactory();
+    EXPECT_CALL(*file, FindBasenameAndLastVolume(_, _, _))
+        .WillOnce(DoAll(
+            SetArgPointee<0>("__test__"),
+            SetArgPointee<1>(0),
+            SetArgPointee<2>(1),
+            Return(Status::OK)));
+    BackupLibrary library(
+        file, cb,
+        new MockMd5Generator(),
+        new MockEncoder(),
+        volume_factory);
+
+    FakeBackupVolume* volume0 = new FakeBackupVolume(file);
+    volume0->InitializeForExistingWithDescriptor2();
+    EXPECT_CALL(*volume_factory, Create("__test__.0.bkp")).WillOnce(
+        Return(volume0));
+
+    EXPECT_TRUE(library.Init().ok());
+    Status retval = library.CreateBackup(
+        BackupOptions().set_description("Foo")
+                       .set_max_volume_size_mb(10)
+                       .set_pack_volumes(true)
+                       .set_type(kBackupTypeFull));
+    EXPECT_TRUE(retval.ok()) << retval.ToString();
+  }
+
+  // The backup went on to a second volume before it was interrupted.
+  File next_volume_file("__test__.1.bkp");
+  ASSERT_TRUE(next_volume_file.Open(File::Mode::kModeReadWrite).ok());
+  ASSERT_TRUE(next_volume_file.Write("1234", 4).ok());
+  ASSERT_TRUE(next_volume_file.Close().ok());
+  uint64_t appended_size = boost::filesystem::file_size("__test__.0.bkp");
+
+  {
+    MockFile* file = new MockFile;
+    MockBackupVolumeFactory* volume_factory = new MockBackupVolumeFactory();
+    EXPECT_CALL(*file, FindBasenameAndLastVolume(_, _, _))
+        .WillOnce(DoAll(
+            SetArgPointee<0>("__test__"),
+            SetArgPointee<1>(1),
+            SetArgPointee<2>(2),
+            Return(Status::OK)));
+    BackupLibrary library(
+        file, cb,
+        new MockMd5Generator(),
+        new MockEncoder(),
+        volume_factory);
+
+    FakeBackupVolume* volume1 = new FakeBackupVolume(file);
+    volume1->InitializeForExistingWithDescriptor2();
+    EXPECT_CALL(*volume_factory, Create("__test__.1.bkp")).WillOnce(
+        Return(volume1));
+
+    // The backup may still be running, so nothing is touched, and no backup
+    // can be started over it.
+    EXPECT_TRUE(library.Init().ok());
+    EXPECT_EQ(2, library.num_volumes());
+    EXPECT_TRUE(boost::filesystem::exists("__test__.refill"));
+    EXPECT_TRUE(boost::filesystem::exists("__test__.1.bkp"));
+    EXPECT_EQ(appended_size, boost::filesystem::file_size("__test__.0.bkp"));
+    EXPECT_FALSE(library.CreateBackup(
+        BackupOptions().set_description("Bar")
+                       .set_type(kBackupTypeFull)).ok());
+  }
+
+  MockFile* file = new MockFile;
+  MockBackupVolumeFactory* volume_factory = new MockBackupVolumeFactory();
+  EXPECT_CALL(*file, FindBasenameAndLastVolume(_, _, _))
+      .WillOnce(DoAll(
+          SetArgPointee<0>("__test__"),
+          SetArgPointee<1>(1),
+          SetArgPointee<2>(2),
+          Return(Status::OK)));
+  BackupLibrary library(
+      file, cb,
+      new MockMd5Generator(),
+      new MockEncoder(),
+      volume_factory);
+
+  FakeBackupVolume* volume0 = new FakeBackupVolume(file);
+  volume0->InitializeForExistingWithDescriptor2();
+  EXPECT_CALL(*volume_factory, Create("__test__.0.bkp")).WillOnce(
+      Return(volume0));
+
+  EXPECT_TRUE(library.InitForBackup().ok());
+  EXPECT_EQ(1, library.num_volumes());
+  EXPECT_FALSE(boost::filesystem::exists("__test__.refill"));
+  EXPECT_FALSE(boost::filesystem::exists("__test__.1.bkp"));
+  EXPECT_EQ(0x323, boost::filesystem::file_size("__test__.0.bkp"));
+  boost::filesystem::remove(boost::filesystem::path("__test__.0.bkp"));
+
+  // All created objects should delete themselves through the library.
+  delete cb;
+}
+
 TEST_F(BackupLibraryTest, ReadFilesAndChunks) {
   // This test verifies a backup library containing chunks and files can be
   // accessed.
@@ -627,6 +1328,63 @@ TEST_F(BackupLibraryTest, ReadFilesAndChunks) {
   EXPECT_TRUE(retval.ok()) << retval.ToString();
   EXPECT_EQ(expected_data, data);
 
+  // Reading the chunk again is served from the chunk cache, without reading
+  // or checksumming it.
+  shared_ptr<const string> cached_data;
+  retval = library.ReadChunk(chunk, &cached_data);
+  EXPECT_TRUE(retval.ok()) << retval.ToString();
+  EXPECT_EQ(expected_data, *cached_data);
+  EXPECT_EQ(1, library.chunk_cache().hits());
+
+  // All created objects should delete themselves through the library.
+  delete cb;
+}
+
+TEST_F(BackupLibraryTest, LoadFilesFromStateRecords) {
+  // This test verifies that the files of a file state cache can be loaded from
+  // the backups their records point at.
+  MockFile* file = new MockFile;
+  auto cb = NewPermanentCallback(
+      static_cast<BackupLibraryTest*>(this),
+      &BackupLibraryTest::GetNextFilename);
+
+  MockBackupVolumeFactory* volume_factory = new MockBackupVolumeFactory();
+
+  EXPECT_CALL(*file, FindBasenameAndLastVolume(_, _, _))
+      .WillOnce(DoAll(
+          SetArgPointee<0>("/foo/bar"),
+          SetArgPointee<1>(0),
+          SetArgPointee<2>(1),
+          Return(Status::OK)));
+  BackupLibrary library(
+      file, cb,
+      new MockMd5Generator(),
+      new MockEncoder(),
+      volume_factory);
+
+  FakeBackupVolume* volume = new FakeBackupVolume(file);
+  volume->InitializeForExistingWithDescriptor2();
+  EXPECT_CALL(*volume_factory, Create("/foo/bar.0.bkp")).WillOnce(
+      Return(volume));
+
+  EXPECT_TRUE(library.Init().ok());
+
+  // Both files point at the same backup, which is loaded once.  Only one of
+  // them is in it.
+  FileStateRecord record;
+  record.backup_volume = 0;
+  record.backup_offset = 0x100;
+  vector<pair<string, const FileStateRecord*> > files;
+  files.push_back(make_pair(string("/my/silly/file"), &record));
+  files.push_back(make_pair(string("/my/missing/file"), &record));
+
+  unordered_map<string, const FileEntry*> entries;
+  Status retval = library.LoadFilesFromStateRecords(files, &entries);
+  EXPECT_TRUE(retval.ok()) << retval.ToString();
+  ASSERT_EQ(1, entries.size());
+  ASSERT_TRUE(entries.find("/my/silly/file") != entries.end());
+  EXPECT_EQ(1, entries["/my/silly/file"]->GetChunks().size());
+
   // All created objects should delete themselves through the library.
   delete cb;
 }
@@ -695,6 +1453,90 @@ TEST_F(BackupLibraryTest, ReadFilesAndChunksWithCompression) {
   delete cb;
 }
 
+TEST_F(BackupLibraryTest, PlanRestore) {
+  // This test verifies the restore plan holds each unique chunk once, with all
+  // of its destinations, ordered by volume and offset.
+  auto cb = NewPermanentCallback(
+      static_cast<BackupLibraryTest*>(this),
+      &BackupLibraryTest::GetNextFilename);
+  BackupLibrary library(
+      new MockFile, cb,
+      new MockMd5Generator(),
+      new MockEncoder(),
+      new MockBackupVolumeFactory());
+
+  FileChunk shared;
+  shared.md5sum.hi = 0x123;
+  shared.md5sum.lo = 0x456;
+  shared.volume_num = 1;
+  shared.volume_offset = 0x10;
+  shared.unencoded_size = 16;
+
+  FileChunk unique = shared;
+  unique.md5sum.lo = 0x789;
+  unique.volume_num = 0;
+  unique.volume_offset = 0x20;
+
+  FileSet fileset;
+  FileEntry* foo = fileset.AddFile("/foo", BackupFile());
+  FileEntry* bar = fileset.AddFile("/bar", BackupFile());
+
+  shared.chunk_offset = 0;
+  foo->AddChunk(shared);
+  shared.chunk_offset = 16;
+  foo->AddChunk(shared);
+  unique.chunk_offset = 32;
+  foo->AddChunk(unique);
+  shared.chunk_offset = 0;
+  bar->AddChunk(shared);
+
+  vector<uint64_t> volumes;
+  vector<RestoreChunk> plan = library.PlanRestore(fileset.GetFiles(),
+                                                  &volumes);
+  ASSERT_EQ(2, plan.size());
+  ASSERT_EQ(2, volumes.size());
+  EXPECT_EQ(0, volumes[0]);
+  EXPECT_EQ(1, volumes[1]);
+
+  EXPECT_EQ(unique.md5sum, plan[0].chunk.md5sum);
+  ASSERT_EQ(1, plan[0].destinations.size());
+  EXPECT_EQ(foo, plan[0].destinations[0].entry);
+  EXPECT_EQ(32, plan[0].destinations[0].chunk_offset);
+
+  EXPECT_EQ(shared.md5sum, plan[1].chunk.md5sum);
+  EXPECT_EQ(3, plan[1].destinations.size());
+  vector<uint64_t> foo_offsets;
+  for (const ChunkDestination& destination : plan[1].destinations) {
+    if (destination.entry == foo) {
+      foo_offsets.push_back(destination.chunk_offset);
+    } else {
+      EXPECT_EQ(bar, destination.entry);
+      EXPECT_EQ(0, destination.chunk_offset);
+    }
+  }
+  ASSERT_EQ(2, foo_offsets.size());
+  EXPECT_EQ(0, foo_offsets[0]);
+  EXPECT_EQ(16, foo_offsets[1]);
+
+  // Chunks too far into a volume to pack into a sort key still come out in
+  // order.
+  FileChunk far = shared;
+  far.md5sum.lo = 0xabc;
+  far.volume_num = 0;
+  far.volume_offset = 1ULL << 50;
+  far.chunk_offset = 32;
+  bar->AddChunk(far);
+
+  plan = library.PlanRestore(fileset.GetFiles(), NULL);
+  ASSERT_EQ(3, plan.size());
+  EXPECT_EQ(unique.md5sum, plan[0].chunk.md5sum);
+  EXPECT_EQ(far.md5sum, plan[1].chunk.md5sum);
+  EXPECT_EQ(shared.md5sum, plan[2].chunk.md5sum);
+  EXPECT_EQ(3, plan[2].destinations.size());
+
+  delete cb;
+}
+
 TEST_F(BackupLibraryTest, ReadLabelsWithCancelledSet) {
   // This test verifies a backup library with a cancelled volume can access
   // labels in previous volumes correctly.
@@ -1,15 +1,18 @@
 // Copyright (C) 2013, All Rights Reserved.
 // Author: Cory Maccarrone <darkstar6262@gmail.com>
 
+#include <algorithm>
 #include <iostream>
 #include <memory>
 #include <string>
+#include <utility>
 #include <vector>
 
 #include "glog/logging.h"
 #include "src/backup_volume.h"
 #include "src/callback.h"
 #include "src/common.h"
+#include "src/crc32c.h"
 #include "src/encoding_interface.h"
 #include "src/file.h"
 #include "src/file_interface.h"
@@ -18,22 +21,44 @@
 
 using std::hex;
 using std::make_pair;
+using std::pair;
+using std::stoull;
 using std::string;
 using std::unique_ptr;
 using std::vector;
 
 namespace backup2 {
 
-const std::string BackupVolume::kFileVersion = "BKP_0000";
+const std::string BackupVolume::kFileVersion = "BKP_0002";
+const uint64_t BackupVolume::kCurrentVersion = 2;
+const uint64_t BackupVolume::kZeroChunkVersion = 2;
+const uint64_t BackupVolume::kMaxCoalescedReadSize = 16 * 1048576ULL;
+const uint64_t BackupVolume::kMaxCoalescedReadGap = 256 * 1024ULL;
+const uint64_t BackupVolume::kSpillCopySize = 1048576ULL;
+
+namespace {
+
+// Order descriptor 1 entries by where their chunks are in the volume.
+bool ChunkVolumeOffsetLessThan(const BackupDescriptor1Chunk& lhs,
+                               const BackupDescriptor1Chunk& rhs) {
+  return lhs.offset < rhs.offset;
+}
+
+}  // namespace
 
 BackupVolume::BackupVolume(FileInterface* file)
     : file_(file),
+      version_(kCurrentVersion),
       descriptor1_(),
       descriptor_header_(),
       descriptor2_offset_(0),
+      descriptor1_loaded_(false),
       parent_offset_(0),
       parent_volume_(0),
-      modified_(false) {
+      descriptor_crc_(0),
+      modified_(false),
+      write_offset_(0),
+      appended_(false) {
 }
 
 BackupVolume::~BackupVolume() {
@@ -78,16 +103,27 @@ Status BackupVolume::CheckVersion() {
   retval = file_->Read(&version.at(0), version.size(), NULL);
   LOG_RETURN_IF_ERROR(retval, "Error reading");
 
-  if (version != kFileVersion) {
+  // Versions are of the form "BKP_nnnn".  Anything up to our own version can
+  // be read.
+  const string prefix = kFileVersion.substr(0, 4);
+  if (version.compare(0, prefix.size(), prefix) != 0 ||
+      version.find_first_not_of("0123456789", prefix.size()) != string::npos) {
     return Status(kStatusCorruptBackup, "Not a recognized backup volume");
   }
+  uint64_t file_version = stoull(version.substr(prefix.size()));
+  if (file_version > kCurrentVersion) {
+    LOG(ERROR) << "Backup volume version " << file_version
+               << " is newer than supported version " << kCurrentVersion;
+    return Status(kStatusCorruptBackup, "Unsupported backup volume version");
+  }
+  version_ = file_version;
   return Status::OK;
 }
 
 Status BackupVolume::CheckBackupDescriptors() {
   // Read the backup header.  This is stored at the end of the file.
   Status retval = file_->Seek(
-      -static_cast<int32_t>(sizeof(BackupDescriptorHeader)));
+      -static_cast<int32_t>(descriptor_header_size()));
   LOG_RETURN_IF_ERROR(retval, "Could not seek to header at EOF");
 
   uint64_t previous_header_offset = file_->Tell();
@@ -95,7 +131,34 @@ Status BackupVolume::CheckBackupDescriptors() {
   retval = ReadBackupDescriptorHeader();
   LOG_RETURN_IF_ERROR(retval, "Could not read descriptor header");
 
-  retval = ReadBackupDescriptor1();
+  // The rest of descriptor 1 can be large, and is only read once it's needed.
+  // Its fixed part tells how large.
+  retval = file_->Seek(descriptor_header_.backup_descriptor_1_offset);
+  LOG_RETURN_IF_ERROR(retval, "Couldn't seek to descriptor 1 offset");
+
+  BackupDescriptor1 descriptor1;
+  retval = file_->Read(&descriptor1, sizeof(BackupDescriptor1), NULL);
+  LOG_RETURN_IF_ERROR(retval, "Couldn't read descriptor 1");
+
+  if (descriptor1.header_type != kHeaderTypeDescriptor1) {
+    LOG(ERROR) << "Backup descriptor 1 has invalid type: 0x" << hex
+               << descriptor1.header_type;
+    return Status(kStatusCorruptBackup, "Invalid descriptor 1 header");
+  }
+  descriptor1_ = descriptor1;
+
+  // Store away the various metadata.
+  descriptor2_.previous_backup_offset = previous_header_offset;
+  descriptor2_.previous_backup_volume_number = descriptor_header_.volume_number;
+  return Status::OK;
+}
+
+Status BackupVolume::LoadDescriptor1() {
+  if (descriptor1_loaded_) {
+    return Status::OK;
+  }
+
+  Status retval = ReadBackupDescriptor1();
   LOG_RETURN_IF_ERROR(retval, "Could not read descriptor1");
 
   if (descriptor_header_.backup_descriptor_2_present) {
@@ -103,10 +166,7 @@ Status BackupVolume::CheckBackupDescriptors() {
     // later on in case we're doing a restore or list operation.
     descriptor2_offset_ = file_->Tell();
   }
-
-  // Store away the various metadata.
-  descriptor2_.previous_backup_offset = previous_header_offset;
-  descriptor2_.previous_backup_volume_number = descriptor_header_.volume_number;
+  descriptor1_loaded_ = true;
   return Status::OK;
 }
 
@@ -115,6 +175,15 @@ Status BackupVolume::Create(const ConfigOptions& options) {
   // open as we add file chunks.
   Status retval = file_->Open(File::Mode::kModeAppend);
   LOG_RETURN_IF_ERROR(retval, "Error opening for append");
+  version_ = kCurrentVersion;
+
+  // From here on, the size of the file is tracked as it's written.
+  uint64_t file_size = 0;
+  retval = file_->size(&file_size);
+  if (!retval.ok()) {
+    file_->Close();
+    LOG_RETURN_IF_ERROR(retval, "Error getting file size");
+  }
 
   retval = file_->Write(&kFileVersion.at(0), kFileVersion.size());
   if (!retval.ok()) {
@@ -122,6 +191,7 @@ Status BackupVolume::Create(const ConfigOptions& options) {
     file_->Unlink();
     LOG_RETURN_IF_ERROR(retval, "Error writing version");
   }
+  write_offset_ = file_size + kFileVersion.size();
 
   // Create (but don't yet write!) the backup descriptor 1.  We'll write this
   // once the backup finishes.
@@ -136,6 +206,7 @@ Status BackupVolume::Create(const ConfigOptions& options) {
   descriptor_header_.backup_descriptor_1_offset = 0;
   descriptor_header_.backup_descriptor_2_present = false;
   descriptor_header_.volume_number = options.volume_number;
+  descriptor1_loaded_ = true;
 
   // Descriptor 2 isn't created directly here -- instead, we wait for the backup
   // driver to tell us when we've finished, and we write out the descriptor from
@@ -146,8 +217,48 @@ Status BackupVolume::Create(const ConfigOptions& options) {
   return Status::OK;
 }
 
+Status BackupVolume::Append(const ConfigOptions& options) {
+  // The chunks and labels already here are written out again in the new
+  // descriptor 1, along with the ones we add.
+  Status retval = LoadDescriptor1();
+  LOG_RETURN_IF_ERROR(retval, "Couldn't load descriptor 1");
+
+  // Only a volume that ends a backup can be continued, and only in the format
+  // we write, as its chunks and descriptors are mixed with ours.
+  if (!descriptor_header_.backup_descriptor_2_present ||
+      descriptor_header_.cancelled) {
+    return Status(kStatusInvalidArgument, "Volume doesn't end a backup");
+  }
+  if (version_ != kCurrentVersion) {
+    return Status(kStatusInvalidArgument,
+                  "Can't append to an older volume version");
+  }
+
+  uint64_t file_size = 0;
+  retval = file_->size(&file_size);
+  LOG_RETURN_IF_ERROR(retval, "Error getting file size");
+
+  file_->Close();
+  retval = file_->Open(File::Mode::kModeAppend);
+  LOG_RETURN_IF_ERROR(retval, "Error opening for append");
+  write_offset_ = file_size;
+
+  // The previous backup's descriptors stay where they are, for loading it
+  // later.  Ours go at the end, as for a new volume.
+  descriptor_header_.backup_descriptor_2_present = false;
+  descriptor_header_.cancelled = false;
+  appended_ = true;
+
+  options_ = options;
+  modified_ = true;
+  return Status::OK;
+}
+
 Status BackupVolume::ReadChunk(const FileChunk& chunk, string* data_out,
                                EncodingType* encoding_type_out) {
+  Status retval = LoadDescriptor1();
+  LOG_RETURN_IF_ERROR(retval, "Couldn't load descriptor 1");
+
   BackupDescriptor1Chunk chunk_meta;
   if (!chunks_.GetChunk(chunk.md5sum, &chunk_meta)) {
     LOG(ERROR) << "Chunk not found: "
@@ -156,14 +267,289 @@ Status BackupVolume::ReadChunk(const FileChunk& chunk, string* data_out,
   }
 
   // Seek to the offset specified in the chunk data and read the chunk.
-  Status retval = file_->Seek(chunk_meta.offset);
+  retval = file_->Seek(chunk_meta.offset);
   LOG_RETURN_IF_ERROR(retval, "Couldn't seek to chunk offset");
 
   // Read the chunk header.
   ChunkHeader header;
-  retval = file_->Read(&header, sizeof(header), NULL);
+  retval = file_->Read(&header, chunk_header_size(), NULL);
   LOG_RETURN_IF_ERROR(retval, "Couldn't read chunk header");
 
+  retval = ValidateChunkHeader(header, chunk_meta, chunk);
+  LOG_RETURN_IF_ERROR(retval, "Bad chunk header");
+
+  // If the encoded size is zero, don't bother reading anything -- we won't have
+  // written anything.
+  if (header.encoded_size == 0) {
+    *encoding_type_out = header.encoding_type;
+    return Status::OK;
+  }
+
+  // Read the chunk.
+  data_out->resize(header.encoded_size);
+  retval = file_->Read(&data_out->at(0), header.encoded_size, NULL);
+  if (retval.ok()) {
+    retval = CheckChunkCrc(header, &data_out->at(0));
+  }
+  if (!retval.ok()) {
+    data_out->clear();
+    LOG_RETURN_IF_ERROR(retval, "Error reading chunk");
+  }
+
+  *encoding_type_out = header.encoding_type;
+  return Status::OK;
+}
+
+Status BackupVolume::ReadChunks(const vector<FileChunk>& chunks,
+                                vector<string>* data_out,
+                                vector<EncodingType>* encoding_types_out) {
+  Status retval = LoadDescriptor1();
+  LOG_RETURN_IF_ERROR(retval, "Couldn't load descriptor 1");
+
+  data_out->clear();
+  data_out->resize(chunks.size());
+  encoding_types_out->assign(chunks.size(), kEncodingTypeRaw);
+
+  // Find where each chunk lives, and visit them in volume order.
+  vector<BackupDescriptor1Chunk> chunk_metas;
+  vector<pair<uint64_t, uint64_t> > order;
+  retval = FindChunks(chunks, &chunk_metas, &order);
+  LOG_RETURN_IF_ERROR(retval, "Couldn't find chunks");
+
+  string buffer;
+  uint64_t run_begin = 0;
+  while (run_begin < order.size()) {
+    // Encoded chunks are never larger than their unencoded size, so that
+    // bounds where each chunk ends.  Grow the run while the next chunk starts
+    // close enough to the end of the run, and the read stays small enough.
+    uint64_t read_offset = order[run_begin].first;
+    uint64_t read_end = read_offset + chunk_header_size() +
+                        chunks[order[run_begin].second].unencoded_size;
+    uint64_t run_end = run_begin + 1;
+    for (; run_end < order.size(); ++run_end) {
+      uint64_t offset = order[run_end].first;
+      uint64_t chunk_end = offset + chunk_header_size() +
+                           chunks[order[run_end].second].unencoded_size;
+      if (offset > read_end + kMaxCoalescedReadGap ||
+          chunk_end - read_offset > kMaxCoalescedReadSize) {
+        break;
+      }
+      read_end = std::max(read_end, chunk_end);
+    }
+
+    // The last chunk of a volume may end well short of its bound, so a short
+    // read is fine as long as every chunk turns out to be in it.
+    retval = file_->Seek(read_offset);
+    LOG_RETURN_IF_ERROR(retval, "Couldn't seek to chunk offset");
+    buffer.resize(read_end - read_offset);
+    size_t bytes_read = 0;
+    retval = file_->Read(&buffer.at(0), buffer.size(), &bytes_read);
+    if (!retval.ok() && retval.code() != kStatusShortRead) {
+      LOG_RETURN_IF_ERROR(retval, "Error reading chunks");
+    }
+    buffer.resize(bytes_read);
+
+    for (uint64_t position = run_begin; position < run_end; ++position) {
+      uint64_t index = order[position].second;
+      uint64_t header_offset = order[position].first - read_offset;
+      if (header_offset + chunk_header_size() > buffer.size()) {
+        LOG(ERROR) << "Chunk header past end of volume";
+        return Status(kStatusCorruptBackup, "Chunk header past end of volume");
+      }
+
+      ChunkHeader header;
+      memcpy(&header, &buffer.at(header_offset), chunk_header_size());
+      retval = ValidateChunkHeader(header, chunk_metas[index], chunks[index]);
+      LOG_RETURN_IF_ERROR(retval, "Bad chunk header");
+
+      uint64_t data_offset = header_offset + chunk_header_size();
+      if (header.encoded_size > buffer.size() - data_offset) {
+        LOG(ERROR) << "Chunk data past end of volume";
+        return Status(kStatusCorruptBackup, "Chunk data past end of volume");
+      }
+      retval = CheckChunkCrc(header, buffer.data() + data_offset);
+      LOG_RETURN_IF_ERROR(retval, "Bad chunk data");
+      (*encoding_types_out)[index] = header.encoding_type;
+      if (header.encoded_size > 0) {
+        (*data_out)[index].assign(buffer, data_offset, header.encoded_size);
+      }
+    }
+    run_begin = run_end;
+  }
+  return Status::OK;
+}
+
+Status BackupVolume::ReadStoredChunks(uint64_t first_chunk,
+                                      uint64_t max_bytes,
+                                      vector<StoredChunk>* chunks_out) {
+  Status retval = LoadDescriptor1();
+  LOG_RETURN_IF_ERROR(retval, "Couldn't load descriptor 1");
+
+  chunks_out->clear();
+  if (stored_order_.size() != chunks_.size()) {
+    stored_order_.clear();
+    for (auto chunk : chunks_) {
+      stored_order_.push_back(chunk.second);
+    }
+    std::sort(stored_order_.begin(), stored_order_.end(),
+              ChunkVolumeOffsetLessThan);
+  }
+  if (first_chunk >= stored_order_.size()) {
+    return Status::OK;
+  }
+
+  // Chunks are written back to back, so each one runs up to the start of the
+  // next, and the last up to descriptor 1.  Entries pointing past that are
+  // given no space at all.  In a volume appended to, the descriptors of the
+  // earlier backups also sit between chunks; see ChunkFillsSpace().
+  uint64_t chunks_end = descriptor_header_.backup_descriptor_1_offset;
+  uint64_t read_offset = std::min(stored_order_[first_chunk].offset,
+                                  chunks_end);
+  vector<uint64_t> ends;
+  for (uint64_t index = first_chunk; index < stored_order_.size(); ++index) {
+    uint64_t end = index + 1 < stored_order_.size() ?
+        stored_order_[index + 1].offset : chunks_end;
+    end = std::max(std::min(end, chunks_end),
+                   std::min(stored_order_[index].offset, chunks_end));
+    if (!ends.empty() && end - read_offset > max_bytes) {
+      break;
+    }
+    ends.push_back(end);
+  }
+
+  // A short read means the volume was cut off, which the chunks past the end
+  // report.
+  string buffer;
+  buffer.resize(ends.back() - read_offset);
+  size_t bytes_read = 0;
+  if (!buffer.empty()) {
+    retval = file_->Seek(read_offset);
+    LOG_RETURN_IF_ERROR(retval, "Couldn't seek to chunk offset");
+    retval = file_->Read(&buffer.at(0), buffer.size(), &bytes_read);
+    if (!retval.ok() && retval.code() != kStatusShortRead) {
+      LOG_RETURN_IF_ERROR(retval, "Error reading chunks");
+    }
+  }
+  buffer.resize(bytes_read);
+
+  chunks_out->resize(ends.size());
+  for (uint64_t position = 0; position < ends.size(); ++position) {
+    StoredChunk* stored = &(*chunks_out)[position];
+    stored->descriptor = stored_order_[first_chunk + position];
+    if (stored->descriptor.volume_number != volume_number()) {
+      stored->status = Status(kStatusCorruptBackup,
+                              "Chunk recorded in the wrong volume");
+      continue;
+    }
+    if (stored->descriptor.offset < kFileVersion.size() ||
+        stored->descriptor.offset >= chunks_end ||
+        ends[position] - read_offset > buffer.size()) {
+      stored->status = Status(kStatusCorruptBackup,
+                              "Chunk outside the volume's chunk data");
+      continue;
+    }
+    uint64_t header_offset = stored->descriptor.offset - read_offset;
+    uint64_t data_offset = header_offset + chunk_header_size();
+    uint64_t data_end = ends[position] - read_offset;
+    if (data_offset > data_end) {
+      stored->status = Status(kStatusCorruptBackup, "Chunk header cut off");
+      continue;
+    }
+
+    memcpy(&stored->header, &buffer.at(header_offset), chunk_header_size());
+    FileChunk chunk;
+    chunk.md5sum = stored->descriptor.md5sum;
+    chunk.unencoded_size = stored->header.unencoded_size;
+    stored->status = ValidateChunkHeader(stored->header, stored->descriptor,
+                                         chunk);
+    if (stored->status.ok() &&
+        !ChunkFillsSpace(stored->header, buffer, data_offset, data_end)) {
+      LOG(ERROR) << "Chunk size doesn't fill its space: "
+                 << stored->header.encoded_size << " / "
+                 << data_end - data_offset;
+      stored->status = Status(kStatusCorruptBackup,
+                              "Chunk size doesn't match its space in volume");
+    }
+    if (stored->status.ok()) {
+      stored->status = CheckChunkCrc(stored->header,
+                                     buffer.data() + data_offset);
+    }
+    if (stored->status.ok()) {
+      stored->data.assign(buffer, data_offset, stored->header.encoded_size);
+    }
+  }
+  return Status::OK;
+}
+
+bool BackupVolume::ChunkFillsSpace(const ChunkHeader& header,
+                                   const string& buffer, uint64_t data_offset,
+                                   uint64_t data_end) const {
+  if (header.encoded_size > data_end - data_offset) {
+    return false;
+  }
+  uint64_t chunk_end = data_offset + header.encoded_size;
+  if (chunk_end == data_end) {
+    return true;
+  }
+
+  // The chunk may be the last before an append, and followed by the
+  // descriptors of the backup it belonged to, starting with descriptor 1.
+  BackupDescriptor1 descriptor1;
+  if (data_end - chunk_end < sizeof(descriptor1)) {
+    return false;
+  }
+  memcpy(&descriptor1, &buffer.at(chunk_end), sizeof(descriptor1));
+  return descriptor1.header_type == kHeaderTypeDescriptor1;
+}
+
+Status BackupVolume::LocateChunksData(const vector<FileChunk>& chunks,
+                                      vector<ChunkHeader>* headers_out,
+                                      vector<uint64_t>* data_offsets_out) {
+  Status retval = LoadDescriptor1();
+  LOG_RETURN_IF_ERROR(retval, "Couldn't load descriptor 1");
+
+  headers_out->assign(chunks.size(), ChunkHeader());
+  data_offsets_out->assign(chunks.size(), 0);
+  vector<BackupDescriptor1Chunk> chunk_metas;
+  vector<pair<uint64_t, uint64_t> > order;
+  retval = FindChunks(chunks, &chunk_metas, &order);
+  LOG_RETURN_IF_ERROR(retval, "Couldn't find chunks");
+
+  // Only the headers are read, so the seeks between them only skip forward.
+  for (const pair<uint64_t, uint64_t>& entry : order) {
+    uint64_t index = entry.second;
+    ChunkHeader* header = &(*headers_out)[index];
+    retval = file_->Seek(entry.first);
+    LOG_RETURN_IF_ERROR(retval, "Couldn't seek to chunk offset");
+    retval = file_->Read(header, chunk_header_size(), NULL);
+    LOG_RETURN_IF_ERROR(retval, "Couldn't read chunk header");
+    retval = ValidateChunkHeader(*header, chunk_metas[index], chunks[index]);
+    LOG_RETURN_IF_ERROR(retval, "Bad chunk header");
+    (*data_offsets_out)[index] = entry.first + chunk_header_size();
+  }
+  return Status::OK;
+}
+
+Status BackupVolume::FindChunks(const vector<FileChunk>& chunks,
+                                vector<BackupDescriptor1Chunk>* chunk_metas_out,
+                                vector<pair<uint64_t, uint64_t> >* order_out) {
+  chunk_metas_out->resize(chunks.size());
+  order_out->clear();
+  for (uint64_t index = 0; index < chunks.size(); ++index) {
+    if (!chunks_.GetChunk(chunks[index].md5sum, &(*chunk_metas_out)[index])) {
+      LOG(ERROR) << "Chunk not found: " << std::hex
+                 << chunks[index].md5sum.hi << chunks[index].md5sum.lo;
+      return Status(kStatusGenericError, "Chunk not found'");
+    }
+    order_out->push_back(make_pair((*chunk_metas_out)[index].offset, index));
+  }
+  std::sort(order_out->begin(), order_out->end());
+  return Status::OK;
+}
+
+Status BackupVolume::ValidateChunkHeader(
+    const ChunkHeader& header, const BackupDescriptor1Chunk& chunk_meta,
+    const FileChunk& chunk) {
   if (header.header_type != kHeaderTypeChunkHeader) {
     LOG(ERROR) << "Invalid chunk header found";
     return Status(kStatusCorruptBackup, "Invalid chunk header found");
@@ -179,23 +565,39 @@ Status BackupVolume::ReadChunk(const FileChunk& chunk, string* data_out,
                << chunk.md5sum.hi << chunk.md5sum.lo;
     return Status(kStatusCorruptBackup, "Chunk size mismatch");
   }
+  if (header.encoded_size > header.unencoded_size) {
+    LOG(ERROR) << "Chunk encoded larger than its data: "
+               << header.encoded_size << " / " << header.unencoded_size;
+    return Status(kStatusCorruptBackup, "Chunk encoded size too large");
+  }
+  if (header.encoding_type > kEncodingTypeZero) {
+    LOG(ERROR) << "Unknown chunk encoding: " << header.encoding_type;
+    return Status(kStatusCorruptBackup, "Unknown chunk encoding");
+  }
+  if (header.encoding_type == kEncodingTypeZero &&
+      version_ < kZeroChunkVersion) {
+    LOG(ERROR) << "Zero chunk in version " << version_ << " volume";
+    return Status(kStatusCorruptBackup, "Zero chunk in volume too old for it");
+  }
+  if (header.encoding_type == kEncodingTypeZero && header.encoded_size != 0) {
+    LOG(ERROR) << "Zero chunk has data: " << header.encoded_size;
+    return Status(kStatusCorruptBackup, "Zero chunk has data");
+  }
+  return Status::OK;
+}
 
-  // If the encoded size is zero, don't bother reading anything -- we won't have
-  // written anything.
-  if (header.encoded_size == 0) {
-    *encoding_type_out = kEncodingTypeRaw;
+Status BackupVolume::CheckChunkCrc(const ChunkHeader& header,
+                                   const char* data) {
+  // Chunks didn't have CRCs before version 2.
+  if (version_ < 2) {
     return Status::OK;
   }
-
-  // Read the chunk.
-  data_out->resize(header.encoded_size);
-  retval = file_->Read(&data_out->at(0), header.encoded_size, NULL);
-  if (!retval.ok()) {
-    data_out->clear();
-    LOG_RETURN_IF_ERROR(retval, "Error reading chunk");
+  uint32_t crc = Crc32c(data, header.encoded_size);
+  if (crc != header.crc32c) {
+    LOG(ERROR) << "Chunk CRC mismatch: expected " << hex << header.crc32c
+               << ", got " << crc;
+    return Status(kStatusCorruptBackup, "Chunk CRC mismatch");
   }
-
-  *encoding_type_out = header.encoding_type;
   return Status::OK;
 }
 
@@ -215,6 +617,10 @@ Status BackupVolume::Close() {
 
 Status BackupVolume::CloseWithFileSetAndLabels(FileSet* fileset,
                                                const LabelMap& labels) {
+  // Descriptor 1 is rewritten with all of this volume's chunks.
+  Status retval = LoadDescriptor1();
+  LOG_RETURN_IF_ERROR(retval, "Couldn't load descriptor 1");
+
   // Merge our label map with the provided one.  Renames and new additions are
   // done as part of the fileset writing.
   labels_ = labels;
@@ -232,7 +638,7 @@ Status BackupVolume::CloseWithFileSetAndLabels(FileSet* fileset,
   WriteBackupDescriptor2(*fileset);
   WriteBackupDescriptorHeader();
 
-  Status retval = file_->Close();
+  retval = file_->Close();
   LOG_RETURN_IF_ERROR(retval, "Error closing file");
 
   modified_ = false;
@@ -245,40 +651,63 @@ Status BackupVolume::Cancel() {
 }
 
 uint64_t BackupVolume::EstimatedSize() const {
-  uint64_t file_size = 0;
-  Status retval = file_->size(&file_size);
-  CHECK(retval.ok()) << retval.ToString();
-  return file_size + chunks_.disk_size();
+  return DiskSize() + chunks_.disk_size();
 }
 
 uint64_t BackupVolume::DiskSize() const {
+  if (write_offset_ > 0) {
+    return write_offset_;
+  }
   uint64_t file_size = 0;
   Status retval = file_->size(&file_size);
   CHECK(retval.ok()) << retval.ToString();
   return file_size;
 }
 
+uint64_t BackupVolume::EstimatedMemoryUsage() const {
+  // Each chunk is a node in the chunk map's hash table, holding its MD5 and
+  // descriptor 1 entry, plus the table's pointers to it.  Labels are few
+  // enough not to matter.
+  uint64_t num_chunks =
+      descriptor1_loaded_ ? chunks_.size() : descriptor1_.total_chunks;
+  return num_chunks *
+         (sizeof(Uint128) + sizeof(BackupDescriptor1Chunk) +
+          3 * sizeof(void*));  // NOLINT(runtime/sizeof)
+}
+
 Status BackupVolume::WriteChunk(
-    Uint128 md5sum, const string& data, uint64_t raw_size, EncodingType type,
-    uint64_t* chunk_offset_out) {
-  Status retval = file_->SeekEofNoFlush();
-  LOG_RETURN_IF_ERROR(retval, "Error seeking to EOF");
-  int64_t chunk_offset = file_->Tell();
+    Uint128 md5sum, const char* data, size_t size, uint64_t raw_size,
+    EncodingType type, uint64_t* chunk_offset_out) {
+  Status retval = LoadDescriptor1();
+  LOG_RETURN_IF_ERROR(retval, "Couldn't load descriptor 1");
+
+  // The file is opened for append, so the chunk goes at the end regardless of
+  // where reads have left the file position.
+  CHECK_LT(0U, write_offset_) << "Volume not open for writing";
+  uint64_t chunk_offset = write_offset_;
+
+  // Readers of older volumes don't know zero chunks.
+  if (type == kEncodingTypeZero && version_ < kZeroChunkVersion) {
+    return Status(kStatusInvalidArgument,
+                  "Volume version can't hold zero chunks");
+  }
 
   ChunkHeader header;
   header.md5sum = md5sum;
   header.unencoded_size = raw_size;
-  header.encoded_size = data.size();
+  header.encoded_size = size;
   header.encoding_type = type;
+  header.crc32c = Crc32c(data, size);
 
   retval = file_->Write(&header, sizeof(ChunkHeader));
   LOG_RETURN_IF_ERROR(retval, "Could not write chunk header");
 
-  if (data.size() > 0) {
+  if (size > 0) {
     // Write the chunk itself.
-    retval = file_->Write(&data.at(0), data.size());
+    retval = file_->Write(data, size);
     LOG_RETURN_IF_ERROR(retval, "Could not write chunk");
   }
+  write_offset_ += sizeof(ChunkHeader) + size;
 
   // Record the chunk in our descriptor.
   BackupDescriptor1Chunk descriptor_chunk;
@@ -301,6 +730,7 @@ Status BackupVolume::WriteBackupDescriptor1(FileSet* fileset) {
   Status retval = file_->SeekEof();
   LOG_RETURN_IF_ERROR(retval, "Error seeking to EOF");
   descriptor_header_.backup_descriptor_1_offset = file_->Tell();
+  descriptor_crc_ = 0;
 
   // Stash away the label we were given in the set.
   if (fileset) {
@@ -357,14 +787,14 @@ Status BackupVolume::WriteBackupDescriptor1(FileSet* fileset) {
   // Grab the number of chunks and labels we have, and write the descriptor.
   LOG(INFO) << "Writing descriptor 1 (labels: " << labels_.size() << ")";
   descriptor1_.total_chunks = chunks_.size();
-  descriptor1_.total_labels = (fileset ? labels_.size() : 0);
-  retval = file_->Write(&descriptor1_, sizeof(BackupDescriptor1));
+  descriptor1_.total_labels = (fileset || appended_ ? labels_.size() : 0);
+  retval = WriteDescriptorData(&descriptor1_, sizeof(BackupDescriptor1));
   LOG_RETURN_IF_ERROR(retval, "Couldn't write descriptor 1 header");
 
   // Following this, we write all the descriptor chunks we have.
   LOG(INFO) << "Writing descriptor 1 chunks";
   for (auto chunk : chunks_) {
-    retval = file_->Write(&chunk.second, sizeof(BackupDescriptor1Chunk));
+    retval = WriteDescriptorData(&chunk.second, sizeof(BackupDescriptor1Chunk));
     LOG_RETURN_IF_ERROR(retval, "Couldn't write descriptor 1 chunk");
   }
 
@@ -378,14 +808,17 @@ Status BackupVolume::WriteBackupDescriptor1(FileSet* fileset) {
   }
 
   // Update our label (we can't do this if we're not closing with a FileSet).
-  if (fileset) {
+  // A volume appended to keeps the labels of its earlier backups either way.
+  if (fileset || appended_) {
     LOG(INFO) << "Writing descriptor 1 labels";
-    Status retval = file_->SeekEof();
-    LOG_RETURN_IF_ERROR(retval, "Error seeking to EOF");
+    if (fileset) {
+      Status retval = file_->SeekEof();
+      LOG_RETURN_IF_ERROR(retval, "Error seeking to EOF");
 
-    auto my_label_iter = labels_.find(fileset->label_id());
-    CHECK(labels_.end() != my_label_iter) << "BUG: Couldn't find label!";
-    my_label_iter->second.set_last_offset(file_->Tell() + label_block_size);
+      auto my_label_iter = labels_.find(fileset->label_id());
+      CHECK(labels_.end() != my_label_iter) << "BUG: Couldn't find label!";
+      my_label_iter->second.set_last_offset(file_->Tell() + label_block_size);
+    }
 
     for (auto label_iter : labels_) {
       BackupDescriptor1Label label;
@@ -398,18 +831,19 @@ Status BackupVolume::WriteBackupDescriptor1(FileSet* fileset) {
                 << hex << label_iter.first;
 
       // Write the descriptor.
-      retval = file_->Write(&label, sizeof(BackupDescriptor1Label));
+      retval = WriteDescriptorData(&label, sizeof(BackupDescriptor1Label));
       LOG_RETURN_IF_ERROR(retval, "Couldn't write descriptor 1 label");
 
       // Write the name.
       if (label_iter.second.name().size() > 0) {
-        retval = file_->Write(&label_iter.second.name().at(0),
-                              label_iter.second.name().size());
+        retval = WriteDescriptorData(&label_iter.second.name().at(0),
+                                     label_iter.second.name().size());
         LOG_RETURN_IF_ERROR(retval, "Couldn't write label string");
       }
     }
   }
 
+  descriptor_header_.descriptor_1_crc32c = descriptor_crc_;
   modified_ = true;
   return Status::OK;
 }
@@ -422,6 +856,8 @@ Status BackupVolume::WriteBackupDescriptor2(const FileSet& fileset) {
 
   LOG(INFO) << "Fileset date: " << fileset.date();
   descriptor_header_.backup_descriptor_2_present = true;
+  descriptor2_offset_ = file_->Tell();
+  descriptor_crc_ = 0;
   descriptor2_.num_files = fileset.num_files();
   descriptor2_.description_size = fileset.description().size();
   descriptor2_.backup_date = fileset.date();
@@ -434,42 +870,38 @@ Status BackupVolume::WriteBackupDescriptor2(const FileSet& fileset) {
   descriptor2_.parent_backup_volume_number = parent_volume_;
   descriptor2_.backup_type = fileset.backup_type();
   descriptor2_.label_id = fileset.label_id();
-  retval = file_->Write(&descriptor2_, sizeof(BackupDescriptor2));
+  retval = WriteDescriptorData(&descriptor2_, sizeof(BackupDescriptor2));
   LOG_RETURN_IF_ERROR(retval, "Couldn't write descriptor 2 header");
 
   if (fileset.description().size() > 0) {
-    retval = file_->Write(
+    retval = WriteDescriptorData(
         &fileset.description().at(0), fileset.description().size());
     LOG_RETURN_IF_ERROR(retval, "Couldn't write file set description");
   }
 
-  // Write the BackupFile and BackupChunk headers.
+  // Files spilled during the backup come first, copied from the spill file a
+  // block at a time, as they're already in descriptor 2 form.
+  string data;
+  for (uint64_t offset = 0; offset < fileset.spilled_size();
+       offset += data.size()) {
+    uint64_t size = std::min(kSpillCopySize, fileset.spilled_size() - offset);
+    retval = fileset.ReadSpilledData(offset, size, &data);
+    LOG_RETURN_IF_ERROR(retval, "Couldn't read spilled files");
+    retval = WriteDescriptorData(data.data(), data.size());
+    LOG_RETURN_IF_ERROR(retval, "Couldn't write spilled files");
+  }
+
+  // Then the BackupFile and BackupChunk headers of the rest.
   for (const FileEntry* backup_file : fileset.GetFiles()) {
-    const BackupFile* metadata = backup_file->GetBackupFile();
     VLOG(4) << "Data for " << backup_file->proper_filename()
-            << "(size = " << metadata->file_size << ")";
-    retval = file_->Write(metadata, sizeof(*metadata));
+            << "(size = " << backup_file->GetBackupFile()->file_size << ")";
+    data.clear();
+    backup_file->AppendRecord(&data);
+    retval = WriteDescriptorData(data.data(), data.size());
     LOG_RETURN_IF_ERROR(retval, "Couldn't write FileEntry data");
-
-    retval = file_->Write(&backup_file->generic_filename().at(0),
-                          backup_file->generic_filename().size());
-    LOG_RETURN_IF_ERROR(retval, "Couldn't write FileEntry filename");
-
-    if (metadata->file_type == BackupFile::kFileTypeSymlink) {
-      // Write the symlink target too.
-      retval = file_->Write(&backup_file->symlink_target().at(0),
-                            backup_file->symlink_target().size());
-      LOG_RETURN_IF_ERROR(retval, "Couldn't write FileEntry symlink target");
-    }
-
-    for (const FileChunk chunk : backup_file->GetChunks()) {
-      VLOG(5) << "Writing chunk " << std::hex
-              << chunk.md5sum.hi << chunk.md5sum.lo;
-      retval = file_->Write(&chunk, sizeof(FileChunk));
-      LOG_RETURN_IF_ERROR(retval, "Couldn't write FileChunk");
-    }
   }
 
+  descriptor_header_.descriptor_2_crc32c = descriptor_crc_;
   modified_ = true;
   return Status::OK;
 }
@@ -483,6 +915,7 @@ Status BackupVolume::WriteBackupDescriptorHeader() {
   retval = file_->Write(&descriptor_header_,
                         sizeof(BackupDescriptorHeader));
   LOG_RETURN_IF_ERROR(retval, "Couldn't write descriptor header");
+  write_offset_ += sizeof(BackupDescriptorHeader);
 
   modified_ = true;
   return Status::OK;
@@ -490,7 +923,7 @@ Status BackupVolume::WriteBackupDescriptorHeader() {
 
 Status BackupVolume::ReadBackupDescriptorHeader() {
   BackupDescriptorHeader header;
-  Status retval = file_->Read(&header, sizeof(BackupDescriptorHeader), NULL);
+  Status retval = file_->Read(&header, descriptor_header_size(), NULL);
   LOG_RETURN_IF_ERROR(retval, "Couldn't read descriptor header");
 
   if (header.header_type != kHeaderTypeDescriptorHeader) {
@@ -510,9 +943,10 @@ Status BackupVolume::ReadBackupDescriptor1() {
   // Read the backup descriptor 1.
   Status retval = file_->Seek(descriptor_header_.backup_descriptor_1_offset);
   LOG_RETURN_IF_ERROR(retval, "Couldn't seek to descriptor 1 offset");
+  descriptor_crc_ = 0;
 
   BackupDescriptor1 descriptor1;
-  retval = file_->Read(&descriptor1, sizeof(BackupDescriptor1), NULL);
+  retval = ReadDescriptorData(&descriptor1, sizeof(BackupDescriptor1));
   LOG_RETURN_IF_ERROR(retval, "Couldn't read descriptor 1");
 
   if (descriptor1.header_type != kHeaderTypeDescriptor1) {
@@ -527,7 +961,7 @@ Status BackupVolume::ReadBackupDescriptor1() {
   for (uint64_t chunk_num = 0; chunk_num < descriptor1.total_chunks;
        chunk_num++) {
     BackupDescriptor1Chunk chunk;
-    retval = file_->Read(&chunk, sizeof(BackupDescriptor1Chunk), NULL);
+    retval = ReadDescriptorData(&chunk, sizeof(BackupDescriptor1Chunk));
     LOG_RETURN_IF_ERROR(retval, "Couldn't read descriptor 1 chunk");
     chunks_.Add(chunk.md5sum, chunk);
   }
@@ -540,14 +974,14 @@ Status BackupVolume::ReadBackupDescriptor1() {
        ++label_num) {
     // Read the label metadata.
     BackupDescriptor1Label label_str;
-    retval = file_->Read(&label_str, sizeof(BackupDescriptor1Label), NULL);
+    retval = ReadDescriptorData(&label_str, sizeof(BackupDescriptor1Label));
     LOG_RETURN_IF_ERROR(retval, "Couldn't read descriptor 1 label");
 
     // Read the label name.
     string label_name;
     if (label_str.name_size > 0) {
       label_name.resize(label_str.name_size);
-      retval = file_->Read(&label_name.at(0), label_name.size(), NULL);
+      retval = ReadDescriptorData(&label_name.at(0), label_name.size());
       LOG_RETURN_IF_ERROR(retval, "Couldn't read label string");
     }
 
@@ -558,6 +992,10 @@ Status BackupVolume::ReadBackupDescriptor1() {
     labels_.insert(make_pair(label.id(), label));
   }
 
+  retval = CheckDescriptorCrc(descriptor_header_.descriptor_1_crc32c,
+                              "Descriptor 1");
+  LOG_RETURN_IF_ERROR(retval, "Bad descriptor 1");
+
   descriptor1_ = descriptor1;
   return Status::OK;
 }
@@ -571,14 +1009,30 @@ StatusOr<FileSet*> BackupVolume::LoadFileSet(int64_t* next_volume) {
     return Status(kStatusNotLastVolume, "");
   }
 
-  Status retval = file_->Seek(descriptor2_offset_);
+  // Descriptor 2 is found from the end of descriptor 1.
+  Status retval = LoadDescriptor1();
+  LOG_RETURN_IF_ERROR(retval, "Couldn't load descriptor 1");
+  return LoadFileSetAtOffset(descriptor2_offset_, next_volume);
+}
+
+StatusOr<FileSet*> BackupVolume::LoadFileSetAtOffset(uint64_t offset,
+                                                     int64_t* next_volume) {
+  CHECK_NOTNULL(next_volume);
+  *next_volume = -1;
+
+  // The labels are needed for the label name.
+  Status retval = LoadDescriptor1();
+  LOG_RETURN_IF_ERROR(retval, "Couldn't load descriptor 1");
+
+  retval = file_->Seek(offset);
   LOG_RETURN_IF_ERROR(retval, "Could not seek to descriptor 2 offset");
+  descriptor_crc_ = 0;
 
   // Read descriptor 2, including all the file chunks.
   BackupDescriptor2 descriptor2;
 
   // This first read doesn't include the string for the description
-  retval = file_->Read(&descriptor2, sizeof(descriptor2), NULL);
+  retval = ReadDescriptorData(&descriptor2, sizeof(descriptor2));
   LOG_RETURN_IF_ERROR(retval, "Couldn't read descriptor 2");
 
   if (descriptor2.header_type != kHeaderTypeDescriptor2) {
@@ -590,29 +1044,44 @@ StatusOr<FileSet*> BackupVolume::LoadFileSet(int64_t* next_volume) {
   string description = "";
   if (descriptor2.description_size > 0) {
     description.resize(descriptor2.description_size);
-    retval = file_->Read(
-        &description.at(0), descriptor2.description_size, NULL);
+    retval = ReadDescriptorData(&description.at(0),
+                                descriptor2.description_size);
     LOG_RETURN_IF_ERROR(retval, "Error reading descriptor 2 description");
   }
   VLOG(3) << "Found backup: " << description;
 
-  FileSet* fileset = new FileSet;
+  unique_ptr<FileSet> fileset(new FileSet);
   fileset->set_description(description);
   fileset->set_label_id(descriptor2.label_id);
   fileset->set_label_name(labels_[descriptor2.label_id].name());
   fileset->set_date(descriptor2.backup_date);
   fileset->set_parent_backup_volume(descriptor2.parent_backup_volume_number);
   fileset->set_parent_backup_offset(descriptor2.parent_backup_offset);
+  fileset->set_previous_backup_volume(
+      descriptor2.previous_backup_volume_number);
+  fileset->set_previous_backup_offset(descriptor2.previous_backup_offset);
   fileset->set_backup_type(descriptor2.backup_type);
   fileset->IncrementDedupCount(descriptor2.deduplicated_size);
   fileset->IncrementEncodedSize(descriptor2.encoded_size);
 
   // Read in all the files, and the file chunks.
   for (uint64_t file_num = 0; file_num < descriptor2.num_files; ++file_num) {
-    StatusOr<FileEntry*> entry = ReadFileEntry();
-    LOG_RETURN_IF_ERROR(entry.status(), "Error reading descriptor 2 file");
-    fileset->AddFile(entry.value());
+    retval = ReadFileEntry(fileset.get());
+    LOG_RETURN_IF_ERROR(retval, "Error reading descriptor 2 file");
+  }
+
+  // Descriptor 2 is followed by the header that ended its backup, with its
+  // CRC.  For the volume's last backup, that's the header at the end of the
+  // volume.
+  BackupDescriptorHeader header;
+  retval = file_->Read(&header, descriptor_header_size(), NULL);
+  LOG_RETURN_IF_ERROR(retval, "Couldn't read descriptor 2's header");
+  if (header.header_type != kHeaderTypeDescriptorHeader ||
+      !header.backup_descriptor_2_present) {
+    return Status(kStatusCorruptBackup, "No header after descriptor 2");
   }
+  retval = CheckDescriptorCrc(header.descriptor_2_crc32c, "Descriptor 2");
+  LOG_RETURN_IF_ERROR(retval, "Bad descriptor 2");
 
   if (descriptor2.previous_backup_volume_number == 0 &&
       descriptor2.previous_backup_offset == 0) {
@@ -622,7 +1091,7 @@ StatusOr<FileSet*> BackupVolume::LoadFileSet(int64_t* next_volume) {
     *next_volume = descriptor2.previous_backup_volume_number;
   }
 
-  return fileset;
+  return fileset.release();
 }
 
 StatusOr<FileSet*> BackupVolume::LoadFileSetFromLabel(
@@ -630,6 +1099,9 @@ StatusOr<FileSet*> BackupVolume::LoadFileSetFromLabel(
   CHECK_NOTNULL(next_volume);
   *next_volume = -1;
 
+  Status retval = LoadDescriptor1();
+  LOG_RETURN_IF_ERROR(retval, "Couldn't load descriptor 1");
+
   // Find the last backup 2 offset done with the given label.
   auto label_iter = labels_.find(label_id);
   if (label_iter == labels_.end()) {
@@ -644,8 +1116,12 @@ StatusOr<FileSet*> BackupVolume::LoadFileSetFromLabel(
     return NULL;
   }
 
-  // The label is in our backup set, so just grab it.
-  StatusOr<FileSet*> fileset = LoadFileSet(next_volume);
+  // The label is in our backup set, so just grab it.  Labels not yet used by
+  // a backup have no offset.
+  StatusOr<FileSet*> fileset =
+      label.last_offset() == 0 ?
+      LoadFileSet(next_volume) :
+      LoadFileSetAtOffset(label.last_offset(), next_volume);
   LOG_RETURN_IF_ERROR(fileset.status(), "Couldn't load fileset");
 
   // Adjust the next volume to short-circuit us to the next one for this label.
@@ -659,52 +1135,89 @@ StatusOr<FileSet*> BackupVolume::LoadFileSetFromLabel(
   return fileset;
 }
 
-StatusOr<FileEntry*> BackupVolume::ReadFileEntry() {
-  unique_ptr<BackupFile> backup_file(new BackupFile);
-  Status retval = file_->Read(backup_file.get(), sizeof(BackupFile), NULL);
+Status BackupVolume::ReadFileEntry(FileSet* fileset) {
+  // Version 0 volumes wrote a shorter BackupFile.  The fields it lacks are
+  // left zeroed.
+  uint64_t backup_file_size =
+      version_ >= 1 ? sizeof(BackupFile) : kBackupFileV0Size;
+  BackupFile backup_file;
+  Status retval = ReadDescriptorData(&backup_file, backup_file_size);
   LOG_RETURN_IF_ERROR(retval, "Couldn't read BackupFile header");
 
-  if (backup_file->header_type != kHeaderTypeBackupFile) {
+  if (backup_file.header_type != kHeaderTypeBackupFile) {
     return Status(kStatusCorruptBackup, "Invalid header for BackupFile");
   }
 
   string filename;
-  filename.resize(backup_file->filename_size);
-  retval = file_->Read(&filename.at(0), filename.size(), NULL);
+  filename.resize(backup_file.filename_size);
+  retval = ReadDescriptorData(&filename.at(0), filename.size());
   LOG_RETURN_IF_ERROR(retval, "Couldn't read BackupFile filename");
 
   string symlink = "";
-  if (backup_file->file_type == BackupFile::kFileTypeSymlink) {
+  if (backup_file.file_type == BackupFile::kFileTypeSymlink) {
     // Also read the symlink target.
-    symlink.resize(backup_file->symlink_target_size);
-    retval = file_->Read(&symlink.at(0), symlink.size(), NULL);
+    symlink.resize(backup_file.symlink_target_size);
+    retval = ReadDescriptorData(&symlink.at(0), symlink.size());
     LOG_RETURN_IF_ERROR(retval, "Couldn't read BackupFile symlink");
   }
 
   // Store away and reset the file size in the metadata.  As we read chunks,
   // this should fill up to its original value (which we check to ensure the
   // backup is good).
-  uint64_t file_size = backup_file->file_size;
-  uint64_t num_chunks = backup_file->num_chunks;
-  backup_file->num_chunks = 0;
+  uint64_t file_size = backup_file.file_size;
+  uint64_t num_chunks = backup_file.num_chunks;
+  backup_file.num_chunks = 0;
 
   VLOG(5) << "Found " << filename;
-  unique_ptr<FileEntry> entry(new FileEntry(filename, backup_file.release()));
+  FileEntry* entry = fileset->AddFile(filename, backup_file);
   entry->set_symlink_target(symlink);
-  retval = ReadFileChunks(num_chunks, entry.get());
+  retval = ReadFileChunks(num_chunks, entry, fileset);
   LOG_RETURN_IF_ERROR(retval, "Couldn't read file chunks");
 
   CHECK_EQ(file_size, entry->GetBackupFile()->file_size);
-  return entry.release();
+  return Status::OK;
 }
 
 Status BackupVolume::ReadFileChunks(
-    const uint64_t num_chunks, FileEntry* entry) {
-  for (uint64_t chunk_num = 0; chunk_num < num_chunks; ++chunk_num) {
-    FileChunk chunk;
-    Status retval = file_->Read(&chunk, sizeof(chunk), NULL);
-    LOG_RETURN_IF_ERROR(retval, "Couldn't read file chunk");
-    entry->AddChunk(chunk);
+    const uint64_t num_chunks, FileEntry* entry, FileSet* fileset) {
+  if (num_chunks == 0) {
+    return Status::OK;
+  }
+
+  // A file's chunks are stored together, so read them in one go, straight
+  // into the fileset's shared chunks.
+  FileChunk* chunks = fileset->AllocateChunks(entry, num_chunks);
+  Status retval = ReadDescriptorData(chunks, num_chunks * sizeof(FileChunk));
+  LOG_RETURN_IF_ERROR(retval, "Couldn't read file chunks");
+  return Status::OK;
+}
+
+Status BackupVolume::WriteDescriptorData(const void* data, size_t size) {
+  descriptor_crc_ = Crc32cExtend(descriptor_crc_,
+                                 static_cast<const char*>(data), size);
+  write_offset_ += size;
+  return file_->Write(data, size);
+}
+
+Status BackupVolume::ReadDescriptorData(void* data, size_t size) {
+  Status retval = file_->Read(data, size, NULL);
+  if (retval.ok()) {
+    descriptor_crc_ = Crc32cExtend(descriptor_crc_,
+                                   static_cast<const char*>(data), size);
+  }
+  return retval;
+}
+
+Status BackupVolume::CheckDescriptorCrc(uint32_t expected,
+                                        const string& name) {
+  // Descriptors didn't have CRCs before version 2.
+  if (version_ < 2) {
+    return Status::OK;
+  }
+  if (descriptor_crc_ != expected) {
+    LOG(ERROR) << name << " CRC mismatch: expected " << hex << expected
+               << ", got " << descriptor_crc_;
+    return Status(kStatusCorruptBackup, name + " CRC mismatch");
   }
   return Status::OK;
 }
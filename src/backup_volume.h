@@ -6,6 +6,7 @@
 #include <map>
 #include <memory>
 #include <string>
+#include <utility>
 #include <vector>
 
 #include "src/backup_volume_defs.h"
@@ -36,8 +37,12 @@ class BackupVolume : public BackupVolumeInterface {
 
   // BackupVolumeInterface methods.
   virtual Status Init() MUST_USE_RESULT;
+  virtual Status LoadDescriptor1() MUST_USE_RESULT;
   virtual Status Create(const ConfigOptions& options) MUST_USE_RESULT;
+  virtual Status Append(const ConfigOptions& options) MUST_USE_RESULT;
   virtual StatusOr<FileSet*> LoadFileSet(int64_t* next_volume);
+  virtual StatusOr<FileSet*> LoadFileSetAtOffset(uint64_t offset,
+                                                 int64_t* next_volume);
   virtual StatusOr<FileSet*> LoadFileSetFromLabel(
       uint64_t label_id, int64_t* next_volume);
   virtual bool HasChunk(Uint128 md5sum) { return chunks_.HasChunk(md5sum); }
@@ -46,17 +51,27 @@ class BackupVolume : public BackupVolumeInterface {
     return chunks_.GetChunk(md5sum, chunk);
   }
   virtual void GetLabels(LabelMap* out_labels) { *out_labels = labels_; }
+  using BackupVolumeInterface::WriteChunk;
   virtual Status WriteChunk(
-      Uint128 md5sum, const std::string& data, uint64_t raw_size,
+      Uint128 md5sum, const char* data, size_t size, uint64_t raw_size,
       EncodingType type, uint64_t* chunk_offset_out);
   virtual Status ReadChunk(const FileChunk& chunk, std::string* data_out,
                            EncodingType* encoding_type_out);
+  virtual Status ReadChunks(const std::vector<FileChunk>& chunks,
+                            std::vector<std::string>* data_out,
+                            std::vector<EncodingType>* encoding_types_out);
+  virtual Status ReadStoredChunks(uint64_t first_chunk, uint64_t max_bytes,
+                                  std::vector<StoredChunk>* chunks_out);
+  virtual Status LocateChunksData(const std::vector<FileChunk>& chunks,
+                                  std::vector<ChunkHeader>* headers_out,
+                                  std::vector<uint64_t>* data_offsets_out);
   virtual Status Close();
   virtual Status CloseWithFileSetAndLabels(
       FileSet* fileset, const LabelMap& labels);
   virtual Status Cancel();
   virtual uint64_t EstimatedSize() const;
   virtual uint64_t DiskSize() const;
+  virtual uint64_t EstimatedMemoryUsage() const;
   virtual uint64_t volume_number() const {
     return descriptor_header_.volume_number;
   }
@@ -69,12 +84,15 @@ class BackupVolume : public BackupVolumeInterface {
   virtual bool is_completed_volume() const {
     return descriptor_header_.backup_descriptor_2_present;
   }
+  virtual bool has_chunk_crcs() const { return version_ >= 2; }
 
  private:
   // Verify the version header in the file.
   Status CheckVersion();
 
-  // Verify the backup descriptors are valid.  This doesn't actually read them.
+  // Verify the backup descriptors are valid.  This reads the descriptor header
+  // and the fixed part of descriptor 1, but not descriptor 1's chunks and
+  // labels.
   Status CheckBackupDescriptors();
 
   // Write the various backup descriptors to the file.  These are run in order
@@ -91,20 +109,81 @@ class BackupVolume : public BackupVolumeInterface {
   Status ReadBackupDescriptorHeader();
   Status ReadBackupDescriptor1();
 
-  // Read a single file entry from the file.  The FileEntry is created and
-  // passed to the caller who takes ownership of it.
-  StatusOr<FileEntry*> ReadFileEntry();
+  // Return whether a chunk read by ReadStoredChunks() fills the space from
+  // data_offset to data_end in buffer: either its data runs right up to the
+  // end, or the rest is the descriptors of an earlier backup in the volume.
+  bool ChunkFillsSpace(const ChunkHeader& header, const std::string& buffer,
+                       uint64_t data_offset, uint64_t data_end) const;
+
+  // Look up a batch of chunks in descriptor 1, returning their entries in
+  // chunk_metas_out, and in order_out the offset and batch index of each, in
+  // volume order.
+  Status FindChunks(const std::vector<FileChunk>& chunks,
+                    std::vector<BackupDescriptor1Chunk>* chunk_metas_out,
+                    std::vector<std::pair<uint64_t, uint64_t> >* order_out);
+
+  // Check that a chunk header read from the file is the one expected for the
+  // given chunk.
+  Status ValidateChunkHeader(const ChunkHeader& header,
+                             const BackupDescriptor1Chunk& chunk_meta,
+                             const FileChunk& chunk);
+
+  // Check a chunk's encoded data against the CRC in its header.  Volumes older
+  // than version 2 have no CRCs, so this always passes for them.
+  Status CheckChunkCrc(const ChunkHeader& header, const char* data);
+
+  // Write or read part of a backup descriptor, adding it to descriptor_crc_.
+  Status WriteDescriptorData(const void* data, size_t size);
+  Status ReadDescriptorData(void* data, size_t size);
+
+  // Compare descriptor_crc_ against the CRC stored for a descriptor, if this
+  // volume's version has descriptor CRCs.
+  Status CheckDescriptorCrc(uint32_t expected, const std::string& name);
+
+  // Sizes of the chunk and descriptor headers in this volume's version.
+  uint64_t chunk_header_size() const {
+    return version_ >= 2 ? sizeof(ChunkHeader) : kChunkHeaderV1Size;
+  }
+  uint64_t descriptor_header_size() const {
+    return version_ >= 2 ? sizeof(BackupDescriptorHeader)
+                         : kBackupDescriptorHeaderV1Size;
+  }
 
-  // Read the chunks of the given FileEntry file and load them into it.
-  Status ReadFileChunks(uint64_t num_chunks, FileEntry* entry);
+  // Read a single file entry from the file, and add it to fileset.
+  Status ReadFileEntry(FileSet* fileset);
+
+  // Read the chunks of the given FileEntry file into the shared chunks of the
+  // fileset it's in.
+  Status ReadFileChunks(uint64_t num_chunks, FileEntry* entry,
+                        FileSet* fileset);
 
   // Current file version.  We expect to see this at the very begining of the
   // file to signify this is a valid backup file.
   static const std::string kFileVersion;
 
+  // Numeric form of kFileVersion.  Volumes of this version or older can be
+  // read, but new volumes are always written with the current version.
+  static const uint64_t kCurrentVersion;
+
+  // First volume version that can hold zero chunks (kEncodingTypeZero).
+  static const uint64_t kZeroChunkVersion;
+
+  // Largest single read ReadChunks() makes, unless one chunk is larger.
+  static const uint64_t kMaxCoalescedReadSize;
+
+  // Largest run of unwanted bytes ReadChunks() reads through to join two
+  // chunks into one read.
+  static const uint64_t kMaxCoalescedReadGap;
+
+  // Size of the blocks spilled files are copied into descriptor 2 in.
+  static const uint64_t kSpillCopySize;
+
   // Open file handle.
   std::unique_ptr<FileInterface> file_;
 
+  // Format version of this volume, as read from the file or created.
+  uint64_t version_;
+
   // Backup volume options.  These were either passed in to us, or determined
   // from the backup volume.
   ConfigOptions options_;
@@ -116,20 +195,40 @@ class BackupVolume : public BackupVolumeInterface {
 
   uint64_t descriptor2_offset_;
 
+  // Whether descriptor 1's chunks and labels are in chunks_ and labels_.
+  bool descriptor1_loaded_;
+
   // Offset and volume number of the parent backup descriptor 2 to this one.
   // Zero for both of these indicates no parent.
   uint64_t parent_offset_;
   uint64_t parent_volume_;
 
+  // Running CRC32C of the descriptor currently being written or read.
+  uint32_t descriptor_crc_;
+
   // Vector of all chunks contained in this backup volume.  This is loaded
   // initially from backup descriptor 1, and stored there at the end of the
   // backup.
   ChunkMap chunks_;
 
+  // Descriptor 1 entries of the chunks in the order they're stored, built by
+  // ReadStoredChunks() when first needed.
+  std::vector<BackupDescriptor1Chunk> stored_order_;
+
   LabelMap labels_;
 
   bool modified_;
 
+  // Size of a volume being created, counting data still buffered by the file.
+  // Everything is appended, so this is also where the next write goes, and
+  // writing a chunk or sizing the volume needs no calls to the filesystem.
+  // 0 for volumes opened with Init().
+  uint64_t write_offset_;
+
+  // Whether the volume had backups before it was reopened with Append().
+  // Their labels are kept even if the volume is closed without a FileSet.
+  bool appended_;
+
   DISALLOW_COPY_AND_ASSIGN(BackupVolume);
 };
 
@@ -6,6 +6,7 @@
 #ifndef BACKUP2_SRC_BACKUP_VOLUME_DEFS_H_
 #define BACKUP2_SRC_BACKUP_VOLUME_DEFS_H_
 
+#include <stddef.h>
 #include <string.h>
 
 #include "src/common.h"
@@ -21,6 +22,12 @@ enum EncodingType {
   kEncodingTypeRaw = 0,
   kEncodingTypeZlib,
   kEndodingTypeBzip2,
+
+  // A chunk of all zeros.  Only the header is stored; the data is implied by
+  // the unencoded size.  Only volumes of version 2 (BKP_0002) or later may hold
+  // these, so that older readers reject the volume as too new rather than
+  // failing on the chunk.
+  kEncodingTypeZero,
 };
 
 // Type of backup.  This is stored in descriptor 2 for each backup set, and
@@ -30,8 +37,19 @@ enum BackupType {
   kBackupTypeFull,
   kBackupTypeDifferential,
   kBackupTypeIncremental,
+
+  // A full backup assembled from the previous backup chain.  Files that haven't
+  // changed reference the chunks already in the library rather than being
+  // re-read; otherwise it is treated exactly like a full backup.
+  kBackupTypeSyntheticFull,
 };
 
+// Return whether the given backup type contains every file in the backup, and
+// so terminates a chain of incremental and differential backups.
+inline bool IsFullBackupType(BackupType type) {
+  return type == kBackupTypeFull || type == kBackupTypeSyntheticFull;
+}
+
 // Types of headers.  These are used to ensure that the chunk of file we're
 // expecting to see is correct.
 enum HeaderType {
@@ -68,8 +86,16 @@ struct ChunkHeader {
 
   // Encoding type.  Needed to be able to decode on restores or verifies.
   EncodingType encoding_type;
+
+  // CRC32C of the encoded data following this header, so damaged data can be
+  // found without decoding it (added in version 2 of the volume format).
+  uint32_t crc32c;
 };
 
+// Size of the ChunkHeader structure in version 0 and 1 backup volumes, which
+// ended before the crc32c field.
+const uint64_t kChunkHeaderV1Size = offsetof(ChunkHeader, crc32c);
+
 // Backup Descriptor 1 is stored towards the end of the file.  It contains only
 // data about the contents of the file, not the entire backup.  This descriptor
 // is required for all backup volumes.
@@ -294,12 +320,45 @@ struct BackupFile {
   // if file_type is kFileTypeSymlink.
   uint64_t symlink_target_size;
 
+  // Device and inode number of the file, and the time its inode last changed
+  // in seconds since the epoch.  Together with the size and modification date
+  // these identify an unchanged file, allowing its chunks to be re-used in
+  // later backups without reading it.  Zero if not known (these were added in
+  // version 1 of the volume format, and aren't available on all platforms).
+  uint64_t device_id;
+  uint64_t inode;
+  uint64_t change_date;
+
   // Filename string, including the entire source path, follows.
 
   // If file_type = kFileTypeSymlink, the symlink target filename follows the
   // filename.
 };
 
+// Size of the BackupFile structure in version 0 backup volumes, which ended
+// before the device_id field.
+const uint64_t kBackupFileV0Size = offsetof(BackupFile, device_id);
+
+// Return whether a file described by current has changed since it was
+// described by previous.  The inode, change date and device catch files that
+// were replaced, or written with their modification date preserved, but are
+// only compared when both sides have them.
+inline bool BackupFileChanged(const BackupFile& previous,
+                              const BackupFile& current) {
+  if (current.file_type != previous.file_type ||
+      current.file_size != previous.file_size ||
+      current.modify_date != previous.modify_date) {
+    return true;
+  }
+  if (current.change_date != 0 && previous.change_date != 0 &&
+      (current.inode != previous.inode ||
+       current.change_date != previous.change_date)) {
+    return true;
+  }
+  return current.device_id != 0 && previous.device_id != 0 &&
+         current.device_id != previous.device_id;
+}
+
 // A checksummed chunk belonging to a file.  These come one after another
 // following a BackupFile header until the entire file is described.  Chunks
 // described here must be looked up in the backup volume's backup descriptor 1
@@ -373,8 +432,19 @@ struct BackupDescriptorHeader {
 
   // Volume number in the set.
   uint64_t volume_number;
+
+  // CRC32C of backup descriptor 1 and, if present, backup descriptor 2, so a
+  // damaged descriptor is found before it's used (added in version 2 of the
+  // volume format).
+  uint32_t descriptor_1_crc32c;
+  uint32_t descriptor_2_crc32c;
 };
 
+// Size of the BackupDescriptorHeader structure in version 0 and 1 backup
+// volumes, which ended before the CRC fields.
+const uint64_t kBackupDescriptorHeaderV1Size =
+    offsetof(BackupDescriptorHeader, descriptor_1_crc32c);
+
 #pragma pack(pop)
 
 }  // namespace backup2
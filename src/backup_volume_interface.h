@@ -64,6 +64,23 @@ class Label {
 // A convenient map to hold the label ID and poitner to the label.
 typedef std::map<uint64_t, Label> LabelMap;
 
+// A chunk as it is stored in a backup volume, returned by
+// BackupVolumeInterface::ReadStoredChunks().
+struct StoredChunk {
+  StoredChunk() : status(Status::OK) {}
+
+  // Descriptor 1 entry for the chunk, saying where it should be.
+  BackupDescriptor1Chunk descriptor;
+
+  // Header and encoded data found there.
+  ChunkHeader header;
+  std::string data;
+
+  // Any problem found with the chunk's header or its place in the volume.  If
+  // this isn't OK, the header and data can't be relied on.
+  Status status;
+};
+
 // Interface for any BackupVolume.  BackupVolumes can be implemented in
 // basically any way, but must conform to this contract to be usable.
 class BackupVolumeInterface {
@@ -71,18 +88,38 @@ class BackupVolumeInterface {
   virtual ~BackupVolumeInterface() {}
 
   // Initialize.  This opens the file (if it exists) and reads in the backup
-  // descriptor.  Returns the error encountered if any.
+  // descriptor header.  Returns the error encountered if any.  Descriptor 1,
+  // with the volume's chunks and labels, isn't read until LoadDescriptor1().
   virtual Status Init() = 0;
 
+  // Read descriptor 1 of a volume opened with Init(), if it hasn't been read
+  // yet.  This must be done before HasChunk(), GetChunks(), GetChunk(),
+  // GetLabels() or last_backup_offset() are used; the methods returning a
+  // Status load it themselves.  New volumes have nothing to load.
+  virtual Status LoadDescriptor1() = 0;
+
   // Initialize a new backup volume.  The configuration options passed in
   // specify how the backup volume will be written.
   virtual Status Create(const ConfigOptions& options) = 0;
 
+  // Reopen a volume initialized with Init() to add another backup after the
+  // one it ends with.  New chunks go after the volume's existing contents,
+  // which are left untouched, so truncating the volume back to its size
+  // beforehand undoes the append.  The volume must end a completed backup.
+  virtual Status Append(const ConfigOptions& options) = 0;
+
   // Load the fileset for the backup set.  If there are more file sets
   // available, next_volume is filled with the volume containing the next recent
   // backup fileset.  Otherwise, -1 is returned indicating the last one.
   virtual StatusOr<FileSet*> LoadFileSet(int64_t* next_volume) = 0;
 
+  // Like LoadFileSet, but load the backup whose descriptor 2 is at the given
+  // offset, such as an earlier backup in a volume appended to.  The returned
+  // FileSet carries the location of the previous backup, for loading it in
+  // turn.
+  virtual StatusOr<FileSet*> LoadFileSetAtOffset(uint64_t offset,
+                                                 int64_t* next_volume) = 0;
+
   // Like LoadFileSet, but restrict the file set to the provided label's
   // lineage.  This function may return OK status but still return a NULL
   // pointer -- if that happens, this volume didn't contain a fileset with the
@@ -104,17 +141,54 @@ class BackupVolumeInterface {
   // This will be of all labels encountered up to this backup volume.
   virtual void GetLabels(LabelMap* out_labels) = 0;
 
-  // Write a chunk to the volume.  The offset in the backup volume for this
-  // chunk is returned on success in chunk_offset_out.
+  // Write a chunk of the size bytes at data to the volume.  The data is
+  // copied, so it may be part of a larger buffer the caller reuses.  The offset
+  // in the backup volume for this chunk is returned on success in
+  // chunk_offset_out.
   virtual Status WriteChunk(
-      Uint128 md5sum, const std::string& data, uint64_t raw_size,
+      Uint128 md5sum, const char* data, size_t size, uint64_t raw_size,
       EncodingType type, uint64_t* chunk_offset_out) = 0;
 
+  // Like WriteChunk() above, for data in a string.
+  Status WriteChunk(
+      Uint128 md5sum, const std::string& data, uint64_t raw_size,
+      EncodingType type, uint64_t* chunk_offset_out) {
+    return WriteChunk(md5sum, data.data(), data.size(), raw_size, type,
+                      chunk_offset_out);
+  }
+
   // Read a chunk from the volume.  If successful, the chunk data is returned in
   // the passed string.
   virtual Status ReadChunk(const FileChunk& chunk, std::string* data_out,
                            EncodingType* encoding_type_out) = 0;
 
+  // Read a batch of chunks from the volume.  Chunks lying close together in
+  // the volume are fetched with one large read rather than a read per chunk.
+  // If successful, the encoded data and encoding type of each chunk are
+  // returned in the matching elements of data_out and encoding_types_out.
+  virtual Status ReadChunks(const std::vector<FileChunk>& chunks,
+                            std::vector<std::string>* data_out,
+                            std::vector<EncodingType>* encoding_types_out) = 0;
+
+  // Read the chunks stored in the volume in the order they're stored, so a
+  // whole volume can be checked with long sequential reads.  Chunks are read
+  // starting with the first_chunk'th until about max_bytes have been read, and
+  // the next call picks up at first_chunk plus the number returned; none are
+  // returned past the last chunk.  Each chunk is checked against its
+  // descriptor 1 entry and the space it fills in the volume, and any problem
+  // is returned in the chunk's status rather than failing the read.  Volumes
+  // not stored in a file may return the chunks in any order.
+  virtual Status ReadStoredChunks(uint64_t first_chunk, uint64_t max_bytes,
+                                  std::vector<StoredChunk>* chunks_out) = 0;
+
+  // Find where the stored data of a batch of chunks starts in the volume file,
+  // without reading the data.  Each chunk's header is read and validated, in
+  // volume order, and returned in headers_out in the order of the batch.
+  // Volumes not stored in a file return kStatusNotImplemented.
+  virtual Status LocateChunksData(const std::vector<FileChunk>& chunks,
+                                  std::vector<ChunkHeader>* headers_out,
+                                  std::vector<uint64_t>* data_offsets_out) = 0;
+
   // Close out the backup volume.  If this is the last volume in the backup a
   // fileset is provided and we write descriptor 2 to the file.  Otherwise, we
   // only leave descriptor 1 and the backup header.  The provided label map is
@@ -139,6 +213,10 @@ class BackupVolumeInterface {
   // to account for backup volumes that don't fill up the maximum volume size.
   virtual uint64_t DiskSize() const = 0;
 
+  // Returns the estimated memory this volume holds once descriptor 1 is
+  // loaded.  This is known as soon as the volume is initialized.
+  virtual uint64_t EstimatedMemoryUsage() const = 0;
+
   // Return the volume number this backup volume represents.
   virtual uint64_t volume_number() const = 0;
 
@@ -151,6 +229,10 @@ class BackupVolumeInterface {
 
   // Return whether this volume is the end of a backup set.
   virtual bool is_completed_volume() const = 0;
+
+  // Return whether the chunks in this volume carry CRCs of their encoded data,
+  // which ReadChunk() and ReadChunks() check.
+  virtual bool has_chunk_crcs() const = 0;
 };
 
 // Interface for any backup volume factory.
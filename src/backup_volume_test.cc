@@ -10,6 +10,7 @@
 #include "src/backup_volume.h"
 #include "src/callback.h"
 #include "src/common.h"
+#include "src/crc32c.h"
 #include "src/fileset.h"
 #include "src/fake_file.h"
 #include "src/mock_encoder.h"
@@ -58,9 +59,20 @@ class BackupVolumeTest : public testing::Test {
  public:
   static const char kGoodVersion[9];
   static const int kBackupDescriptor1Offset = 0x12345;
+
+  // Return the CRC32C of the file's contents from the given offset on, as
+  // stored for the descriptor written there.
+  static uint32_t FileCrc(FakeFile* file, uint64_t offset) {
+    uint64_t size = 0;
+    EXPECT_TRUE(file->size(&size).ok());
+    string data(size - offset, '\0');
+    EXPECT_TRUE(file->Seek(offset).ok());
+    EXPECT_TRUE(file->Read(&data.at(0), data.size(), NULL).ok());
+    return Crc32c(data);
+  }
 };
 
-const char BackupVolumeTest::kGoodVersion[9] = "BKP_0000";
+const char BackupVolumeTest::kGoodVersion[9] = "BKP_0002";
 
 TEST_F(BackupVolumeTest, ShortVersionHeader) {
   FakeFile* file = new FakeFile;
@@ -82,6 +94,16 @@ TEST_F(BackupVolumeTest, InvalidVersionHeader) {
   EXPECT_EQ(kStatusCorruptBackup, retval.code());
 }
 
+TEST_F(BackupVolumeTest, NewerVersionHeader) {
+  FakeFile* file = new FakeFile;
+  file->Write("BKP_9999", 8);
+
+  BackupVolume volume(file);
+  Status retval = volume.Init();
+  EXPECT_FALSE(retval.ok());
+  EXPECT_EQ(kStatusCorruptBackup, retval.code());
+}
+
 TEST_F(BackupVolumeTest, SuccessfulInit) {
   // This test verifies that a successful init can be accomplished with valid
   // input.  We also test error conditions as we're building the file.  It
@@ -100,6 +122,7 @@ TEST_F(BackupVolumeTest, SuccessfulInit) {
   chunk_header.encoded_size = 16;
   chunk_header.unencoded_size = 16;
   chunk_header.encoding_type = kEncodingTypeRaw;
+  chunk_header.crc32c = Crc32c("1234567890123456");
   file->Write(&chunk_header, sizeof(chunk_header));
   retval = volume.Init();
   EXPECT_FALSE(retval.ok());
@@ -140,6 +163,11 @@ TEST_F(BackupVolumeTest, SuccessfulInit) {
   file->Write(&descriptor1_label, sizeof(descriptor1_label));
   file->Write(&label_name.at(0), label_name.size());
 
+  // Descriptor 1 ends where descriptor 2 starts.
+  uint32_t desc1_crc = FileCrc(file, desc1_offset);
+  uint64_t desc2_offset = 0;
+  EXPECT_TRUE(file->size(&desc2_offset).ok());
+
   // Create a descriptor 2.
   BackupDescriptor2 descriptor2;
   descriptor2.unencoded_size = 16;
@@ -195,6 +223,8 @@ TEST_F(BackupVolumeTest, SuccessfulInit) {
   header.backup_descriptor_2_present = true;
   header.cancelled = false;
   header.volume_number = 0;
+  header.descriptor_1_crc32c = desc1_crc;
+  header.descriptor_2_crc32c = FileCrc(file, desc2_offset);
   file->Write(&header, sizeof(BackupDescriptorHeader));
 
   // Attempt an init.
@@ -227,6 +257,7 @@ TEST_F(BackupVolumeTest, CreateAndClose) {
   header.backup_descriptor_2_present = false;
   header.cancelled = false;
   header.volume_number = 0;
+  header.descriptor_1_crc32c = FileCrc(file, desc1_offset);
   file->Write(&header, sizeof(BackupDescriptorHeader));
 
   // Reset for the test.
@@ -263,6 +294,7 @@ TEST_F(BackupVolumeTest, CreateAddChunkAndClose) {
   chunk_header.encoding_type = kEncodingTypeRaw;
   chunk_header.md5sum.hi = 123;
   chunk_header.md5sum.lo = 456;
+  chunk_header.crc32c = Crc32c(chunk_data);
   file->Write(&chunk_header, sizeof(chunk_header));
   file->Write(&chunk_data.at(0), chunk_data.size());
 
@@ -286,6 +318,7 @@ TEST_F(BackupVolumeTest, CreateAddChunkAndClose) {
   header.backup_descriptor_2_present = false;
   header.cancelled = false;
   header.volume_number = 0;
+  header.descriptor_1_crc32c = FileCrc(file, desc1_offset);
   file->Write(&header, sizeof(BackupDescriptorHeader));
 
   // Reset for the test.
@@ -299,7 +332,7 @@ TEST_F(BackupVolumeTest, CreateAddChunkAndClose) {
   EXPECT_TRUE(volume.Create(options).ok());
 
   // TODO(darkstar62): This should be a FakeFileEntry.
-  BackupFile* entry_metadata = new BackupFile;
+  BackupFile entry_metadata;
   FileEntry file_entry("/foo", entry_metadata);
   uint64_t volume_offset = 0;
   EXPECT_TRUE(volume.WriteChunk(chunk_header.md5sum, chunk_data,
@@ -307,10 +340,18 @@ TEST_F(BackupVolumeTest, CreateAddChunkAndClose) {
                                 chunk_header.encoding_type,
                                 &volume_offset).ok());
   EXPECT_EQ(descriptor1_chunk.offset, volume_offset);
+
+  // The size is tracked as the volume is written.
+  EXPECT_EQ(desc1_offset, volume.DiskSize());
+  EXPECT_EQ(desc1_offset + sizeof(BackupDescriptor1Chunk),
+            volume.EstimatedSize());
   EXPECT_TRUE(volume.Close().ok());
 
   // Validate the contents.
   EXPECT_TRUE(file->CompareExpected());
+  uint64_t file_size = 0;
+  EXPECT_TRUE(file->size(&file_size).ok());
+  EXPECT_EQ(file_size, volume.DiskSize());
 }
 
 TEST_F(BackupVolumeTest, CreateAddChunkAndCancel) {
@@ -332,6 +373,7 @@ TEST_F(BackupVolumeTest, CreateAddChunkAndCancel) {
   chunk_header.encoding_type = kEncodingTypeRaw;
   chunk_header.md5sum.hi = 123;
   chunk_header.md5sum.lo = 456;
+  chunk_header.crc32c = Crc32c(chunk_data);
   file->Write(&chunk_header, sizeof(chunk_header));
   file->Write(&chunk_data.at(0), chunk_data.size());
 
@@ -355,6 +397,7 @@ TEST_F(BackupVolumeTest, CreateAddChunkAndCancel) {
   header.backup_descriptor_2_present = false;
   header.cancelled = true;
   header.volume_number = 0;
+  header.descriptor_1_crc32c = FileCrc(file, desc1_offset);
   file->Write(&header, sizeof(BackupDescriptorHeader));
 
   // Reset for the test.
@@ -368,7 +411,7 @@ TEST_F(BackupVolumeTest, CreateAddChunkAndCancel) {
   EXPECT_TRUE(volume.Create(options).ok());
 
   // TODO(darkstar62): This should be a FakeFileEntry.
-  BackupFile* entry_metadata = new BackupFile;
+  BackupFile entry_metadata;
   FileEntry file_entry("/foo", entry_metadata);
   uint64_t volume_offset = 0;
   EXPECT_TRUE(volume.WriteChunk(chunk_header.md5sum, chunk_data,
@@ -401,6 +444,7 @@ TEST_F(BackupVolumeTest, CreateAddChunkAndCloseWithFileSet) {
   chunk_header.encoding_type = kEncodingTypeRaw;
   chunk_header.md5sum.hi = 123;
   chunk_header.md5sum.lo = 456;
+  chunk_header.crc32c = Crc32c(chunk_data);
   file->Write(&chunk_header, sizeof(chunk_header));
   file->Write(&chunk_data.at(0), chunk_data.size());
 
@@ -445,6 +489,11 @@ TEST_F(BackupVolumeTest, CreateAddChunkAndCloseWithFileSet) {
   file->Write(&descriptor1_label2, sizeof(descriptor1_label2));
   file->Write(&label_name2.at(0), label_name2.size());
 
+  // Descriptor 1 ends where descriptor 2 starts.
+  uint32_t desc1_crc = FileCrc(file, desc1_offset);
+  uint64_t desc2_offset = 0;
+  EXPECT_TRUE(file->size(&desc2_offset).ok());
+
   // Create the descriptor 2.
   string description = "backup";
   BackupDescriptor2 descriptor2;
@@ -485,6 +534,8 @@ TEST_F(BackupVolumeTest, CreateAddChunkAndCloseWithFileSet) {
   header.backup_descriptor_2_present = true;
   header.cancelled = false;
   header.volume_number = 0;
+  header.descriptor_1_crc32c = desc1_crc;
+  header.descriptor_2_crc32c = FileCrc(file, desc2_offset);
   file->Write(&header, sizeof(BackupDescriptorHeader));
 
   // Reset for the test.
@@ -497,15 +548,15 @@ TEST_F(BackupVolumeTest, CreateAddChunkAndCloseWithFileSet) {
   EXPECT_FALSE(volume.Init().ok());
   EXPECT_TRUE(volume.Create(options).ok());
 
-  BackupFile* entry_metadata = new BackupFile;
-  entry_metadata->file_size = chunk_data.size();
-  entry_metadata->file_type = BackupFile::kFileTypeRegularFile;
+  BackupFile entry_metadata;
+  entry_metadata.file_size = chunk_data.size();
+  entry_metadata.file_type = BackupFile::kFileTypeRegularFile;
 
-  FileEntry* file_entry = new FileEntry(kTestGenericFilename, entry_metadata);
-  file_entry->AddChunk(file_chunk);
   FileSet file_set;
+  FileEntry* file_entry =
+      file_set.AddFile(kTestGenericFilename, entry_metadata);
+  file_entry->AddChunk(file_chunk);
 
-  file_set.AddFile(file_entry);
   file_set.set_description(description);
   file_set.set_backup_type(kBackupTypeFull);
   file_set.set_previous_backup_volume(0);
@@ -515,7 +566,7 @@ TEST_F(BackupVolumeTest, CreateAddChunkAndCloseWithFileSet) {
   file_set.set_label_name(label_name2);
   file_set.set_date(descriptor2.backup_date);
 
-  LOG(INFO) << entry_metadata->filename_size;
+  LOG(INFO) << entry_metadata.filename_size;
   uint64_t volume_offset = 0;
   EXPECT_TRUE(volume.WriteChunk(chunk_header.md5sum, chunk_data,
                                 chunk_header.encoded_size,
@@ -577,6 +628,11 @@ TEST_F(BackupVolumeTest, CreateAddChunkAndCloseWithFileSetSymlink) {
   file->Write(&descriptor1_label2, sizeof(descriptor1_label2));
   file->Write(&label_name2.at(0), label_name2.size());
 
+  // Descriptor 1 ends where descriptor 2 starts.
+  uint32_t desc1_crc = FileCrc(file, desc1_offset);
+  uint64_t desc2_offset = 0;
+  EXPECT_TRUE(file->size(&desc2_offset).ok());
+
   // Create the descriptor 2.
   string description = "backup";
   BackupDescriptor2 descriptor2;
@@ -612,6 +668,8 @@ TEST_F(BackupVolumeTest, CreateAddChunkAndCloseWithFileSetSymlink) {
   header.backup_descriptor_2_present = true;
   header.cancelled = false;
   header.volume_number = 0;
+  header.descriptor_1_crc32c = desc1_crc;
+  header.descriptor_2_crc32c = FileCrc(file, desc2_offset);
   file->Write(&header, sizeof(BackupDescriptorHeader));
 
   // Reset for the test.
@@ -624,15 +682,15 @@ TEST_F(BackupVolumeTest, CreateAddChunkAndCloseWithFileSetSymlink) {
   EXPECT_FALSE(volume.Init().ok());
   EXPECT_TRUE(volume.Create(options).ok());
 
-  BackupFile* entry_metadata = new BackupFile;
-  entry_metadata->file_size = 0;
-  entry_metadata->file_type = BackupFile::kFileTypeSymlink;
+  BackupFile entry_metadata;
+  entry_metadata.file_size = 0;
+  entry_metadata.file_type = BackupFile::kFileTypeSymlink;
 
-  FileEntry* file_entry = new FileEntry(kTestGenericFilename, entry_metadata);
-  file_entry->set_symlink_target(symlink);
   FileSet file_set;
+  FileEntry* file_entry =
+      file_set.AddFile(kTestGenericFilename, entry_metadata);
+  file_entry->set_symlink_target(symlink);
 
-  file_set.AddFile(file_entry);
   file_set.set_description(description);
   file_set.set_backup_type(kBackupTypeFull);
   file_set.set_previous_backup_volume(0);
@@ -671,6 +729,7 @@ TEST_F(BackupVolumeTest, CreateAddChunkAndCloseWithFileSetRenameLabel1) {
   chunk_header.encoding_type = kEncodingTypeRaw;
   chunk_header.md5sum.hi = 123;
   chunk_header.md5sum.lo = 456;
+  chunk_header.crc32c = Crc32c(chunk_data);
   file->Write(&chunk_header, sizeof(chunk_header));
   file->Write(&chunk_data.at(0), chunk_data.size());
 
@@ -702,6 +761,11 @@ TEST_F(BackupVolumeTest, CreateAddChunkAndCloseWithFileSetRenameLabel1) {
   file->Write(&descriptor1_label1, sizeof(descriptor1_label1));
   file->Write(&label_name1.at(0), label_name1.size());
 
+  // Descriptor 1 ends where descriptor 2 starts.
+  uint32_t desc1_crc = FileCrc(file, desc1_offset);
+  uint64_t desc2_offset = 0;
+  EXPECT_TRUE(file->size(&desc2_offset).ok());
+
   // Create the descriptor 2.
   string description = "backup";
   BackupDescriptor2 descriptor2;
@@ -742,6 +806,8 @@ TEST_F(BackupVolumeTest, CreateAddChunkAndCloseWithFileSetRenameLabel1) {
   header.backup_descriptor_2_present = true;
   header.cancelled = false;
   header.volume_number = 0;
+  header.descriptor_1_crc32c = desc1_crc;
+  header.descriptor_2_crc32c = FileCrc(file, desc2_offset);
   file->Write(&header, sizeof(BackupDescriptorHeader));
 
   // Reset for the test.
@@ -754,15 +820,15 @@ TEST_F(BackupVolumeTest, CreateAddChunkAndCloseWithFileSetRenameLabel1) {
   EXPECT_FALSE(volume.Init().ok());
   EXPECT_TRUE(volume.Create(options).ok());
 
-  BackupFile* entry_metadata = new BackupFile;
-  entry_metadata->file_size = chunk_data.size();
-  entry_metadata->file_type = BackupFile::kFileTypeRegularFile;
+  BackupFile entry_metadata;
+  entry_metadata.file_size = chunk_data.size();
+  entry_metadata.file_type = BackupFile::kFileTypeRegularFile;
 
-  FileEntry* file_entry = new FileEntry(kTestGenericFilename, entry_metadata);
-  file_entry->AddChunk(file_chunk);
   FileSet file_set;
+  FileEntry* file_entry =
+      file_set.AddFile(kTestGenericFilename, entry_metadata);
+  file_entry->AddChunk(file_chunk);
 
-  file_set.AddFile(file_entry);
   file_set.set_description(description);
   file_set.set_backup_type(kBackupTypeFull);
   file_set.set_previous_backup_volume(0);
@@ -772,7 +838,7 @@ TEST_F(BackupVolumeTest, CreateAddChunkAndCloseWithFileSetRenameLabel1) {
   file_set.set_label_name(label_name1);
   file_set.set_date(descriptor2.backup_date);
 
-  LOG(INFO) << entry_metadata->filename_size;
+  LOG(INFO) << entry_metadata.filename_size;
   uint64_t volume_offset = 0;
   EXPECT_TRUE(volume.WriteChunk(chunk_header.md5sum, chunk_data,
                                 chunk_header.encoded_size,
@@ -808,6 +874,7 @@ TEST_F(BackupVolumeTest, CreateAddChunkAndCloseWithFileSetAndLabels) {
   chunk_header.encoding_type = kEncodingTypeRaw;
   chunk_header.md5sum.hi = 123;
   chunk_header.md5sum.lo = 456;
+  chunk_header.crc32c = Crc32c(chunk_data);
   file->Write(&chunk_header, sizeof(chunk_header));
   file->Write(&chunk_data.at(0), chunk_data.size());
 
@@ -853,6 +920,11 @@ TEST_F(BackupVolumeTest, CreateAddChunkAndCloseWithFileSetAndLabels) {
   file->Write(&descriptor1_label2, sizeof(descriptor1_label2));
   file->Write(&label_name2.at(0), label_name2.size());
 
+  // Descriptor 1 ends where descriptor 2 starts.
+  uint32_t desc1_crc = FileCrc(file, desc1_offset);
+  uint64_t desc2_offset = 0;
+  EXPECT_TRUE(file->size(&desc2_offset).ok());
+
   // Create the descriptor 2.
   string description = "backup";
   BackupDescriptor2 descriptor2;
@@ -893,6 +965,8 @@ TEST_F(BackupVolumeTest, CreateAddChunkAndCloseWithFileSetAndLabels) {
   header.backup_descriptor_2_present = true;
   header.cancelled = false;
   header.volume_number = 0;
+  header.descriptor_1_crc32c = desc1_crc;
+  header.descriptor_2_crc32c = FileCrc(file, desc2_offset);
   file->Write(&header, sizeof(BackupDescriptorHeader));
 
   // Reset for the test.
@@ -905,15 +979,15 @@ TEST_F(BackupVolumeTest, CreateAddChunkAndCloseWithFileSetAndLabels) {
   EXPECT_FALSE(volume.Init().ok());
   EXPECT_TRUE(volume.Create(options).ok());
 
-  BackupFile* entry_metadata = new BackupFile;
-  entry_metadata->file_size = chunk_data.size();
-  entry_metadata->file_type = BackupFile::kFileTypeRegularFile;
+  BackupFile entry_metadata;
+  entry_metadata.file_size = chunk_data.size();
+  entry_metadata.file_type = BackupFile::kFileTypeRegularFile;
 
-  FileEntry* file_entry = new FileEntry(kTestGenericFilename, entry_metadata);
-  file_entry->AddChunk(file_chunk);
   FileSet file_set;
+  FileEntry* file_entry =
+      file_set.AddFile(kTestGenericFilename, entry_metadata);
+  file_entry->AddChunk(file_chunk);
 
-  file_set.AddFile(file_entry);
   file_set.set_description(description);
   file_set.set_backup_type(kBackupTypeFull);
   file_set.set_previous_backup_volume(0);
@@ -923,7 +997,7 @@ TEST_F(BackupVolumeTest, CreateAddChunkAndCloseWithFileSetAndLabels) {
   file_set.set_label_name("Ishcabibble");
   file_set.set_date(descriptor2.backup_date);
 
-  LOG(INFO) << entry_metadata->filename_size;
+  LOG(INFO) << entry_metadata.filename_size;
   uint64_t volume_offset = 0;
   EXPECT_TRUE(volume.WriteChunk(chunk_header.md5sum, chunk_data,
                                 chunk_header.encoded_size,
@@ -969,6 +1043,7 @@ TEST_F(BackupVolumeTest, ReadChunks) {
   chunk_header.encoding_type = kEncodingTypeRaw;
   chunk_header.md5sum.hi = 123;
   chunk_header.md5sum.lo = 456;
+  chunk_header.crc32c = Crc32c(chunk_data);
   file->Write(&chunk_header, sizeof(chunk_header));
   file->Write(&chunk_data.at(0), chunk_data.size());
 
@@ -983,6 +1058,7 @@ TEST_F(BackupVolumeTest, ReadChunks) {
   chunk_header2.encoding_type = kEncodingTypeZlib;
   chunk_header2.md5sum.hi = 456;
   chunk_header2.md5sum.lo = 789;
+  chunk_header2.crc32c = Crc32c(encoded_data2);
   file->Write(&chunk_header2, sizeof(chunk_header2));
   file->Write(&encoded_data2.at(0), encoded_data2.size());
 
@@ -1019,6 +1095,7 @@ TEST_F(BackupVolumeTest, ReadChunks) {
   header.backup_descriptor_2_present = false;
   header.cancelled = false;
   header.volume_number = 0;
+  header.descriptor_1_crc32c = FileCrc(file, desc1_offset);
   file->Write(&header, sizeof(BackupDescriptorHeader));
 
   // Reset for the test.
@@ -1066,6 +1143,268 @@ TEST_F(BackupVolumeTest, ReadChunks) {
   EXPECT_EQ(label_name, label_iter->second.name());
 }
 
+TEST_F(BackupVolumeTest, ReadChunksCoalesced) {
+  // This test reads a batch of chunks, some next to each other and some far
+  // apart, in an order different from the volume's.
+  FakeFile* file = new FakeFile;
+  file->Write(kGoodVersion, 8);
+
+  vector<string> stored_data;
+  vector<FileChunk> lookup_chunks;
+  vector<BackupDescriptor1Chunk> descriptor1_chunks;
+  for (uint64_t index = 0; index < 4; ++index) {
+    // The third chunk is big enough to put a gap between the others.
+    string data(index == 2 ? 512 * 1024 : 100, 'a' + index);
+    string encoded = index == 1 ? "ABC123" : data;
+
+    BackupDescriptor1Chunk descriptor1_chunk;
+    descriptor1_chunk.md5sum.hi = index;
+    descriptor1_chunk.md5sum.lo = 123;
+    EXPECT_TRUE(file->size(&descriptor1_chunk.offset).ok());
+    descriptor1_chunks.push_back(descriptor1_chunk);
+
+    ChunkHeader chunk_header;
+    chunk_header.encoded_size = encoded.size();
+    chunk_header.unencoded_size = data.size();
+    chunk_header.encoding_type =
+        index == 1 ? kEncodingTypeZlib : kEncodingTypeRaw;
+    chunk_header.md5sum = descriptor1_chunk.md5sum;
+    chunk_header.crc32c = Crc32c(encoded);
+    file->Write(&chunk_header, sizeof(chunk_header));
+    file->Write(&encoded.at(0), encoded.size());
+
+    FileChunk lookup_chunk;
+    lookup_chunk.md5sum = descriptor1_chunk.md5sum;
+    lookup_chunk.unencoded_size = data.size();
+    stored_data.push_back(encoded);
+    lookup_chunks.push_back(lookup_chunk);
+  }
+
+  uint64_t desc1_offset = 0;
+  EXPECT_TRUE(file->size(&desc1_offset).ok());
+  BackupDescriptor1 descriptor1;
+  descriptor1.total_chunks = descriptor1_chunks.size();
+  descriptor1.total_labels = 0;
+  file->Write(&descriptor1, sizeof(descriptor1));
+  for (const BackupDescriptor1Chunk& descriptor1_chunk : descriptor1_chunks) {
+    file->Write(&descriptor1_chunk, sizeof(descriptor1_chunk));
+  }
+
+  BackupDescriptorHeader header;
+  header.backup_descriptor_1_offset = desc1_offset;
+  header.backup_descriptor_2_present = false;
+  header.cancelled = false;
+  header.volume_number = 0;
+  header.descriptor_1_crc32c = FileCrc(file, desc1_offset);
+  file->Write(&header, sizeof(BackupDescriptorHeader));
+
+  BackupVolume volume(file);
+  EXPECT_TRUE(volume.Init().ok());
+
+  vector<FileChunk> batch;
+  batch.push_back(lookup_chunks[3]);
+  batch.push_back(lookup_chunks[0]);
+  batch.push_back(lookup_chunks[1]);
+  vector<string> read_data;
+  vector<EncodingType> encoding_types;
+  EXPECT_TRUE(volume.ReadChunks(batch, &read_data, &encoding_types).ok());
+  ASSERT_EQ(3, read_data.size());
+  ASSERT_EQ(3, encoding_types.size());
+  EXPECT_EQ(stored_data[3], read_data[0]);
+  EXPECT_EQ(stored_data[0], read_data[1]);
+  EXPECT_EQ(stored_data[1], read_data[2]);
+  EXPECT_EQ(kEncodingTypeRaw, encoding_types[0]);
+  EXPECT_EQ(kEncodingTypeRaw, encoding_types[1]);
+  EXPECT_EQ(kEncodingTypeZlib, encoding_types[2]);
+
+  // Locating the batch finds each chunk's data without reading it.
+  vector<ChunkHeader> headers;
+  vector<uint64_t> data_offsets;
+  EXPECT_TRUE(volume.LocateChunksData(batch, &headers, &data_offsets).ok());
+  ASSERT_EQ(3, headers.size());
+  ASSERT_EQ(3, data_offsets.size());
+  EXPECT_EQ(descriptor1_chunks[3].offset + sizeof(ChunkHeader),
+            data_offsets[0]);
+  EXPECT_EQ(descriptor1_chunks[0].offset + sizeof(ChunkHeader),
+            data_offsets[1]);
+  EXPECT_EQ(descriptor1_chunks[1].offset + sizeof(ChunkHeader),
+            data_offsets[2]);
+  EXPECT_EQ(kEncodingTypeRaw, headers[0].encoding_type);
+  EXPECT_EQ(kEncodingTypeZlib, headers[2].encoding_type);
+  EXPECT_EQ(stored_data[1].size(), headers[2].encoded_size);
+
+  // A chunk whose header doesn't match fails the batch.
+  batch[1].unencoded_size = 99;
+  EXPECT_EQ(kStatusCorruptBackup,
+            volume.ReadChunks(batch, &read_data, &encoding_types).code());
+  EXPECT_EQ(kStatusCorruptBackup,
+            volume.LocateChunksData(batch, &headers, &data_offsets).code());
+}
+
+TEST_F(BackupVolumeTest, ReadStoredChunks) {
+  // This test reads a volume's chunks in the order they're stored, in batches,
+  // with one chunk's header not matching its descriptor 1 entry.
+  FakeFile* file = new FakeFile;
+  file->Write(kGoodVersion, 8);
+
+  vector<BackupDescriptor1Chunk> descriptor1_chunks;
+  for (uint64_t index = 0; index < 4; ++index) {
+    string data(100 * (index + 1), 'a' + index);
+
+    BackupDescriptor1Chunk descriptor1_chunk;
+    descriptor1_chunk.md5sum.hi = 4 - index;
+    descriptor1_chunk.md5sum.lo = 123;
+    EXPECT_TRUE(file->size(&descriptor1_chunk.offset).ok());
+    descriptor1_chunks.push_back(descriptor1_chunk);
+
+    ChunkHeader chunk_header;
+    chunk_header.encoded_size = data.size();
+    chunk_header.unencoded_size = data.size();
+    chunk_header.encoding_type = kEncodingTypeRaw;
+    chunk_header.md5sum = descriptor1_chunk.md5sum;
+    if (index == 2) {
+      chunk_header.md5sum.lo = 999;
+    }
+    chunk_header.crc32c = Crc32c(data);
+    file->Write(&chunk_header, sizeof(chunk_header));
+    file->Write(&data.at(0), data.size());
+  }
+
+  uint64_t desc1_offset = 0;
+  EXPECT_TRUE(file->size(&desc1_offset).ok());
+  BackupDescriptor1 descriptor1;
+  descriptor1.total_chunks = descriptor1_chunks.size();
+  descriptor1.total_labels = 0;
+  file->Write(&descriptor1, sizeof(descriptor1));
+  for (const BackupDescriptor1Chunk& descriptor1_chunk : descriptor1_chunks) {
+    file->Write(&descriptor1_chunk, sizeof(descriptor1_chunk));
+  }
+
+  BackupDescriptorHeader header;
+  header.backup_descriptor_1_offset = desc1_offset;
+  header.backup_descriptor_2_present = false;
+  header.cancelled = false;
+  header.volume_number = 0;
+  header.descriptor_1_crc32c = FileCrc(file, desc1_offset);
+  file->Write(&header, sizeof(BackupDescriptorHeader));
+
+  BackupVolume volume(file);
+  EXPECT_TRUE(volume.Init().ok());
+
+  // The first batch stops short of max_bytes, and the rest come in the next.
+  vector<StoredChunk> stored;
+  EXPECT_TRUE(volume.ReadStoredChunks(0, 400, &stored).ok());
+  ASSERT_EQ(2, stored.size());
+  EXPECT_EQ(descriptor1_chunks[0].offset, stored[0].descriptor.offset);
+  EXPECT_TRUE(stored[0].status.ok());
+  EXPECT_EQ(string(100, 'a'), stored[0].data);
+  EXPECT_EQ(descriptor1_chunks[1].offset, stored[1].descriptor.offset);
+  EXPECT_TRUE(stored[1].status.ok());
+  EXPECT_EQ(string(200, 'b'), stored[1].data);
+
+  EXPECT_TRUE(volume.ReadStoredChunks(2, 1048576, &stored).ok());
+  ASSERT_EQ(2, stored.size());
+  EXPECT_EQ(kStatusCorruptBackup, stored[0].status.code());
+  EXPECT_TRUE(stored[1].status.ok());
+  EXPECT_EQ(string(400, 'd'), stored[1].data);
+
+  // Every chunk is read at least once, however small max_bytes is.
+  EXPECT_TRUE(volume.ReadStoredChunks(3, 1, &stored).ok());
+  EXPECT_EQ(1, stored.size());
+  EXPECT_TRUE(volume.ReadStoredChunks(4, 1048576, &stored).ok());
+  EXPECT_TRUE(stored.empty());
+}
+
+TEST_F(BackupVolumeTest, ChunkCrcMismatch) {
+  // This test verifies that a chunk whose data doesn't match the CRC in its
+  // header is rejected however it's read.
+  FakeFile* file = new FakeFile;
+  file->Write(kGoodVersion, 8);
+
+  uint64_t chunk_offset = 0;
+  EXPECT_TRUE(file->size(&chunk_offset).ok());
+  string chunk_data = "1234567890123456";
+  ChunkHeader chunk_header;
+  chunk_header.encoded_size = chunk_data.size();
+  chunk_header.unencoded_size = chunk_data.size();
+  chunk_header.encoding_type = kEncodingTypeRaw;
+  chunk_header.md5sum.hi = 123;
+  chunk_header.md5sum.lo = 456;
+  chunk_header.crc32c = Crc32c("1234567890123457");
+  file->Write(&chunk_header, sizeof(chunk_header));
+  file->Write(&chunk_data.at(0), chunk_data.size());
+
+  uint64_t desc1_offset = 0;
+  EXPECT_TRUE(file->size(&desc1_offset).ok());
+  BackupDescriptor1 descriptor1;
+  descriptor1.total_chunks = 1;
+  descriptor1.total_labels = 0;
+  file->Write(&descriptor1, sizeof(descriptor1));
+  BackupDescriptor1Chunk descriptor1_chunk;
+  descriptor1_chunk.md5sum = chunk_header.md5sum;
+  descriptor1_chunk.offset = chunk_offset;
+  file->Write(&descriptor1_chunk, sizeof(descriptor1_chunk));
+
+  BackupDescriptorHeader header;
+  header.backup_descriptor_1_offset = desc1_offset;
+  header.backup_descriptor_2_present = false;
+  header.cancelled = false;
+  header.volume_number = 0;
+  header.descriptor_1_crc32c = FileCrc(file, desc1_offset);
+  file->Write(&header, sizeof(BackupDescriptorHeader));
+
+  BackupVolume volume(file);
+  EXPECT_TRUE(volume.Init().ok());
+  EXPECT_TRUE(volume.has_chunk_crcs());
+
+  FileChunk lookup_chunk;
+  lookup_chunk.md5sum = chunk_header.md5sum;
+  lookup_chunk.unencoded_size = chunk_data.size();
+  string read_data;
+  EncodingType encoding_type;
+  EXPECT_EQ(kStatusCorruptBackup,
+            volume.ReadChunk(lookup_chunk, &read_data, &encoding_type).code());
+
+  vector<string> read_datas;
+  vector<EncodingType> encoding_types;
+  EXPECT_EQ(kStatusCorruptBackup,
+            volume.ReadChunks(vector<FileChunk>(1, lookup_chunk), &read_datas,
+                              &encoding_types).code());
+
+  vector<StoredChunk> stored;
+  EXPECT_TRUE(volume.ReadStoredChunks(0, 1048576, &stored).ok());
+  ASSERT_EQ(1, stored.size());
+  EXPECT_EQ("Chunk CRC mismatch", stored[0].status.description());
+}
+
+TEST_F(BackupVolumeTest, DescriptorCrcMismatch) {
+  // This test verifies that a volume whose descriptor 1 doesn't match the CRC
+  // in its header fails to load.  Descriptor 1 is only read when first needed,
+  // so the volume still opens.
+  FakeFile* file = new FakeFile;
+  file->Write(kGoodVersion, 8);
+
+  uint64_t desc1_offset = 0;
+  EXPECT_TRUE(file->size(&desc1_offset).ok());
+  BackupDescriptor1 descriptor1;
+  descriptor1.total_chunks = 0;
+  descriptor1.total_labels = 0;
+  file->Write(&descriptor1, sizeof(descriptor1));
+
+  BackupDescriptorHeader header;
+  header.backup_descriptor_1_offset = desc1_offset;
+  header.backup_descriptor_2_present = false;
+  header.cancelled = false;
+  header.volume_number = 0;
+  header.descriptor_1_crc32c = FileCrc(file, desc1_offset) ^ 1;
+  file->Write(&header, sizeof(BackupDescriptorHeader));
+
+  BackupVolume volume(file);
+  Status retval = volume.Init();
+  EXPECT_TRUE(retval.ok()) << retval.ToString();
+  EXPECT_EQ(kStatusCorruptBackup, volume.LoadDescriptor1().code());
+}
+
 TEST_F(BackupVolumeTest, ReadBackupSets) {
   // This test attempts to read several backup sets from the file.
   FakeFile* file = new FakeFile;
@@ -1088,6 +1427,7 @@ TEST_F(BackupVolumeTest, ReadBackupSets) {
   chunk_header.encoding_type = kEncodingTypeRaw;
   chunk_header.md5sum.hi = 123;
   chunk_header.md5sum.lo = 456;
+  chunk_header.crc32c = Crc32c(chunk_data);
   file->Write(&chunk_header, sizeof(chunk_header));
   file->Write(&chunk_data.at(0), chunk_data.size());
 
@@ -1112,6 +1452,11 @@ TEST_F(BackupVolumeTest, ReadBackupSets) {
   file->Write(&descriptor1_label, sizeof(descriptor1_label));
   file->Write(&label1_name.at(0), label1_name.size());
 
+  // Descriptor 1 ends where descriptor 2 starts.
+  uint32_t desc1_crc = FileCrc(file, desc1_offset);
+  uint64_t desc2_offset = 0;
+  EXPECT_TRUE(file->size(&desc2_offset).ok());
+
   // Create the descriptor 2.
   string description = "backup";
   BackupDescriptor2 descriptor2;
@@ -1149,6 +1494,8 @@ TEST_F(BackupVolumeTest, ReadBackupSets) {
   header.backup_descriptor_2_present = true;
   header.cancelled = false;
   header.volume_number = 0;
+  header.descriptor_1_crc32c = desc1_crc;
+  header.descriptor_2_crc32c = FileCrc(file, desc2_offset);
   file->Write(&header, sizeof(BackupDescriptorHeader));
 
   // Reset for the test.
@@ -1178,6 +1525,151 @@ TEST_F(BackupVolumeTest, ReadBackupSets) {
   delete file_set;
 }
 
+TEST_F(BackupVolumeTest, ReadBackupSetsVersion0) {
+  // This test verifies that backup sets written by version 0 of the volume
+  // format, which had a shorter BackupFile, can still be read.
+  FakeFile* file = new FakeFile;
+
+  // Build up our fake file.
+  string label1_name = "foo bar blah";
+  string label2_name = "another label";
+  uint64_t label1_id = 0x123;
+
+  // Version string.
+  file->Write("BKP_0000", 8);
+
+  // Create a ChunkHeader and chunk.  This one is not compressed.
+  uint64_t chunk1_offset = 0;
+  EXPECT_TRUE(file->size(&chunk1_offset).ok());
+  string chunk_data = "1234567890123456";
+  ChunkHeader chunk_header;
+  chunk_header.encoded_size = chunk_data.size();
+  chunk_header.unencoded_size = chunk_data.size();
+  chunk_header.encoding_type = kEncodingTypeRaw;
+  chunk_header.md5sum.hi = 123;
+  chunk_header.md5sum.lo = 456;
+  file->Write(&chunk_header, kChunkHeaderV1Size);
+  file->Write(&chunk_data.at(0), chunk_data.size());
+
+  // A zero chunk, which volumes this old can't hold.
+  uint64_t chunk2_offset = 0;
+  EXPECT_TRUE(file->size(&chunk2_offset).ok());
+  ChunkHeader zero_header;
+  zero_header.encoded_size = 0;
+  zero_header.unencoded_size = 16;
+  zero_header.encoding_type = kEncodingTypeZero;
+  zero_header.md5sum.hi = 789;
+  zero_header.md5sum.lo = 12;
+  file->Write(&zero_header, kChunkHeaderV1Size);
+
+  // Create backup descriptor 1.
+  uint64_t desc1_offset = 0;
+  EXPECT_TRUE(file->size(&desc1_offset).ok());
+  BackupDescriptor1 descriptor1;
+  descriptor1.total_chunks = 2;
+  descriptor1.total_labels = 1;
+  file->Write(&descriptor1, sizeof(descriptor1));
+
+  // Create the descriptor 1 chunks.
+  BackupDescriptor1Chunk descriptor1_chunk;
+  descriptor1_chunk.md5sum = chunk_header.md5sum;
+  descriptor1_chunk.offset = chunk1_offset;
+  file->Write(&descriptor1_chunk, sizeof(descriptor1_chunk));
+  descriptor1_chunk.md5sum = zero_header.md5sum;
+  descriptor1_chunk.offset = chunk2_offset;
+  file->Write(&descriptor1_chunk, sizeof(descriptor1_chunk));
+
+  // Create a descriptor 1 label.
+  BackupDescriptor1Label descriptor1_label;
+  descriptor1_label.id = label1_id;
+  descriptor1_label.name_size = label1_name.size();
+  file->Write(&descriptor1_label, sizeof(descriptor1_label));
+  file->Write(&label1_name.at(0), label1_name.size());
+
+  // Create the descriptor 2.
+  string description = "backup";
+  BackupDescriptor2 descriptor2;
+  descriptor2.previous_backup_offset = 0;
+  descriptor2.previous_backup_volume_number = 0;
+  descriptor2.backup_type = kBackupTypeFull;
+  descriptor2.num_files = 1;
+  descriptor2.label_id = label1_id;
+  descriptor2.description_size = description.size();
+  descriptor2.unencoded_size = chunk_data.size();
+  descriptor2.backup_date = 12345;
+  file->Write(&descriptor2, sizeof(descriptor2));
+  file->Write(&description.at(0), description.size());
+
+  // Create a BackupFile, and a chunk to go with it.
+  string filename = kTestGenericFilename;
+  BackupFile backup_file;
+  backup_file.file_size = chunk_data.size();
+  backup_file.num_chunks = 1;
+  backup_file.filename_size = filename.size();
+  file->Write(&backup_file, kBackupFileV0Size);
+  file->Write(&filename.at(0), filename.size());
+
+  // Create a FileChunk.
+  FileChunk file_chunk;
+  file_chunk.md5sum = chunk_header.md5sum;
+  file_chunk.volume_num = 0;
+  file_chunk.chunk_offset = 0;
+  file_chunk.unencoded_size = chunk_data.size();
+  file->Write(&file_chunk, sizeof(file_chunk));
+
+  // Create the backup header.
+  BackupDescriptorHeader header;
+  header.backup_descriptor_1_offset = desc1_offset;
+  header.backup_descriptor_2_present = true;
+  header.cancelled = false;
+  header.volume_number = 0;
+  file->Write(&header, kBackupDescriptorHeaderV1Size);
+
+  // Reset for the test.
+  BackupVolume volume(file);
+  ConfigOptions options;
+
+  EXPECT_TRUE(volume.Init().ok());
+
+  int64_t next_volume = 0;
+  StatusOr<FileSet*> test_file_set = volume.LoadFileSet(&next_volume);
+  EXPECT_TRUE(test_file_set.ok()) << test_file_set.status().ToString();
+  EXPECT_EQ(-1, next_volume);
+
+  // Check the backup.
+  FileSet* file_set = test_file_set.value();
+  ASSERT_THAT(file_set, NotNull());
+  EXPECT_EQ("backup", file_set->description());
+  EXPECT_EQ(1, file_set->num_files());
+  EXPECT_EQ(kTestProperFilename,
+            (*(file_set->GetFiles().begin()))->proper_filename());
+  EXPECT_EQ(label1_id, file_set->label_id());
+  EXPECT_EQ(label1_name, file_set->label_name());
+  EXPECT_EQ(12345, file_set->date());
+  EXPECT_EQ(kBackupTypeFull, file_set->backup_type());
+
+  const BackupFile* metadata =
+      (*(file_set->GetFiles().begin()))->GetBackupFile();
+  EXPECT_EQ(chunk_data.size(), metadata->file_size);
+  EXPECT_EQ(1, metadata->num_chunks);
+  EXPECT_EQ(0, metadata->inode);
+  EXPECT_EQ(0, metadata->change_date);
+
+  // The chunk reads back, but the zero chunk is rejected.
+  string read_data;
+  EncodingType encoding_type;
+  EXPECT_TRUE(volume.ReadChunk(file_chunk, &read_data, &encoding_type).ok());
+  EXPECT_EQ(chunk_data, read_data);
+  FileChunk zero_chunk;
+  zero_chunk.md5sum = zero_header.md5sum;
+  zero_chunk.unencoded_size = 16;
+  EXPECT_EQ(kStatusCorruptBackup,
+            volume.ReadChunk(zero_chunk, &read_data, &encoding_type).code());
+
+  // Clean up.
+  delete file_set;
+}
+
 TEST_F(BackupVolumeTest, ReadBackupSetsMultiFile) {
   // This test attempts to read several backup sets from the file, and requests
   // a second backup set.
@@ -1199,6 +1691,7 @@ TEST_F(BackupVolumeTest, ReadBackupSetsMultiFile) {
     chunk_header.encoding_type = kEncodingTypeRaw;
     chunk_header.md5sum.hi = 123;
     chunk_header.md5sum.lo = 456;
+    chunk_header.crc32c = Crc32c(chunk_data);
     vol0->Write(&chunk_header, sizeof(chunk_header));
     vol0->Write(&chunk_data.at(0), chunk_data.size());
 
@@ -1224,6 +1717,11 @@ TEST_F(BackupVolumeTest, ReadBackupSetsMultiFile) {
     vol0->Write(&descriptor1_label, sizeof(descriptor1_label));
     vol0->Write(&label_name.at(0), label_name.size());
 
+    // Descriptor 1 ends where descriptor 2 starts.
+    uint32_t desc1_crc = FileCrc(vol0, desc1_offset);
+    uint64_t desc2_offset = 0;
+    EXPECT_TRUE(vol0->size(&desc2_offset).ok());
+
     // Create the descriptor 2.
     string description = "backup";
     BackupDescriptor2 descriptor2;
@@ -1263,6 +1761,8 @@ TEST_F(BackupVolumeTest, ReadBackupSetsMultiFile) {
     header.backup_descriptor_2_present = true;
     header.cancelled = false;
     header.volume_number = 3;
+    header.descriptor_1_crc32c = desc1_crc;
+    header.descriptor_2_crc32c = FileCrc(vol0, desc2_offset);
     vol0->Write(&header, sizeof(BackupDescriptorHeader));
   }
 
@@ -1290,4 +1790,77 @@ TEST_F(BackupVolumeTest, ReadBackupSetsMultiFile) {
   delete file_set;
 }
 
+TEST_F(BackupVolumeTest, AppendAndReadBackupSets) {
+  // This test appends a second backup to a volume, and reads both backups and
+  // all of the chunks back.
+  FakeFile* file = new FakeFile;
+  BackupVolume volume(file);
+  ConfigOptions options;
+  EXPECT_TRUE(volume.Create(options).ok());
+
+  LabelMap label_map;
+  Label default_label(1, "Default");
+  label_map.insert(make_pair(default_label.id(), default_label));
+
+  const string chunk_data[] = { "1234567890123456", "abcdefghij" };
+  const string filenames[] = { "/foo", "/bar" };
+  uint64_t first_backup_offset = 0;
+  for (uint64_t index = 0; index < 2; ++index) {
+    if (index > 0) {
+      // Appending is only possible once the volume ends a backup.
+      first_backup_offset = volume.last_backup_offset();
+      EXPECT_TRUE(volume.Append(options).ok());
+    }
+
+    FileChunk file_chunk;
+    file_chunk.md5sum.hi = index + 1;
+    file_chunk.md5sum.lo = 456;
+    file_chunk.unencoded_size = chunk_data[index].size();
+    EXPECT_TRUE(volume.WriteChunk(file_chunk.md5sum, chunk_data[index],
+                                  chunk_data[index].size(), kEncodingTypeRaw,
+                                  &file_chunk.volume_offset).ok());
+
+    BackupFile entry_metadata;
+    entry_metadata.file_size = chunk_data[index].size();
+    entry_metadata.file_type = BackupFile::kFileTypeRegularFile;
+    FileSet file_set;
+    FileEntry* file_entry = file_set.AddFile(filenames[index], entry_metadata);
+    file_entry->AddChunk(file_chunk);
+    file_set.set_description(filenames[index]);
+    file_set.set_backup_type(kBackupTypeFull);
+    file_set.set_previous_backup_volume(0);
+    file_set.set_previous_backup_offset(first_backup_offset);
+    file_set.set_use_default_label(true);
+    EXPECT_TRUE(volume.CloseWithFileSetAndLabels(&file_set, label_map).ok());
+  }
+  EXPECT_LT(0U, first_backup_offset);
+
+  // The last backup is found from the end of the volume, and points back at
+  // the first.
+  int64_t next_volume = -1;
+  StatusOr<FileSet*> file_set = volume.LoadFileSet(&next_volume);
+  ASSERT_TRUE(file_set.ok()) << file_set.status().ToString();
+  EXPECT_EQ(0, next_volume);
+  EXPECT_EQ("/bar", file_set.value()->description());
+  EXPECT_EQ(first_backup_offset, file_set.value()->previous_backup_offset());
+  delete file_set.value();
+
+  file_set = volume.LoadFileSetAtOffset(first_backup_offset, &next_volume);
+  ASSERT_TRUE(file_set.ok()) << file_set.status().ToString();
+  EXPECT_EQ(-1, next_volume);
+  EXPECT_EQ("/foo", file_set.value()->description());
+  EXPECT_EQ("Default", file_set.value()->label_name());
+  delete file_set.value();
+
+  // The first backup's descriptors between the chunks aren't mistaken for
+  // damage.
+  vector<StoredChunk> stored;
+  EXPECT_TRUE(volume.ReadStoredChunks(0, 1048576, &stored).ok());
+  ASSERT_EQ(2, stored.size());
+  for (uint64_t index = 0; index < 2; ++index) {
+    EXPECT_TRUE(stored[index].status.ok()) << stored[index].status.ToString();
+    EXPECT_EQ(chunk_data[index], stored[index].data);
+  }
+}
+
 }  // namespace backup2
@@ -0,0 +1,167 @@
+// Copyright (C) 2013, All Rights Reserved.
+// Author: Cory Maccarrone <darkstar6262@gmail.com>
+
+#include "src/chunk_cache.h"
+
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+
+#include "glog/logging.h"
+
+using std::lock_guard;
+using std::mutex;
+using std::shared_ptr;
+using std::string;
+
+namespace backup2 {
+
+ChunkCache::ChunkCache(uint64_t max_bytes)
+    : max_bytes_(0),
+      max_in_bytes_(0),
+      max_out_bytes_(0),
+      in_bytes_(0),
+      out_bytes_(0),
+      main_bytes_(0),
+      hits_(0),
+      misses_(0),
+      evictions_(0) {
+  Reset(max_bytes);
+}
+
+ChunkCache::~ChunkCache() {
+}
+
+shared_ptr<const string> ChunkCache::Find(const Uint128& md5sum) {
+  lock_guard<mutex> lock(mutex_);
+  auto location_iter = locations_.find(md5sum);
+  if (location_iter == locations_.end() ||
+      location_iter->second.queue == kQueueOut) {
+    ++misses_;
+    return shared_ptr<const string>();
+  }
+
+  ++hits_;
+  Location& location = location_iter->second;
+  if (location.queue == kQueueMain) {
+    // Move the chunk to the front of the LRU queue.  Chunks in kQueueIn stay
+    // put, so a burst of requests for a new chunk doesn't promote it.
+    main_.splice(main_.begin(), main_, location.entry);
+  }
+  return location.entry->data;
+}
+
+void ChunkCache::Insert(const Uint128& md5sum,
+                        shared_ptr<const string> data) {
+  lock_guard<mutex> lock(mutex_);
+  uint64_t size = data->size();
+  if (max_bytes_ == 0 || size > max_in_bytes_) {
+    return;
+  }
+
+  auto location_iter = locations_.find(md5sum);
+  Queue queue = kQueueIn;
+  if (location_iter != locations_.end()) {
+    if (location_iter->second.queue != kQueueOut) {
+      // Already cached.
+      return;
+    }
+
+    // Requested again after being dropped from kQueueIn, so this chunk is
+    // used repeatedly.
+    out_bytes_ -= location_iter->second.entry->size;
+    out_.erase(location_iter->second.entry);
+    queue = kQueueMain;
+  }
+
+  Entry entry;
+  entry.md5sum = md5sum;
+  entry.size = size;
+  entry.data = data;
+
+  Location location;
+  location.queue = queue;
+  if (queue == kQueueMain) {
+    main_.push_front(entry);
+    main_bytes_ += size;
+    location.entry = main_.begin();
+  } else {
+    in_.push_front(entry);
+    in_bytes_ += size;
+    location.entry = in_.begin();
+  }
+  locations_[md5sum] = location;
+
+  EvictLocked();
+}
+
+void ChunkCache::Reset(uint64_t max_bytes) {
+  lock_guard<mutex> lock(mutex_);
+  in_.clear();
+  out_.clear();
+  main_.clear();
+  locations_.clear();
+  in_bytes_ = 0;
+  out_bytes_ = 0;
+  main_bytes_ = 0;
+
+  // The usual 2Q tuning: a quarter of the cache for new chunks, and the keys
+  // of chunks worth half the cache remembered.
+  max_bytes_ = max_bytes;
+  max_in_bytes_ = max_bytes / 4;
+  max_out_bytes_ = max_bytes / 2;
+}
+
+uint64_t ChunkCache::hits() const {
+  lock_guard<mutex> lock(mutex_);
+  return hits_;
+}
+
+uint64_t ChunkCache::misses() const {
+  lock_guard<mutex> lock(mutex_);
+  return misses_;
+}
+
+uint64_t ChunkCache::evictions() const {
+  lock_guard<mutex> lock(mutex_);
+  return evictions_;
+}
+
+uint64_t ChunkCache::size() const {
+  lock_guard<mutex> lock(mutex_);
+  return in_bytes_ + main_bytes_;
+}
+
+void ChunkCache::EvictLocked() {
+  while (in_bytes_ + main_bytes_ > max_bytes_) {
+    if (in_bytes_ > max_in_bytes_ || main_.empty()) {
+      // Drop the oldest new chunk, but remember its key.
+      Entry& entry = in_.back();
+      in_bytes_ -= entry.size;
+      entry.data.reset();
+      out_.splice(out_.begin(), in_, --in_.end());
+      out_bytes_ += entry.size;
+      locations_[entry.md5sum].queue = kQueueOut;
+    } else {
+      // Drop the least recently used chunk.
+      Entry& entry = main_.back();
+      main_bytes_ -= entry.size;
+      locations_.erase(entry.md5sum);
+      main_.pop_back();
+    }
+    ++evictions_;
+  }
+  TrimOutLocked();
+}
+
+void ChunkCache::TrimOutLocked() {
+  while (out_bytes_ > max_out_bytes_) {
+    Entry& entry = out_.back();
+    out_bytes_ -= entry.size;
+    locations_.erase(entry.md5sum);
+    out_.pop_back();
+  }
+}
+
+}  // namespace backup2
@@ -0,0 +1,113 @@
+// Copyright (C) 2013, All Rights Reserved.
+// Author: Cory Maccarrone <darkstar6262@gmail.com>
+#ifndef BACKUP2_SRC_CHUNK_CACHE_H_
+#define BACKUP2_SRC_CHUNK_CACHE_H_
+
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+#include "src/common.h"
+
+namespace backup2 {
+
+// A ChunkCache holds decoded chunk data keyed by MD5, up to a budget of bytes.
+// Data is handed out as shared, immutable buffers, so a hit costs no copy, and
+// a buffer stays valid after its chunk is evicted.
+//
+// Eviction follows the 2Q algorithm.  New chunks go into a small FIFO queue,
+// and are only promoted to the main LRU queue if they are requested again
+// after falling out of it.  The keys of recently dropped chunks are kept to
+// recognize this.  This way, a stream of chunks read only once -- the common
+// case in a restore -- can't push out the chunks that are used repeatedly.
+//
+// The cache is safe to use from multiple threads.
+class ChunkCache {
+ public:
+  // Create a cache holding up to max_bytes of chunk data.  A cache of size 0
+  // holds nothing.
+  explicit ChunkCache(uint64_t max_bytes);
+  ~ChunkCache();
+
+  // Return the data of the chunk with the given MD5, or NULL if it isn't
+  // cached.
+  std::shared_ptr<const std::string> Find(const Uint128& md5sum);
+
+  // Add the data of the chunk with the given MD5 to the cache, evicting other
+  // chunks to make room as needed.  Chunks larger than the cache's share for
+  // new chunks aren't cached.
+  void Insert(const Uint128& md5sum, std::shared_ptr<const std::string> data);
+
+  // Drop all chunks, and change the budget.  The counters are kept.
+  void Reset(uint64_t max_bytes);
+
+  // Counters of lookups that found their chunk, lookups that didn't, and
+  // chunks evicted to make room for others.
+  uint64_t hits() const;
+  uint64_t misses() const;
+  uint64_t evictions() const;
+
+  // Return the number of bytes of chunk data cached.
+  uint64_t size() const;
+
+ private:
+  // Queues a key can be in.  kQueueIn and kQueueMain hold data; kQueueOut only
+  // remembers keys recently dropped from kQueueIn.
+  enum Queue {
+    kQueueIn = 0,
+    kQueueOut,
+    kQueueMain,
+  };
+
+  struct Entry {
+    Uint128 md5sum;
+    uint64_t size;
+    std::shared_ptr<const std::string> data;
+  };
+
+  typedef std::list<Entry> EntryList;
+
+  // Where an entry lives.
+  struct Location {
+    Queue queue;
+    EntryList::iterator entry;
+  };
+
+  // Evict chunks until the cache is within budget.  Must be called with the
+  // lock held.
+  void EvictLocked();
+
+  // Drop the oldest remembered keys until they're within budget.  Must be
+  // called with the lock held.
+  void TrimOutLocked();
+
+  mutable std::mutex mutex_;
+
+  // Budgets of the whole cache, of kQueueIn, and of the sizes of the chunks
+  // remembered in kQueueOut.
+  uint64_t max_bytes_;
+  uint64_t max_in_bytes_;
+  uint64_t max_out_bytes_;
+
+  // Queues, newest first, and the bytes in each.
+  EntryList in_;
+  EntryList out_;
+  EntryList main_;
+  uint64_t in_bytes_;
+  uint64_t out_bytes_;
+  uint64_t main_bytes_;
+
+  // Location of every key in the queues.
+  std::unordered_map<Uint128, Location, boost::hash<Uint128> > locations_;
+
+  uint64_t hits_;
+  uint64_t misses_;
+  uint64_t evictions_;
+
+  DISALLOW_COPY_AND_ASSIGN(ChunkCache);
+};
+
+}  // namespace backup2
+#endif  // BACKUP2_SRC_CHUNK_CACHE_H_
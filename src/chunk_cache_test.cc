@@ -0,0 +1,105 @@
+// Copyright (C) 2013, All Rights Reserved.
+// Author: Cory Maccarrone <darkstar6262@gmail.com>
+
+#include <memory>
+#include <string>
+
+#include "src/chunk_cache.h"
+#include "src/common.h"
+#include "glog/logging.h"
+#include "gtest/gtest.h"
+
+using std::shared_ptr;
+using std::string;
+
+namespace backup2 {
+
+class ChunkCacheTest : public testing::Test {
+ protected:
+  Uint128 Md5(uint64_t value) {
+    Uint128 md5sum;
+    md5sum.hi = 0;
+    md5sum.lo = value;
+    return md5sum;
+  }
+
+  shared_ptr<const string> Data(uint64_t size) {
+    return shared_ptr<const string>(new string(size, 'x'));
+  }
+};
+
+TEST_F(ChunkCacheTest, FindAndInsert) {
+  ChunkCache cache(1000);
+  EXPECT_FALSE(cache.Find(Md5(1)));
+
+  // Hits hand out the cached buffer itself.
+  shared_ptr<const string> data = Data(100);
+  cache.Insert(Md5(1), data);
+  EXPECT_EQ(data.get(), cache.Find(Md5(1)).get());
+  EXPECT_EQ(100, cache.size());
+
+  // Inserting a cached chunk again changes nothing.
+  cache.Insert(Md5(1), Data(100));
+  EXPECT_EQ(data.get(), cache.Find(Md5(1)).get());
+  EXPECT_EQ(100, cache.size());
+
+  EXPECT_EQ(2, cache.hits());
+  EXPECT_EQ(1, cache.misses());
+  EXPECT_EQ(0, cache.evictions());
+}
+
+TEST_F(ChunkCacheTest, Budget) {
+  ChunkCache cache(1000);
+  shared_ptr<const string> data = Data(100);
+  cache.Insert(Md5(1), data);
+  for (uint64_t chunk = 2; chunk <= 10; ++chunk) {
+    cache.Insert(Md5(chunk), Data(100));
+  }
+  EXPECT_EQ(1000, cache.size());
+  EXPECT_EQ(0, cache.evictions());
+
+  // Once full, the oldest chunk makes room.
+  cache.Insert(Md5(11), Data(100));
+  EXPECT_EQ(1000, cache.size());
+  EXPECT_EQ(1, cache.evictions());
+  EXPECT_FALSE(cache.Find(Md5(1)));
+  EXPECT_TRUE(cache.Find(Md5(2)));
+  EXPECT_TRUE(cache.Find(Md5(11)));
+
+  // Evicted buffers stay valid for those holding them.
+  EXPECT_EQ(string(100, 'x'), *data);
+
+  // Chunks too big for the new chunk queue aren't cached.
+  cache.Insert(Md5(12), Data(300));
+  EXPECT_FALSE(cache.Find(Md5(12)));
+
+  // Nor is anything in an empty cache.
+  cache.Reset(0);
+  cache.Insert(Md5(13), Data(0));
+  EXPECT_FALSE(cache.Find(Md5(13)));
+  EXPECT_EQ(0, cache.size());
+}
+
+TEST_F(ChunkCacheTest, ScanResistance) {
+  ChunkCache cache(1000);
+
+  // A chunk requested again after dropping out of the new chunk queue is
+  // promoted to the main queue.
+  cache.Insert(Md5(1), Data(200));
+  for (uint64_t chunk = 100; chunk < 109; ++chunk) {
+    cache.Insert(Md5(chunk), Data(100));
+  }
+  EXPECT_FALSE(cache.Find(Md5(1)));
+  cache.Insert(Md5(1), Data(200));
+
+  // A long run of chunks used only once doesn't push it out.
+  for (uint64_t chunk = 200; chunk < 300; ++chunk) {
+    cache.Insert(Md5(chunk), Data(100));
+  }
+  EXPECT_TRUE(cache.Find(Md5(1)));
+  EXPECT_FALSE(cache.Find(Md5(200)));
+  EXPECT_TRUE(cache.Find(Md5(299)));
+  EXPECT_LE(cache.size(), 1000);
+}
+
+}  // namespace backup2
@@ -35,6 +35,9 @@ class ChunkMap {
     chunks_.insert(std::make_pair(md5sum, chunk));
   }
 
+  // Remove all chunks from the map.
+  void Clear() { chunks_.clear(); }
+
   // Retreive a chunk.  The passed out_chunk structure is filled with the
   // retreived data if found (and true is returned).  Otherwise, the structure
   // is left alone and the function returns false.
@@ -7,14 +7,17 @@
 #include "glog/logging.h"
 #include "src/backup_driver.h"
 #include "src/restore_driver.h"
+#include "src/scrub_driver.h"
+#include "src/verify_driver.h"
 
 DEFINE_string(backup_filename, "", "Backup volume to use.");
 DEFINE_string(restore_path, "", "Path to restore back to.");
 DEFINE_string(operation, "",
-              "Operation to perform.  Valid: backup, restore, list");
+              "Operation to perform.  "
+              "Valid: backup, restore, list, verify, scrub");
 DEFINE_string(backup_type, "",
               "Perform a backup of the indicated type.  "
-              "Valid: full, incremental, differential");
+              "Valid: full, incremental, differential, synthetic_full");
 DEFINE_string(backup_description, "", "Description of this backup set");
 DEFINE_bool(enable_compression, false, "Enable compression during backup");
 DEFINE_uint64(max_volume_size_mb, 0,
@@ -23,15 +26,69 @@ DEFINE_uint64(max_volume_size_mb, 0,
 DEFINE_string(filelist, "",
               "File to read the list of files to backup.  The file should be "
               "formatted with filenames, one per line.");
+DEFINE_string(append_detection, "off",
+              "How to detect files that were only appended to, so just the new "
+              "data is read.  Valid: off, last_chunk, sampled");
+DEFINE_uint64(append_verify_samples, 8,
+              "Number of earlier chunks of an appended file to check, in "
+              "addition to its last chunk, with --append_detection=sampled.");
+DEFINE_bool(track_extents, false,
+            "Record the on-disk extents of backed up files, and only read the "
+            "regions of changed files whose extents changed.  Only has an "
+            "effect on copy-on-write filesystems (btrfs).");
+DEFINE_uint64(max_file_set_memory_mb, 256,
+              "Memory the metadata of files already backed up may use before "
+              "it's spilled to a temporary file next to the backup.  If 0, "
+              "it's all kept in memory.");
+DEFINE_bool(pack_volumes, false,
+            "Append backups to the last volume until it reaches "
+            "--max_volume_size_mb, rather than starting a new volume for each "
+            "backup.");
 DEFINE_uint64(restore_set_number, 0,
               "Restore set to restore from, numbered according to the list "
               "command.");
+DEFINE_int32(restore_decode_threads, 0,
+             "Number of threads decompressing and verifying chunks during a "
+             "restore.  If 0, one is used per core.");
+DEFINE_int32(restore_writer_threads, 4,
+             "Number of threads writing restored files.");
+DEFINE_uint64(restore_memory_mb, 256,
+              "Maximum amount of chunk data held in memory during a restore.");
+DEFINE_bool(restore_copy_raw_chunks, false,
+            "Copy uncompressed chunks straight from the backup volumes to the "
+            "restored files, sharing their data (reflinking) where the "
+            "filesystem allows.  Copied chunks are not verified against their "
+            "MD5s.");
+DEFINE_bool(restore_trust_crc, false,
+            "Skip checking restored chunks against their MD5s when the CRC "
+            "stored with them matches.  Roughly halves the CPU a restore "
+            "takes, but only catches damage to the backup media, not a bad "
+            "decompression.  Volumes written before chunk CRCs were added are "
+            "still fully checked.");
+DEFINE_bool(restore_update_in_place, false,
+            "Restore over an existing copy of the files, only writing the "
+            "chunks that differ from the backup.  Files whose size and "
+            "modification time match the backup are assumed unchanged.");
+DEFINE_int32(verify_threads, 4,
+             "Number of threads reading files during a verify.  If 0, one is "
+             "used per core.");
+DEFINE_int32(scrub_threads, 0,
+             "Number of threads decompressing and checking chunks during a "
+             "scrub.  If 0, one is used per core.");
+DEFINE_uint64(scrub_max_mb_per_sec, 0,
+              "Maximum rate, in MB per second, to read backup volumes at "
+              "during a scrub.  If 0, volumes are read as fast as possible.");
 
+using backup2::AppendDetection;
 using backup2::BackupType;
+using backup2::kAppendDetectionLastChunk;
+using backup2::kAppendDetectionOff;
+using backup2::kAppendDetectionSampled;
 using backup2::kBackupTypeDifferential;
 using backup2::kBackupTypeFull;
 using backup2::kBackupTypeIncremental;
 using backup2::kBackupTypeInvalid;
+using backup2::kBackupTypeSyntheticFull;
 
 int main(int argc, char* argv[]) {
   google::SetUsageMessage("TODO: Add message");
@@ -53,27 +110,68 @@ int main(int argc, char* argv[]) {
       backup_type = kBackupTypeIncremental;
     } else if (FLAGS_backup_type == "differential") {
       backup_type = kBackupTypeDifferential;
+    } else if (FLAGS_backup_type == "synthetic_full") {
+      backup_type = kBackupTypeSyntheticFull;
     }
+
+    AppendDetection append_detection = kAppendDetectionOff;
+    if (FLAGS_append_detection == "last_chunk") {
+      append_detection = kAppendDetectionLastChunk;
+    } else if (FLAGS_append_detection == "sampled") {
+      append_detection = kAppendDetectionSampled;
+    } else if (FLAGS_append_detection != "off") {
+      LOG(ERROR) << "Unknown append detection: " << FLAGS_append_detection;
+      return -1;
+    }
+
     backup2::BackupDriver driver(
         FLAGS_backup_filename,
         backup_type,
         FLAGS_backup_description,
         FLAGS_max_volume_size_mb,
         FLAGS_enable_compression,
-        FLAGS_filelist);
+        FLAGS_filelist,
+        append_detection,
+        FLAGS_append_verify_samples,
+        FLAGS_track_extents,
+        FLAGS_max_file_set_memory_mb,
+        FLAGS_pack_volumes);
     return driver.Run();
   } else if (FLAGS_operation == "list") {
     backup2::RestoreDriver driver(
         FLAGS_backup_filename,
         FLAGS_restore_path,
-        0);
+        backup2::RestoreOptions());
     return driver.List();
   } else if (FLAGS_operation == "restore") {
+    backup2::RestoreOptions options;
+    options.set_set_number(FLAGS_restore_set_number)
+           .set_num_decode_threads(FLAGS_restore_decode_threads)
+           .set_num_writer_threads(FLAGS_restore_writer_threads)
+           .set_max_memory_mb(FLAGS_restore_memory_mb)
+           .set_copy_raw_chunks(FLAGS_restore_copy_raw_chunks)
+           .set_trust_crc(FLAGS_restore_trust_crc)
+           .set_update_in_place(FLAGS_restore_update_in_place);
     backup2::RestoreDriver driver(
         FLAGS_backup_filename,
         FLAGS_restore_path,
-        FLAGS_restore_set_number);
+        options);
     return driver.Restore();
+  } else if (FLAGS_operation == "verify") {
+    // Files are compared against those under the restore path; a path of /
+    // checks the live filesystem.
+    backup2::VerifyDriver driver(
+        FLAGS_backup_filename,
+        FLAGS_restore_path,
+        FLAGS_restore_set_number,
+        FLAGS_verify_threads);
+    return driver.Verify();
+  } else if (FLAGS_operation == "scrub") {
+    backup2::ScrubDriver driver(
+        FLAGS_backup_filename,
+        FLAGS_scrub_threads,
+        FLAGS_scrub_max_mb_per_sec);
+    return driver.Scrub();
   } else {
     LOG(ERROR) << "Unknown operation: " << FLAGS_operation;
   }
@@ -53,6 +53,10 @@ struct Uint128 {
     return !(*this == rhs);
   }
 
+  bool operator<(const Uint128& rhs) const {
+    return hi < rhs.hi || (hi == rhs.hi && lo < rhs.lo);
+  }
+
   friend std::size_t hash_value(const Uint128& rhs) {
     std::size_t seed = 0;
     boost::hash_combine(seed, rhs.hi);
@@ -0,0 +1,116 @@
+// Copyright (C) 2013, All Rights Reserved.
+// Author: Cory Maccarrone <darkstar6262@gmail.com>
+
+#include "src/crc32c.h"
+
+#include <string.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define CRC32C_HAVE_SSE42_GCC
+#elif defined(_MSC_VER) && defined(_M_X64)
+#include <intrin.h>
+#define CRC32C_HAVE_SSE42_MSVC
+#endif
+
+#if defined(CRC32C_HAVE_SSE42_GCC) || defined(CRC32C_HAVE_SSE42_MSVC)
+#include <nmmintrin.h>
+#endif
+
+namespace backup2 {
+namespace {
+
+// Reversed form of the Castagnoli polynomial.
+const uint32_t kCastagnoliPolynomial = 0x82F63B78;
+
+// Table of the CRC of each byte value, for the portable implementation.
+class Crc32cTable {
+ public:
+  Crc32cTable() {
+    for (uint32_t byte = 0; byte < 256; ++byte) {
+      uint32_t crc = byte;
+      for (int bit = 0; bit < 8; ++bit) {
+        crc = (crc >> 1) ^ ((crc & 1) ? kCastagnoliPolynomial : 0);
+      }
+      entries_[byte] = crc;
+    }
+  }
+
+  uint32_t operator[](uint8_t byte) const { return entries_[byte]; }
+
+ private:
+  uint32_t entries_[256];
+};
+
+#if defined(CRC32C_HAVE_SSE42_GCC) || defined(CRC32C_HAVE_SSE42_MSVC)
+
+#ifdef CRC32C_HAVE_SSE42_GCC
+bool CpuHasSse42() {
+  return __builtin_cpu_supports("sse4.2");
+}
+#define CRC32C_TARGET_SSE42 __attribute__((target("sse4.2")))
+#else
+bool CpuHasSse42() {
+  int info[4];
+  __cpuid(info, 1);
+  return (info[2] & (1 << 20)) != 0;
+}
+#define CRC32C_TARGET_SSE42
+#endif  // CRC32C_HAVE_SSE42_GCC
+
+// Extend an unfinalized CRC with the crc32 instruction, a word at a time.
+CRC32C_TARGET_SSE42
+uint32_t ExtendSse42(uint32_t crc, const char* data, size_t size) {
+  const uint8_t* bytes = reinterpret_cast<const uint8_t*>(data);
+  for (; size > 0 && (reinterpret_cast<uintptr_t>(bytes) & 7) != 0; --size) {
+    crc = _mm_crc32_u8(crc, *bytes++);
+  }
+#if defined(__x86_64__) || defined(_M_X64)
+  uint64_t crc64 = crc;
+  for (; size >= 8; size -= 8, bytes += 8) {
+    uint64_t word;
+    memcpy(&word, bytes, sizeof(word));
+    crc64 = _mm_crc32_u64(crc64, word);
+  }
+  crc = static_cast<uint32_t>(crc64);
+#else
+  for (; size >= 4; size -= 4, bytes += 4) {
+    uint32_t word;
+    memcpy(&word, bytes, sizeof(word));
+    crc = _mm_crc32_u32(crc, word);
+  }
+#endif  // __x86_64__ || _M_X64
+  for (; size > 0; --size) {
+    crc = _mm_crc32_u8(crc, *bytes++);
+  }
+  return crc;
+}
+
+#endif  // CRC32C_HAVE_SSE42_GCC || CRC32C_HAVE_SSE42_MSVC
+
+}  // namespace
+
+uint32_t Crc32c(const char* data, size_t size) {
+  return Crc32cExtend(0, data, size);
+}
+
+uint32_t Crc32cExtend(uint32_t crc, const char* data, size_t size) {
+#if defined(CRC32C_HAVE_SSE42_GCC) || defined(CRC32C_HAVE_SSE42_MSVC)
+  static const bool have_sse42 = CpuHasSse42();
+  if (have_sse42) {
+    return ~ExtendSse42(~crc, data, size);
+  }
+#endif  // CRC32C_HAVE_SSE42_GCC || CRC32C_HAVE_SSE42_MSVC
+  return Crc32cExtendPortable(crc, data, size);
+}
+
+uint32_t Crc32cExtendPortable(uint32_t crc, const char* data, size_t size) {
+  static const Crc32cTable table;
+  const uint8_t* bytes = reinterpret_cast<const uint8_t*>(data);
+  crc = ~crc;
+  for (size_t index = 0; index < size; ++index) {
+    crc = table[static_cast<uint8_t>(crc ^ bytes[index])] ^ (crc >> 8);
+  }
+  return ~crc;
+}
+
+}  // namespace backup2
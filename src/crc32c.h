@@ -0,0 +1,32 @@
+// Copyright (C) 2013, All Rights Reserved.
+// Author: Cory Maccarrone <darkstar6262@gmail.com>
+#ifndef BACKUP2_SRC_CRC32C_H_
+#define BACKUP2_SRC_CRC32C_H_
+
+#include <stddef.h>
+
+#include <string>
+
+#include "src/common.h"
+
+namespace backup2 {
+
+// Return the CRC32C (Castagnoli) checksum of the given data.  This uses the
+// SSE 4.2 crc32 instruction where the CPU has it, which checksums data many
+// times faster than MD5, and a table otherwise.
+uint32_t Crc32c(const char* data, size_t size);
+
+inline uint32_t Crc32c(const std::string& data) {
+  return Crc32c(data.data(), data.size());
+}
+
+// Return the CRC32C of some data followed by more data, given the CRC32C of
+// the first part.  Crc32c(a + b) == Crc32cExtend(Crc32c(a), b).
+uint32_t Crc32cExtend(uint32_t crc, const char* data, size_t size);
+
+// Like Crc32cExtend(), but always uses the table.  This is what Crc32cExtend()
+// falls back to without SSE 4.2, and is exposed for testing.
+uint32_t Crc32cExtendPortable(uint32_t crc, const char* data, size_t size);
+
+}  // namespace backup2
+#endif  // BACKUP2_SRC_CRC32C_H_
@@ -0,0 +1,59 @@
+// Copyright (C) 2013, All Rights Reserved.
+// Author: Cory Maccarrone <darkstar6262@gmail.com>
+#include <string>
+
+#include "src/common.h"
+#include "src/crc32c.h"
+#include "glog/logging.h"
+#include "gtest/gtest.h"
+
+using std::string;
+
+namespace backup2 {
+
+TEST(Crc32cTest, KnownValues) {
+  // Test vectors from RFC 3720, appendix B.4.
+  string data(32, '\0');
+  EXPECT_EQ(0x8A9136AA, Crc32c(data));
+  EXPECT_EQ(0x8A9136AA, Crc32cExtendPortable(0, &data.at(0), data.size()));
+
+  data.assign(32, '\xFF');
+  EXPECT_EQ(0x62A8AB43, Crc32c(data));
+  EXPECT_EQ(0x62A8AB43, Crc32cExtendPortable(0, &data.at(0), data.size()));
+
+  for (int index = 0; index < 32; ++index) {
+    data[index] = index;
+  }
+  EXPECT_EQ(0x46DD794E, Crc32c(data));
+  EXPECT_EQ(0x46DD794E, Crc32cExtendPortable(0, &data.at(0), data.size()));
+
+  for (int index = 0; index < 32; ++index) {
+    data[index] = 31 - index;
+  }
+  EXPECT_EQ(0x113FDB5C, Crc32c(data));
+  EXPECT_EQ(0x113FDB5C, Crc32cExtendPortable(0, &data.at(0), data.size()));
+
+  EXPECT_EQ(0xE3069283, Crc32c("123456789"));
+  EXPECT_EQ(0, Crc32c(""));
+}
+
+TEST(Crc32cTest, ExtendMatchesWhole) {
+  // Split at every point, so the pieces start at every alignment and end with
+  // every length of tail.
+  string data;
+  for (int index = 0; index < 100; ++index) {
+    data.push_back(static_cast<char>(index * 37 + 11));
+  }
+  uint32_t whole = Crc32c(data);
+  EXPECT_EQ(whole, Crc32cExtendPortable(0, &data.at(0), data.size()));
+  for (size_t split = 0; split <= data.size(); ++split) {
+    uint32_t crc = Crc32c(&data.at(0), split);
+    EXPECT_EQ(whole, Crc32cExtend(crc, data.data() + split,
+                                  data.size() - split)) << split;
+    crc = Crc32cExtendPortable(0, &data.at(0), split);
+    EXPECT_EQ(whole, Crc32cExtendPortable(crc, data.data() + split,
+                                          data.size() - split)) << split;
+  }
+}
+
+}  // namespace backup2
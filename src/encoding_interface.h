@@ -19,6 +19,13 @@ class EncodingInterface {
   // string is resized to exactly contain the encoded data.
   virtual Status Encode(const std::string& source, std::string* dest) = 0;
 
+  // Like Encode() above, but encodes the size bytes at source, such as part of
+  // a larger read buffer.  This default copies them into a string first;
+  // implementations should encode them in place.
+  virtual Status Encode(const char* source, size_t size, std::string* dest) {
+    return Encode(std::string(source, size), dest);
+  }
+
   // Decode the given string, producing the original content.  The destinatino
   // string must be sized large enough for the unencoded content.
   virtual Status Decode(const std::string& source, std::string* dest) = 0;
@@ -0,0 +1,306 @@
+// Copyright (C) 2013, All Rights Reserved.
+// Author: Cory Maccarrone <darkstar6262@gmail.com>
+
+#include "src/extent_map.h"
+
+#include <algorithm>
+#include <map>
+#include <memory>
+#include <set>
+#include <string>
+#include <vector>
+
+#include "boost/filesystem.hpp"
+#include "boost/interprocess/exceptions.hpp"
+#include "boost/interprocess/file_mapping.hpp"
+#include "boost/interprocess/mapped_region.hpp"
+#include "boost/system/error_code.hpp"
+#include "glog/logging.h"
+#include "src/backup_volume_defs.h"
+#include "src/file.h"
+#include "src/fileset.h"
+#include "src/md5_generator_interface.h"
+#include "src/status.h"
+
+using boost::interprocess::file_mapping;
+using boost::interprocess::interprocess_exception;
+using boost::interprocess::mapped_region;
+using boost::interprocess::read_only;
+using std::map;
+using std::set;
+using std::string;
+using std::unique_ptr;
+using std::vector;
+
+namespace backup2 {
+namespace {
+
+// Order records by path hash, which is how they're stored on disk.
+bool RecordLessThan(const FileExtentRecord& lhs, const FileExtentRecord& rhs) {
+  return lhs.path_hash < rhs.path_hash;
+}
+
+// Order an extent before an offset if it ends at or before the offset.
+bool ExtentEndsBefore(const FileExtent& extent, uint64_t offset) {
+  return extent.logical_offset + extent.length <= offset;
+}
+
+// Return the first extent overlapping offset or later.
+vector<FileExtent>::const_iterator FirstExtentFrom(
+    const vector<FileExtent>& extents, uint64_t offset) {
+  return std::lower_bound(extents.begin(), extents.end(), offset,
+                          ExtentEndsBefore);
+}
+
+}  // namespace
+
+const std::string ExtentMap::kFileVersion = "FEM_0001";
+
+ExtentMap::ExtentMap(Md5GeneratorInterface* md5_maker)
+    : md5_maker_(md5_maker),
+      records_(NULL),
+      extents_(NULL) {
+}
+
+ExtentMap::~ExtentMap() {
+}
+
+Status ExtentMap::Load(const string& filename) {
+  Unload();
+
+  boost::system::error_code error_code;
+  uint64_t file_size = boost::filesystem::file_size(
+      boost::filesystem::path(filename), error_code);
+  if (error_code.value() != 0) {
+    return Status(kStatusNoSuchFile, "No extent map");
+  }
+  if (file_size < sizeof(ExtentMapHeader)) {
+    LOG(ERROR) << "Extent map too short: " << filename;
+    return Status(kStatusCorruptBackup, "Extent map too short");
+  }
+
+  try {
+    mapping_.reset(new file_mapping(filename.c_str(), read_only));
+    region_.reset(new mapped_region(*mapping_, read_only));
+  } catch(const interprocess_exception& e) {
+    LOG(ERROR) << "Could not map extent map: " << e.what();
+    Unload();
+    return Status(kStatusFileError, "Could not map extent map");
+  }
+
+  const char* data = static_cast<const char*>(region_->get_address());
+  ExtentMapHeader header;
+  memcpy(&header, data, sizeof(ExtentMapHeader));
+
+  if (string(header.version, sizeof(header.version)) != kFileVersion) {
+    LOG(ERROR) << "Unrecognized extent map: " << filename;
+    Unload();
+    return Status(kStatusCorruptBackup, "Not a recognized extent map");
+  }
+  if (file_size != sizeof(ExtentMapHeader) +
+                   header.num_files * sizeof(FileExtentRecord) +
+                   header.num_extents * sizeof(FileExtent)) {
+    LOG(ERROR) << "Extent map size mismatch: " << filename;
+    Unload();
+    return Status(kStatusCorruptBackup, "Extent map size mismatch");
+  }
+
+  header_ = header;
+  records_ = reinterpret_cast<const FileExtentRecord*>(
+      data + sizeof(ExtentMapHeader));
+  extents_ = reinterpret_cast<const FileExtent*>(
+      data + sizeof(ExtentMapHeader) +
+      header.num_files * sizeof(FileExtentRecord));
+
+  // Make sure no record points outside the extents.
+  for (uint64_t index = 0; index < header_.num_files; ++index) {
+    const FileExtentRecord& record = records_[index];
+    if (record.first_extent > header_.num_extents ||
+        record.num_extents > header_.num_extents - record.first_extent) {
+      LOG(ERROR) << "Extent map record out of range: " << filename;
+      Unload();
+      return Status(kStatusCorruptBackup, "Extent map record out of range");
+    }
+  }
+  return Status::OK;
+}
+
+const FileExtentRecord* ExtentMap::Find(const string& generic_filename) const {
+  if (!records_) {
+    return NULL;
+  }
+
+  FileExtentRecord key;
+  key.path_hash = md5_maker_->Checksum(generic_filename);
+
+  const FileExtentRecord* end = records_ + header_.num_files;
+  const FileExtentRecord* record = std::lower_bound(
+      records_, end, key, RecordLessThan);
+  if (record == end || record->path_hash != key.path_hash) {
+    return NULL;
+  }
+  return record;
+}
+
+void ExtentMap::GetExtents(const FileExtentRecord& record,
+                           vector<FileExtent>* extents_out) const {
+  extents_out->assign(extents_ + record.first_extent,
+                      extents_ + record.first_extent + record.num_extents);
+}
+
+void ExtentMap::AddFile(const string& generic_filename,
+                        const BackupFile& metadata,
+                        const vector<FileExtent>& extents) {
+  PendingFile file;
+  file.record.path_hash = md5_maker_->Checksum(generic_filename);
+  file.record.device_id = metadata.device_id;
+  file.record.inode = metadata.inode;
+  file.record.file_size = metadata.file_size;
+  file.record.modify_date = metadata.modify_date;
+  file.record.change_date = metadata.change_date;
+  file.record.num_extents = extents.size();
+  file.extents = extents;
+  pending_[file.record.path_hash] = file;
+}
+
+Status ExtentMap::Write(const string& filename, uint64_t label_id,
+                        const FileSet* live_files) {
+  set<Uint128> live_hashes;
+  if (live_files) {
+    for (const FileEntry* entry : live_files->GetFiles()) {
+      live_hashes.insert(md5_maker_->Checksum(entry->generic_filename()));
+    }
+    uint64_t spilled_offset = 0;
+    while (spilled_offset < live_files->spilled_size()) {
+      vector<unique_ptr<FileEntry> > spilled;
+      Status retval = live_files->ReadSpilledFiles(
+          &spilled_offset, FileSet::kSpilledBatchSize, &spilled);
+      LOG_RETURN_IF_ERROR(retval, "Could not read spilled files");
+      for (const unique_ptr<FileEntry>& entry : spilled) {
+        live_hashes.insert(md5_maker_->Checksum(entry->generic_filename()));
+      }
+    }
+  }
+
+  // Merge the added files with the loaded records, both sorted by path hash.
+  // Added files replace loaded records for the same file.  Each output record
+  // remembers where its extents come from.
+  vector<FileExtentRecord> records;
+  vector<const FileExtent*> sources;
+  uint64_t num_extents = 0;
+  auto pending_iter = pending_.begin();
+  const FileExtentRecord* loaded_iter = records_;
+  const FileExtentRecord* loaded_end =
+      records_ ? records_ + header_.num_files : NULL;
+  while (pending_iter != pending_.end() || loaded_iter != loaded_end) {
+    FileExtentRecord record;
+    const FileExtent* source = NULL;
+    if (loaded_iter == loaded_end ||
+        (pending_iter != pending_.end() &&
+         !(loaded_iter->path_hash < pending_iter->first))) {
+      if (loaded_iter != loaded_end &&
+          loaded_iter->path_hash == pending_iter->first) {
+        ++loaded_iter;
+      }
+      record = pending_iter->second.record;
+      source = pending_iter->second.extents.data();
+      ++pending_iter;
+    } else {
+      record = *loaded_iter;
+      source = extents_ + loaded_iter->first_extent;
+      ++loaded_iter;
+      if (live_files && live_hashes.count(record.path_hash) == 0) {
+        continue;
+      }
+    }
+    record.first_extent = num_extents;
+    num_extents += record.num_extents;
+    records.push_back(record);
+    sources.push_back(source);
+  }
+
+  ExtentMapHeader header;
+  memcpy(header.version, kFileVersion.data(), sizeof(header.version));
+  header.label_id = label_id;
+  header.num_files = records.size();
+  header.num_extents = num_extents;
+
+  // Write everything out to a temporary file first.
+  string temp_filename = filename + ".tmp";
+  unique_ptr<File> file(new File(temp_filename));
+  if (file->Exists()) {
+    Status retval = file->Unlink();
+    LOG_RETURN_IF_ERROR(retval, "Could not remove old extent map");
+  }
+
+  Status retval = file->Open(File::Mode::kModeAppend);
+  LOG_RETURN_IF_ERROR(retval, "Could not open extent map");
+
+  retval = file->Write(&header, sizeof(ExtentMapHeader));
+  LOG_RETURN_IF_ERROR(retval, "Could not write extent map header");
+
+  for (const FileExtentRecord& record : records) {
+    retval = file->Write(&record, sizeof(FileExtentRecord));
+    LOG_RETURN_IF_ERROR(retval, "Could not write extent map record");
+  }
+  for (uint64_t index = 0; index < records.size(); ++index) {
+    for (uint64_t extent = 0; extent < records[index].num_extents; ++extent) {
+      retval = file->Write(&sources[index][extent], sizeof(FileExtent));
+      LOG_RETURN_IF_ERROR(retval, "Could not write extent");
+    }
+  }
+
+  retval = file->Close();
+  LOG_RETURN_IF_ERROR(retval, "Could not close extent map");
+
+  // The old map has to be unmapped before it can be replaced.
+  Unload();
+  pending_.clear();
+
+  boost::system::error_code error_code;
+  boost::filesystem::rename(boost::filesystem::path(temp_filename),
+                            boost::filesystem::path(filename), error_code);
+  if (error_code.value() != 0) {
+    LOG(ERROR) << "Could not move extent map into place: "
+               << error_code.message();
+    return Status(kStatusFileError,
+                  "Could not move extent map: " + error_code.message());
+  }
+  return Status::OK;
+}
+
+bool ExtentMap::RangeUnchanged(const vector<FileExtent>& previous,
+                               const vector<FileExtent>& current,
+                               uint64_t offset, uint64_t length) {
+  // Walk the extents overlapping the range in both.  They must be identical
+  // extents -- the same file range at the same physical location.  Comparing
+  // whole extents rather than the overlapping parts also catches extents
+  // that were split or merged around the range.
+  uint64_t end = offset + length;
+  auto previous_iter = FirstExtentFrom(previous, offset);
+  auto current_iter = FirstExtentFrom(current, offset);
+  while (true) {
+    bool previous_done = previous_iter == previous.end() ||
+                         previous_iter->logical_offset >= end;
+    bool current_done = current_iter == current.end() ||
+                        current_iter->logical_offset >= end;
+    if (previous_done || current_done) {
+      return previous_done && current_done;
+    }
+    if (!(*previous_iter == *current_iter)) {
+      return false;
+    }
+    ++previous_iter;
+    ++current_iter;
+  }
+}
+
+void ExtentMap::Unload() {
+  records_ = NULL;
+  extents_ = NULL;
+  region_.reset();
+  mapping_.reset();
+  header_ = ExtentMapHeader();
+}
+
+}  // namespace backup2
@@ -0,0 +1,162 @@
+// Copyright (C) 2013, All Rights Reserved.
+// Author: Cory Maccarrone <darkstar6262@gmail.com>
+#ifndef BACKUP2_SRC_EXTENT_MAP_H_
+#define BACKUP2_SRC_EXTENT_MAP_H_
+
+#include <string.h>
+
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "src/common.h"
+#include "src/file_interface.h"
+#include "src/status.h"
+
+namespace boost {
+namespace interprocess {
+class file_mapping;
+class mapped_region;
+}  // namespace interprocess
+}  // namespace boost
+
+namespace backup2 {
+struct BackupFile;
+class FileSet;
+class Md5GeneratorInterface;
+
+#pragma pack(push, 4)
+
+// Header of an extent map file.  This is followed by num_files
+// FileExtentRecords sorted by path hash, and then by num_extents FileExtents.
+struct ExtentMapHeader {
+  ExtentMapHeader() {
+    memset(this, 0, sizeof(ExtentMapHeader));
+  }
+
+  // Version of the extent map file.
+  char version[8];
+
+  // Label the extent map describes.
+  uint64_t label_id;
+
+  // Number of file records and extents following the header.
+  uint64_t num_files;
+  uint64_t num_extents;
+};
+
+// Extents of a single file, as of the backup the file was last read in.
+struct FileExtentRecord {
+  FileExtentRecord() {
+    memset(this, 0, sizeof(FileExtentRecord));
+  }
+
+  // MD5 of the generic filename.
+  Uint128 path_hash;
+
+  // Identity and change information of the file when the extents were taken,
+  // as in BackupFile.  The extents only describe the chunks of a backed up
+  // file if these match its metadata.
+  uint64_t device_id;
+  uint64_t inode;
+  uint64_t file_size;
+  uint64_t modify_date;
+  uint64_t change_date;
+
+  // Index of the first extent of the file, and the number of extents.
+  uint64_t first_extent;
+  uint64_t num_extents;
+};
+
+#pragma pack(pop)
+
+// An ExtentMap records where on disk the data of each backed up file lived,
+// keyed by a hash of the filename.  On copy-on-write filesystems, data is never
+// overwritten in place -- a changed region of a file is written to a new
+// physical location.  So any region whose extents are the same as when the
+// file was last backed up still holds the same data, and its chunks can be
+// re-used without reading it.
+//
+// Extent maps are written next to the backup volumes at the end of each backup
+// that tracks extents, one per label.  Like the file state cache, the map is
+// memory-mapped when loaded.
+class ExtentMap {
+ public:
+  // Current version of the extent map file.
+  static const std::string kFileVersion;
+
+  // The MD5 generator is used to hash filenames.  Ownership is not taken.
+  explicit ExtentMap(Md5GeneratorInterface* md5_maker);
+  ~ExtentMap();
+
+  // Load and map the extent map from the given file.  Returns
+  // kStatusNoSuchFile if the map doesn't exist, or kStatusCorruptBackup if it
+  // is not a valid extent map.
+  Status Load(const std::string& filename);
+
+  // Return the record for the given generic filename, or NULL if the file
+  // isn't in the loaded map.
+  const FileExtentRecord* Find(const std::string& generic_filename) const;
+
+  // Return the extents of the given record, which must come from Find().
+  void GetExtents(const FileExtentRecord& record,
+                  std::vector<FileExtent>* extents_out) const;
+
+  // Add the extents of a file to be written out with the next Write().  The
+  // metadata is that of the file when the extents were taken.
+  void AddFile(const std::string& generic_filename, const BackupFile& metadata,
+               const std::vector<FileExtent>& extents);
+
+  // Write the files added with AddFile(), along with the records of the loaded
+  // map for files not added, to the given filename.  If live_files is not
+  // NULL, loaded records for files not in it are dropped.  The map is written
+  // to a temporary file and moved into place.  Once written, the loaded map
+  // and added files are released.
+  Status Write(const std::string& filename, uint64_t label_id,
+               const FileSet* live_files);
+
+  // Return whether the byte range [offset, offset + length) of a file is laid
+  // out the same way in both sets of extents.  Both must be sorted by logical
+  // offset.  Ranges that are holes in both are unchanged.
+  static bool RangeUnchanged(const std::vector<FileExtent>& previous,
+                             const std::vector<FileExtent>& current,
+                             uint64_t offset, uint64_t length);
+
+  // Return the header of the loaded map.
+  const ExtentMapHeader& header() const { return header_; }
+
+  // Return the number of files in the loaded map.
+  uint64_t size() const { return header_.num_files; }
+
+ private:
+  // A file added to be written out.
+  struct PendingFile {
+    FileExtentRecord record;
+    std::vector<FileExtent> extents;
+  };
+
+  // Release the mapping of the loaded map, if any.
+  void Unload();
+
+  // MD5 generator used to hash filenames.
+  Md5GeneratorInterface* md5_maker_;
+
+  // Mapping of the loaded extent map file.
+  std::unique_ptr<boost::interprocess::file_mapping> mapping_;
+  std::unique_ptr<boost::interprocess::mapped_region> region_;
+
+  // Header, records and extents of the loaded map.  The records and extents
+  // point into the mapped region.
+  ExtentMapHeader header_;
+  const FileExtentRecord* records_;
+  const FileExtent* extents_;
+
+  // Files added since the last write, by path hash.
+  std::map<Uint128, PendingFile> pending_;
+
+  DISALLOW_COPY_AND_ASSIGN(ExtentMap);
+};
+
+}  // namespace backup2
+#endif  // BACKUP2_SRC_EXTENT_MAP_H_
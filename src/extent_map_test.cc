@@ -0,0 +1,199 @@
+// Copyright (C) 2013, All Rights Reserved.
+// Author: Cory Maccarrone <darkstar6262@gmail.com>
+
+#include <string>
+#include <vector>
+
+#include "boost/filesystem.hpp"
+#include "src/backup_volume_defs.h"
+#include "src/extent_map.h"
+#include "src/file.h"
+#include "src/file_interface.h"
+#include "src/fileset.h"
+#include "src/md5_generator.h"
+#include "src/status.h"
+#include "glog/logging.h"
+#include "gmock/gmock.h"
+#include "gtest/gtest.h"
+
+using std::string;
+using std::vector;
+
+namespace backup2 {
+
+class ExtentMapTest : public testing::Test {
+ public:
+  static const char* kTestFilename;
+
+  void SetUp() {
+    RemoveTestFiles();
+  }
+
+  void TearDown() {
+    RemoveTestFiles();
+  }
+
+ protected:
+  void RemoveTestFiles() {
+    boost::filesystem::remove(boost::filesystem::path(kTestFilename));
+    boost::filesystem::remove(
+        boost::filesystem::path(string(kTestFilename) + ".tmp"));
+  }
+
+  BackupFile Metadata(uint64_t size, uint64_t modify_date) {
+    BackupFile metadata;
+    metadata.file_type = BackupFile::kFileTypeRegularFile;
+    metadata.file_size = size;
+    metadata.modify_date = modify_date;
+    metadata.inode = 30;
+    metadata.change_date = 40;
+    return metadata;
+  }
+
+  FileExtent Extent(uint64_t logical_offset, uint64_t physical_offset,
+                    uint64_t length) {
+    FileExtent extent;
+    extent.logical_offset = logical_offset;
+    extent.physical_offset = physical_offset;
+    extent.length = length;
+    return extent;
+  }
+
+  Md5Generator md5_maker_;
+};
+
+const char* ExtentMapTest::kTestFilename = "__test__.fem";
+
+TEST_F(ExtentMapTest, LoadMissing) {
+  ExtentMap extent_map(&md5_maker_);
+  EXPECT_EQ(kStatusNoSuchFile, extent_map.Load(kTestFilename).code());
+  EXPECT_EQ(NULL, extent_map.Find("/foo/bar"));
+}
+
+TEST_F(ExtentMapTest, LoadCorrupt) {
+  File file(kTestFilename);
+  ASSERT_TRUE(file.Open(File::Mode::kModeAppend).ok());
+  ExtentMapHeader header;
+  memcpy(header.version, ExtentMap::kFileVersion.data(), 8);
+  header.num_files = 1;
+  ASSERT_TRUE(file.Write(&header, sizeof(header)).ok());
+  ASSERT_TRUE(file.Close().ok());
+
+  ExtentMap extent_map(&md5_maker_);
+  EXPECT_EQ(kStatusCorruptBackup, extent_map.Load(kTestFilename).code());
+}
+
+TEST_F(ExtentMapTest, WriteAndLoad) {
+  vector<FileExtent> bar_extents;
+  bar_extents.push_back(Extent(0, 4096, 8192));
+  bar_extents.push_back(Extent(8192, 65536, 4096));
+  vector<FileExtent> baz_extents(1, Extent(0, 131072, 4096));
+
+  ExtentMap extent_map(&md5_maker_);
+  extent_map.AddFile("/foo/bar", Metadata(12288, 20), bar_extents);
+  extent_map.AddFile("/foo/baz", Metadata(4096, 21), baz_extents);
+  extent_map.AddFile("/zip/zap", Metadata(0, 22), vector<FileExtent>());
+  ASSERT_TRUE(extent_map.Write(kTestFilename, 1, NULL).ok());
+  EXPECT_FALSE(boost::filesystem::exists(string(kTestFilename) + ".tmp"));
+
+  ExtentMap loaded(&md5_maker_);
+  ASSERT_TRUE(loaded.Load(kTestFilename).ok());
+  EXPECT_EQ(3, loaded.size());
+  EXPECT_EQ(1, loaded.header().label_id);
+  EXPECT_EQ(3, loaded.header().num_extents);
+
+  const FileExtentRecord* record = loaded.Find("/foo/bar");
+  ASSERT_TRUE(record != NULL);
+  EXPECT_EQ(12288, record->file_size);
+  EXPECT_EQ(20, record->modify_date);
+  EXPECT_EQ(30, record->inode);
+  EXPECT_EQ(40, record->change_date);
+
+  vector<FileExtent> extents;
+  loaded.GetExtents(*record, &extents);
+  EXPECT_EQ(bar_extents, extents);
+
+  record = loaded.Find("/foo/baz");
+  ASSERT_TRUE(record != NULL);
+  loaded.GetExtents(*record, &extents);
+  EXPECT_EQ(baz_extents, extents);
+
+  record = loaded.Find("/zip/zap");
+  ASSERT_TRUE(record != NULL);
+  loaded.GetExtents(*record, &extents);
+  EXPECT_TRUE(extents.empty());
+
+  EXPECT_EQ(NULL, loaded.Find("/not/there"));
+}
+
+TEST_F(ExtentMapTest, WriteMerge) {
+  vector<FileExtent> old_extents(1, Extent(0, 4096, 4096));
+  vector<FileExtent> new_extents(1, Extent(0, 8192, 4096));
+
+  ExtentMap extent_map(&md5_maker_);
+  extent_map.AddFile("/foo/bar", Metadata(4096, 20), old_extents);
+  extent_map.AddFile("/foo/baz", Metadata(4096, 21), old_extents);
+  ASSERT_TRUE(extent_map.Write(kTestFilename, 1, NULL).ok());
+  ASSERT_TRUE(extent_map.Load(kTestFilename).ok());
+
+  // Added files replace the loaded ones; the rest are kept.
+  extent_map.AddFile("/foo/baz", Metadata(4096, 25), new_extents);
+  extent_map.AddFile("/zip/zap", Metadata(4096, 22), new_extents);
+  ASSERT_TRUE(extent_map.Write(kTestFilename, 1, NULL).ok());
+  EXPECT_EQ(0, extent_map.size());
+
+  ASSERT_TRUE(extent_map.Load(kTestFilename).ok());
+  EXPECT_EQ(3, extent_map.size());
+
+  vector<FileExtent> extents;
+  const FileExtentRecord* record = extent_map.Find("/foo/bar");
+  ASSERT_TRUE(record != NULL);
+  EXPECT_EQ(20, record->modify_date);
+  extent_map.GetExtents(*record, &extents);
+  EXPECT_EQ(old_extents, extents);
+
+  record = extent_map.Find("/foo/baz");
+  ASSERT_TRUE(record != NULL);
+  EXPECT_EQ(25, record->modify_date);
+  extent_map.GetExtents(*record, &extents);
+  EXPECT_EQ(new_extents, extents);
+
+  EXPECT_TRUE(extent_map.Find("/zip/zap") != NULL);
+
+  // Given the live files, records of files not among them are dropped.
+  FileSet live_files;
+  live_files.AddFile("/foo/bar", BackupFile());
+  ASSERT_TRUE(extent_map.Write(kTestFilename, 1, &live_files).ok());
+  ASSERT_TRUE(extent_map.Load(kTestFilename).ok());
+  EXPECT_EQ(1, extent_map.size());
+  EXPECT_TRUE(extent_map.Find("/foo/bar") != NULL);
+  EXPECT_EQ(NULL, extent_map.Find("/foo/baz"));
+}
+
+TEST_F(ExtentMapTest, RangeUnchanged) {
+  vector<FileExtent> previous;
+  previous.push_back(Extent(0, 4096, 8192));
+  previous.push_back(Extent(8192, 65536, 8192));
+  previous.push_back(Extent(32768, 131072, 8192));
+
+  // The second extent was rewritten elsewhere, and a hole was filled in.
+  vector<FileExtent> current;
+  current.push_back(Extent(0, 4096, 8192));
+  current.push_back(Extent(8192, 262144, 8192));
+  current.push_back(Extent(16384, 327680, 4096));
+  current.push_back(Extent(32768, 131072, 8192));
+
+  EXPECT_TRUE(ExtentMap::RangeUnchanged(previous, current, 0, 8192));
+  EXPECT_TRUE(ExtentMap::RangeUnchanged(previous, current, 4096, 4096));
+  EXPECT_FALSE(ExtentMap::RangeUnchanged(previous, current, 4096, 8192));
+  EXPECT_FALSE(ExtentMap::RangeUnchanged(previous, current, 16384, 4096));
+  EXPECT_TRUE(ExtentMap::RangeUnchanged(previous, current, 20480, 12288));
+  EXPECT_TRUE(ExtentMap::RangeUnchanged(previous, current, 32768, 16384));
+
+  // Data past the previous end of the file is new.
+  EXPECT_TRUE(ExtentMap::RangeUnchanged(previous, current, 49152, 4096));
+  current.push_back(Extent(49152, 393216, 4096));
+  EXPECT_FALSE(ExtentMap::RangeUnchanged(previous, current, 49152, 4096));
+}
+
+}  // namespace backup2
@@ -79,8 +79,8 @@ class FakeBackupVolume : public BackupVolumeInterface {
     // We'll create a fileset with a few files.
     FileSet* fileset = new FileSet;
 
-    BackupFile* metadata = new BackupFile;
-    FileEntry* entry = new FileEntry("/my/silly/file", metadata);
+    BackupFile metadata;
+    FileEntry* entry = fileset->AddFile("/my/silly/file", metadata);
 
     FileChunk file_chunk;
     file_chunk.md5sum = chunk.md5sum;
@@ -89,7 +89,6 @@ class FakeBackupVolume : public BackupVolumeInterface {
     file_chunk.unencoded_size = 16;
 
     entry->AddChunk(file_chunk);
-    fileset->AddFile(entry);
 
     fileset_.reset(fileset);
 
@@ -129,13 +128,24 @@ class FakeBackupVolume : public BackupVolumeInterface {
   // BackupVolumeInterface methods.
 
   virtual Status Init() { return init_status_; }
+  virtual Status LoadDescriptor1() { return Status::OK; }
   virtual Status Create(const ConfigOptions& options) { return create_status_; }
+  virtual Status Append(const ConfigOptions& options) {
+    return is_completed_volume() ? Status::OK :
+        Status(kStatusInvalidArgument, "");
+  }
 
   virtual StatusOr<FileSet*> LoadFileSet(int64_t* next_volume) {
     *next_volume = -1;
     return fileset_.get();
   }
 
+  virtual StatusOr<FileSet*> LoadFileSetAtOffset(uint64_t offset,
+                                                 int64_t* next_volume) {
+    *next_volume = -1;
+    return fileset_.get();
+  }
+
   virtual StatusOr<FileSet*> LoadFileSetFromLabel(
       uint64_t label_id, int64_t* next_volume) {
     *next_volume = -1;
@@ -155,10 +165,11 @@ class FakeBackupVolume : public BackupVolumeInterface {
     *out_labels = labels_;
   }
 
+  using BackupVolumeInterface::WriteChunk;
   virtual Status WriteChunk(
-      Uint128 md5sum, const std::string& data, uint64_t raw_size,
+      Uint128 md5sum, const char* data, size_t size, uint64_t raw_size,
       EncodingType type, uint64_t* chunk_offset_out) {
-    chunk_data_.insert(std::make_pair(md5sum, data));
+    chunk_data_.insert(std::make_pair(md5sum, std::string(data, size)));
 
     BackupDescriptor1Chunk chunk;
     chunk.md5sum = md5sum;
@@ -168,6 +179,8 @@ class FakeBackupVolume : public BackupVolumeInterface {
 
     ChunkHeader chunk_header;
     chunk_header.md5sum = md5sum;
+    chunk_header.unencoded_size = raw_size;
+    chunk_header.encoded_size = size;
     chunk_header.encoding_type = type;
     chunk_headers_.insert(std::make_pair(md5sum, chunk_header));
 
@@ -193,6 +206,51 @@ class FakeBackupVolume : public BackupVolumeInterface {
     return Status::OK;
   }
 
+  virtual Status ReadChunks(const std::vector<FileChunk>& chunks,
+                            std::vector<std::string>* data_out,
+                            std::vector<EncodingType>* encoding_types_out) {
+    data_out->resize(chunks.size());
+    encoding_types_out->resize(chunks.size());
+    for (uint64_t index = 0; index < chunks.size(); ++index) {
+      Status retval = ReadChunk(chunks[index], &(*data_out)[index],
+                                &(*encoding_types_out)[index]);
+      if (!retval.ok()) {
+        return retval;
+      }
+    }
+    return Status::OK;
+  }
+
+  // Chunks are returned in no particular order, at least one per call.
+  virtual Status ReadStoredChunks(uint64_t first_chunk, uint64_t max_bytes,
+                                  std::vector<StoredChunk>* chunks_out) {
+    chunks_out->clear();
+    uint64_t index = 0;
+    uint64_t bytes = 0;
+    for (auto iter : chunk_data_) {
+      if (index++ < first_chunk) {
+        continue;
+      }
+      if (!chunks_out->empty() && bytes + iter.second.size() > max_bytes) {
+        break;
+      }
+      StoredChunk stored;
+      chunks_.GetChunk(iter.first, &stored.descriptor);
+      stored.header = chunk_headers_[iter.first];
+      stored.data = iter.second;
+      chunks_out->push_back(stored);
+      bytes += iter.second.size();
+    }
+    return Status::OK;
+  }
+
+  virtual Status LocateChunksData(
+      const std::vector<FileChunk>& /* chunks */,
+      std::vector<ChunkHeader>* /* headers_out */,
+      std::vector<uint64_t>* /* data_offsets_out */) {
+    return Status::NOT_IMPLEMENTED;
+  }
+
   virtual Status Close() { return Status::OK; }
 
   // Note, the fileset here won't be available when queried.
@@ -204,6 +262,9 @@ class FakeBackupVolume : public BackupVolumeInterface {
   virtual Status Cancel() { return Status::OK; }
   virtual uint64_t EstimatedSize() const { return estimated_size_; }
   virtual uint64_t DiskSize() const { return estimated_size_; }
+  virtual uint64_t EstimatedMemoryUsage() const {
+    return chunks_.size() * sizeof(BackupDescriptor1Chunk);
+  }
   virtual uint64_t volume_number() const {
     return volume_number_;
   }
@@ -214,6 +275,7 @@ class FakeBackupVolume : public BackupVolumeInterface {
   virtual bool is_completed_volume() const {
     return init_status_.ok() && !cancelled_;
   }
+  virtual bool has_chunk_crcs() const { return false; }
 
  private:
   MockFile* file_;
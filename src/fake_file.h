@@ -126,10 +126,19 @@ class FakeFile : public FileInterface {
     return Status::OK;
   }
 
+  virtual Status Truncate(uint64_t size) {
+    data_.resize(size);
+    return Status::OK;
+  }
+
   virtual Status Flush() {
     return Status::OK;
   }
 
+  virtual Status Sync() {
+    return Status::OK;
+  }
+
   virtual Status CreateDirectories(bool strip_leaf) {
     return Status::OK;
   }
@@ -164,6 +173,10 @@ class FakeFile : public FileInterface {
     return Status::OK;
   }
 
+  virtual Status GetExtents(std::vector<FileExtent>* /* extents_out */) {
+    return Status::NOT_IMPLEMENTED;
+  }
+
   //////////////////
 
   // Make the current contents the expected contents and reset for the test.
@@ -8,15 +8,30 @@
 #define FSEEK64 _fseeki64
 #define FTELL64 _ftelli64
 #define ERROR
+#include <io.h>
 #include <windows.h>
 #undef ERROR
 #else
+#include <sys/stat.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <linux/fiemap.h>
+#include <linux/fs.h>
+#include <linux/magic.h>
+#include <sys/ioctl.h>
+#include <sys/vfs.h>
+#endif  // __linux__
 #define FSEEK64 fseeko
 #define FTELL64 ftello
 #endif  // _WIN32
 
+#include <fcntl.h>
+
 #include <algorithm>
+#include <memory>
+#include <mutex>
 #include <string>
+#include <utility>
 #include <vector>
 
 #include "boost/algorithm/string/classification.hpp"
@@ -27,18 +42,38 @@
 #include "src/backup_volume_defs.h"
 #include "src/file.h"
 #include "src/fileset.h"
+#include "src/path.h"
 #include "src/status.h"
 
+using std::lock_guard;
+using std::make_pair;
+using std::mutex;
+using std::pair;
 using std::string;
+using std::unique_ptr;
 using std::vector;
 
 namespace backup2 {
+namespace {
+
+// Write buffers of closed files, kept for the next files written.
+struct BufferPool {
+  mutex pool_mutex;
+  vector<unique_ptr<char[]> > buffers;
+};
+
+BufferPool* GetBufferPool() {
+  static BufferPool* pool = new BufferPool;
+  return pool;
+}
+
+}  // namespace
 
 File::File(const string& filename)
     : filename_(filename),
       file_(NULL),
       mode_(kModeInvalid),
-      buffer_(new char[kFlushSize * 2]),
+      buffer_(),
       buffer_size_(0) {
 }
 
@@ -48,6 +83,27 @@ File::~File() {
   }
 }
 
+unique_ptr<char[]> File::AcquireBuffer() {
+  BufferPool* pool = GetBufferPool();
+  {
+    lock_guard<mutex> lock(pool->pool_mutex);
+    if (!pool->buffers.empty()) {
+      unique_ptr<char[]> buffer(std::move(pool->buffers.back()));
+      pool->buffers.pop_back();
+      return buffer;
+    }
+  }
+  return unique_ptr<char[]>(new char[kBufferSize]);
+}
+
+void File::ReleaseBuffer(unique_ptr<char[]> buffer) {
+  BufferPool* pool = GetBufferPool();
+  lock_guard<mutex> lock(pool->pool_mutex);
+  if (pool->buffers.size() < kMaxPooledBuffers) {
+    pool->buffers.push_back(std::move(buffer));
+  }
+}
+
 bool File::Exists() {
   return boost::filesystem::exists(boost::filesystem::path(filename_));
 }
@@ -87,16 +143,15 @@ vector<string> File::ListDirectory() {
 }
 
 string File::RootName() {
-  return boost::filesystem::path(filename_)
-      .root_path().make_preferred().string();
+  return RootPath(filename_);
 }
 
 string File::ProperName() {
-  return boost::filesystem::path(filename_).make_preferred().string();
+  return ProperPath(filename_);
 }
 
 string File::GenericName() {
-  return boost::filesystem::path(filename_).generic_string();
+  return GenericPath(filename_);
 }
 
 Status File::Open(const Mode mode) {
@@ -152,6 +207,9 @@ Status File::Close() {
       return retval;
     }
   }
+  if (buffer_) {
+    ReleaseBuffer(std::move(buffer_));
+  }
   if (fclose(file_) == -1) {
     return Status(kStatusCorruptBackup, strerror(errno));
   }
@@ -288,7 +346,11 @@ Status File::ReadLines(vector<string>* lines) {
 
 Status File::Write(const void* buffer, size_t length) {
   CHECK_NOTNULL(file_);
-  if (buffer_size_ + length > kFlushSize * 2) {
+  CHECK_NE(kModeRead, mode_) << "File not open for writing";
+  if (!buffer_) {
+    buffer_ = AcquireBuffer();
+  }
+  if (buffer_size_ + length > kBufferSize) {
     // If we put this in the buffer, it'll overflow.  Flush first, then buffer.
     Status retval = Flush();
     if (!retval.ok()) {
@@ -332,13 +394,202 @@ Status File::Flush() {
   return Status::OK;
 }
 
+Status File::Sync() {
+  if (file_) {
+    Status retval = Flush();
+    LOG_RETURN_IF_ERROR(retval, "Couldn't flush before syncing");
+    if (fflush(file_) != 0) {
+      return Status(kStatusFileError, strerror(errno));
+    }
+#ifdef _WIN32
+    int result = _commit(_fileno(file_));
+#else
+    int result = fsync(fileno(file_));
+#endif  // _WIN32
+    if (result != 0) {
+      LOG(ERROR) << "Error syncing " << filename_ << ": " << strerror(errno);
+      return Status(kStatusFileError, strerror(errno));
+    }
+    return Status::OK;
+  }
+
+#ifdef _WIN32
+  // Directory entries can't be synced on Windows; NTFS journals them itself.
+  if (IsDirectory()) {
+    return Status::OK;
+  }
+  int fd = _open(filename_.c_str(), _O_RDWR | _O_BINARY);
+#else
+  int fd = open(filename_.c_str(), O_RDONLY);
+#endif  // _WIN32
+  if (fd == -1) {
+    return Status(kStatusFileError, strerror(errno));
+  }
+#ifdef _WIN32
+  int result = _commit(fd);
+  int sync_errno = errno;
+  _close(fd);
+#else
+  int result = fsync(fd);
+  int sync_errno = errno;
+  close(fd);
+#endif  // _WIN32
+  if (result != 0) {
+    LOG(ERROR) << "Error syncing " << filename_ << ": " << strerror(sync_errno);
+    return Status(kStatusFileError, strerror(sync_errno));
+  }
+  return Status::OK;
+}
+
+Status File::Truncate(uint64_t size) {
+  CHECK_NOTNULL(file_);
+  Status retval = Flush();
+  LOG_RETURN_IF_ERROR(retval, "Couldn't flush before truncating");
+  if (fflush(file_) != 0) {
+    return Status(kStatusFileError, strerror(errno));
+  }
+
+#ifdef _WIN32
+  int result = _chsize_s(_fileno(file_), size);
+#else
+  int result = ftruncate(fileno(file_), size);
+#endif  // _WIN32
+  if (result != 0) {
+    LOG(ERROR) << "Error truncating " << filename_ << " to " << size << ": "
+               << strerror(errno);
+    return Status(kStatusFileError, strerror(errno));
+  }
+  return Status::OK;
+}
+
+Status File::WriteAt(uint64_t offset, const void* buffer, size_t length) {
+  CHECK_NOTNULL(file_);
+  Status retval = Flush();
+  LOG_RETURN_IF_ERROR(retval, "Couldn't flush before writing");
+  if (fflush(file_) != 0) {
+    return Status(kStatusFileError, strerror(errno));
+  }
+
+#ifdef _WIN32
+  int64_t position = Tell();
+  retval = Seek(offset);
+  if (retval.ok()) {
+    retval = Write(buffer, length);
+  }
+  if (retval.ok()) {
+    retval = Flush();
+  }
+  if (retval.ok()) {
+    retval = Seek(position);
+  }
+  return retval;
+#else
+  const char* data = static_cast<const char*>(buffer);
+  while (length > 0) {
+    ssize_t written = pwrite(fileno(file_), data, length, offset);
+    if (written < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      LOG(ERROR) << "Error writing " << filename_ << " at " << offset << ": "
+                 << strerror(errno);
+      return Status(kStatusFileError, strerror(errno));
+    }
+    data += written;
+    offset += written;
+    length -= written;
+  }
+  return Status::OK;
+#endif  // _WIN32
+}
+
+Status File::PunchHole(uint64_t offset, uint64_t length) {
+  CHECK_NOTNULL(file_);
+  Status retval = Flush();
+  LOG_RETURN_IF_ERROR(retval, "Couldn't flush before punching hole");
+  if (fflush(file_) != 0) {
+    return Status(kStatusFileError, strerror(errno));
+  }
+
+#if defined(__linux__) && defined(FALLOC_FL_PUNCH_HOLE)
+  if (fallocate(fileno(file_), FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+                offset, length) == 0) {
+    return Status::OK;
+  }
+  if (errno == EOPNOTSUPP) {
+    return Status(kStatusNotImplemented, "Filesystem doesn't support holes");
+  }
+  LOG(ERROR) << "Error punching hole in " << filename_ << ": "
+             << strerror(errno);
+  return Status(kStatusFileError, strerror(errno));
+#else
+  return Status(kStatusNotImplemented, "Holes not supported");
+#endif  // __linux__ && FALLOC_FL_PUNCH_HOLE
+}
+
+Status File::GetHoles(vector<pair<uint64_t, uint64_t> >* holes_out) {
+  CHECK_NOTNULL(file_);
+  holes_out->clear();
+
+#if defined(__linux__) && defined(SEEK_HOLE)
+  uint64_t file_size = 0;
+  Status retval = size(&file_size);
+  LOG_RETURN_IF_ERROR(retval, "Couldn't get size to find holes");
+  int64_t position = Tell();
+  retval = Flush();
+  LOG_RETURN_IF_ERROR(retval, "Couldn't flush before finding holes");
+  if (fflush(file_) != 0) {
+    return Status(kStatusFileError, strerror(errno));
+  }
+
+  // Skip from each hole to the data after it.  Filesystems without holes
+  // report all of the file as data.
+  int fd = fileno(file_);
+  uint64_t offset = 0;
+  while (offset < file_size) {
+    off_t hole = lseek(fd, offset, SEEK_HOLE);
+    if (hole < 0) {
+      if (errno == EINVAL) {
+        return Status(kStatusNotImplemented, "Filesystem doesn't find holes");
+      }
+      return Status(kStatusFileError, strerror(errno));
+    }
+    if (static_cast<uint64_t>(hole) >= file_size) {
+      break;
+    }
+
+    // With no data after the hole, it runs to the end of the file.
+    off_t data = lseek(fd, hole, SEEK_DATA);
+    if (data < 0 && errno != ENXIO) {
+      return Status(kStatusFileError, strerror(errno));
+    }
+    offset = data < 0 ? file_size : std::min<uint64_t>(data, file_size);
+    holes_out->push_back(make_pair(hole, offset - hole));
+  }
+
+  // Put the stream back where it was.
+  return Seek(position);
+#else
+  return Status(kStatusNotImplemented, "Holes not supported");
+#endif  // __linux__ && SEEK_HOLE
+}
+
 Status File::CreateDirectories(bool strip_leaf) {
   boost::filesystem::path orig_path(filename_);
+  boost::system::error_code error_code;
   if (strip_leaf) {
     boost::filesystem::path parent = orig_path.parent_path();
-    boost::filesystem::create_directories(parent);
+    if (!parent.empty()) {
+      boost::filesystem::create_directories(parent, error_code);
+    }
   } else {
-    boost::filesystem::create_directories(orig_path);
+    boost::filesystem::create_directories(orig_path, error_code);
+  }
+
+  if (error_code.value() != 0) {
+    LOG(ERROR) << "Error creating directories: " << error_code.message();
+    return Status(kStatusFileError,
+                  "Error creating directories: " + error_code.message());
   }
   return Status::OK;
 }
@@ -359,8 +610,7 @@ Status File::CreateSymlink(string target) {
 }
 
 string File::RelativePath() {
-  boost::filesystem::path orig_path(filename_);
-  return orig_path.relative_path().string();
+  return backup2::RelativePath(filename_);
 }
 
 Status File::RestoreAttributes(const FileEntry& entry) {
@@ -433,6 +683,7 @@ Status File::FillBackupFile(BackupFile* metadata, string* symlink_target) {
                     "Cannot handle file type for " + filename_);
       break;
   }
+  FillFileIdentity(metadata);
   return Status::OK;
 }
 
@@ -501,6 +752,164 @@ Status File::size(uint64_t* size_out) const {
   return Status::OK;
 }
 
+#ifdef __linux__
+Status File::GetExtents(vector<FileExtent>* extents_out) {
+  if (!file_) {
+    return Status(kStatusInvalidArgument, "File not open: " + filename_);
+  }
+  int fd = fileno(file_);
+
+  // Only btrfs reliably writes changed data to a new location -- other
+  // filesystems (including XFS with reflinks) overwrite unshared blocks in
+  // place.  Even on btrfs, files marked no-copy-on-write are overwritten.
+  struct statfs fs_buf;
+  if (fstatfs(fd, &fs_buf) != 0 || fs_buf.f_type != BTRFS_SUPER_MAGIC) {
+    return Status(kStatusNotImplemented,
+                  "Filesystem may overwrite data in place");
+  }
+  int attributes = 0;
+  if (ioctl(fd, FS_IOC_GETFLAGS, &attributes) != 0 ||
+      (attributes & FS_NOCOW_FL)) {
+    return Status(kStatusNotImplemented, "File may be overwritten in place");
+  }
+
+  // Fetch the extents in batches until we see the last one.  Syncing the file
+  // first gives delayed allocations a real location.
+  static const uint32_t kExtentsPerCall = 256;
+  unique_ptr<char[]> buffer(
+      new char[sizeof(struct fiemap) +
+               kExtentsPerCall * sizeof(struct fiemap_extent)]);
+  struct fiemap* fiemap = reinterpret_cast<struct fiemap*>(buffer.get());
+
+  vector<FileExtent> extents;
+  uint64_t next_offset = 0;
+  bool found_last = false;
+  while (!found_last) {
+    memset(fiemap, 0, sizeof(struct fiemap));
+    fiemap->fm_start = next_offset;
+    fiemap->fm_length = FIEMAP_MAX_OFFSET - next_offset;
+    fiemap->fm_flags = FIEMAP_FLAG_SYNC;
+    fiemap->fm_extent_count = kExtentsPerCall;
+    if (ioctl(fd, FS_IOC_FIEMAP, fiemap) != 0) {
+      return Status(kStatusNotImplemented,
+                    "Could not get extents of " + filename_);
+    }
+    if (fiemap->fm_mapped_extents == 0) {
+      break;
+    }
+
+    for (uint32_t i = 0; i < fiemap->fm_mapped_extents; ++i) {
+      const struct fiemap_extent& extent = fiemap->fm_extents[i];
+
+      // Data without a location of its own (inline or packed with other data),
+      // or stored encoded, can't be compared by location.
+      if (extent.fe_flags & (FIEMAP_EXTENT_UNKNOWN |
+                             FIEMAP_EXTENT_DELALLOC |
+                             FIEMAP_EXTENT_ENCODED |
+                             FIEMAP_EXTENT_NOT_ALIGNED)) {
+        return Status(kStatusNotImplemented,
+                      "Extents of " + filename_ + " have no fixed location");
+      }
+
+      FileExtent file_extent;
+      file_extent.logical_offset = extent.fe_logical;
+      file_extent.physical_offset = extent.fe_physical;
+      file_extent.length = extent.fe_length;
+      extents.push_back(file_extent);
+
+      next_offset = extent.fe_logical + extent.fe_length;
+      if (extent.fe_flags & FIEMAP_EXTENT_LAST) {
+        found_last = true;
+      }
+    }
+  }
+  extents_out->swap(extents);
+  return Status::OK;
+}
+#else  // __linux__
+Status File::GetExtents(vector<FileExtent>* /* extents_out */) {
+  return Status::NOT_IMPLEMENTED;
+}
+#endif  // __linux__
+
+Status File::CopyRangeFrom(File* source, uint64_t source_offset,
+                           uint64_t length, uint64_t dest_offset) {
+  CHECK_NOTNULL(file_);
+  CHECK_NOTNULL(source->file_);
+
+  // Both files need to be consistent on disk for the kernel to copy them.
+  Status retval = Flush();
+  LOG_RETURN_IF_ERROR(retval, "Couldn't flush before copying");
+  retval = source->Flush();
+  LOG_RETURN_IF_ERROR(retval, "Couldn't flush source before copying");
+  if (fflush(file_) != 0 || fflush(source->file_) != 0) {
+    return Status(kStatusFileError, strerror(errno));
+  }
+
+#ifdef __linux__
+  int source_fd = fileno(source->file_);
+  int dest_fd = fileno(file_);
+
+#ifdef FICLONERANGE
+  // Share the data outright if the filesystem supports it.  Clones must cover
+  // whole blocks, at the same position within a block in both files.
+  struct stat stat_buf;
+  if (length > 0 && fstat(dest_fd, &stat_buf) == 0 &&
+      stat_buf.st_blksize > 0) {
+    uint64_t block_size = stat_buf.st_blksize;
+    if (source_offset % block_size == 0 && dest_offset % block_size == 0 &&
+        length % block_size == 0) {
+      struct file_clone_range range;
+      range.src_fd = source_fd;
+      range.src_offset = source_offset;
+      range.src_length = length;
+      range.dest_offset = dest_offset;
+      if (ioctl(dest_fd, FICLONERANGE, &range) == 0) {
+        return Status::OK;
+      }
+    }
+  }
+#endif  // FICLONERANGE
+
+#if defined(__GLIBC__) && __GLIBC_PREREQ(2, 27)
+  // Have the kernel copy the data, which also lets filesystems and network
+  // shares copy it without it coming through here.
+  while (length > 0) {
+    loff_t in_offset = source_offset;
+    loff_t out_offset = dest_offset;
+    ssize_t copied = copy_file_range(source_fd, &in_offset, dest_fd,
+                                     &out_offset, length, 0);
+    if (copied <= 0) {
+      // Not supported between these files, or the source ended early.  Let
+      // the buffered copy below finish the job or report the problem.
+      break;
+    }
+    source_offset += copied;
+    dest_offset += copied;
+    length -= copied;
+  }
+#endif  // __GLIBC_PREREQ(2, 27)
+#endif  // __linux__
+
+  unique_ptr<char[]> buffer(new char[std::min(length, kCopyBufferSize)]);
+  while (length > 0) {
+    uint64_t block_length = std::min(length, kCopyBufferSize);
+    retval = source->Seek(source_offset);
+    LOG_RETURN_IF_ERROR(retval, "Couldn't seek in source");
+    retval = source->Read(buffer.get(), block_length, NULL);
+    LOG_RETURN_IF_ERROR(retval, "Couldn't read source");
+    retval = Seek(dest_offset);
+    LOG_RETURN_IF_ERROR(retval, "Couldn't seek in destination");
+    retval = Write(buffer.get(), block_length);
+    LOG_RETURN_IF_ERROR(retval, "Couldn't write destination");
+
+    source_offset += block_length;
+    dest_offset += block_length;
+    length -= block_length;
+  }
+  return Status::OK;
+}
+
 Status File::FilenameToVolumeNumber(
     const boost::filesystem::path filename,
     uint64_t* vol_num, boost::filesystem::path* base_name) {
@@ -566,6 +975,25 @@ uint64_t File::GetAttributes() {
 #endif  // _WIN32
 }
 
+void File::FillFileIdentity(BackupFile* metadata) {
+#ifdef _WIN32
+  // Windows doesn't give us inode numbers or change times in a form that's
+  // cheap to get, so these are left unset.
+  metadata->device_id = 0;
+  metadata->inode = 0;
+  metadata->change_date = 0;
+#else  // _WIN32
+  struct stat stat_buf;
+  if (lstat(filename_.c_str(), &stat_buf) != 0) {
+    LOG(WARNING) << "Could not stat " << filename_;
+    return;
+  }
+  metadata->device_id = static_cast<uint64_t>(stat_buf.st_dev);
+  metadata->inode = static_cast<uint64_t>(stat_buf.st_ino);
+  metadata->change_date = static_cast<uint64_t>(stat_buf.st_ctime);
+#endif  // _WIN32
+}
+
 #ifdef _WIN32
 void File::SetAttributes(uint64_t attributes) {
   DWORD win_attributes = static_cast<DWORD>(attributes);
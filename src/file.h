@@ -3,7 +3,9 @@
 #ifndef BACKUP2_SRC_FILE_H_
 #define BACKUP2_SRC_FILE_H_
 
+#include <memory>
 #include <string>
+#include <utility>
 #include <vector>
 
 #include "boost/filesystem.hpp"
@@ -13,6 +15,9 @@
 namespace backup2 {
 class FileEntry;
 
+// A File is a handle for I/O on a file.  Creating one is cheap; the write
+// buffer is only allocated once the file is written to.  Code that only needs
+// to convert between forms of a path should use the functions in path.h.
 class File : public FileInterface {
  public:
   explicit File(const std::string& filename);
@@ -37,7 +42,9 @@ class File : public FileInterface {
   virtual Status Read(void* buffer, size_t length, size_t* read_bytes);
   virtual Status ReadLines(std::vector<std::string>* strings);
   virtual Status Write(const void* buffer, size_t length);
+  virtual Status Truncate(uint64_t size);
   virtual Status Flush();
+  virtual Status Sync();
   virtual Status CreateDirectories(bool strip_leaf);
   virtual Status CreateSymlink(std::string target);
   virtual std::string RelativePath();
@@ -48,10 +55,49 @@ class File : public FileInterface {
       std::string* basename_out, uint64_t* last_vol_out,
       uint64_t* num_vols_out);
   virtual Status size(uint64_t* size_out) const;
+  virtual Status GetExtents(std::vector<FileExtent>* extents_out);
+
+  // Write length bytes from buffer at the given offset of the open file,
+  // without moving the file position or going through the write buffer.
+  // Buffered writes are flushed first.
+  Status WriteAt(uint64_t offset, const void* buffer, size_t length);
+
+  // Deallocate the given range of the open file, leaving a hole that reads as
+  // zeros, without changing the file's size.  Returns kStatusNotImplemented if
+  // the filesystem doesn't support holes.
+  Status PunchHole(uint64_t offset, uint64_t length);
+
+  // Get the holes of the open file, as sorted (offset, length) ranges that
+  // read as zeros without being stored.  Returns kStatusNotImplemented if the
+  // filesystem can't tell where the holes are.
+  Status GetHoles(std::vector<std::pair<uint64_t, uint64_t> >* holes_out);
+
+  // Copy length bytes at source_offset in the open source file to dest_offset
+  // in this open file.  Where the filesystem allows, the data is shared
+  // between the files rather than copied (reflinked), or else copied within
+  // the kernel.  Otherwise, it's copied through a buffer.  The file positions
+  // of both files are undefined afterwards.
+  Status CopyRangeFrom(File* source, uint64_t source_offset, uint64_t length,
+                       uint64_t dest_offset);
 
  private:
+  // Size of the buffer used by CopyRangeFrom() when the kernel can't copy.
+  static const uint64_t kCopyBufferSize = 1024 * 1024;
+
   static const uint64_t kFlushSize = 1024 * 1024 * 10;
 
+  // Size of the write buffer.
+  static const uint64_t kBufferSize = kFlushSize * 2;
+
+  // Maximum number of unused write buffers kept for re-use.
+  static const uint64_t kMaxPooledBuffers = 4;
+
+  // Take a write buffer from the pool shared by all files, allocating one if
+  // the pool is empty, or return one to it.  These are safe to call from
+  // multiple threads at once.
+  static std::unique_ptr<char[]> AcquireBuffer();
+  static void ReleaseBuffer(std::unique_ptr<char[]> buffer);
+
   // Given a path, decode from it the base path and the volume number it
   // represents.
   Status FilenameToVolumeNumber(
@@ -62,6 +108,9 @@ class File : public FileInterface {
   uint64_t GetAttributes();
   void SetAttributes(uint64_t attributes);
 
+  // Fill in the device, inode, and change date of the file in the metadata.
+  void FillFileIdentity(BackupFile* metadata);
+
   const std::string filename_;
   FILE* file_;
   FileInterface::Mode mode_;
@@ -70,9 +119,10 @@ class File : public FileInterface {
   // least kFlushSize bytes once the buffer reaches that size.  This way we're
   // not making a million tiny inefficient writes.
   //
-  // The buffer is statically allocated to kFlushSize * 2 to avoid doing lots of
-  // memory allocation during the backup, and to allow us to go over the flush
-  // size by some amount.
+  // The buffer is kBufferSize, to allow us to go over the flush size by some
+  // amount.  It's taken from the pool on the first write, and returned when
+  // the file is closed, so files never written don't allocate one and files
+  // written one after another share them.
   std::unique_ptr<char[]> buffer_;
   uint64_t buffer_size_;
 };
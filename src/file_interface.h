@@ -3,6 +3,8 @@
 #ifndef BACKUP2_SRC_FILE_INTERFACE_H_
 #define BACKUP2_SRC_FILE_INTERFACE_H_
 
+#include <stdint.h>
+
 #include <string>
 #include <vector>
 
@@ -12,6 +14,24 @@ namespace backup2 {
 struct BackupFile;
 class FileEntry;
 
+// A contiguous range of a file's data and where it lives on disk.
+struct FileExtent {
+  // Offset of the range in the file.
+  uint64_t logical_offset;
+
+  // Offset of the range on the underlying device.
+  uint64_t physical_offset;
+
+  // Length of the range.
+  uint64_t length;
+
+  bool operator==(const FileExtent& rhs) const {
+    return logical_offset == rhs.logical_offset &&
+           physical_offset == rhs.physical_offset &&
+           length == rhs.length;
+  }
+};
+
 class FileInterface {
  public:
   enum Mode {
@@ -86,11 +106,21 @@ class FileInterface {
   // happen at the end of the file.
   virtual Status Write(const void* buffer, size_t length) = 0;
 
+  // Truncate or extend the open file to the given size.  Any buffered writes
+  // are flushed first.
+  virtual Status Truncate(uint64_t size) = 0;
+
   // Flush any unwritten content to the disk.  If the file implementation
   // supports buffering, this can be used to flush the buffer to disk.
   // Otherwise, this is does nothing successfully.
   virtual Status Flush() = 0;
 
+  // Flush the file's content and wait until it's on the disk, so it survives a
+  // crash or power loss.  If the file isn't open, it's opened just for the
+  // sync; this also works on directories, to make the files created in or
+  // removed from them durable.
+  virtual Status Sync() = 0;
+
   // Create the directories recursively leading to the file represented by this
   // class.  If strip_leaf is false, the filename pointed to by this File is
   // taken to be a directory as well, and it is not stripped.
@@ -121,6 +151,12 @@ class FileInterface {
 
   // Return the current size of the file.
   virtual Status size(uint64_t* size_out) const = 0;
+
+  // Get the extents of the open file, sorted by offset.  Extents are only
+  // returned where the filesystem never overwrites data in place, so that
+  // unchanged extents mean unchanged data.  Returns kStatusNotImplemented if
+  // that isn't the case, or the extents can't be determined.
+  virtual Status GetExtents(std::vector<FileExtent>* extents_out) = 0;
 };
 
 }  // namespace backup2
@@ -0,0 +1,241 @@
+// Copyright (C) 2013, All Rights Reserved.
+// Author: Cory Maccarrone <darkstar6262@gmail.com>
+
+#include "src/file_state_cache.h"
+
+#include <algorithm>
+#include <iterator>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "boost/filesystem.hpp"
+#include "boost/interprocess/exceptions.hpp"
+#include "boost/interprocess/file_mapping.hpp"
+#include "boost/interprocess/mapped_region.hpp"
+#include "boost/system/error_code.hpp"
+#include "glog/logging.h"
+#include "src/backup_volume_defs.h"
+#include "src/file.h"
+#include "src/fileset.h"
+#include "src/md5_generator_interface.h"
+#include "src/status.h"
+
+using boost::interprocess::file_mapping;
+using boost::interprocess::interprocess_exception;
+using boost::interprocess::mapped_region;
+using boost::interprocess::read_only;
+using std::string;
+using std::unique_ptr;
+using std::vector;
+
+namespace backup2 {
+namespace {
+
+// Order records by path hash, which is how they're stored on disk.
+bool RecordLessThan(const FileStateRecord& lhs, const FileStateRecord& rhs) {
+  return lhs.path_hash < rhs.path_hash;
+}
+
+}  // namespace
+
+const std::string FileStateCache::kFileVersion = "FSC_0001";
+
+FileStateCache::FileStateCache(Md5GeneratorInterface* md5_maker)
+    : md5_maker_(md5_maker),
+      records_(NULL) {
+}
+
+FileStateCache::~FileStateCache() {
+}
+
+Status FileStateCache::Load(const string& filename) {
+  Unload();
+
+  boost::system::error_code error_code;
+  uint64_t file_size = boost::filesystem::file_size(
+      boost::filesystem::path(filename), error_code);
+  if (error_code.value() != 0) {
+    return Status(kStatusNoSuchFile, "No file state cache");
+  }
+  if (file_size < sizeof(FileStateCacheHeader)) {
+    LOG(ERROR) << "File state cache too short: " << filename;
+    return Status(kStatusCorruptBackup, "File state cache too short");
+  }
+
+  try {
+    mapping_.reset(new file_mapping(filename.c_str(), read_only));
+    region_.reset(new mapped_region(*mapping_, read_only));
+  } catch(const interprocess_exception& e) {
+    LOG(ERROR) << "Could not map file state cache: " << e.what();
+    Unload();
+    return Status(kStatusFileError, "Could not map file state cache");
+  }
+
+  const char* data = static_cast<const char*>(region_->get_address());
+  FileStateCacheHeader header;
+  memcpy(&header, data, sizeof(FileStateCacheHeader));
+
+  if (string(header.version, sizeof(header.version)) != kFileVersion) {
+    LOG(ERROR) << "Unrecognized file state cache: " << filename;
+    Unload();
+    return Status(kStatusCorruptBackup, "Not a recognized file state cache");
+  }
+  if (file_size != sizeof(FileStateCacheHeader) +
+                   header.num_records * sizeof(FileStateRecord)) {
+    LOG(ERROR) << "File state cache size mismatch: " << filename;
+    Unload();
+    return Status(kStatusCorruptBackup, "File state cache size mismatch");
+  }
+
+  header_ = header;
+  records_ = reinterpret_cast<const FileStateRecord*>(
+      data + sizeof(FileStateCacheHeader));
+  return Status::OK;
+}
+
+const FileStateRecord* FileStateCache::Find(
+    const string& generic_filename) const {
+  if (!records_) {
+    return NULL;
+  }
+
+  FileStateRecord key;
+  key.path_hash = md5_maker_->Checksum(generic_filename);
+
+  const FileStateRecord* end = records_ + header_.num_records;
+  const FileStateRecord* record = std::lower_bound(
+      records_, end, key, RecordLessThan);
+  if (record == end || record->path_hash != key.path_hash) {
+    return NULL;
+  }
+  return record;
+}
+
+bool FileStateCache::FileChanged(const string& generic_filename,
+                                 const BackupFile& metadata) const {
+  const FileStateRecord* record = Find(generic_filename);
+  if (!record) {
+    return true;
+  }
+  return RecordChanged(*record, metadata);
+}
+
+bool FileStateCache::RecordChanged(const FileStateRecord& record,
+                                   const BackupFile& metadata) {
+  // Files are compared exactly as when they're carried forward.
+  BackupFile previous;
+  previous.file_type = static_cast<BackupFile::FileType>(record.file_type);
+  previous.device_id = record.device_id;
+  previous.inode = record.inode;
+  previous.file_size = record.file_size;
+  previous.modify_date = record.modify_date;
+  previous.change_date = record.change_date;
+  return BackupFileChanged(previous, metadata);
+}
+
+FileStateRecord FileStateCache::MakeRecord(const FileEntry& entry,
+                                           uint64_t backup_volume,
+                                           uint64_t backup_offset) const {
+  const BackupFile* metadata = entry.GetBackupFile();
+
+  FileStateRecord record;
+  record.path_hash = md5_maker_->Checksum(entry.generic_filename());
+  record.file_type = metadata->file_type;
+  record.device_id = metadata->device_id;
+  record.inode = metadata->inode;
+  record.file_size = metadata->file_size;
+  record.modify_date = metadata->modify_date;
+  record.change_date = metadata->change_date;
+  record.backup_volume = backup_volume;
+  record.backup_offset = backup_offset;
+  return record;
+}
+
+Status FileStateCache::Write(const string& filename, const FileSet& fileset,
+                             uint64_t label_id, uint64_t backup_volume,
+                             uint64_t backup_offset, bool merge) {
+  // Build the records for the file set, sorted for lookup.  Files spilled
+  // from the file set are read back a batch at a time.
+  vector<FileStateRecord> new_records;
+  new_records.reserve(fileset.num_files());
+  for (const FileEntry* entry : fileset.GetFiles()) {
+    new_records.push_back(MakeRecord(*entry, backup_volume, backup_offset));
+  }
+  uint64_t spilled_offset = 0;
+  while (spilled_offset < fileset.spilled_size()) {
+    vector<unique_ptr<FileEntry> > spilled;
+    Status retval = fileset.ReadSpilledFiles(&spilled_offset,
+                                             FileSet::kSpilledBatchSize,
+                                             &spilled);
+    LOG_RETURN_IF_ERROR(retval, "Could not read spilled files");
+    for (const unique_ptr<FileEntry>& entry : spilled) {
+      new_records.push_back(MakeRecord(*entry, backup_volume, backup_offset));
+    }
+  }
+  std::sort(new_records.begin(), new_records.end(), RecordLessThan);
+
+  // Fold in the existing records.  Where both have a file, the new record is
+  // the one kept.
+  vector<FileStateRecord> records;
+  if (merge && records_) {
+    records.reserve(new_records.size() + header_.num_records);
+    std::set_union(new_records.begin(), new_records.end(),
+                   records_, records_ + header_.num_records,
+                   std::back_inserter(records), RecordLessThan);
+  } else {
+    records.swap(new_records);
+  }
+
+  FileStateCacheHeader header;
+  memcpy(header.version, kFileVersion.data(), sizeof(header.version));
+  header.label_id = label_id;
+  header.backup_volume = backup_volume;
+  header.backup_offset = backup_offset;
+  header.num_records = records.size();
+
+  // Write everything out to a temporary file first.
+  string temp_filename = filename + ".tmp";
+  unique_ptr<File> file(new File(temp_filename));
+  if (file->Exists()) {
+    Status retval = file->Unlink();
+    LOG_RETURN_IF_ERROR(retval, "Could not remove old file state cache");
+  }
+
+  Status retval = file->Open(File::Mode::kModeAppend);
+  LOG_RETURN_IF_ERROR(retval, "Could not open file state cache");
+
+  retval = file->Write(&header, sizeof(FileStateCacheHeader));
+  LOG_RETURN_IF_ERROR(retval, "Could not write file state cache header");
+
+  for (const FileStateRecord& record : records) {
+    retval = file->Write(&record, sizeof(FileStateRecord));
+    LOG_RETURN_IF_ERROR(retval, "Could not write file state record");
+  }
+
+  retval = file->Close();
+  LOG_RETURN_IF_ERROR(retval, "Could not close file state cache");
+
+  // The old cache has to be unmapped before it can be replaced.
+  Unload();
+
+  boost::system::error_code error_code;
+  boost::filesystem::rename(boost::filesystem::path(temp_filename),
+                            boost::filesystem::path(filename), error_code);
+  if (error_code.value() != 0) {
+    LOG(ERROR) << "Could not move file state cache into place: "
+               << error_code.message();
+    return Status(kStatusFileError,
+                  "Could not move file state cache: " + error_code.message());
+  }
+  return Status::OK;
+}
+
+void FileStateCache::Unload() {
+  records_ = NULL;
+  region_.reset();
+  mapping_.reset();
+  header_ = FileStateCacheHeader();
+}
+
+}  // namespace backup2
@@ -0,0 +1,153 @@
+// Copyright (C) 2013, All Rights Reserved.
+// Author: Cory Maccarrone <darkstar6262@gmail.com>
+#ifndef BACKUP2_SRC_FILE_STATE_CACHE_H_
+#define BACKUP2_SRC_FILE_STATE_CACHE_H_
+
+#include <string.h>
+
+#include <memory>
+#include <string>
+
+#include "src/common.h"
+#include "src/status.h"
+
+namespace boost {
+namespace interprocess {
+class file_mapping;
+class mapped_region;
+}  // namespace interprocess
+}  // namespace boost
+
+namespace backup2 {
+struct BackupFile;
+class FileEntry;
+class FileSet;
+class Md5GeneratorInterface;
+
+#pragma pack(push, 4)
+
+// Header of a file state cache file.  This is followed by num_records
+// FileStateRecords, sorted by path hash.
+struct FileStateCacheHeader {
+  FileStateCacheHeader() {
+    memset(this, 0, sizeof(FileStateCacheHeader));
+  }
+
+  // Version of the cache file.
+  char version[8];
+
+  // Label the cache describes.
+  uint64_t label_id;
+
+  // Location of descriptor 2 of the backup the cache was last updated with.  If
+  // this doesn't match the label's last backup, the cache is out of date.
+  uint64_t backup_volume;
+  uint64_t backup_offset;
+
+  // Number of records following the header.
+  uint64_t num_records;
+};
+
+// State of a single file as of the last backup it was seen in.
+struct FileStateRecord {
+  FileStateRecord() {
+    memset(this, 0, sizeof(FileStateRecord));
+  }
+
+  // MD5 of the generic filename.
+  Uint128 path_hash;
+
+  // Identity and change information of the file, as in BackupFile.
+  uint64_t file_type;
+  uint64_t device_id;
+  uint64_t inode;
+  uint64_t file_size;
+  uint64_t modify_date;
+  uint64_t change_date;
+
+  // Location of descriptor 2 of the backup containing the file's chunk list.
+  uint64_t backup_volume;
+  uint64_t backup_offset;
+};
+
+#pragma pack(pop)
+
+// A FileStateCache is a compact index of the state of every file in a label as
+// of its last backup, keyed by a hash of the filename.  It lets an incremental
+// backup decide which files have changed without loading and combining every
+// file set back to the last full backup.  The cache is memory-mapped, so
+// loading it costs nothing beyond paging in the records actually looked at.
+//
+// Caches are written next to the backup volumes at the end of each backup.  A
+// cache is only meaningful for the backup it was written with; callers must
+// compare the header against the label before trusting it.
+class FileStateCache {
+ public:
+  // Current version of the cache file.
+  static const std::string kFileVersion;
+
+  // The MD5 generator is used to hash filenames.  Ownership is not taken.
+  explicit FileStateCache(Md5GeneratorInterface* md5_maker);
+  ~FileStateCache();
+
+  // Load and map the cache from the given file.  Returns kStatusNoSuchFile if
+  // the cache doesn't exist, or kStatusCorruptBackup if it is not a valid
+  // cache.
+  Status Load(const std::string& filename);
+
+  // Return the record for the given generic filename, or NULL if the file
+  // isn't in the cache.
+  const FileStateRecord* Find(const std::string& generic_filename) const;
+
+  // Return whether the file with the given generic filename and metadata has
+  // changed since it was recorded.  Files not in the cache are considered
+  // changed.  See BackupFileChanged().
+  bool FileChanged(const std::string& generic_filename,
+                   const BackupFile& metadata) const;
+
+  // Return whether the file described by the metadata has changed from the
+  // given record.
+  static bool RecordChanged(const FileStateRecord& record,
+                            const BackupFile& metadata);
+
+  // Write a cache describing the files in the given file set to the given
+  // filename, recording the backup the set was written to.  If merge is true,
+  // the records of the currently loaded cache are kept for files not in the
+  // set.  The cache is written to a temporary file and moved into place, so an
+  // interrupted write leaves the old cache intact.  Once written, the loaded
+  // cache is released.
+  Status Write(const std::string& filename, const FileSet& fileset,
+               uint64_t label_id, uint64_t backup_volume,
+               uint64_t backup_offset, bool merge);
+
+  // Return the header of the loaded cache.
+  const FileStateCacheHeader& header() const { return header_; }
+
+  // Return the number of records in the loaded cache.
+  uint64_t size() const { return header_.num_records; }
+
+ private:
+  // Release the mapping of the loaded cache, if any.
+  void Unload();
+
+  // Return the record for a file in a file set written to the given backup.
+  FileStateRecord MakeRecord(const FileEntry& entry, uint64_t backup_volume,
+                             uint64_t backup_offset) const;
+
+  // MD5 generator used to hash filenames.
+  Md5GeneratorInterface* md5_maker_;
+
+  // Mapping of the loaded cache file.
+  std::unique_ptr<boost::interprocess::file_mapping> mapping_;
+  std::unique_ptr<boost::interprocess::mapped_region> region_;
+
+  // Header and records of the loaded cache.  The records point into the mapped
+  // region.
+  FileStateCacheHeader header_;
+  const FileStateRecord* records_;
+
+  DISALLOW_COPY_AND_ASSIGN(FileStateCache);
+};
+
+}  // namespace backup2
+#endif  // BACKUP2_SRC_FILE_STATE_CACHE_H_
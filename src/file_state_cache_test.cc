@@ -0,0 +1,195 @@
+// Copyright (C) 2013, All Rights Reserved.
+// Author: Cory Maccarrone <darkstar6262@gmail.com>
+
+#include <string>
+
+#include "boost/filesystem.hpp"
+#include "src/backup_volume_defs.h"
+#include "src/file.h"
+#include "src/file_state_cache.h"
+#include "src/fileset.h"
+#include "src/md5_generator.h"
+#include "src/status.h"
+#include "glog/logging.h"
+#include "gmock/gmock.h"
+#include "gtest/gtest.h"
+
+using std::string;
+
+namespace backup2 {
+
+class FileStateCacheTest : public testing::Test {
+ public:
+  static const char* kTestFilename;
+
+  void SetUp() {
+    RemoveTestFiles();
+  }
+
+  void TearDown() {
+    RemoveTestFiles();
+  }
+
+ protected:
+  void RemoveTestFiles() {
+    boost::filesystem::remove(boost::filesystem::path(kTestFilename));
+    boost::filesystem::remove(
+        boost::filesystem::path(string(kTestFilename) + ".tmp"));
+  }
+
+  // Add a file to the given file set with the given identity.
+  void AddFile(FileSet* fileset, const string& filename, uint64_t size,
+               uint64_t modify_date, uint64_t inode, uint64_t change_date) {
+    BackupFile metadata;
+    metadata.file_type = BackupFile::kFileTypeRegularFile;
+    metadata.file_size = size;
+    metadata.modify_date = modify_date;
+    metadata.inode = inode;
+    metadata.change_date = change_date;
+    fileset->AddFile(filename, metadata);
+  }
+
+  BackupFile Metadata(uint64_t size, uint64_t modify_date, uint64_t inode,
+                      uint64_t change_date) {
+    BackupFile metadata;
+    metadata.file_type = BackupFile::kFileTypeRegularFile;
+    metadata.file_size = size;
+    metadata.modify_date = modify_date;
+    metadata.inode = inode;
+    metadata.change_date = change_date;
+    return metadata;
+  }
+
+  Md5Generator md5_maker_;
+};
+
+const char* FileStateCacheTest::kTestFilename = "__test__.fsc";
+
+TEST_F(FileStateCacheTest, LoadMissing) {
+  FileStateCache cache(&md5_maker_);
+  Status retval = cache.Load(kTestFilename);
+  EXPECT_EQ(kStatusNoSuchFile, retval.code());
+  EXPECT_EQ(NULL, cache.Find("/foo/bar"));
+  EXPECT_TRUE(cache.FileChanged("/foo/bar", Metadata(10, 20, 30, 40)));
+}
+
+TEST_F(FileStateCacheTest, LoadCorrupt) {
+  File file(kTestFilename);
+  ASSERT_TRUE(file.Open(File::Mode::kModeAppend).ok());
+  FileStateCacheHeader header;
+  memcpy(header.version, "BLAHBLAH", 8);
+  ASSERT_TRUE(file.Write(&header, sizeof(header)).ok());
+  ASSERT_TRUE(file.Close().ok());
+
+  FileStateCache cache(&md5_maker_);
+  EXPECT_EQ(kStatusCorruptBackup, cache.Load(kTestFilename).code());
+}
+
+TEST_F(FileStateCacheTest, WriteAndLoad) {
+  FileSet fileset;
+  AddFile(&fileset, "/foo/bar", 10, 20, 30, 40);
+  AddFile(&fileset, "/foo/baz", 11, 21, 31, 41);
+  AddFile(&fileset, "/zip/zap", 12, 22, 32, 42);
+
+  FileStateCache cache(&md5_maker_);
+  ASSERT_TRUE(cache.Write(kTestFilename, fileset, 1, 3, 0x1234, false).ok());
+  EXPECT_FALSE(
+      boost::filesystem::exists(string(kTestFilename) + ".tmp"));
+
+  FileStateCache loaded(&md5_maker_);
+  ASSERT_TRUE(loaded.Load(kTestFilename).ok());
+  EXPECT_EQ(3, loaded.size());
+  EXPECT_EQ(1, loaded.header().label_id);
+  EXPECT_EQ(3, loaded.header().backup_volume);
+  EXPECT_EQ(0x1234, loaded.header().backup_offset);
+
+  const FileStateRecord* record = loaded.Find("/foo/baz");
+  ASSERT_TRUE(record != NULL);
+  EXPECT_EQ(11, record->file_size);
+  EXPECT_EQ(21, record->modify_date);
+  EXPECT_EQ(31, record->inode);
+  EXPECT_EQ(41, record->change_date);
+  EXPECT_EQ(3, record->backup_volume);
+  EXPECT_EQ(0x1234, record->backup_offset);
+
+  EXPECT_TRUE(loaded.Find("/foo/bar") != NULL);
+  EXPECT_TRUE(loaded.Find("/zip/zap") != NULL);
+  EXPECT_EQ(NULL, loaded.Find("/not/there"));
+}
+
+TEST_F(FileStateCacheTest, FileChanged) {
+  FileSet fileset;
+  AddFile(&fileset, "/foo/bar", 10, 20, 30, 40);
+
+  FileStateCache cache(&md5_maker_);
+  ASSERT_TRUE(cache.Write(kTestFilename, fileset, 1, 0, 0, false).ok());
+  ASSERT_TRUE(cache.Load(kTestFilename).ok());
+
+  EXPECT_FALSE(cache.FileChanged("/foo/bar", Metadata(10, 20, 30, 40)));
+
+  // Size and modification date changes.
+  EXPECT_TRUE(cache.FileChanged("/foo/bar", Metadata(11, 20, 30, 40)));
+  EXPECT_TRUE(cache.FileChanged("/foo/bar", Metadata(10, 21, 30, 40)));
+
+  // Files that became something else.
+  BackupFile directory = Metadata(10, 20, 30, 40);
+  directory.file_type = BackupFile::kFileTypeDirectory;
+  EXPECT_TRUE(cache.FileChanged("/foo/bar", directory));
+
+  // Replaced file, or change with the modification date preserved.
+  EXPECT_TRUE(cache.FileChanged("/foo/bar", Metadata(10, 20, 31, 40)));
+  EXPECT_TRUE(cache.FileChanged("/foo/bar", Metadata(10, 20, 30, 41)));
+
+  // Without a change date, only size and modification date are compared.
+  EXPECT_FALSE(cache.FileChanged("/foo/bar", Metadata(10, 20, 0, 0)));
+
+  // Unknown files are always changed.
+  EXPECT_TRUE(cache.FileChanged("/foo/baz", Metadata(10, 20, 30, 40)));
+}
+
+TEST_F(FileStateCacheTest, WriteMerge) {
+  FileSet full;
+  AddFile(&full, "/foo/bar", 10, 20, 30, 40);
+  AddFile(&full, "/foo/baz", 11, 21, 31, 41);
+
+  FileStateCache cache(&md5_maker_);
+  ASSERT_TRUE(cache.Write(kTestFilename, full, 1, 0, 0x10, false).ok());
+  ASSERT_TRUE(cache.Load(kTestFilename).ok());
+
+  // An incremental backup with one changed file and one new one.
+  FileSet incremental;
+  AddFile(&incremental, "/foo/baz", 15, 25, 31, 45);
+  AddFile(&incremental, "/zip/zap", 12, 22, 32, 42);
+  ASSERT_TRUE(cache.Write(kTestFilename, incremental, 1, 1, 0x20, true).ok());
+  EXPECT_EQ(0, cache.size());
+
+  ASSERT_TRUE(cache.Load(kTestFilename).ok());
+  EXPECT_EQ(3, cache.size());
+  EXPECT_EQ(1, cache.header().backup_volume);
+  EXPECT_EQ(0x20, cache.header().backup_offset);
+
+  // Untouched files point at the full backup.
+  const FileStateRecord* record = cache.Find("/foo/bar");
+  ASSERT_TRUE(record != NULL);
+  EXPECT_EQ(10, record->file_size);
+  EXPECT_EQ(0, record->backup_volume);
+  EXPECT_EQ(0x10, record->backup_offset);
+
+  // Changed files take the new state.
+  record = cache.Find("/foo/baz");
+  ASSERT_TRUE(record != NULL);
+  EXPECT_EQ(15, record->file_size);
+  EXPECT_EQ(45, record->change_date);
+  EXPECT_EQ(1, record->backup_volume);
+  EXPECT_EQ(0x20, record->backup_offset);
+
+  EXPECT_TRUE(cache.Find("/zip/zap") != NULL);
+
+  // Without merging, only the given set is kept.
+  ASSERT_TRUE(cache.Write(kTestFilename, incremental, 1, 1, 0x20, false).ok());
+  ASSERT_TRUE(cache.Load(kTestFilename).ok());
+  EXPECT_EQ(2, cache.size());
+  EXPECT_EQ(NULL, cache.Find("/foo/bar"));
+}
+
+}  // namespace backup2
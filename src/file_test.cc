@@ -2,16 +2,19 @@
 // Author: Cory Maccarrone <darkstar6262@gmail.com>
 
 #include <string>
+#include <utility>
 #include <vector>
 
 #include "boost/filesystem.hpp"
 #include "src/backup_volume_defs.h"
 #include "src/file.h"
+#include "src/path.h"
 #include "src/status.h"
 #include "glog/logging.h"
 #include "gmock/gmock.h"
 #include "gtest/gtest.h"
 
+using std::pair;
 using std::string;
 using std::vector;
 
@@ -140,6 +143,117 @@ TEST_F(FileTest, SeekEof) {
   ASSERT_TRUE(file.Close().ok());
 }
 
+TEST_F(FileTest, Truncate) {
+  // This test verifies that a file can be shortened and extended, including
+  // writes still buffered.
+  File file(kTestFilename);
+  ASSERT_TRUE(file.Open(File::Mode::kModeReadWrite).ok());
+  ASSERT_TRUE(file.Write("ABCDEFG", 7).ok());
+  ASSERT_TRUE(file.Truncate(3).ok());
+  uint64_t size = 0;
+  ASSERT_TRUE(file.size(&size).ok());
+  EXPECT_EQ(3, size);
+
+  ASSERT_TRUE(file.Truncate(5).ok());
+  ASSERT_TRUE(file.Seek(0).ok());
+  string data;
+  data.resize(5);
+  ASSERT_TRUE(file.Read(&data.at(0), 5, NULL).ok());
+  ASSERT_TRUE(file.Close().ok());
+  EXPECT_EQ(string("ABC\0\0", 5), data);
+}
+
+TEST_F(FileTest, Sync) {
+  // This test verifies that buffered writes are written out by a sync, and that
+  // closed files and directories can be synced too.
+  File file(kTestFilename);
+  ASSERT_TRUE(file.Open(File::Mode::kModeReadWrite).ok());
+  ASSERT_TRUE(file.Write("ABCDEFG", 7).ok());
+  ASSERT_TRUE(file.Sync().ok());
+  EXPECT_EQ(7, boost::filesystem::file_size(kTestFilename));
+  ASSERT_TRUE(file.Close().ok());
+
+  EXPECT_TRUE(File(kTestFilename).Sync().ok());
+  EXPECT_TRUE(File(".").Sync().ok());
+  EXPECT_FALSE(File("__no_such_file__").Sync().ok());
+}
+
+TEST_F(FileTest, WriteAtAndPunchHole) {
+  // This test verifies positioned writes, past the end of the file and over
+  // data, and that punched holes read back as zeros.
+  File file(kTestFilename);
+  ASSERT_TRUE(file.Open(File::Mode::kModeReadWrite).ok());
+  ASSERT_TRUE(file.Write("ABCDEFG", 7).ok());
+  ASSERT_TRUE(file.WriteAt(9, "XY", 2).ok());
+  ASSERT_TRUE(file.WriteAt(1, "bc", 2).ok());
+
+  Status retval = file.PunchHole(4, 2);
+  if (retval.code() == kStatusNotImplemented) {
+    ASSERT_TRUE(file.WriteAt(4, "\0\0", 2).ok());
+  } else {
+    ASSERT_TRUE(retval.ok()) << retval.ToString();
+  }
+
+  ASSERT_TRUE(file.Seek(0).ok());
+  string data;
+  data.resize(11);
+  ASSERT_TRUE(file.Read(&data.at(0), data.size(), NULL).ok());
+  ASSERT_TRUE(file.Close().ok());
+  EXPECT_EQ(string("AbcD\0\0G\0\0XY", 11), data);
+}
+
+TEST_F(FileTest, GetHoles) {
+  // This test verifies that the holes of a sparse file are found, without
+  // moving the file position.
+  const uint64_t kMiB = 1048576;
+  File file(kTestFilename);
+  ASSERT_TRUE(file.Open(File::Mode::kModeReadWrite).ok());
+  ASSERT_TRUE(file.Write("A", 1).ok());
+  ASSERT_TRUE(file.WriteAt(4 * kMiB, "Z", 1).ok());
+  ASSERT_TRUE(file.Truncate(8 * kMiB).ok());
+
+  vector<pair<uint64_t, uint64_t> > holes;
+  Status retval = file.GetHoles(&holes);
+  EXPECT_EQ(1, file.Tell());
+  ASSERT_TRUE(file.Close().ok());
+  if (retval.code() == kStatusNotImplemented || holes.empty()) {
+    // The filesystem stores every byte.
+    return;
+  }
+  ASSERT_TRUE(retval.ok()) << retval.ToString();
+
+  // Holes cover whole blocks, so they stop short of the data around them.
+  ASSERT_EQ(2, holes.size());
+  EXPECT_GT(holes[0].first, 0);
+  EXPECT_EQ(4 * kMiB, holes[0].first + holes[0].second);
+  EXPECT_GT(holes[1].first, 4 * kMiB);
+  EXPECT_EQ(8 * kMiB, holes[1].first + holes[1].second);
+}
+
+TEST_F(FileTest, CopyRangeFrom) {
+  // This test verifies that a range of one file can be copied into another,
+  // over existing data and past its end.
+  const string source_filename = string(kTestFilename) + ".source";
+  File source(source_filename);
+  ASSERT_TRUE(source.Open(File::Mode::kModeReadWrite).ok());
+  ASSERT_TRUE(source.Write("0123456789", 10).ok());
+
+  File file(kTestFilename);
+  ASSERT_TRUE(file.Open(File::Mode::kModeReadWrite).ok());
+  ASSERT_TRUE(file.Write("ABCDEFG", 7).ok());
+  ASSERT_TRUE(file.CopyRangeFrom(&source, 2, 3, 5).ok());
+  ASSERT_TRUE(file.CopyRangeFrom(&source, 9, 1, 0).ok());
+  ASSERT_TRUE(source.Close().ok());
+  ASSERT_TRUE(source.Unlink().ok());
+
+  ASSERT_TRUE(file.Seek(0).ok());
+  string data;
+  data.resize(8);
+  ASSERT_TRUE(file.Read(&data.at(0), data.size(), NULL).ok());
+  ASSERT_TRUE(file.Close().ok());
+  EXPECT_EQ("9BCDE234", data);
+}
+
 TEST_F(FileTest, ReadLines) {
   // This test verifies that lines can be read and parsed frmo a file.
   File file(kTestFilename);
@@ -306,6 +420,38 @@ TEST_F(FileTest, RootAndProperName) {
 }
 #endif  // _WIN32
 
+#ifndef _WIN32
+TEST_F(FileTest, PathFunctions) {
+  // This test verifies the path functions, which work on the string alone.
+  EXPECT_EQ("/", RootPath("/foo/bar"));
+  EXPECT_EQ("", RootPath("foo/bar"));
+  EXPECT_EQ("/foo/bar", ProperPath("/foo/bar"));
+  EXPECT_EQ("/foo/bar", GenericPath("/foo/bar"));
+  EXPECT_EQ("foo/bar", RelativePath("/foo/bar"));
+  EXPECT_EQ("/does/not/exist", File("/does/not/exist").GenericName());
+}
+#endif  // _WIN32
+
+TEST_F(FileTest, WriteAfterReopen) {
+  // This test verifies a file's write buffer is given back on Close() and that
+  // the file can be written again once re-opened.
+  File file(kTestFilename);
+  ASSERT_TRUE(file.Open(File::Mode::kModeAppend).ok());
+  ASSERT_TRUE(file.Write("ABC", 3).ok());
+  ASSERT_TRUE(file.Close().ok());
+  ASSERT_TRUE(file.Open(File::Mode::kModeAppend).ok());
+  ASSERT_TRUE(file.Write("DEFG", 4).ok());
+  ASSERT_TRUE(file.Close().ok());
+
+  File file2(kTestFilename);
+  ASSERT_TRUE(file2.Open(File::Mode::kModeRead).ok());
+  string data;
+  data.resize(7);
+  ASSERT_TRUE(file2.Read(&data.at(0), 7, NULL).ok());
+  ASSERT_TRUE(file2.Close().ok());
+  EXPECT_EQ("ABCDEFG", data);
+}
+
 TEST_F(FileTest, SymlinkMetadata) {
   // This test verifies that the File class can correctly fill in BackupFile
   // metadata for symlinks.
@@ -3,50 +3,373 @@
 
 #include "src/fileset.h"
 
+#include <string.h>
+
+#include <algorithm>
+#include <functional>
+#include <memory>
+#include <new>
 #include <string>
 #include <vector>
 
-#include "boost/filesystem.hpp"
 #include "glog/logging.h"
-#include "src/file.h"
+#include "src/file_interface.h"
+#include "src/path.h"
+#include "src/status.h"
 
 using std::string;
+using std::unique_ptr;
+using std::vector;
 
 namespace backup2 {
 
+const uint64_t FileSet::kSpilledBatchSize = 4 * 1048576ULL;
+const uint64_t FileSet::kEntriesPerBlock = 1024;
+const uint64_t FileSet::kChunksPerBlock = 16384;
+
 FileSet::FileSet()
-    : description_(""),
+    : entries_in_last_block_(kEntriesPerBlock),
+      next_chunk_(NULL),
+      chunks_left_in_last_block_(0),
+      spill_file_open_(false),
+      max_finished_memory_(0),
+      spill_failed_(false),
+      finished_memory_(0),
+      num_spilled_files_(0),
+      spilled_size_(0),
+      spilled_unencoded_size_(0),
+      description_(""),
       dedup_count_(0),
       encoded_size_(0) {
 }
 
 FileSet::~FileSet() {
   for (FileEntry* entry : files_) {
-    delete entry;
+    entry->~FileEntry();
+  }
+  Status retval = DiscardSpilledFiles();
+  LOG_IF(WARNING, !retval.ok())
+      << "Could not remove spill file: " << retval.ToString();
+}
+
+FileEntry* FileSet::AddFile(const string& filename,
+                           const BackupFile& metadata) {
+  void* space = NULL;
+  if (!free_entries_.empty()) {
+    space = free_entries_.back();
+    free_entries_.pop_back();
+  } else {
+    if (entries_in_last_block_ == kEntriesPerBlock) {
+      entry_blocks_.push_back(
+          unique_ptr<char[]>(new char[kEntriesPerBlock * sizeof(FileEntry)]));
+      entries_in_last_block_ = 0;
+    }
+    space = entry_blocks_.back().get() +
+            entries_in_last_block_ * sizeof(FileEntry);
+    ++entries_in_last_block_;
   }
+
+  FileEntry* entry = new(space) FileEntry(filename, metadata);
+  files_.insert(entry);
+  return entry;
+}
+
+FileChunk* FileSet::AllocateChunks(FileEntry* entry, uint64_t num_chunks) {
+  CHECK_EQ(0U, entry->metadata_.num_chunks) << "File already has chunks";
+  if (num_chunks == 0) {
+    return NULL;
+  }
+  if (num_chunks > chunks_left_in_last_block_) {
+    // Files with more chunks than a block get a block of their own.
+    uint64_t block_size = std::max<uint64_t>(num_chunks, kChunksPerBlock);
+    chunk_blocks_.push_back(
+        unique_ptr<char[]>(new char[block_size * sizeof(FileChunk)]));
+    next_chunk_ = reinterpret_cast<FileChunk*>(chunk_blocks_.back().get());
+    chunks_left_in_last_block_ = block_size;
+  }
+  FileChunk* chunks = next_chunk_;
+  next_chunk_ += num_chunks;
+  chunks_left_in_last_block_ -= num_chunks;
+
+  entry->shared_chunks_ = chunks;
+  entry->metadata_.num_chunks = num_chunks;
+  return chunks;
 }
 
 void FileSet::RemoveFile(FileEntry* entry) {
   auto iter = files_.find(entry);
   if (iter != files_.end()) {
     files_.erase(iter);
-    delete entry;
+    auto finished_iter = std::find(finished_.begin(), finished_.end(), entry);
+    if (finished_iter != finished_.end()) {
+      finished_memory_ -= entry->EstimatedMemoryUsage();
+      finished_.erase(finished_iter);
+    }
+    FreeEntry(entry);
+  }
+}
+
+void FileSet::FreeEntry(FileEntry* entry) {
+  entry->~FileEntry();
+  free_entries_.push_back(entry);
+}
+
+void FileSet::set_spill_file(FileInterface* spill_file, uint64_t max_bytes) {
+  spill_file_.reset(spill_file);
+  spill_file_open_ = false;
+  max_finished_memory_ = max_bytes;
+  spill_failed_ = false;
+}
+
+Status FileSet::FinishFile(FileEntry* entry) {
+  if (!spill_file_) {
+    return Status::OK;
+  }
+  finished_.push_back(entry);
+  finished_memory_ += entry->EstimatedMemoryUsage();
+  if (finished_memory_ <= max_finished_memory_) {
+    return Status::OK;
   }
+  return SpillFinishedFiles();
+}
+
+Status FileSet::SpillFinishedFiles() {
+  if (spill_failed_) {
+    return Status(kStatusFileError, "Spill file is damaged");
+  }
+  if (!spill_file_open_) {
+    Status retval = spill_file_->Open(FileInterface::kModeReadWrite);
+    LOG_RETURN_IF_ERROR(retval, "Could not open spill file");
+    spill_file_open_ = true;
+
+    retval = spill_file_->Truncate(0);
+    LOG_RETURN_IF_ERROR(retval, "Could not truncate spill file");
+  }
+  Status retval = spill_file_->SeekEof();
+  LOG_RETURN_IF_ERROR(retval, "Could not seek to end of spill file");
+
+  VLOG(3) << "Spilling " << finished_.size() << " files ("
+          << finished_memory_ << " bytes)";
+  string record;
+  for (FileEntry* entry : finished_) {
+    record.clear();
+    entry->AppendRecord(&record);
+    retval = spill_file_->Write(record.data(), record.size());
+    if (!retval.ok()) {
+      // Files already spilled are gone from memory; the rest stay finished.
+      finished_.erase(
+          finished_.begin(),
+          std::find(finished_.begin(), finished_.end(), entry));
+      LOG(ERROR) << "Could not write spill file: " << retval.ToString();
+
+      // Whatever part of the record was written has to go, or the next spill
+      // would start after it.
+      Status truncate_retval = spill_file_->Truncate(spilled_size_);
+      if (!truncate_retval.ok()) {
+        LOG(ERROR) << "Could not truncate spill file: "
+                   << truncate_retval.ToString();
+        spill_failed_ = true;
+      }
+      return retval;
+    }
+    ++num_spilled_files_;
+    spilled_size_ += record.size();
+    spilled_unencoded_size_ += entry->GetBackupFile()->file_size;
+    finished_memory_ -= entry->EstimatedMemoryUsage();
+    files_.erase(entry);
+    FreeEntry(entry);
+  }
+  finished_.clear();
+  return Status::OK;
+}
+
+Status FileSet::ReadSpilledData(uint64_t offset, uint64_t size,
+                                string* data_out) const {
+  CHECK_LE(offset + size, spilled_size_) << "Read past end of spilled files";
+  data_out->resize(size);
+  if (size == 0) {
+    return Status::OK;
+  }
+  if (!spill_file_open_) {
+    return Status(kStatusFileError, "Spilled files were discarded");
+  }
+
+  Status retval = spill_file_->Seek(offset);
+  LOG_RETURN_IF_ERROR(retval, "Could not seek in spill file");
+  retval = spill_file_->Read(&data_out->at(0), size, NULL);
+  LOG_RETURN_IF_ERROR(retval, "Could not read spill file");
+  return Status::OK;
+}
+
+Status FileSet::ReadSpilledFiles(
+    uint64_t* offset, uint64_t max_bytes,
+    vector<unique_ptr<FileEntry> >* files_out) const {
+  if (*offset >= spilled_size_) {
+    return Status::OK;
+  }
+
+  // Always read at least one record header.
+  uint64_t size = std::min<uint64_t>(
+      std::max<uint64_t>(max_bytes, sizeof(BackupFile)),
+      spilled_size_ - *offset);
+  string data;
+  Status retval = ReadSpilledData(*offset, size, &data);
+  LOG_RETURN_IF_ERROR(retval, "Could not read spilled files");
+
+  uint64_t position = 0;
+  while (data.size() - position >= sizeof(BackupFile)) {
+    BackupFile metadata;
+    memcpy(&metadata, data.data() + position, sizeof(metadata));
+    uint64_t record_size = FileEntry::RecordSize(metadata);
+    if (record_size > data.size() - position) {
+      if (position > 0) {
+        // Leave it for the next call.
+        break;
+      }
+      if (*offset + record_size > spilled_size_) {
+        return Status(kStatusCorruptBackup, "Truncated spilled file record");
+      }
+
+      // The first record alone is larger than max_bytes, so read the rest of
+      // it.
+      string rest;
+      retval = ReadSpilledData(*offset + data.size(),
+                               record_size - data.size(), &rest);
+      LOG_RETURN_IF_ERROR(retval, "Could not read spilled file record");
+      data.append(rest);
+    }
+
+    StatusOr<FileEntry*> entry =
+        FileEntry::ParseRecord(data.data() + position, record_size);
+    LOG_RETURN_IF_ERROR(entry.status(), "Bad spilled file record");
+    files_out->push_back(unique_ptr<FileEntry>(entry.value()));
+    position += record_size;
+  }
+  if (position == 0) {
+    return Status(kStatusCorruptBackup, "Truncated spilled file record");
+  }
+  *offset += position;
+  return Status::OK;
+}
+
+Status FileSet::DiscardSpilledFiles() {
+  if (!spill_file_open_) {
+    return Status::OK;
+  }
+  spill_file_open_ = false;
+  Status retval = spill_file_->Close();
+  LOG_RETURN_IF_ERROR(retval, "Could not close spill file");
+  retval = spill_file_->Unlink();
+  LOG_RETURN_IF_ERROR(retval, "Could not remove spill file");
+  return Status::OK;
 }
 
 uint64_t FileSet::unencoded_size() const {
-  uint64_t size = 0;
+  uint64_t size = spilled_unencoded_size_;
   for (FileEntry* entry : files_) {
     size += entry->GetBackupFile()->file_size;
   }
   return size;
 }
 
-FileEntry::FileEntry(const string& filename, BackupFile* metadata)
+bool FileEntryLess::operator()(const FileEntry* lhs,
+                               const FileEntry* rhs) const {
+  if (lhs->path() != rhs->path()) {
+    return PathTable::Less(lhs->path(), rhs->path());
+  }
+  return std::less<const FileEntry*>()(lhs, rhs);
+}
+
+bool ChunkOffsetLessThan(const FileChunk& lhs, const FileChunk& rhs) {
+  return lhs.chunk_offset < rhs.chunk_offset;
+}
+
+FileEntry::FileEntry(const string& filename, const BackupFile& metadata)
     : metadata_(metadata),
-      generic_filename_(File(filename).GenericName()),
-      proper_filename_(File(filename).ProperName()) {
-  metadata->filename_size = generic_filename_.size();
+      path_(NULL),
+      shared_chunks_(NULL) {
+  string generic_filename = GenericPath(filename);
+  path_ = PathTable::Default()->Intern(generic_filename);
+  metadata_.filename_size = generic_filename.size();
+}
+
+FileEntry::~FileEntry() {
+  PathTable::Default()->Release(path_);
+}
+
+string FileEntry::proper_filename() const {
+  return ProperPath(generic_filename());
+}
+
+void FileEntry::AppendRecord(string* record) const {
+  string generic_filename = this->generic_filename();
+  record->reserve(record->size() + RecordSize(metadata_));
+  record->append(reinterpret_cast<const char*>(&metadata_), sizeof(metadata_));
+  record->append(generic_filename);
+  if (metadata_.file_type == BackupFile::kFileTypeSymlink) {
+    record->append(symlink_target_);
+  }
+  FileChunkSpan chunks = GetChunks();
+  if (!chunks.empty()) {
+    record->append(reinterpret_cast<const char*>(chunks.begin()),
+                   chunks.size() * sizeof(FileChunk));
+  }
+}
+
+uint64_t FileEntry::RecordSize(const BackupFile& metadata) {
+  uint64_t size = sizeof(metadata) + metadata.filename_size +
+                  metadata.num_chunks * sizeof(FileChunk);
+  if (metadata.file_type == BackupFile::kFileTypeSymlink) {
+    size += metadata.symlink_target_size;
+  }
+  return size;
+}
+
+StatusOr<FileEntry*> FileEntry::ParseRecord(const char* data, uint64_t size) {
+  BackupFile metadata;
+  if (size < sizeof(metadata)) {
+    return Status(kStatusCorruptBackup, "Short BackupFile record");
+  }
+  memcpy(&metadata, data, sizeof(metadata));
+  if (metadata.header_type != kHeaderTypeBackupFile) {
+    return Status(kStatusCorruptBackup, "Invalid header for BackupFile");
+  }
+  if (RecordSize(metadata) != size) {
+    return Status(kStatusCorruptBackup, "Bad BackupFile record size");
+  }
+  data += sizeof(metadata);
+
+  string filename(data, metadata.filename_size);
+  data += metadata.filename_size;
+
+  string symlink = "";
+  if (metadata.file_type == BackupFile::kFileTypeSymlink) {
+    symlink.assign(data, metadata.symlink_target_size);
+    data += metadata.symlink_target_size;
+  }
+
+  uint64_t num_chunks = metadata.num_chunks;
+  metadata.num_chunks = 0;
+  unique_ptr<FileEntry> entry(new FileEntry(filename, metadata));
+  entry->set_symlink_target(symlink);
+  if (num_chunks > 0) {
+    // The record isn't necessarily aligned for FileChunk, so copy them out.
+    vector<FileChunk> chunks(num_chunks);
+    memcpy(&chunks.at(0), data, num_chunks * sizeof(FileChunk));
+    entry->AddChunks(&chunks.at(0), num_chunks);
+  }
+  return entry.release();
+}
+
+uint64_t FileEntry::EstimatedMemoryUsage() const {
+  uint64_t chunks = shared_chunks_ ? metadata_.num_chunks : chunks_.capacity();
+  return sizeof(*this) + chunks * sizeof(FileChunk) +
+         symlink_target_.capacity();
+}
+
+void FileEntry::UnshareChunks() {
+  chunks_.assign(shared_chunks_, shared_chunks_ + metadata_.num_chunks);
+  shared_chunks_ = NULL;
 }
 
 }  // namespace backup2
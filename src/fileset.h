@@ -11,29 +11,127 @@
 #include "glog/logging.h"
 #include "src/common.h"
 #include "src/backup_volume_defs.h"
+#include "src/path_table.h"
+#include "src/status.h"
 
 namespace backup2 {
 class FileEntry;
+class FileInterface;
+
+// Orders FileEntry objects by their generic filename, a path component at a
+// time (see PathTable::Less()), and then by address for entries with the same
+// name.  Sets of entries are kept in this order, so that walking them, and the
+// descriptor 2 written from them, is the same from run to run.
+struct FileEntryLess {
+  bool operator()(const FileEntry* lhs, const FileEntry* rhs) const;
+};
+
+typedef std::set<FileEntry*, FileEntryLess> FileEntrySet;
+
+// Orders file chunks by their offset in the file.
+bool ChunkOffsetLessThan(const FileChunk& lhs, const FileChunk& rhs);
+
+// A read-only view of a file's chunks, which may be held by its FileEntry or
+// by the FileSet it's in.  It's valid until chunks are next added to the
+// entry, or the entry is destroyed.
+class FileChunkSpan {
+ public:
+  FileChunkSpan(const FileChunk* chunks, uint64_t size)
+      : chunks_(chunks),
+        size_(size) {}
+
+  const FileChunk* begin() const { return chunks_; }
+  const FileChunk* end() const { return chunks_ + size_; }
+  uint64_t size() const { return size_; }
+  bool empty() const { return size_ == 0; }
+
+  const FileChunk& operator[](uint64_t index) const {
+    return chunks_[index];
+  }
+  const FileChunk& at(uint64_t index) const {
+    CHECK_LT(index, size_) << "Chunk index out of range";
+    return chunks_[index];
+  }
+
+ private:
+  const FileChunk* chunks_;
+  uint64_t size_;
+};
 
 // A FileSet represents all of the files, as well as the chunks that go with
 // them, in a backup increment.  This class is used with a BackupVolume to write
 // out backup descriptor 2 containing all the details of the backup.
+//
+// The entries of a file set are allocated by the set, in blocks of contiguous
+// entries, and the chunks of files read from descriptor 2 are held together
+// in blocks shared by all of the set's files.  Loading or freeing a large
+// backup then takes a few large allocations rather than several per file.
+//
+// A file set being backed up can be given a spill file, to which files are
+// moved once finished whenever the finished files use more memory than
+// allowed.  Spilled files are kept in the spill file as descriptor 2 records,
+// in the order they were spilled, and no longer appear in GetFiles().
 class FileSet {
  public:
   FileSet();
   ~FileSet();
 
-  // Add a FileEntry to this file set.  Ownership is transferred to FileSet.
-  void AddFile(FileEntry* file) {
-    files_.insert(file);
-  }
+  // Bytes of records to read at a time when reading back all the spilled
+  // files with ReadSpilledFiles().
+  static const uint64_t kSpilledBatchSize;
+
+  // Number of entries, and of chunks, allocated together in each block.
+  static const uint64_t kEntriesPerBlock;
+  static const uint64_t kChunksPerBlock;
 
-  // Remove a FileEntry from the set.
+  // Add a file with the given name and metadata to this file set, and return
+  // its entry, which the set owns.  The metadata is copied into the entry.
+  FileEntry* AddFile(const std::string& filename, const BackupFile& metadata);
+
+  // Give entry, a file in this set without chunks, num_chunks chunks held in
+  // the set's shared chunk blocks, and return them to be filled in, such as by
+  // reading them from descriptor 2.  They're freed with the set.
+  FileChunk* AllocateChunks(FileEntry* entry, uint64_t num_chunks);
+
+  // Remove a FileEntry from the set.  Spilled files can't be removed.
   void RemoveFile(FileEntry* entry);
 
-  // Return access to the vector of FileEntry objects.  This is used primarily
-  // by BackupVolume to enumerate and create descriptor 2.
-  const std::set<FileEntry*> GetFiles() const {
+  // Set the file to spill finished files to, and the memory finished files may
+  // use before they're spilled.  Ownership of spill_file is transferred to
+  // FileSet.  The file is created on first use, and its contents replaced.
+  void set_spill_file(FileInterface* spill_file, uint64_t max_bytes);
+
+  // Mark a file in the set as finished, so no more chunks will be added to it.
+  // If the finished files now use more memory than allowed, they're all moved
+  // to the spill file and deleted, so the entry can't be used after this call.
+  // Without a spill file, this does nothing.  If writing the spill file fails,
+  // the files not yet written stay in memory.
+  Status FinishFile(FileEntry* entry);
+
+  // Return the number of files spilled, and the size of their records.
+  uint64_t num_spilled_files() const { return num_spilled_files_; }
+  uint64_t spilled_size() const { return spilled_size_; }
+
+  // Read size bytes of spilled records, starting at offset, such as to copy
+  // them into descriptor 2.
+  Status ReadSpilledData(uint64_t offset, uint64_t size,
+                         std::string* data_out) const;
+
+  // Read spilled files from the spill file, starting with the record at
+  // *offset, until about max_bytes of records have been read or there are no
+  // more.  *offset is advanced past the records read, and reaches
+  // spilled_size() once all the files have been read.
+  Status ReadSpilledFiles(
+      uint64_t* offset, uint64_t max_bytes,
+      std::vector<std::unique_ptr<FileEntry> >* files_out) const;
+
+  // Remove the spill file.  The spilled files still count towards num_files()
+  // and unencoded_size(), but can no longer be read.
+  Status DiscardSpilledFiles();
+
+  // Return access to the set of FileEntry objects, in filename order.  This is
+  // used primarily by BackupVolume to enumerate and create descriptor 2.
+  const FileEntrySet& GetFiles() const {
     return files_;
   }
 
@@ -43,12 +141,12 @@ class FileSet {
   // Increment the encoded size of the backup.
   void IncrementEncodedSize(uint64_t size) { encoded_size_ += size; }
 
-  // Return the number of files in this file set.
+  // Return the number of files in this file set, including spilled files.
   uint64_t num_files() const {
-    return files_.size();
+    return files_.size() + num_spilled_files_;
   }
 
-  // Return the unencoded size of the file set.
+  // Return the unencoded size of the file set, including spilled files.
   uint64_t unencoded_size() const;
 
   // Get/set the description of the fileset.
@@ -118,8 +216,48 @@ class FileSet {
   uint64_t encoded_size() const { return encoded_size_; }
 
  private:
+  // Spill all finished files.
+  Status SpillFinishedFiles();
+
+  // Destroy an entry of this set, which must already be out of files_, and
+  // keep its space for the next file added.
+  void FreeEntry(FileEntry* entry);
+
   // Set of files in the file set.
-  std::set<FileEntry*> files_;
+  FileEntrySet files_;
+
+  // Blocks of kEntriesPerBlock entries, the number used in the last block,
+  // and the entries freed from them to be used again.
+  std::vector<std::unique_ptr<char[]> > entry_blocks_;
+  uint64_t entries_in_last_block_;
+  std::vector<FileEntry*> free_entries_;
+
+  // Blocks of shared chunks, at least kChunksPerBlock long, the next unused
+  // chunk of the last block, and the number left after it.
+  std::vector<std::unique_ptr<char[]> > chunk_blocks_;
+  FileChunk* next_chunk_;
+  uint64_t chunks_left_in_last_block_;
+
+  // File finished files are spilled to, if any, whether it's been opened, and
+  // the memory finished files may use before they're spilled.
+  std::unique_ptr<FileInterface> spill_file_;
+  bool spill_file_open_;
+  uint64_t max_finished_memory_;
+
+  // Set if a failed spill couldn't be cleaned up, leaving the spill file with
+  // part of a record past spilled_size_.  No more files are spilled.
+  bool spill_failed_;
+
+  // Files finished but not yet spilled, in the order they were finished, and
+  // the memory they use.
+  std::vector<FileEntry*> finished_;
+  uint64_t finished_memory_;
+
+  // Number of files spilled, the size of their records, and their total
+  // unencoded size.
+  uint64_t num_spilled_files_;
+  uint64_t spilled_size_;
+  uint64_t spilled_unencoded_size_;
 
   // Description of the backup fileset.
   std::string description_;
@@ -163,60 +301,108 @@ class FileSet {
 // structures necessary to fully fill out descriptor 2.
 class FileEntry {
  public:
-  // FileEntry takes ownership of the metadata.
-  explicit FileEntry(const std::string& filename, BackupFile* metadata);
+  // The metadata is copied into the entry.  The filename is interned in
+  // PathTable::Default().
+  FileEntry(const std::string& filename, const BackupFile& metadata);
+  ~FileEntry();
 
   // Add a chunk of data to the file entry.  The header describes the chunk and
   // is used when writing backup descriptor 2.
   void AddChunk(FileChunk chunk) {
+    if (shared_chunks_) {
+      UnshareChunks();
+    }
     chunks_.push_back(chunk);
-    metadata_->num_chunks++;
+    metadata_.num_chunks++;
+  }
+
+  // Add num_chunks chunks at once, such as when read together from a spill
+  // file.
+  void AddChunks(const FileChunk* chunks, uint64_t num_chunks) {
+    if (shared_chunks_) {
+      UnshareChunks();
+    }
+    chunks_.insert(chunks_.end(), chunks, chunks + num_chunks);
+    metadata_.num_chunks += num_chunks;
   }
 
   // Return the BackupFile structure maintained by this entry.  This is used
   // when writing the header metadata for a file in a backup.
   const BackupFile* GetBackupFile() const {
-    return metadata_.get();
+    return &metadata_;
   }
 
-  // Return access to the vector of FileChunk metadata entries.  This is used in
-  // the raw to enumerate all the chunks in the backup.  Future backups use this
-  // to deduplicate against previous backups.
-  const std::vector<FileChunk> GetChunks() const {
-    return chunks_;
+  // Return the FileChunk metadata entries of the file.  This is used in the raw
+  // to enumerate all the chunks in the backup.  Future backups use this to
+  // deduplicate against previous backups.
+  FileChunkSpan GetChunks() const {
+    if (shared_chunks_) {
+      return FileChunkSpan(shared_chunks_, metadata_.num_chunks);
+    }
+    return FileChunkSpan(chunks_.data(), chunks_.size());
   }
 
   // Return the generic filename for this entry.  This filename is stored in the
   // backup files, and allows the paths to be translated between different OS's.
-  const std::string& generic_filename() const { return generic_filename_; }
+  // It's built from the path table each time, so callers using it repeatedly
+  // should keep a copy.
+  std::string generic_filename() const { return PathTable::Path(path_); }
 
   // Return the proper filename for the platform.  This is used for
   // pretty-printing to the user and for restoring files to the native
   // filesystem.
-  const std::string& proper_filename() const { return proper_filename_; }
+  std::string proper_filename() const;
+
+  // Return the path table node of the filename.  Entries with the same
+  // filename have the same node.
+  const PathTable::Node* path() const { return path_; }
 
   // Set the symlink target.
-  void set_symlink_target(const std::string target) {
+  void set_symlink_target(const std::string& target) {
     symlink_target_ = target;
-    metadata_->symlink_target_size = target.size();
+    metadata_.symlink_target_size = target.size();
   }
-  std::string symlink_target() const { return symlink_target_; }
+  const std::string& symlink_target() const { return symlink_target_; }
+
+  // Append the entry's descriptor 2 record to *record: the BackupFile, the
+  // generic filename, the symlink target for symlinks, and the chunks.
+  void AppendRecord(std::string* record) const;
+
+  // Return the size of the descriptor 2 record for a file with the given
+  // metadata.
+  static uint64_t RecordSize(const BackupFile& metadata);
+
+  // Create an entry from the size bytes of a record written by AppendRecord().
+  // The caller takes ownership of the entry.
+  static StatusOr<FileEntry*> ParseRecord(const char* data, uint64_t size);
+
+  // Return roughly how much memory the entry uses, not counting its path.
+  uint64_t EstimatedMemoryUsage() const;
 
  private:
-  // File metadata, ultimately saved into the backup volume.
-  std::unique_ptr<BackupFile> metadata_;
+  friend class FileSet;
 
-  // Filename for this file, both a generic (platform-agnostic) and native
-  // format.
-  const std::string generic_filename_;
-  const std::string proper_filename_;
+  // Copy the shared chunks into chunks_, so more can be added.
+  void UnshareChunks();
+
+  // File metadata, ultimately saved into the backup volume.  This is held
+  // inline rather than separately allocated, as a large backup has millions of
+  // entries.
+  BackupFile metadata_;
+
+  // Generic filename of this file, shared with every other entry of the same
+  // name.
+  const PathTable::Node* path_;
 
   // The target of the symlink for this file (if any).
   std::string symlink_target_;
 
-  // List of chunks
+  // List of chunks added to this entry.
   std::vector<struct FileChunk> chunks_;
 
+  // The file's chunks, if held by its FileSet rather than in chunks_.
+  const FileChunk* shared_chunks_;
+
   DISALLOW_COPY_AND_ASSIGN(FileEntry);
 };
 
@@ -0,0 +1,237 @@
+// Copyright (C) 2013, All Rights Reserved.
+// Author: Cory Maccarrone <darkstar6262@gmail.com>
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "src/backup_volume_defs.h"
+#include "src/fake_file.h"
+#include "src/fileset.h"
+#include "src/status.h"
+#include "glog/logging.h"
+#include "gtest/gtest.h"
+
+using std::string;
+using std::unique_ptr;
+using std::vector;
+
+namespace backup2 {
+
+// A FakeFile whose writes can be made to fail after writing half their data,
+// and whose truncates can be made to fail.
+class FailingFile : public FakeFile {
+ public:
+  FailingFile() : fail_writes_(false), fail_truncates_(false) {}
+
+  virtual Status Write(const void* buffer, size_t length) {
+    if (fail_writes_) {
+      FakeFile::Write(buffer, length / 2);
+      return Status(kStatusFileError, "Disk full");
+    }
+    return FakeFile::Write(buffer, length);
+  }
+
+  virtual Status Truncate(uint64_t size) {
+    if (fail_truncates_) {
+      return Status(kStatusFileError, "Disk full");
+    }
+    return FakeFile::Truncate(size);
+  }
+
+  bool fail_writes_;
+  bool fail_truncates_;
+};
+
+class FileSetTest : public testing::Test {
+ protected:
+  // Return an entry for a file with the given number of chunks, added to
+  // file_set, or a new one of the caller's if file_set is NULL.
+  FileEntry* Entry(FileSet* file_set, const string& filename,
+                   uint64_t num_chunks) {
+    BackupFile metadata;
+    metadata.file_type = BackupFile::kFileTypeRegularFile;
+    metadata.file_size = num_chunks * 10;
+    FileEntry* entry = file_set ? file_set->AddFile(filename, metadata) :
+                                  new FileEntry(filename, metadata);
+    for (uint64_t chunk_num = 0; chunk_num < num_chunks; ++chunk_num) {
+      FileChunk chunk;
+      chunk.md5sum.lo = chunk_num;
+      chunk.chunk_offset = chunk_num * 10;
+      chunk.unencoded_size = 10;
+      entry->AddChunk(chunk);
+    }
+    return entry;
+  }
+};
+
+TEST_F(FileSetTest, Record) {
+  unique_ptr<FileEntry> entry(Entry(NULL, "/foo/bar", 3));
+  string record;
+  entry->AppendRecord(&record);
+  EXPECT_EQ(FileEntry::RecordSize(*entry->GetBackupFile()), record.size());
+
+  StatusOr<FileEntry*> parsed =
+      FileEntry::ParseRecord(record.data(), record.size());
+  ASSERT_TRUE(parsed.ok()) << parsed.status().ToString();
+  unique_ptr<FileEntry> parsed_entry(parsed.value());
+  EXPECT_EQ("/foo/bar", parsed_entry->generic_filename());
+  EXPECT_EQ(3, parsed_entry->GetBackupFile()->num_chunks);
+  ASSERT_EQ(3, parsed_entry->GetChunks().size());
+  EXPECT_EQ(20, parsed_entry->GetChunks()[2].chunk_offset);
+
+  // Symlinks have their target in the record too.
+  BackupFile metadata;
+  metadata.file_type = BackupFile::kFileTypeSymlink;
+  FileEntry symlink("/foo/link", metadata);
+  symlink.set_symlink_target("/foo/bar");
+  record.clear();
+  symlink.AppendRecord(&record);
+  parsed = FileEntry::ParseRecord(record.data(), record.size());
+  ASSERT_TRUE(parsed.ok()) << parsed.status().ToString();
+  parsed_entry.reset(parsed.value());
+  EXPECT_EQ("/foo/bar", parsed_entry->symlink_target());
+
+  // A truncated record is an error.
+  EXPECT_FALSE(FileEntry::ParseRecord(record.data(), record.size() - 1).ok());
+}
+
+TEST_F(FileSetTest, SpillFinishedFiles) {
+  FileSet file_set;
+  file_set.set_spill_file(new FakeFile, 1);
+
+  // Finished files are spilled once they're over the limit.
+  FileEntry* first = Entry(&file_set, "/b", 2);
+  FileEntry* second = Entry(&file_set, "/a", 1);
+  Entry(&file_set, "/c", 4);
+  string expected;
+  first->AppendRecord(&expected);
+  second->AppendRecord(&expected);
+
+  EXPECT_TRUE(file_set.FinishFile(first).ok());
+  EXPECT_TRUE(file_set.FinishFile(second).ok());
+  EXPECT_EQ(2, file_set.num_spilled_files());
+  EXPECT_EQ(expected.size(), file_set.spilled_size());
+  EXPECT_EQ(1, file_set.GetFiles().size());
+  EXPECT_EQ(3, file_set.num_files());
+  EXPECT_EQ(70, file_set.unencoded_size());
+
+  string data;
+  EXPECT_TRUE(file_set.ReadSpilledData(0, expected.size(), &data).ok());
+  EXPECT_EQ(expected, data);
+
+  // Spilled files read back in the order they were spilled, in batches of
+  // about the size asked for, and at least one at a time.
+  uint64_t offset = 0;
+  vector<unique_ptr<FileEntry> > files;
+  EXPECT_TRUE(file_set.ReadSpilledFiles(&offset, 1, &files).ok());
+  ASSERT_EQ(1, files.size());
+  EXPECT_EQ("/b", files[0]->generic_filename());
+  EXPECT_EQ(2, files[0]->GetChunks().size());
+  EXPECT_TRUE(file_set.ReadSpilledFiles(&offset, 1 << 20, &files).ok());
+  ASSERT_EQ(2, files.size());
+  EXPECT_EQ("/a", files[1]->generic_filename());
+  EXPECT_EQ(file_set.spilled_size(), offset);
+
+  // Once discarded, the spilled files still count.
+  EXPECT_TRUE(file_set.DiscardSpilledFiles().ok());
+  EXPECT_EQ(3, file_set.num_files());
+  EXPECT_FALSE(file_set.ReadSpilledData(0, expected.size(), &data).ok());
+}
+
+TEST_F(FileSetTest, SpillWriteFailure) {
+  FailingFile* spill_file = new FailingFile;
+  FileSet file_set;
+  file_set.set_spill_file(spill_file, 1);
+
+  FileEntry* first = Entry(&file_set, "/a", 1);
+  string expected;
+  first->AppendRecord(&expected);
+  EXPECT_TRUE(file_set.FinishFile(first).ok());
+
+  // A record only partly written is removed, and the file stays in memory.
+  spill_file->fail_writes_ = true;
+  FileEntry* second = Entry(&file_set, "/b", 2);
+  EXPECT_FALSE(file_set.FinishFile(second).ok());
+  EXPECT_EQ(1, file_set.num_spilled_files());
+  EXPECT_EQ(expected.size(), file_set.spilled_size());
+  EXPECT_EQ(1, file_set.GetFiles().size());
+
+  // So the next spill follows the last complete record.
+  spill_file->fail_writes_ = false;
+  FileEntry* third = Entry(&file_set, "/c", 3);
+  second->AppendRecord(&expected);
+  third->AppendRecord(&expected);
+  EXPECT_TRUE(file_set.FinishFile(third).ok());
+  EXPECT_EQ(3, file_set.num_spilled_files());
+  string data;
+  EXPECT_TRUE(file_set.ReadSpilledData(0, expected.size(), &data).ok());
+  EXPECT_EQ(expected, data);
+
+  // If the partial record can't be removed, no more files are spilled.
+  spill_file->fail_writes_ = true;
+  spill_file->fail_truncates_ = true;
+  EXPECT_FALSE(file_set.FinishFile(Entry(&file_set, "/d", 1)).ok());
+  spill_file->fail_writes_ = false;
+  spill_file->fail_truncates_ = false;
+  EXPECT_FALSE(file_set.FinishFile(Entry(&file_set, "/e", 1)).ok());
+  EXPECT_EQ(3, file_set.num_spilled_files());
+  EXPECT_EQ(2, file_set.GetFiles().size());
+}
+
+TEST_F(FileSetTest, NoSpillFile) {
+  // Without a spill file, finished files stay in memory.
+  FileSet file_set;
+  FileEntry* entry = Entry(&file_set, "/a", 1);
+  EXPECT_TRUE(file_set.FinishFile(entry).ok());
+  EXPECT_EQ(0, file_set.num_spilled_files());
+  EXPECT_EQ(1, file_set.GetFiles().size());
+  EXPECT_EQ(1, file_set.num_files());
+}
+
+TEST_F(FileSetTest, SharedChunks) {
+  FileSet file_set;
+  BackupFile metadata;
+  metadata.file_type = BackupFile::kFileTypeRegularFile;
+  FileEntry* small = file_set.AddFile("/small", metadata);
+  FileEntry* large = file_set.AddFile("/large", metadata);
+
+  // Files' chunks are handed out from the set's shared blocks, with files of
+  // more chunks than a block given their own.
+  FileChunk* small_chunks = file_set.AllocateChunks(small, 2);
+  small_chunks[0] = FileChunk();
+  small_chunks[1] = FileChunk();
+  small_chunks[1].chunk_offset = 10;
+  uint64_t num_large_chunks = FileSet::kChunksPerBlock + 1;
+  FileChunk* large_chunks = file_set.AllocateChunks(large, num_large_chunks);
+  for (uint64_t index = 0; index < num_large_chunks; ++index) {
+    large_chunks[index] = FileChunk();
+    large_chunks[index].chunk_offset = index;
+  }
+  EXPECT_EQ(2, small->GetBackupFile()->num_chunks);
+  ASSERT_EQ(2, small->GetChunks().size());
+  EXPECT_EQ(small_chunks, small->GetChunks().begin());
+  EXPECT_EQ(10, small->GetChunks()[1].chunk_offset);
+  ASSERT_EQ(num_large_chunks, large->GetChunks().size());
+  EXPECT_EQ(FileSet::kChunksPerBlock,
+            large->GetChunks()[FileSet::kChunksPerBlock].chunk_offset);
+
+  // Adding to a file's shared chunks gives it its own copy.
+  FileChunk chunk;
+  chunk.chunk_offset = 20;
+  small->AddChunk(chunk);
+  ASSERT_EQ(3, small->GetChunks().size());
+  EXPECT_NE(small_chunks, small->GetChunks().begin());
+  EXPECT_EQ(10, small->GetChunks()[1].chunk_offset);
+  EXPECT_EQ(20, small->GetChunks()[2].chunk_offset);
+  EXPECT_EQ(3, small->GetBackupFile()->num_chunks);
+
+  // The space of removed entries is used for the next files added.
+  file_set.RemoveFile(small);
+  FileEntry* replacement = file_set.AddFile("/replacement", metadata);
+  EXPECT_EQ(small, replacement);
+  EXPECT_TRUE(replacement->GetChunks().empty());
+  EXPECT_EQ(2, file_set.GetFiles().size());
+}
+
+}  // namespace backup2
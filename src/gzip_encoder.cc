@@ -23,6 +23,10 @@ using std::string;
 namespace backup2 {
 
 Status GzipEncoder::Encode(const string& source, string* dest) {
+  return Encode(source.data(), source.size(), dest);
+}
+
+Status GzipEncoder::Encode(const char* source, size_t size, string* dest) {
   CHECK_NOTNULL(dest);
 
   z_stream stream_z;
@@ -34,11 +38,12 @@ Status GzipEncoder::Encode(const string& source, string* dest) {
 
   // Allocate twice as much space as the source to account for compression
   // actually taking more space than the original.
-  dest->resize(source.size() * 2);
+  dest->resize(size * 2);
 
-  string source_copy = source;
-  stream_z.avail_in = source.size();
-  stream_z.next_in = reinterpret_cast<uint8_t*>(&source_copy.at(0));
+  // zlib only reads the input, though next_in isn't const.
+  stream_z.avail_in = size;
+  stream_z.next_in =
+      reinterpret_cast<uint8_t*>(const_cast<char*>(source));
   stream_z.avail_out = dest->size();
   stream_z.next_out =
       reinterpret_cast<unsigned char*>(&dest->at(0));
@@ -46,7 +51,7 @@ Status GzipEncoder::Encode(const string& source, string* dest) {
   ret = deflate(&stream_z, Z_FINISH);
   CHECK_NE(Z_STREAM_ERROR, ret);
 
-  uint32_t compressed_size = (source.size() * 2) - stream_z.avail_out;
+  uint32_t compressed_size = (size * 2) - stream_z.avail_out;
   dest->resize(compressed_size);
   deflateEnd(&stream_z);
   return Status::OK;
@@ -18,6 +18,7 @@ class GzipEncoder : public EncodingInterface {
 
   // EncodingInterface methods.
   virtual Status Encode(const std::string& source, std::string* dest);
+  virtual Status Encode(const char* source, size_t size, std::string* dest);
   virtual Status Decode(const std::string& source, std::string* dest);
 
  private:
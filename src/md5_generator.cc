@@ -4,7 +4,6 @@
 #include "src/md5_generator.h"
 
 #include <openssl/md5.h>
-#include <stdio.h>
 #include <string>
 
 #include "glog/logging.h"
@@ -15,17 +14,22 @@ using std::string;
 namespace backup2 {
 
 Uint128 Md5Generator::Checksum(const string& data) {
+  return Checksum(data.data(), data.size());
+}
+
+Uint128 Md5Generator::Checksum(const char* data, size_t size) {
   unsigned char result[MD5_DIGEST_LENGTH];
-  MD5((const unsigned char*)data.c_str(), data.size(), result);
+  MD5(reinterpret_cast<const unsigned char*>(data), size, result);
 
-  char mdstring[33];
-  for (int i = 0; i < 16; ++i) {
-    snprintf(&mdstring[i*2], sizeof(unsigned int), "%02x",
-             (unsigned int)result[i]);
-  }
+  // The digest bytes are read as two big-endian 64-bit halves, the same as
+  // parsing its hex string.
   Uint128 md5_int;
-  sscanf((const char*)mdstring, "%016llx%016llx",  // NOLINT
-         &md5_int.hi, &md5_int.lo);
+  md5_int.hi = 0;
+  md5_int.lo = 0;
+  for (int i = 0; i < 8; ++i) {
+    md5_int.hi = (md5_int.hi << 8) | result[i];
+    md5_int.lo = (md5_int.lo << 8) | result[i + 8];
+  }
   return md5_int;
 }
 
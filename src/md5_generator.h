@@ -18,6 +18,7 @@ class Md5Generator : public Md5GeneratorInterface {
 
   // Md5GeneratorInterface methods.
   virtual Uint128 Checksum(const std::string& data);
+  virtual Uint128 Checksum(const char* data, size_t size);
 
  private:
   DISALLOW_COPY_AND_ASSIGN(Md5Generator);
@@ -16,6 +16,13 @@ class Md5GeneratorInterface {
 
   // Generate a 128-bit MD5 checksum of the given data string.
   virtual Uint128 Checksum(const std::string& data) = 0;
+
+  // Like Checksum() above, but of the size bytes at data, such as part of a
+  // larger read buffer.  This default copies them into a string first;
+  // implementations should checksum them in place.
+  virtual Uint128 Checksum(const char* data, size_t size) {
+    return Checksum(std::string(data, size));
+  }
 };
 
 }  // namespace backup2
@@ -34,6 +34,12 @@ TEST(Md5GeneratorTest, MD5Tests) {
   expected.lo = 0x610a36bd693728dd;
   EXPECT_EQ(expected, generator.Checksum(
       "skl;dfjoivj;wklefjoidsfl;kjweorijfjkwoiweopijfsoidfl;ksdjf[owierkjfpo"));
+
+  // Part of a larger buffer checksums the same as a string of it.
+  string buffer = "xxTesting 123xx";
+  expected.hi = 0x41884e32dd651882;
+  expected.lo = 0x32ce22cde06a153d;
+  EXPECT_EQ(expected, generator.Checksum(buffer.data() + 2, 11));
 }
 
 }  // namespace backup2
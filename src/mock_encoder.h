@@ -14,6 +14,7 @@ namespace backup2 {
 
 class MockEncoder: public EncodingInterface {
  public:
+  using EncodingInterface::Encode;
   MOCK_METHOD2(Encode, Status(const std::string& source, std::string* dest));
   MOCK_METHOD2(Decode, Status(const std::string& source, std::string* dest));
 };
@@ -34,7 +34,9 @@ class MockFile : public FileInterface {
   MOCK_METHOD3(Read, Status(void* buffer, size_t length, size_t* read_bytes));
   MOCK_METHOD1(ReadLines, Status(std::vector<std::string>* lines));
   MOCK_METHOD2(Write, Status(const void* buffer, size_t length));
+  MOCK_METHOD1(Truncate, Status(uint64_t size));
   MOCK_METHOD0(Flush, Status());
+  MOCK_METHOD0(Sync, Status());
   MOCK_METHOD1(CreateDirectories, Status(bool strip_leaf));
   MOCK_METHOD1(CreateSymlink, Status(std::string target));
   MOCK_METHOD0(RelativePath, std::string());
@@ -45,6 +47,7 @@ class MockFile : public FileInterface {
                Status(std::string* basename_out, uint64_t* last_vol_out,
                       uint64_t* num_vols_out));
   MOCK_CONST_METHOD1(size, Status(uint64_t* size_out));
+  MOCK_METHOD1(GetExtents, Status(std::vector<FileExtent>* extents_out));
 };
 
 }  // namespace backup2
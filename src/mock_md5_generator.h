@@ -14,6 +14,7 @@ namespace backup2 {
 
 class MockMd5Generator : public Md5GeneratorInterface {
  public:
+  using Md5GeneratorInterface::Checksum;
   MOCK_METHOD1(Checksum, Uint128(const std::string& data));
 };
 
@@ -0,0 +1,30 @@
+// Copyright (C) 2013, All Rights Reserved.
+// Author: Cory Maccarrone <darkstar6262@gmail.com>
+
+#include "src/path.h"
+
+#include <string>
+
+#include "boost/filesystem.hpp"
+
+using std::string;
+
+namespace backup2 {
+
+string RootPath(const string& path) {
+  return boost::filesystem::path(path).root_path().make_preferred().string();
+}
+
+string ProperPath(const string& path) {
+  return boost::filesystem::path(path).make_preferred().string();
+}
+
+string GenericPath(const string& path) {
+  return boost::filesystem::path(path).generic_string();
+}
+
+string RelativePath(const string& path) {
+  return boost::filesystem::path(path).relative_path().string();
+}
+
+}  // namespace backup2
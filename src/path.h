@@ -0,0 +1,29 @@
+// Copyright (C) 2013, All Rights Reserved.
+// Author: Cory Maccarrone <darkstar6262@gmail.com>
+#ifndef BACKUP2_SRC_PATH_H_
+#define BACKUP2_SRC_PATH_H_
+
+#include <string>
+
+namespace backup2 {
+
+// Functions for converting between forms of a path.  These only operate on
+// the path string, and never touch the filesystem; unlike File, they need no
+// object to be created for each path.
+
+// Return the root of the given path, or an empty string if it's relative.  For
+// Windows, this is the drive letter or UNC root of the path.
+std::string RootPath(const std::string& path);
+
+// Return the given path formatted as preferred for the system.
+std::string ProperPath(const std::string& path);
+
+// Return the given path in a generic form that works with any operating
+// system.
+std::string GenericPath(const std::string& path);
+
+// Return the given path with its root removed.
+std::string RelativePath(const std::string& path);
+
+}  // namespace backup2
+#endif  // BACKUP2_SRC_PATH_H_
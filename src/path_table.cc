@@ -0,0 +1,155 @@
+// Copyright (C) 2013, All Rights Reserved.
+// Author: Cory Maccarrone <darkstar6262@gmail.com>
+
+#include "src/path_table.h"
+
+#include <cstring>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "glog/logging.h"
+
+using std::lock_guard;
+using std::make_pair;
+using std::mutex;
+using std::pair;
+using std::string;
+using std::vector;
+
+namespace backup2 {
+
+PathTable::PathTable() {
+}
+
+PathTable::~PathTable() {
+  for (const pair<const NodeKey, Node*>& entry : nodes_) {
+    delete entry.second;
+  }
+}
+
+PathTable* PathTable::Default() {
+  static PathTable* table = new PathTable;
+  return table;
+}
+
+const PathTable::Node* PathTable::Intern(const string& generic_path) {
+  lock_guard<mutex> lock(mutex_);
+  Node* node = NULL;
+  size_t start = 0;
+  while (true) {
+    size_t end = generic_path.find('/', start);
+    if (end == string::npos) {
+      node = ChildLocked(node, generic_path.data() + start,
+                         generic_path.size() - start);
+      break;
+    }
+    node = ChildLocked(node, generic_path.data() + start, end - start);
+    start = end + 1;
+  }
+  ++node->references_;
+  return node;
+}
+
+void PathTable::Release(const Node* node) {
+  lock_guard<mutex> lock(mutex_);
+  Node* current = const_cast<Node*>(node);
+  while (current) {
+    CHECK_LT(0U, current->references_) << "Released an unreferenced path";
+    if (--current->references_ > 0) {
+      break;
+    }
+    Node* parent = const_cast<Node*>(current->parent_);
+    nodes_.erase(KeyOf(current));
+    delete current;
+    current = parent;
+  }
+}
+
+string PathTable::Path(const Node* node) {
+  vector<const Node*> components(node->depth());
+  size_t size = node->depth() - 1;
+  for (uint32_t index = node->depth(); index > 0; --index) {
+    components[index - 1] = node;
+    size += node->name().size();
+    node = node->parent();
+  }
+
+  string path;
+  path.reserve(size);
+  for (const Node* component : components) {
+    if (component->parent()) {
+      path += '/';
+    }
+    path += component->name();
+  }
+  return path;
+}
+
+bool PathTable::Less(const Node* lhs, const Node* rhs) {
+  if (lhs == rhs) {
+    return false;
+  }
+
+  // Bring both to the same depth.  If one was within the other, the shorter
+  // path comes first.
+  const Node* lhs_ancestor = lhs;
+  const Node* rhs_ancestor = rhs;
+  while (lhs_ancestor->depth() > rhs_ancestor->depth()) {
+    lhs_ancestor = lhs_ancestor->parent();
+  }
+  while (rhs_ancestor->depth() > lhs_ancestor->depth()) {
+    rhs_ancestor = rhs_ancestor->parent();
+  }
+  if (lhs_ancestor == rhs_ancestor) {
+    return lhs->depth() < rhs->depth();
+  }
+
+  // Otherwise they differ at the components just below their common ancestor.
+  while (lhs_ancestor->parent() != rhs_ancestor->parent()) {
+    lhs_ancestor = lhs_ancestor->parent();
+    rhs_ancestor = rhs_ancestor->parent();
+  }
+  return lhs_ancestor->name() < rhs_ancestor->name();
+}
+
+uint64_t PathTable::size() const {
+  lock_guard<mutex> lock(mutex_);
+  return nodes_.size();
+}
+
+size_t PathTable::NodeKeyHash::operator()(const NodeKey& key) const {
+  // FNV-1a over the name, so that hashing needs no string.
+  uint64_t hash = 14695981039346656037ULL;
+  for (size_t index = 0; index < key.name_size; ++index) {
+    hash ^= static_cast<unsigned char>(key.name[index]);
+    hash *= 1099511628211ULL;
+  }
+  return static_cast<size_t>(hash) ^
+         (std::hash<const Node*>()(key.parent) * 31);
+}
+
+bool PathTable::NodeKeyEqual::operator()(const NodeKey& lhs,
+                                         const NodeKey& rhs) const {
+  return lhs.parent == rhs.parent && lhs.name_size == rhs.name_size &&
+         memcmp(lhs.name, rhs.name, lhs.name_size) == 0;
+}
+
+PathTable::Node* PathTable::ChildLocked(const Node* parent, const char* name,
+                                        size_t name_size) {
+  auto node_iter = nodes_.find(NodeKey(parent, name, name_size));
+  if (node_iter != nodes_.end()) {
+    return node_iter->second;
+  }
+
+  Node* node = new Node(parent, string(name, name_size));
+  nodes_.insert(make_pair(KeyOf(node), node));
+  if (parent) {
+    ++const_cast<Node*>(parent)->references_;
+  }
+  return node;
+}
+
+}  // namespace backup2
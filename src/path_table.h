@@ -0,0 +1,120 @@
+// Copyright (C) 2013, All Rights Reserved.
+// Author: Cory Maccarrone <darkstar6262@gmail.com>
+#ifndef BACKUP2_SRC_PATH_TABLE_H_
+#define BACKUP2_SRC_PATH_TABLE_H_
+
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+#include "src/common.h"
+
+namespace backup2 {
+
+// A PathTable stores generic paths as a tree of their components, so that the
+// directories shared by many files, and the files shared by many file sets, are
+// each held only once.  A path is referred to by the node of its last
+// component; the same path always gives the same node, so paths can be
+// compared for equality by comparing their nodes.
+//
+// Nodes are reference counted.  Every Intern() of a path must be matched by a
+// Release() of its node, after which the node, and any of its parents no
+// longer used, are freed.
+//
+// The table is safe to use from multiple threads.
+class PathTable {
+ public:
+  // One component of a path.
+  class Node {
+   public:
+    // The component's name, and its parent, or NULL for the first component.
+    const std::string& name() const { return name_; }
+    const Node* parent() const { return parent_; }
+
+    // Number of components in the path this node ends.
+    uint32_t depth() const { return depth_; }
+
+   private:
+    friend class PathTable;
+
+    Node(const Node* parent, const std::string& name)
+        : parent_(parent),
+          name_(name),
+          depth_(parent ? parent->depth_ + 1 : 1),
+          references_(0) {}
+
+    const Node* parent_;
+    const std::string name_;
+    const uint32_t depth_;
+
+    // Number of paths interned at this node, plus the number of its children.
+    // Guarded by the table's mutex.
+    uint64_t references_;
+
+    DISALLOW_COPY_AND_ASSIGN(Node);
+  };
+
+  PathTable();
+  ~PathTable();
+
+  // Return the table used for the paths of FileEntry objects.  It's created on
+  // first use and never destroyed.
+  static PathTable* Default();
+
+  // Return the node for the given generic path, adding it to the table if
+  // needed.  The path is split on '/' and joined again exactly, so any string
+  // can be interned.
+  const Node* Intern(const std::string& generic_path);
+
+  // Release a node returned by Intern().
+  void Release(const Node* node);
+
+  // Return the generic path a node ends.
+  static std::string Path(const Node* node);
+
+  // Order nodes by their paths, a component at a time, so that a directory
+  // comes before its contents and its contents come before its later siblings.
+  // This only walks the nodes, without building their paths.
+  static bool Less(const Node* lhs, const Node* rhs);
+
+  // Return the number of nodes in the table.
+  uint64_t size() const;
+
+ private:
+  // A parent and a view of a child's name, used to find a parent's child
+  // without copying the name.  The keys stored in the table view the names
+  // held by their nodes; lookup keys view the path being interned.
+  struct NodeKey {
+    NodeKey(const Node* parent, const char* name, size_t name_size)
+        : parent(parent), name(name), name_size(name_size) {}
+
+    const Node* parent;
+    const char* name;
+    size_t name_size;
+  };
+  struct NodeKeyHash {
+    size_t operator()(const NodeKey& key) const;
+  };
+  struct NodeKeyEqual {
+    bool operator()(const NodeKey& lhs, const NodeKey& rhs) const;
+  };
+
+  // Return the key a node is stored under.
+  static NodeKey KeyOf(const Node* node) {
+    return NodeKey(node->parent_, node->name_.data(), node->name_.size());
+  }
+
+  // Return the child of parent with the given name, creating it if needed.
+  // Must be called with the lock held.
+  Node* ChildLocked(const Node* parent, const char* name, size_t name_size);
+
+  mutable std::mutex mutex_;
+
+  // All nodes in the table, by their parent and name.
+  std::unordered_map<NodeKey, Node*, NodeKeyHash, NodeKeyEqual> nodes_;
+
+  DISALLOW_COPY_AND_ASSIGN(PathTable);
+};
+
+}  // namespace backup2
+#endif  // BACKUP2_SRC_PATH_TABLE_H_
@@ -0,0 +1,76 @@
+// Copyright (C) 2013, All Rights Reserved.
+// Author: Cory Maccarrone <darkstar6262@gmail.com>
+
+#include <string>
+
+#include "src/path_table.h"
+#include "glog/logging.h"
+#include "gtest/gtest.h"
+
+using std::string;
+
+namespace backup2 {
+
+TEST(PathTableTest, InternAndPath) {
+  PathTable table;
+  const PathTable::Node* bar = table.Intern("/foo/bar");
+  EXPECT_EQ("/foo/bar", PathTable::Path(bar));
+  EXPECT_EQ("bar", bar->name());
+  EXPECT_EQ(3U, bar->depth());
+  EXPECT_EQ(3U, table.size());
+
+  // The same path gives the same node, and shares its parents with others.
+  EXPECT_EQ(bar, table.Intern("/foo/bar"));
+  const PathTable::Node* baz = table.Intern("/foo/baz");
+  EXPECT_EQ(bar->parent(), baz->parent());
+  EXPECT_EQ(4U, table.size());
+
+  // Paths come back exactly as they went in.
+  const string paths[] = { "", "relative/path", "//server/share", "dir/",
+                           "C:/Windows" };
+  for (const string& path : paths) {
+    const PathTable::Node* node = table.Intern(path);
+    EXPECT_EQ(path, PathTable::Path(node));
+    table.Release(node);
+  }
+  EXPECT_EQ(4U, table.size());
+
+  table.Release(bar);
+  table.Release(bar);
+  table.Release(baz);
+  EXPECT_EQ(0U, table.size());
+}
+
+TEST(PathTableTest, Release) {
+  // Nodes are freed once their paths and children are released.
+  PathTable table;
+  const PathTable::Node* dir = table.Intern("/dir");
+  const PathTable::Node* file = table.Intern("/dir/file");
+  EXPECT_EQ(3U, table.size());
+
+  table.Release(dir);
+  EXPECT_EQ(3U, table.size());
+  EXPECT_EQ("/dir/file", PathTable::Path(file));
+
+  table.Release(file);
+  EXPECT_EQ(0U, table.size());
+}
+
+TEST(PathTableTest, Less) {
+  PathTable table;
+  const PathTable::Node* dir = table.Intern("/a");
+  const PathTable::Node* file = table.Intern("/a/b");
+  const PathTable::Node* sibling = table.Intern("/a-c");
+  const PathTable::Node* other = table.Intern("/b/a");
+
+  // A directory comes before its contents, and its contents before its later
+  // siblings.
+  EXPECT_TRUE(PathTable::Less(dir, file));
+  EXPECT_FALSE(PathTable::Less(file, dir));
+  EXPECT_TRUE(PathTable::Less(file, sibling));
+  EXPECT_TRUE(PathTable::Less(sibling, other));
+  EXPECT_FALSE(PathTable::Less(other, file));
+  EXPECT_FALSE(PathTable::Less(file, file));
+}
+
+}  // namespace backup2
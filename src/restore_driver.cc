@@ -4,6 +4,7 @@
 #include "src/restore_driver.h"
 
 #include <memory>
+#include <sstream>
 #include <string>
 #include <utility>
 #include <vector>
@@ -19,8 +20,10 @@
 #include "src/fileset.h"
 #include "src/gzip_encoder.h"
 #include "src/md5_generator.h"
+#include "src/restore_engine.h"
 #include "src/status.h"
 
+using std::ostringstream;
 using std::pair;
 using std::string;
 using std::unique_ptr;
@@ -31,10 +34,10 @@ namespace backup2 {
 RestoreDriver::RestoreDriver(
     const string& backup_filename,
     const string& restore_path,
-    const uint64_t set_number)
+    const RestoreOptions& options)
     : backup_filename_(backup_filename),
       restore_path_(restore_path),
-      set_number_(set_number),
+      options_(options),
       volume_change_callback_(
           NewPermanentCallback(this, &RestoreDriver::ChangeBackupVolume)) {
 }
@@ -64,73 +67,63 @@ int RestoreDriver::Restore() {
   // from given user input.
   // TODO(darkstar62): Implement this.  Right now we have limited support, but
   // only for restoring from a single fileset.
-  FileSet* fileset = filesets.value()[set_number_];
+  FileSet* fileset = filesets.value()[options_.set_number()];
 
   // Extract out the directories from the filelist (these'll be ignored by the
   // optimization below).  We need to create them first anyway.
   for (FileEntry* entry : fileset->GetFiles()) {
     if (entry->GetBackupFile()->file_type == BackupFile::kFileTypeDirectory) {
-      boost::filesystem::path restore_path(restore_path_);
-      boost::filesystem::path file_path(entry->proper_filename());
-      boost::filesystem::path dest = restore_path;
-      dest /= file_path;
-
-      // Create the destination directories if they don't exist, and open the
-      // destination file.
-      File file(dest.string());
+      // Create the destination directories if they don't exist.
+      File file(RestorePath(*entry));
       CHECK(file.CreateDirectories(false).ok());
     }
   }
 
-  // Determine the chunks we need, and in what order they should come for
-  // maximum performance.
-  vector<pair<FileChunk, const FileEntry*> > sorted_chunks =
-      library.OptimizeChunksForRestore(fileset->GetFiles());
-
-  // Start the restore process by iterating through the restore sets.
-  string last_filename = "";
-  File* file = NULL;
-  for (auto chunk_pair : sorted_chunks) {
-    FileChunk chunk = chunk_pair.first;
-    const FileEntry* entry = chunk_pair.second;
-
-    if (entry->proper_filename() != last_filename) {
-      if (file) {
-        file->Close();
-        delete file;
-        file = NULL;
-      }
-
-      boost::filesystem::path restore_path(restore_path_);
-      boost::filesystem::path file_path(entry->proper_filename());
-      boost::filesystem::path dest = restore_path;
-      dest /= file_path;
-
-      // Create the destination directories if they don't exist, and open the
-      // destination file.
-      file = new File(dest.string());
-      CHECK(file->CreateDirectories(true).ok());
-      CHECK(file->Open(File::Mode::kModeReadWrite).ok());
-
-      last_filename = entry->proper_filename();
-    }
+  // Determine the chunks we need, each read once, and in what order they
+  // should come for maximum performance.
+  vector<uint64_t> volumes;
+  vector<RestoreChunk> plan = library.PlanRestore(fileset->GetFiles(),
+                                                  &volumes);
+  ostringstream volume_list;
+  for (uint64_t volume : volumes) {
+    volume_list << " " << volume;
+  }
+  LOG(INFO) << "Restore needs " << volumes.size() << " volume(s):"
+            << volume_list.str();
+
+  // Restore the chunks, reading, decoding and writing them in parallel.
+  unique_ptr<RestoreEngine::PathCallback> path_callback(
+      NewPermanentCallback(this, &RestoreDriver::RestorePath));
+  RestoreEngine engine(&library, path_callback.get(),
+                       options_.num_decode_threads(),
+                       options_.num_writer_threads(),
+                       options_.max_memory_mb() * 1048576);
+  engine.set_copy_raw_chunks(options_.copy_raw_chunks());
+  engine.set_trust_crc(options_.trust_crc());
+  if (options_.update_in_place()) {
+    // Skip whatever the existing files already hold.
+    engine.PlanUpdate(&plan);
+    LOG(INFO) << engine.bytes_unchanged() << " bytes already up to date.";
+  }
+  retval = engine.Restore(plan, NULL);
+  CHECK(retval.ok()) << retval.ToString();
 
-    string data;
-    retval = library.ReadChunk(chunk, &data);
-    CHECK(retval.ok()) << retval.ToString();
+  LOG(INFO) << "Restored " << engine.bytes_restored() << " bytes.";
+  for (const string& filename : engine.failed_files()) {
+    LOG(ERROR) << "Could not restore " << filename;
+  }
 
-    if (data.size() == 0) {
-      // Skip empty files.
-      // TODO(darkstar62): We need a better way to handle this.
-      continue;
+  // Restore the modification dates and permissions of the files, so a later
+  // update in place can tell they're unchanged.
+  for (FileEntry* entry : fileset->GetFiles()) {
+    if (entry->GetBackupFile()->file_type == BackupFile::kFileTypeRegularFile &&
+        engine.failed_files().count(RestorePath(*entry)) == 0) {
+      File file(RestorePath(*entry));
+      file.RestoreAttributes(*entry);
     }
-    // Seek to the location for this chunk.
-    file->Seek(chunk.chunk_offset);
-    file->Write(&data.at(0), data.size());
   }
-  if (file) {
-    file->Close();
-    delete file;
+  if (!engine.failed_files().empty()) {
+    return 1;
   }
 
   return 0;
@@ -161,6 +154,12 @@ int RestoreDriver::List() {
   return 0;
 }
 
+string RestoreDriver::RestorePath(const FileEntry& entry) {
+  boost::filesystem::path dest(restore_path_);
+  dest /= boost::filesystem::path(entry.proper_filename());
+  return dest.string();
+}
+
 string RestoreDriver::ChangeBackupVolume(string /* needed_filename */) {
   // If we're here, it means the backup library couldn't find the needed file,
   // and we need to ask the user for the location of the file.
@@ -11,6 +11,57 @@
 
 namespace backup2 {
 class BackupVolume;
+class FileEntry;
+
+#define RESTORE_PROPERTY(type, name) \
+  public: \
+    RestoreOptions& set_ ## name(type name) { \
+      name ## _ = name; \
+      return *this; \
+    } \
+    type name() const { return name ## _; } \
+  private: \
+    type name ## _
+
+// Options controlling a restore.  The defaults restore with one decode thread
+// per core, checking every chunk against its MD5.
+class RestoreOptions {
+ public:
+  RestoreOptions()
+      : set_number_(0),
+        num_decode_threads_(0),
+        num_writer_threads_(4),
+        max_memory_mb_(256),
+        copy_raw_chunks_(false),
+        trust_crc_(false),
+        update_in_place_(false) {}
+
+  // Backup set to restore, numbered as listed by List().
+  RESTORE_PROPERTY(uint64_t, set_number);
+
+  // Number of threads decoding chunks, or 0 for one per core.
+  RESTORE_PROPERTY(int, num_decode_threads);
+
+  // Number of threads writing restored files.
+  RESTORE_PROPERTY(int, num_writer_threads);
+
+  // Maximum amount of chunk data held in memory, in MB.
+  RESTORE_PROPERTY(uint64_t, max_memory_mb);
+
+  // Whether to copy uncompressed chunks straight from the volumes.  See
+  // RestoreEngine::set_copy_raw_chunks().
+  RESTORE_PROPERTY(bool, copy_raw_chunks);
+
+  // Whether a matching CRC is enough to trust a chunk.  See
+  // RestoreEngine::set_trust_crc().
+  RESTORE_PROPERTY(bool, trust_crc);
+
+  // Whether to restore over existing files, writing only the chunks that
+  // differ.  See RestoreEngine::PlanUpdate().
+  RESTORE_PROPERTY(bool, update_in_place);
+};
+
+#undef RESTORE_PROPERTY
 
 // The RestoreDriver does all the work of actually coordinating restore
 // activities.
@@ -21,7 +72,7 @@ class RestoreDriver {
   RestoreDriver(
       const std::string& backup_filename,
       const std::string& restore_path,
-      const uint64_t set_number);
+      const RestoreOptions& options);
 
   // Perform the restore operation.
   int Restore();
@@ -32,10 +83,13 @@ class RestoreDriver {
  private:
   const std::string backup_filename_;
   const std::string restore_path_;
-  const uint64_t set_number_;
+  const RestoreOptions options_;
 
   std::string ChangeBackupVolume(std::string needed_filename);
 
+  // Return the path a file is restored to.
+  std::string RestorePath(const FileEntry& entry);
+
   std::unique_ptr<BackupLibrary::VolumeChangeCallback> volume_change_callback_;
 
   DISALLOW_COPY_AND_ASSIGN(RestoreDriver);
@@ -0,0 +1,873 @@
+// Copyright (C) 2013, All Rights Reserved.
+// Author: Cory Maccarrone <darkstar6262@gmail.com>
+
+#include "src/restore_engine.h"
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "boost/filesystem.hpp"
+#include "glog/logging.h"
+#include "src/backup_library.h"
+#include "src/backup_volume_defs.h"
+#include "src/file.h"
+#include "src/fileset.h"
+#include "src/path_table.h"
+#include "src/status.h"
+
+using std::condition_variable;
+using std::deque;
+using std::list;
+using std::lock_guard;
+using std::mutex;
+using std::pair;
+using std::set;
+using std::shared_ptr;
+using std::string;
+using std::thread;
+using std::unique_lock;
+using std::unique_ptr;
+using std::unordered_map;
+using std::vector;
+
+namespace backup2 {
+namespace {
+
+// How often the progress callback is called.
+const std::chrono::milliseconds kProgressInterval(250);
+
+// Most chunk bytes the reader asks the library for at once.  The volume
+// merges each batch into as few reads as it can.
+const uint64_t kMaxReadBatchSize = 16 * 1048576ULL;
+
+// Most destination files each writer keeps open.  The chunks of a file
+// arrive interleaved with those of other files, so this saves reopening it
+// for each.
+const uint64_t kMaxOpenFilesPerWriter = 16;
+
+// A unique chunk on its way from the reader to the decoders.  The data starts
+// out encoded, and is decoded in place.
+struct DecodeItem {
+  DecodeItem() : chunk(NULL), encoding_type(kEncodingTypeRaw),
+                 crc_checked(false) {}
+
+  const RestoreChunk* chunk;
+  EncodingType encoding_type;
+  string data;
+
+  // Whether the data was checked against a CRC when read.
+  bool crc_checked;
+};
+
+// A write of decoded chunk data to one of the chunk's destinations.  The data
+// is shared between all the destinations of the chunk.  Raw chunks copied
+// straight from their volume have no data, but the location of it instead,
+// and share the chunk's reservation in the budget.
+struct WriteItem {
+  WriteItem() : source_offset(0), source_size(0) {}
+
+  ChunkDestination destination;
+  shared_ptr<const string> data;
+
+  string source_filename;
+  uint64_t source_offset;
+  uint64_t source_size;
+  shared_ptr<const uint64_t> source_reservation;
+};
+
+// A queue handing items from one stage of the pipeline to the next.  The
+// queue is unbounded; the byte budget limits what's in it.
+template<typename Item>
+class ItemQueue {
+ public:
+  ItemQueue() : closed_(false) {}
+
+  // Add an item to the queue.
+  void Push(unique_ptr<Item> item) {
+    {
+      lock_guard<mutex> lock(mutex_);
+      items_.push_back(std::move(item));
+    }
+    ready_.notify_one();
+  }
+
+  // Take the next item off the queue, waiting for one if needed.  Returns
+  // NULL once the queue is closed and empty.
+  unique_ptr<Item> Pop() {
+    unique_lock<mutex> lock(mutex_);
+    ready_.wait(lock, [this] {
+      return closed_ || !items_.empty();
+    });
+    if (items_.empty()) {
+      return unique_ptr<Item>();
+    }
+    unique_ptr<Item> item = std::move(items_.front());
+    items_.pop_front();
+    return item;
+  }
+
+  // Mark that no more items will be added.
+  void Close() {
+    {
+      lock_guard<mutex> lock(mutex_);
+      closed_ = true;
+    }
+    ready_.notify_all();
+  }
+
+ private:
+  mutex mutex_;
+  condition_variable ready_;
+  deque<unique_ptr<Item> > items_;
+  bool closed_;
+
+  DISALLOW_COPY_AND_ASSIGN(ItemQueue);
+};
+
+// Return whether the given data is all zeros.
+bool IsZero(const string& data) {
+  // Each byte is compared with the next, so if the first is zero, all are.
+  return !data.empty() && data[0] == '\0' &&
+         memcmp(data.data(), data.data() + 1, data.size() - 1) == 0;
+}
+
+// A destination file open in a writer.
+struct OpenFile {
+  OpenFile() : path(NULL), size(0), end(0) {}
+
+  const PathTable::Node* path;
+  string dest;
+  unique_ptr<File> file;
+
+  // Size of the file on disk, and the end of its furthest chunk.  Zero chunks
+  // past the end of the file are left as holes, which may leave the file
+  // short until it's closed.
+  uint64_t size;
+  uint64_t end;
+};
+
+// Close a restored file, first extending it over any hole left at its end.
+Status FinishFile(File* file, uint64_t size, uint64_t end) {
+  Status retval = Status::OK;
+  if (end > size) {
+    retval = file->Truncate(end);
+  }
+  Status close_retval = file->Close();
+  return retval.ok() ? close_retval : retval;
+}
+
+// Close an open destination file, adding it to failed_files if that fails.
+void CloseOpenFile(OpenFile* open_file, set<string>* failed_files) {
+  Status retval = FinishFile(open_file->file.get(), open_file->size,
+                             open_file->end);
+  if (!retval.ok()) {
+    LOG(ERROR) << "Could not close " << open_file->dest << ": "
+               << retval.ToString();
+    failed_files->insert(open_file->dest);
+  }
+}
+
+}  // namespace
+
+struct RestoreEngine::Pipeline {
+  Pipeline(int num_writers, uint64_t max_bytes_in_flight)
+      : max_bytes_in_flight(max_bytes_in_flight),
+        bytes_in_flight(0),
+        bytes_restored(0),
+        stopped(false),
+        result(Status::OK),
+        decoders_running(0),
+        threads_running(0) {
+    for (int writer = 0; writer < num_writers; ++writer) {
+      writer_queues.push_back(
+          unique_ptr<ItemQueue<WriteItem> >(new ItemQueue<WriteItem>));
+    }
+  }
+
+  // Reserve room for the given number of bytes in the budget, waiting for
+  // room if needed.  A chunk larger than the whole budget is let through once
+  // nothing else is in flight.  Returns false if the restore was stopped.
+  bool Acquire(uint64_t size) {
+    unique_lock<mutex> lock(state_mutex);
+    budget_changed.wait(lock, [this, size] {
+      return stopped || bytes_in_flight == 0 ||
+             bytes_in_flight + size <= max_bytes_in_flight;
+    });
+    if (stopped) {
+      return false;
+    }
+    bytes_in_flight += size;
+    return true;
+  }
+
+  // Return bytes reserved with Acquire() to the budget.
+  void Release(uint64_t size) {
+    {
+      lock_guard<mutex> lock(state_mutex);
+      bytes_in_flight -= size;
+    }
+    budget_changed.notify_all();
+  }
+
+  // Stop the restore with the given status.  Only the first status is kept.
+  void Stop(const Status& status) {
+    {
+      lock_guard<mutex> lock(state_mutex);
+      if (!stopped) {
+        result = status;
+        stopped = true;
+      }
+    }
+    budget_changed.notify_all();
+  }
+
+  bool IsStopped() {
+    lock_guard<mutex> lock(state_mutex);
+    return stopped;
+  }
+
+  // Create the directories leading to the given destination file, unless a
+  // file restored earlier already did.
+  Status CreateDirectories(const string& dest, File* file) {
+    string directory = boost::filesystem::path(dest).parent_path().string();
+    {
+      lock_guard<mutex> lock(state_mutex);
+      if (created_directories.count(directory) > 0) {
+        return Status::OK;
+      }
+    }
+    Status retval = file->CreateDirectories(true);
+    if (retval.ok()) {
+      lock_guard<mutex> lock(state_mutex);
+      created_directories.insert(directory);
+    }
+    return retval;
+  }
+
+  // Mark a pipeline thread as done.
+  void ThreadDone() {
+    {
+      lock_guard<mutex> lock(state_mutex);
+      --threads_running;
+    }
+    threads_done.notify_all();
+  }
+
+  // Everything up to the queues is protected by state_mutex.
+  mutex state_mutex;
+  condition_variable budget_changed;
+  condition_variable threads_done;
+
+  uint64_t max_bytes_in_flight;
+  uint64_t bytes_in_flight;
+  uint64_t bytes_restored;
+  set<string> failed_files;
+  set<string> created_directories;
+
+  // Whether the restore was stopped, and why.
+  bool stopped;
+  Status result;
+
+  // Number of decoders still decoding, and of pipeline threads still running.
+  int decoders_running;
+  int threads_running;
+
+  // Queues between the reader and decoders, and the decoders and each writer.
+  // Decoded data and copies return their bytes to the budget when released,
+  // so these come last, to be destroyed before the budget.
+  ItemQueue<DecodeItem> decode_queue;
+  vector<unique_ptr<ItemQueue<WriteItem> > > writer_queues;
+};
+
+struct RestoreEngine::UpdateFile {
+  const FileEntry* entry;
+
+  // Each destination in the file, as the index of its chunk in the plan, and
+  // its index in the chunk's destinations.
+  vector<pair<uint64_t, uint64_t> > destinations;
+};
+
+const int RestoreEngine::kDefaultNumWriters = 4;
+const uint64_t RestoreEngine::kDefaultMaxBytesInFlight = 256 * 1048576ULL;
+
+RestoreEngine::RestoreEngine(BackupLibrary* library,
+                             PathCallback* path_callback,
+                             int num_decoders, int num_writers,
+                             uint64_t max_bytes_in_flight)
+    : library_(library),
+      path_callback_(path_callback),
+      num_decoders_(num_decoders),
+      num_writers_(num_writers > 0 ? num_writers : 1),
+      max_bytes_in_flight_(max_bytes_in_flight),
+      copy_raw_chunks_(false),
+      trust_crc_(false),
+      bytes_unchanged_(0),
+      bytes_restored_(0) {
+  if (num_decoders_ <= 0) {
+    num_decoders_ = thread::hardware_concurrency();
+    if (num_decoders_ <= 0) {
+      num_decoders_ = 1;
+    }
+  }
+}
+
+RestoreEngine::~RestoreEngine() {
+}
+
+void RestoreEngine::PlanUpdate(vector<RestoreChunk>* plan) {
+  // Gather the destinations in each file.
+  vector<UpdateFile> files;
+  unordered_map<const FileEntry*, uint64_t> file_index;
+  vector<vector<char> > unchanged(plan->size());
+  for (uint64_t chunk = 0; chunk < plan->size(); ++chunk) {
+    const vector<ChunkDestination>& destinations = (*plan)[chunk].destinations;
+    unchanged[chunk].resize(destinations.size(), 0);
+    for (uint64_t destination = 0; destination < destinations.size();
+         ++destination) {
+      const FileEntry* entry = destinations[destination].entry;
+      auto index_iter = file_index.find(entry);
+      if (index_iter == file_index.end()) {
+        index_iter = file_index.insert(
+            std::make_pair(entry, files.size())).first;
+        files.push_back(UpdateFile());
+        files.back().entry = entry;
+      }
+      files[index_iter->second].destinations.push_back(
+          std::make_pair(chunk, destination));
+    }
+  }
+
+  // Scan the files.  Each thread touches only the destinations of its own
+  // files.
+  vector<uint64_t> bytes_unchanged(num_writers_, 0);
+  vector<thread> threads;
+  for (int scanner = 0; scanner < num_writers_; ++scanner) {
+    threads.push_back(thread(&RestoreEngine::ScanFiles, this, std::cref(*plan),
+                             std::cref(files), scanner, num_writers_,
+                             &unchanged, &bytes_unchanged[scanner]));
+  }
+  bytes_unchanged_ = 0;
+  for (int scanner = 0; scanner < num_writers_; ++scanner) {
+    threads[scanner].join();
+    bytes_unchanged_ += bytes_unchanged[scanner];
+  }
+
+  // Keep the chunks with destinations left to write.
+  vector<RestoreChunk> update;
+  for (uint64_t chunk = 0; chunk < plan->size(); ++chunk) {
+    RestoreChunk& restore_chunk = (*plan)[chunk];
+    vector<ChunkDestination> destinations;
+    for (uint64_t destination = 0;
+         destination < restore_chunk.destinations.size(); ++destination) {
+      if (!unchanged[chunk][destination]) {
+        destinations.push_back(restore_chunk.destinations[destination]);
+      }
+    }
+    if (!destinations.empty()) {
+      update.push_back(RestoreChunk());
+      update.back().chunk = restore_chunk.chunk;
+      update.back().destinations.swap(destinations);
+    }
+  }
+  LOG(INFO) << "Update needs " << update.size() << " of " << plan->size()
+            << " chunks; " << bytes_unchanged_ << " bytes already in place";
+  plan->swap(update);
+}
+
+void RestoreEngine::ScanFiles(const vector<RestoreChunk>& plan,
+                              const vector<UpdateFile>& files,
+                              uint64_t first_file, uint64_t num_threads,
+                              vector<vector<char> >* unchanged,
+                              uint64_t* bytes_unchanged) {
+  string data;
+  for (uint64_t index = first_file; index < files.size();
+       index += num_threads) {
+    const UpdateFile& update_file = files[index];
+    string dest = path_callback_->Run(*update_file.entry);
+    File file(dest);
+    if (!file.Exists()) {
+      continue;
+    }
+    BackupFile disk_metadata;
+    Status retval = file.FillBackupFile(&disk_metadata, NULL);
+    if (!retval.ok() ||
+        disk_metadata.file_type != BackupFile::kFileTypeRegularFile) {
+      continue;
+    }
+
+    // Files that look untouched aren't read at all.  Others lose anything past
+    // their backed-up size, and have each chunk checked.
+    const BackupFile* metadata = update_file.entry->GetBackupFile();
+    bool same_metadata = disk_metadata.file_size == metadata->file_size &&
+                         disk_metadata.modify_date == metadata->modify_date;
+    if (!same_metadata) {
+      retval = file.Open(File::Mode::kModeReadWrite);
+      if (retval.ok() && disk_metadata.file_size > metadata->file_size) {
+        retval = file.Truncate(metadata->file_size);
+        disk_metadata.file_size = metadata->file_size;
+      }
+      if (!retval.ok()) {
+        LOG(WARNING) << "Could not scan " << dest << ", restoring all of it: "
+                     << retval.ToString();
+        continue;
+      }
+    }
+
+    for (const pair<uint64_t, uint64_t>& location :
+         update_file.destinations) {
+      const RestoreChunk& restore_chunk = plan[location.first];
+      const FileChunk& chunk = restore_chunk.chunk;
+      if (!same_metadata) {
+        uint64_t offset =
+            restore_chunk.destinations[location.second].chunk_offset;
+        if (offset + chunk.unencoded_size > disk_metadata.file_size) {
+          continue;
+        }
+        data.resize(chunk.unencoded_size);
+        if (!data.empty()) {
+          retval = file.Seek(offset);
+          if (retval.ok()) {
+            retval = file.Read(&data.at(0), data.size(), NULL);
+          }
+          if (!retval.ok()) {
+            continue;
+          }
+        }
+        if (!library_->MatchesChunk(chunk, data)) {
+          continue;
+        }
+      }
+      (*unchanged)[location.first][location.second] = 1;
+      *bytes_unchanged += chunk.unencoded_size;
+    }
+
+    if (!same_metadata) {
+      file.Close();
+    }
+  }
+}
+
+Status RestoreEngine::Restore(const vector<RestoreChunk>& plan,
+                              ProgressCallback* progress) {
+  Pipeline pipeline(num_writers_, max_bytes_in_flight_);
+  pipeline.decoders_running = num_decoders_;
+  pipeline.threads_running = 1 + num_decoders_ + num_writers_;
+
+  vector<thread> threads;
+  threads.push_back(thread(&RestoreEngine::ReadChunks, this,
+                           std::cref(plan), &pipeline));
+  for (int decoder = 0; decoder < num_decoders_; ++decoder) {
+    threads.push_back(thread(&RestoreEngine::DecodeChunks, this, &pipeline));
+  }
+  for (int writer = 0; writer < num_writers_; ++writer) {
+    threads.push_back(
+        thread(&RestoreEngine::WriteChunks, this, writer, &pipeline));
+  }
+
+  // Report progress until the pipeline drains.
+  bool cancelled = false;
+  while (true) {
+    uint64_t bytes_restored = 0;
+    {
+      unique_lock<mutex> lock(pipeline.state_mutex);
+      if (pipeline.threads_done.wait_for(
+              lock, kProgressInterval,
+              [&pipeline] { return pipeline.threads_running == 0; })) {
+        break;
+      }
+      bytes_restored = pipeline.bytes_restored;
+    }
+    if (progress && !cancelled && !progress->Run(bytes_restored)) {
+      LOG(INFO) << "Restore cancelled";
+      cancelled = true;
+      pipeline.Stop(Status(kStatusGenericError, "Restore cancelled"));
+    }
+  }
+
+  for (uint64_t index = 0; index < threads.size(); ++index) {
+    threads[index].join();
+  }
+
+  bytes_restored_ = pipeline.bytes_restored;
+  failed_files_ = pipeline.failed_files;
+  return pipeline.result;
+}
+
+void RestoreEngine::ReadChunks(const vector<RestoreChunk>& plan,
+                               Pipeline* pipeline) {
+  // Read the plan in batches of neighbouring chunks from one volume.  Keep
+  // batches to a fraction of the budget, so the decoders can work on one
+  // while the next is read.
+  uint64_t max_batch_size =
+      std::min(kMaxReadBatchSize, max_bytes_in_flight_ / 4);
+  vector<const RestoreChunk*> zero_chunks;
+  vector<const RestoreChunk*> copy_chunks;
+  vector<const RestoreChunk*> batch_chunks;
+  vector<FileChunk> batch;
+  vector<string> encoded;
+  vector<EncodingType> encoding_types;
+  uint64_t next = 0;
+  Status retval = Status::OK;
+  while (next < plan.size() && retval.ok()) {
+    uint64_t batch_size = 0;
+    uint64_t batch_volume = 0;
+    zero_chunks.clear();
+    copy_chunks.clear();
+    batch_chunks.clear();
+    batch.clear();
+    while (next < plan.size()) {
+      const RestoreChunk& restore_chunk = plan[next];
+      const FileChunk& chunk = restore_chunk.chunk;
+      if ((!batch.empty() || !copy_chunks.empty()) &&
+          (chunk.volume_num != batch_volume ||
+           batch_size + chunk.unencoded_size > max_batch_size)) {
+        break;
+      }
+      ++next;
+
+      // Chunks of zeros aren't read at all.
+      if (library_->IsZeroChunk(chunk)) {
+        zero_chunks.push_back(&restore_chunk);
+        continue;
+      }
+
+      // Raw chunks may go straight to the writers, once they're located.
+      if (copy_raw_chunks_ && chunk.unencoded_size > 0) {
+        copy_chunks.push_back(&restore_chunk);
+      } else {
+        batch_chunks.push_back(&restore_chunk);
+        batch.push_back(chunk);
+      }
+      batch_size += chunk.unencoded_size;
+      batch_volume = chunk.volume_num;
+    }
+
+    if (!copy_chunks.empty()) {
+      retval = CopyRawChunks(copy_chunks, pipeline, &batch_chunks, &batch);
+      if (!retval.ok() || pipeline->IsStopped()) {
+        break;
+      }
+    }
+
+    bool stopped = false;
+    for (const RestoreChunk* zero_chunk : zero_chunks) {
+      if (!pipeline->Acquire(zero_chunk->chunk.unencoded_size)) {
+        stopped = true;
+        break;
+      }
+      unique_ptr<DecodeItem> item(new DecodeItem);
+      item->chunk = zero_chunk;
+      item->encoding_type = kEncodingTypeZero;
+      pipeline->decode_queue.Push(std::move(item));
+    }
+    if (stopped) {
+      break;
+    }
+    if (batch.empty()) {
+      continue;
+    }
+
+    // Chunks copied from their volume have their own share of the budget.
+    batch_size = 0;
+    for (const FileChunk& chunk : batch) {
+      batch_size += chunk.unencoded_size;
+    }
+    if (!pipeline->Acquire(batch_size)) {
+      break;
+    }
+    retval = library_->ReadEncodedChunks(batch, &encoded, &encoding_types);
+    if (!retval.ok()) {
+      pipeline->Release(batch_size);
+      break;
+    }
+    bool crc_checked = false;
+    if (trust_crc_) {
+      StatusOr<bool> have_crcs = library_->ChunksHaveCrcs(batch[0].volume_num);
+      retval = have_crcs.status();
+      if (!retval.ok()) {
+        pipeline->Release(batch_size);
+        break;
+      }
+      crc_checked = have_crcs.value();
+    }
+
+    // Each chunk returns its own share of the batch to the budget.
+    for (uint64_t index = 0; index < batch.size(); ++index) {
+      unique_ptr<DecodeItem> item(new DecodeItem);
+      item->chunk = batch_chunks[index];
+      item->encoding_type = encoding_types[index];
+      item->data.swap(encoded[index]);
+      item->crc_checked = crc_checked;
+      pipeline->decode_queue.Push(std::move(item));
+    }
+  }
+  if (!retval.ok()) {
+    LOG(ERROR) << "Could not read chunks: " << retval.ToString();
+    pipeline->Stop(retval);
+  }
+
+  pipeline->decode_queue.Close();
+  pipeline->ThreadDone();
+}
+
+Status RestoreEngine::CopyRawChunks(const vector<const RestoreChunk*>& chunks,
+                                    Pipeline* pipeline,
+                                    vector<const RestoreChunk*>* decode_chunks,
+                                    vector<FileChunk>* decode_batch) {
+  vector<FileChunk> file_chunks;
+  for (const RestoreChunk* restore_chunk : chunks) {
+    file_chunks.push_back(restore_chunk->chunk);
+  }
+  string volume_filename;
+  vector<uint64_t> data_offsets;
+  vector<ChunkHeader> headers;
+  Status retval = library_->LocateEncodedChunks(file_chunks, &volume_filename,
+                                                &data_offsets, &headers);
+  if (retval.code() == kStatusNotImplemented) {
+    headers.clear();
+  } else {
+    LOG_RETURN_IF_ERROR(retval, "Could not locate chunks");
+  }
+
+  // Copy the raw chunks in the order they're stored, so each writer reads
+  // the volume forward.
+  vector<pair<uint64_t, uint64_t> > copies;
+  uint64_t copy_size = 0;
+  for (uint64_t index = 0; index < chunks.size(); ++index) {
+    const FileChunk& chunk = file_chunks[index];
+    if (index < headers.size() &&
+        headers[index].encoding_type == kEncodingTypeRaw &&
+        headers[index].encoded_size == chunk.unencoded_size) {
+      copies.push_back(std::make_pair(data_offsets[index], index));
+      copy_size += chunk.unencoded_size;
+    } else {
+      decode_chunks->push_back(chunks[index]);
+      decode_batch->push_back(chunk);
+    }
+  }
+  std::sort(copies.begin(), copies.end());
+  if (copies.empty() || !pipeline->Acquire(copy_size)) {
+    return Status::OK;
+  }
+
+  // Each chunk returns its own share of the budget once all its destinations
+  // are written.
+  std::hash<const PathTable::Node*> path_hash;
+  for (const pair<uint64_t, uint64_t>& copy : copies) {
+    const RestoreChunk* restore_chunk = chunks[copy.second];
+    uint64_t size = restore_chunk->chunk.unencoded_size;
+    shared_ptr<const uint64_t> reservation(
+        new uint64_t(size),
+        [pipeline](const uint64_t* released) {
+          pipeline->Release(*released);
+          delete released;
+        });
+    for (const ChunkDestination& destination : restore_chunk->destinations) {
+      unique_ptr<WriteItem> write(new WriteItem);
+      write->destination = destination;
+      write->source_filename = volume_filename;
+      write->source_offset = copy.first;
+      write->source_size = size;
+      write->source_reservation = reservation;
+      int writer = path_hash(destination.entry->path()) %
+                   pipeline->writer_queues.size();
+      pipeline->writer_queues[writer]->Push(std::move(write));
+    }
+  }
+  return Status::OK;
+}
+
+void RestoreEngine::DecodeChunks(Pipeline* pipeline) {
+  std::hash<const PathTable::Node*> path_hash;
+  while (true) {
+    unique_ptr<DecodeItem> item = pipeline->decode_queue.Pop();
+    if (!item) {
+      break;
+    }
+    const FileChunk& chunk = item->chunk->chunk;
+    uint64_t size = chunk.unencoded_size;
+    if (pipeline->IsStopped()) {
+      pipeline->Release(size);
+      continue;
+    }
+
+    Status retval = item->crc_checked ?
+        library_->DecodeCheckedChunk(chunk, item->encoding_type, &item->data) :
+        library_->DecodeChunk(chunk, item->encoding_type, &item->data);
+    if (!retval.ok()) {
+      LOG(ERROR) << "Could not decode chunk: " << retval.ToString();
+      pipeline->Release(size);
+      pipeline->Stop(retval);
+      continue;
+    }
+
+    // Hand the data to the writer of each destination.  The chunk stays in
+    // the budget until the last of them is done with it.
+    shared_ptr<const string> data(
+        new string(std::move(item->data)),
+        [pipeline, size](const string* released) {
+          delete released;
+          pipeline->Release(size);
+        });
+    for (const ChunkDestination& destination : item->chunk->destinations) {
+      unique_ptr<WriteItem> write(new WriteItem);
+      write->destination = destination;
+      write->data = data;
+      int writer = path_hash(destination.entry->path()) %
+                   pipeline->writer_queues.size();
+      pipeline->writer_queues[writer]->Push(std::move(write));
+    }
+  }
+
+  // The last decoder out lets the writers finish.
+  bool last_decoder = false;
+  {
+    lock_guard<mutex> lock(pipeline->state_mutex);
+    last_decoder = --pipeline->decoders_running == 0;
+  }
+  if (last_decoder) {
+    for (const unique_ptr<ItemQueue<WriteItem> >& queue :
+         pipeline->writer_queues) {
+      queue->Close();
+    }
+  }
+  pipeline->ThreadDone();
+}
+
+void RestoreEngine::WriteChunks(int writer, Pipeline* pipeline) {
+  // Open destination files, most recently used first.
+  list<OpenFile> open_files;
+  set<string> failed_files;
+  string source_filename = "";
+  unique_ptr<File> source;
+
+  while (true) {
+    unique_ptr<WriteItem> item = pipeline->writer_queues[writer]->Pop();
+    if (!item) {
+      break;
+    }
+    if (pipeline->IsStopped()) {
+      continue;
+    }
+
+    const FileEntry* entry = item->destination.entry;
+    list<OpenFile>::iterator open_file = open_files.begin();
+    while (open_file != open_files.end() && open_file->path != entry->path()) {
+      ++open_file;
+    }
+    if (open_file != open_files.end()) {
+      open_files.splice(open_files.begin(), open_files, open_file);
+    } else {
+      string dest = path_callback_->Run(*entry);
+      if (failed_files.find(dest) != failed_files.end()) {
+        continue;
+      }
+      if (open_files.size() >= kMaxOpenFilesPerWriter) {
+        CloseOpenFile(&open_files.back(), &failed_files);
+        open_files.pop_back();
+      }
+
+      // Create the destination directories if they don't exist, and open the
+      // destination file.
+      open_files.push_front(OpenFile());
+      open_file = open_files.begin();
+      open_file->path = entry->path();
+      open_file->dest = dest;
+      open_file->file.reset(new File(dest));
+      Status retval = pipeline->CreateDirectories(dest,
+                                                  open_file->file.get());
+      if (retval.ok()) {
+        retval = open_file->file->Open(File::Mode::kModeReadWrite);
+      }
+      if (retval.ok()) {
+        retval = open_file->file->size(&open_file->size);
+      }
+      if (!retval.ok()) {
+        LOG(ERROR) << "Could not open " << dest << " for write: "
+                   << retval.ToString();
+        failed_files.insert(dest);
+        open_files.pop_front();
+        continue;
+      }
+    }
+
+    uint64_t size = item->data ? item->data->size() : item->source_size;
+    if (size == 0) {
+      // Empty files only need creating.
+      continue;
+    }
+
+    File* file = open_file->file.get();
+    uint64_t offset = item->destination.chunk_offset;
+    Status retval = Status::OK;
+    if (item->data && IsZero(*item->data)) {
+      // Zero chunks become holes.  Past the end of the file they already
+      // are; existing data has to be punched out.
+      if (offset < open_file->size) {
+        uint64_t punch_size = std::min(size, open_file->size - offset);
+        retval = file->PunchHole(offset, punch_size);
+        if (retval.code() == kStatusNotImplemented) {
+          retval = file->WriteAt(offset, &item->data->at(0), punch_size);
+        }
+      }
+    } else if (item->data) {
+      retval = file->WriteAt(offset, &item->data->at(0), size);
+      open_file->size = std::max(open_file->size, offset + size);
+    } else {
+      // Copy the chunk from its volume, keeping the last volume open.
+      if (!source || source_filename != item->source_filename) {
+        source_filename = item->source_filename;
+        source.reset(new File(source_filename));
+        retval = source->Open(File::Mode::kModeRead);
+        if (!retval.ok()) {
+          source.reset();
+          LOG(ERROR) << "Could not open volume " << source_filename << ": "
+                     << retval.ToString();
+          pipeline->Stop(retval);
+          continue;
+        }
+      }
+      retval = file->CopyRangeFrom(source.get(), item->source_offset, size,
+                                   offset);
+      open_file->size = std::max(open_file->size, offset + size);
+    }
+    if (!retval.ok()) {
+      LOG(ERROR) << "Could not write " << open_file->dest << ": "
+                 << retval.ToString();
+      failed_files.insert(open_file->dest);
+      open_files.erase(open_file);
+      continue;
+    }
+    open_file->end = std::max(open_file->end, offset + size);
+
+    {
+      lock_guard<mutex> lock(pipeline->state_mutex);
+      pipeline->bytes_restored += size;
+    }
+  }
+
+  for (list<OpenFile>::iterator open_file = open_files.begin();
+       open_file != open_files.end(); ++open_file) {
+    CloseOpenFile(&*open_file, &failed_files);
+  }
+
+  {
+    lock_guard<mutex> lock(pipeline->state_mutex);
+    pipeline->failed_files.insert(failed_files.begin(), failed_files.end());
+  }
+  pipeline->ThreadDone();
+}
+
+}  // namespace backup2
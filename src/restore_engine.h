@@ -0,0 +1,162 @@
+// Copyright (C) 2013, All Rights Reserved.
+// Author: Cory Maccarrone <darkstar6262@gmail.com>
+#ifndef BACKUP2_SRC_RESTORE_ENGINE_H_
+#define BACKUP2_SRC_RESTORE_ENGINE_H_
+
+#include <set>
+#include <string>
+#include <vector>
+
+#include "src/callback.h"
+#include "src/common.h"
+#include "src/status.h"
+
+namespace backup2 {
+class BackupLibrary;
+class FileEntry;
+struct FileChunk;
+struct RestoreChunk;
+
+// The RestoreEngine restores the chunks of a restore plan, from
+// BackupLibrary::PlanRestore(), to their destination files as a pipeline of
+// threads:
+//
+//  - A reader reads each unique chunk from the backup volumes once, in the
+//    order of the plan.  The reader is the only thread touching the library's
+//    volumes, and reads ahead of the rest of the pipeline.  Chunks of zeros
+//    aren't read, and left as holes by the writers.  Raw chunks may instead
+//    skip the decoders, to be copied by the writers straight from their
+//    volumes.
+//  - A pool of decoders decompresses the chunks and validates their MD5s, and
+//    hands the data to the writers of all of the chunk's destinations.  Chunks
+//    already checked against a CRC may skip the MD5; see set_trust_crc().
+//  - A set of writers writes the chunks to their files.  Each file belongs to
+//    exactly one writer, so writes to a file happen in the order its chunks
+//    were decoded, and no two threads ever have the same file open.
+//
+// Decoded data is shared between all the destinations of a chunk, however
+// many there are.  The chunks between the reader and the writers are limited
+// to a budget of bytes in flight, so memory use doesn't depend on the size of
+// the restore.
+class RestoreEngine {
+ public:
+  // Callback returning the destination path of a file.  This is called from
+  // the writer threads, and so must be safe to call from multiple threads.
+  typedef ResultCallback1<std::string, const FileEntry&> PathCallback;
+
+  // Callback called periodically with the number of bytes restored so far.
+  // Returning false cancels the restore.
+  typedef ResultCallback1<bool, uint64_t> ProgressCallback;
+
+  // Default number of writer threads.
+  static const int kDefaultNumWriters;
+
+  // Default budget of decoded chunk bytes in flight.
+  static const uint64_t kDefaultMaxBytesInFlight;
+
+  // Create an engine restoring from the given library, with files placed
+  // where path_callback says.  Ownership of neither is taken.  If num_decoders
+  // is zero, one decoder is used per core.
+  RestoreEngine(BackupLibrary* library, PathCallback* path_callback,
+                int num_decoders, int num_writers,
+                uint64_t max_bytes_in_flight);
+  ~RestoreEngine();
+
+  // Restore the chunks of the given plan.  The destination directories of the
+  // files are created as needed.  progress may be NULL.  Files that can't be
+  // opened or written are skipped and reported in failed_files(); any error
+  // reading or validating a chunk stops the restore, and is returned.
+  Status Restore(const std::vector<RestoreChunk>& plan,
+                 ProgressCallback* progress);
+
+  // Set whether chunks stored raw are copied straight from their backup volume
+  // to their destinations, rather than read in and written out.  Where the
+  // filesystem supports it, the copy shares the volume's data with the
+  // restored file, taking neither time nor space.  The copied data is not
+  // checked against the chunk's MD5, so this trusts the backup media.
+  void set_copy_raw_chunks(bool copy_raw_chunks) {
+    copy_raw_chunks_ = copy_raw_chunks;
+  }
+
+  // Set whether chunks read from volumes that store CRCs of their chunks are
+  // trusted once their CRC matches, rather than decoded and checked against
+  // their MD5 as well.  The CRC catches damage to the media, but not a bad
+  // decoding, so only the size of the decoded data is then checked.
+  void set_trust_crc(bool trust_crc) { trust_crc_ = trust_crc; }
+
+  // Drop from the plan the chunks their destinations already hold, so that
+  // restoring over an existing copy of the files only reads and writes what
+  // differs.  Files whose size and modification time match the backup are
+  // taken to be unchanged without reading them.  The rest are cut down to
+  // their backed-up size, and read and checksummed at each chunk's offset.
+  // Files that can't be read keep all their chunks.  Files are scanned in
+  // parallel, by one thread per writer.
+  void PlanUpdate(std::vector<RestoreChunk>* plan);
+
+  // Return the number of bytes the last PlanUpdate() found already in place.
+  uint64_t bytes_unchanged() const { return bytes_unchanged_; }
+
+  // Return the number of bytes written by the last restore.
+  uint64_t bytes_restored() const { return bytes_restored_; }
+
+  // Return the destination paths of the files the last restore couldn't
+  // write.
+  const std::set<std::string>& failed_files() const { return failed_files_; }
+
+ private:
+  // State shared by the threads of one restore.
+  struct Pipeline;
+
+  // The chunks a file needs, by position in the plan.
+  struct UpdateFile;
+
+  // Thread body of PlanUpdate().  Scans every num_threads'th file starting at
+  // first_file, marks the destinations already holding their chunk in
+  // unchanged, and adds the bytes found in place to bytes_unchanged.
+  void ScanFiles(const std::vector<RestoreChunk>& plan,
+                 const std::vector<UpdateFile>& files, uint64_t first_file,
+                 uint64_t num_threads,
+                 std::vector<std::vector<char> >* unchanged,
+                 uint64_t* bytes_unchanged);
+
+  // Hand the chunks of a batch that are stored raw in a volume file to the
+  // writers of all their destinations, in the order they're stored, charging
+  // them to the budget.  The rest are added to decode_chunks and
+  // decode_batch, to be read like any other chunk.  Called from the reader.
+  Status CopyRawChunks(const std::vector<const RestoreChunk*>& chunks,
+                       Pipeline* pipeline,
+                       std::vector<const RestoreChunk*>* decode_chunks,
+                       std::vector<FileChunk>* decode_batch);
+
+  // Thread bodies of the pipeline stages.
+  void ReadChunks(const std::vector<RestoreChunk>& plan, Pipeline* pipeline);
+  void DecodeChunks(Pipeline* pipeline);
+  void WriteChunks(int writer, Pipeline* pipeline);
+
+  // Library to read chunks from.
+  BackupLibrary* library_;
+
+  // Callback returning the destination path of a file.
+  PathCallback* path_callback_;
+
+  // Sizes of the pipeline.
+  int num_decoders_;
+  int num_writers_;
+  uint64_t max_bytes_in_flight_;
+
+  // Whether raw chunks are copied from their volumes by the writers.
+  bool copy_raw_chunks_;
+
+  // Whether chunks with matching CRCs skip the MD5 check.
+  bool trust_crc_;
+
+  // Results of the last update plan and restore.
+  uint64_t bytes_unchanged_;
+  uint64_t bytes_restored_;
+  std::set<std::string> failed_files_;
+
+  DISALLOW_COPY_AND_ASSIGN(RestoreEngine);
+};
+
+}  // namespace backup2
+#endif  // BACKUP2_SRC_RESTORE_ENGINE_H_
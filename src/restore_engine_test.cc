@@ -0,0 +1,323 @@
+// Copyright (C) 2013, All Rights Reserved.
+// Author: Cory Maccarrone <darkstar6262@gmail.com>
+
+#include <memory>
+#include <set>
+#include <string>
+#include <vector>
+
+#include "boost/filesystem.hpp"
+#include "src/backup_library.h"
+#include "src/backup_volume_defs.h"
+#include "src/callback.h"
+#include "src/fake_backup_volume.h"
+#include "src/file.h"
+#include "src/fileset.h"
+#include "src/gzip_encoder.h"
+#include "src/md5_generator.h"
+#include "src/mock_backup_volume_factory.h"
+#include "src/mock_file.h"
+#include "src/restore_engine.h"
+#include "src/status.h"
+#include "glog/logging.h"
+#include "gmock/gmock.h"
+#include "gtest/gtest.h"
+
+using std::set;
+using std::string;
+using std::unique_ptr;
+using std::vector;
+using testing::_;
+using testing::DoAll;
+using testing::Return;
+using testing::SetArgPointee;
+
+namespace backup2 {
+
+class RestoreEngineTest : public testing::Test {
+ public:
+  static const char* kRestorePath;
+
+  RestoreEngineTest() : volume_(NULL) {}
+
+  void SetUp() {
+    boost::filesystem::remove_all(boost::filesystem::path(kRestorePath));
+
+    MockFile* file = new MockFile;
+    MockBackupVolumeFactory* volume_factory = new MockBackupVolumeFactory;
+    volume_change_callback_.reset(
+        NewPermanentCallback(this, &RestoreEngineTest::GetNextFilename));
+    path_callback_.reset(
+        NewPermanentCallback(this, &RestoreEngineTest::RestorePath));
+    progress_callback_.reset(
+        NewPermanentCallback(this, &RestoreEngineTest::Progress));
+
+    EXPECT_CALL(*file, FindBasenameAndLastVolume(_, _, _))
+        .WillOnce(DoAll(
+            SetArgPointee<0>("/foo/bar"),
+            SetArgPointee<1>(0),
+            SetArgPointee<2>(1),
+            Return(Status::OK)));
+    library_.reset(new BackupLibrary(
+        file, volume_change_callback_.get(), new Md5Generator,
+        new GzipEncoder, volume_factory));
+
+    volume_ = new FakeBackupVolume(file);
+    volume_->InitializeForExistingWithDescriptor2();
+    EXPECT_CALL(*volume_factory, Create("/foo/bar.0.bkp"))
+        .WillOnce(Return(volume_));
+    ASSERT_TRUE(library_->Init().ok());
+  }
+
+  void TearDown() {
+    library_.reset();
+    boost::filesystem::remove_all(boost::filesystem::path(kRestorePath));
+  }
+
+  string GetNextFilename(string /* original */) {
+    return "";
+  }
+
+  string RestorePath(const FileEntry& entry) {
+    return string(kRestorePath) + entry.proper_filename();
+  }
+
+  bool Progress(uint64_t /* bytes_restored */) {
+    return true;
+  }
+
+ protected:
+  // Store the given data in the volume, and add it to the entry at the given
+  // offset.
+  void AddChunk(const string& data, uint64_t offset, bool compress,
+                FileEntry* entry) {
+    Uint128 md5sum = md5_maker_.Checksum(data);
+    string stored = data;
+    if (compress) {
+      ASSERT_TRUE(encoder_.Encode(data, &stored).ok());
+    }
+    ASSERT_TRUE(volume_->WriteChunk(
+        md5sum, stored, data.size(),
+        compress ? kEncodingTypeZlib : kEncodingTypeRaw, NULL).ok());
+
+    FileChunk chunk;
+    chunk.md5sum = md5sum;
+    chunk.volume_num = 0;
+    chunk.chunk_offset = offset;
+    chunk.unencoded_size = data.size();
+    entry->AddChunk(chunk);
+    files_.insert(entry);
+  }
+
+  // Read back a restored file.
+  string ReadRestored(const string& filename) {
+    File file(string(kRestorePath) + filename);
+    EXPECT_TRUE(file.Open(File::Mode::kModeRead).ok());
+    uint64_t size = 0;
+    EXPECT_TRUE(file.size(&size).ok());
+    string data(size, '\0');
+    if (!data.empty()) {
+      EXPECT_TRUE(file.Read(&data.at(0), data.size(), NULL).ok());
+    }
+    EXPECT_TRUE(file.Close().ok());
+    return data;
+  }
+
+  // Replace the contents of a restored file.
+  void WriteRestored(const string& filename, const string& data) {
+    File file(string(kRestorePath) + filename);
+    ASSERT_TRUE(file.Unlink().ok());
+    ASSERT_TRUE(file.Open(File::Mode::kModeAppend).ok());
+    ASSERT_TRUE(file.Write(&data.at(0), data.size()).ok());
+    ASSERT_TRUE(file.Close().ok());
+  }
+
+  unique_ptr<BackupLibrary::VolumeChangeCallback> volume_change_callback_;
+  unique_ptr<RestoreEngine::PathCallback> path_callback_;
+  unique_ptr<RestoreEngine::ProgressCallback> progress_callback_;
+  unique_ptr<BackupLibrary> library_;
+  FakeBackupVolume* volume_;
+  Md5Generator md5_maker_;
+  GzipEncoder encoder_;
+  FileSet fileset_;
+  FileEntrySet files_;
+};
+
+const char* RestoreEngineTest::kRestorePath = "__restore_engine_test__";
+
+TEST_F(RestoreEngineTest, RestoreFiles) {
+  // Restore several files, with chunks shared between and within them.  The
+  // budget is smaller than the data, so the reader has to wait for the
+  // writers.
+  FileEntry* foo = fileset_.AddFile("/foo", BackupFile());
+  FileEntry* bar = fileset_.AddFile("/dir/bar", BackupFile());
+  FileEntry* empty = fileset_.AddFile("/dir/empty", BackupFile());
+
+  string first(4096, 'a');
+  string second(4096, 'b');
+  string third = "some incompressible text";
+  AddChunk(first, 0, true, foo);
+  AddChunk(first, 0, true, bar);
+  AddChunk(second, 4096, false, foo);
+  AddChunk(third, 4096, false, bar);
+  AddChunk(second, 4096 + third.size(), true, bar);
+  AddChunk(first, 4096 * 2 + third.size(), true, bar);
+  AddChunk("", 0, false, empty);
+
+  // Each unique chunk is read once, and written everywhere it's needed.
+  vector<RestoreChunk> plan = library_->PlanRestore(files_, NULL);
+  ASSERT_EQ(4, plan.size());
+
+  // The fake volume isn't a file, so raw chunks can't be copied from it, and
+  // are read like the rest.
+  RestoreEngine engine(library_.get(), path_callback_.get(), 2, 2, 4096);
+  engine.set_copy_raw_chunks(true);
+  Status retval = engine.Restore(plan, progress_callback_.get());
+  ASSERT_TRUE(retval.ok()) << retval.ToString();
+  EXPECT_TRUE(engine.failed_files().empty());
+  EXPECT_EQ(5 * 4096 + third.size(), engine.bytes_restored());
+
+  EXPECT_EQ(first + second, ReadRestored("/foo"));
+  EXPECT_EQ(first + third + second + first, ReadRestored("/dir/bar"));
+  EXPECT_EQ("", ReadRestored("/dir/empty"));
+}
+
+TEST_F(RestoreEngineTest, CorruptChunk) {
+  // A chunk whose data doesn't match its MD5 stops the restore.
+  FileEntry* foo = fileset_.AddFile("/foo", BackupFile());
+  AddChunk("good data", 0, false, foo);
+
+  FileChunk chunk;
+  chunk.md5sum = md5_maker_.Checksum("other data");
+  chunk.volume_num = 0;
+  chunk.chunk_offset = 9;
+  chunk.unencoded_size = 8;
+  ASSERT_TRUE(volume_->WriteChunk(chunk.md5sum, "bad data", 8,
+                                  kEncodingTypeRaw, NULL).ok());
+  foo->AddChunk(chunk);
+
+  RestoreEngine engine(library_.get(), path_callback_.get(), 0,
+                       RestoreEngine::kDefaultNumWriters,
+                       RestoreEngine::kDefaultMaxBytesInFlight);
+  EXPECT_EQ(kStatusCorruptBackup,
+            engine.Restore(library_->PlanRestore(files_, NULL), NULL).code());
+}
+
+TEST_F(RestoreEngineTest, UnwritableFile) {
+  // Files that can't be opened are reported, and the rest are restored.
+  FileEntry* blocker = fileset_.AddFile("/blocker", BackupFile());
+  FileEntry* blocked = fileset_.AddFile("/blocker/file", BackupFile());
+  AddChunk("blocker data", 0, false, blocker);
+
+  RestoreEngine engine(library_.get(), path_callback_.get(), 1, 1,
+                       RestoreEngine::kDefaultMaxBytesInFlight);
+  ASSERT_TRUE(engine.Restore(library_->PlanRestore(files_, NULL), NULL).ok());
+
+  // The second restore puts a file under what is now a regular file.
+  files_.clear();
+  AddChunk("blocked data", 0, false, blocked);
+  AddChunk("more data", 12, false, blocked);
+  ASSERT_TRUE(engine.Restore(library_->PlanRestore(files_, NULL), NULL).ok());
+  ASSERT_EQ(1, engine.failed_files().size());
+  EXPECT_EQ(string(kRestorePath) + "/blocker/file",
+            *engine.failed_files().begin());
+  EXPECT_EQ(0, engine.bytes_restored());
+  EXPECT_EQ("blocker data", ReadRestored("/blocker"));
+}
+
+TEST_F(RestoreEngineTest, UpdateInPlace) {
+  // Restoring over an existing copy of the files only restores what differs.
+  string first(4096, 'a');
+  string second(4096, 'b');
+  BackupFile foo_metadata;
+  foo_metadata.file_size = 2 * 4096;
+  BackupFile bar_metadata;
+  bar_metadata.file_size = 4096 + 5;
+  bar_metadata.modify_date = 1000000000;
+  FileEntry* foo = fileset_.AddFile("/foo", foo_metadata);
+  FileEntry* bar = fileset_.AddFile("/bar", bar_metadata);
+  AddChunk(first, 0, true, foo);
+  AddChunk(second, 4096, true, foo);
+  AddChunk(first, 0, true, bar);
+  AddChunk("tail!", 4096, false, bar);
+
+  RestoreEngine engine(library_.get(), path_callback_.get(), 2, 2,
+                       RestoreEngine::kDefaultMaxBytesInFlight);
+  ASSERT_TRUE(engine.Restore(library_->PlanRestore(files_, NULL), NULL).ok());
+
+  // Damage the second chunk of one file and add to its end.  Change the other
+  // without changing its size or modification time, so it looks untouched.
+  WriteRestored("/foo", first + string(4096, 'x') + "junk");
+  WriteRestored("/bar", string(4096, 'y') + "tail!");
+  boost::filesystem::last_write_time(
+      boost::filesystem::path(string(kRestorePath) + "/bar"),
+      bar_metadata.modify_date);
+
+  vector<RestoreChunk> plan = library_->PlanRestore(files_, NULL);
+  engine.PlanUpdate(&plan);
+  ASSERT_EQ(1, plan.size());
+  EXPECT_EQ(md5_maker_.Checksum(second), plan[0].chunk.md5sum);
+  ASSERT_EQ(1, plan[0].destinations.size());
+  EXPECT_EQ(foo, plan[0].destinations[0].entry);
+  EXPECT_EQ(2 * 4096 + 5, engine.bytes_unchanged());
+
+  ASSERT_TRUE(engine.Restore(plan, NULL).ok());
+  EXPECT_EQ(4096, engine.bytes_restored());
+  EXPECT_EQ(first + second, ReadRestored("/foo"));
+  EXPECT_EQ(string(4096, 'y') + "tail!", ReadRestored("/bar"));
+}
+
+TEST_F(RestoreEngineTest, ZeroChunks) {
+  // Zero chunks are left as holes, including at the end of a new file, and
+  // replace existing data when restoring over a file.
+  string zeros(4096, '\0');
+  string data(4096, 'd');
+  FileEntry* fresh = fileset_.AddFile("/fresh", BackupFile());
+  FileEntry* existing = fileset_.AddFile("/dir/existing", BackupFile());
+  AddChunk(zeros, 0, true, fresh);
+  AddChunk(data, 4096, true, fresh);
+  AddChunk(zeros, 2 * 4096, true, fresh);
+  AddChunk(data, 0, true, existing);
+  AddChunk(zeros, 4096, true, existing);
+
+  RestoreEngine engine(library_.get(), path_callback_.get(), 1, 1,
+                       RestoreEngine::kDefaultMaxBytesInFlight);
+  ASSERT_TRUE(engine.Restore(library_->PlanRestore(files_, NULL), NULL).ok());
+  EXPECT_EQ(zeros + data + zeros, ReadRestored("/fresh"));
+  EXPECT_EQ(data + zeros, ReadRestored("/dir/existing"));
+
+  WriteRestored("/dir/existing", string(3 * 4096, 'x'));
+  ASSERT_TRUE(engine.Restore(library_->PlanRestore(files_, NULL), NULL).ok());
+  EXPECT_EQ(zeros + data + zeros, ReadRestored("/fresh"));
+  EXPECT_EQ(data + zeros + string(4096, 'x'), ReadRestored("/dir/existing"));
+}
+
+TEST_F(RestoreEngineTest, InterleavedFiles) {
+  // More files than a writer keeps open, with their chunks interleaved in the
+  // volume, are each restored whole, including holes left at their ends.
+  string zeros(4096, '\0');
+  vector<FileEntry*> entries;
+  for (int index = 0; index < 40; ++index) {
+    entries.push_back(fileset_.AddFile("/file" + std::to_string(index),
+                                       BackupFile()));
+    AddChunk("first " + std::to_string(index), 0, false, entries.back());
+  }
+  for (int index = 0; index < 40; ++index) {
+    string second = "second " + std::to_string(index);
+    AddChunk(second, 16, false, entries[index]);
+    AddChunk(zeros, 16 + second.size(), true, entries[index]);
+  }
+
+  RestoreEngine engine(library_.get(), path_callback_.get(), 1, 1,
+                       RestoreEngine::kDefaultMaxBytesInFlight);
+  ASSERT_TRUE(engine.Restore(library_->PlanRestore(files_, NULL), NULL).ok());
+  EXPECT_TRUE(engine.failed_files().empty());
+  for (int index = 0; index < 40; ++index) {
+    string first = "first " + std::to_string(index);
+    string expected = first + string(16 - first.size(), '\0') + "second " +
+                      std::to_string(index) + zeros;
+    EXPECT_EQ(expected, ReadRestored("/file" + std::to_string(index)));
+  }
+}
+
+}  // namespace backup2
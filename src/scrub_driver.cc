@@ -0,0 +1,94 @@
+// Copyright (C) 2013, All Rights Reserved.
+// Author: Cory Maccarrone <darkstar6262@gmail.com>
+
+#include "src/scrub_driver.h"
+
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "glog/logging.h"
+#include "src/backup_library.h"
+#include "src/backup_volume.h"
+#include "src/callback.h"
+#include "src/common.h"
+#include "src/file.h"
+#include "src/fileset.h"
+#include "src/gzip_encoder.h"
+#include "src/md5_generator.h"
+#include "src/scrub_engine.h"
+#include "src/status.h"
+
+using std::pair;
+using std::string;
+using std::vector;
+
+namespace backup2 {
+
+ScrubDriver::ScrubDriver(
+    const string& backup_filename,
+    const int num_threads,
+    const uint64_t max_mb_per_sec)
+    : backup_filename_(backup_filename),
+      num_threads_(num_threads),
+      max_mb_per_sec_(max_mb_per_sec),
+      volume_change_callback_(
+          NewPermanentCallback(this, &ScrubDriver::ChangeBackupVolume)) {
+}
+
+int ScrubDriver::Scrub() {
+  BackupLibrary library(new File(backup_filename_),
+                        volume_change_callback_.get(),
+                        new Md5Generator(),
+                        new GzipEncoder(),
+                        new BackupVolumeFactory());
+  Status retval = library.Init();
+  LOG_IF(FATAL, !retval.ok())
+      << "Could not init library: " << retval.ToString();
+
+  // The file sets are only needed to say which files use damaged chunks, so
+  // the chunks are still checked if they can't be loaded.
+  vector<FileSet*> filesets;
+  StatusOr<vector<FileSet*> > filesets_result = library.LoadFileSets(true);
+  if (filesets_result.ok()) {
+    filesets = filesets_result.value();
+  } else {
+    LOG(ERROR) << "Could not load backup sets: "
+               << filesets_result.status().ToString();
+  }
+
+  LOG(INFO) << "Scrubbing " << library.num_volumes() << " volumes.";
+  ScrubEngine engine(&library, num_threads_, max_mb_per_sec_ * 1048576);
+  retval = engine.Scrub(filesets, NULL);
+  CHECK(retval.ok()) << retval.ToString();
+
+  LOG(INFO) << "Scrubbed " << engine.chunks_scrubbed() << " chunks, "
+            << engine.bytes_scrubbed() << " bytes.";
+  for (uint64_t volume : engine.unreadable_volumes()) {
+    LOG(ERROR) << "Unreadable volume: " << volume;
+  }
+  for (const DamagedChunk& damaged : engine.damaged_chunks()) {
+    LOG(ERROR) << "Damaged chunk " << std::hex << damaged.md5sum.hi
+               << damaged.md5sum.lo << std::dec << " in volume "
+               << damaged.volume_number << " at offset " << damaged.offset
+               << ": " << damaged.problem;
+    for (const pair<uint64_t, string>& file : damaged.files) {
+      LOG(ERROR) << "  Used by " << file.second << " in set " << file.first
+                 << " " << filesets[file.first]->description();
+    }
+  }
+  if (!filesets_result.ok() || !engine.unreadable_volumes().empty() ||
+      !engine.damaged_chunks().empty()) {
+    return 1;
+  }
+
+  return 0;
+}
+
+string ScrubDriver::ChangeBackupVolume(string /* needed_filename */) {
+  // TODO(darkstar62): The implementation of this will depend on the UI in use.
+  return "";
+}
+
+}  // namespace backup2
@@ -0,0 +1,44 @@
+// Copyright (C) 2013, All Rights Reserved.
+// Author: Cory Maccarrone <darkstar6262@gmail.com>
+#ifndef BACKUP2_SRC_SCRUB_DRIVER_H_
+#define BACKUP2_SRC_SCRUB_DRIVER_H_
+
+#include <memory>
+#include <string>
+
+#include "src/backup_library.h"
+#include "src/common.h"
+
+namespace backup2 {
+
+// The ScrubDriver checks every chunk stored in the backup volumes, reading
+// each volume from front to back.
+class ScrubDriver {
+ public:
+  // If num_threads is zero, one thread is used per core.  If max_mb_per_sec is
+  // zero, volumes are read as fast as possible.
+  ScrubDriver(
+      const std::string& backup_filename,
+      const int num_threads,
+      const uint64_t max_mb_per_sec);
+
+  // Perform the scrub.  Damaged and missing chunks are reported along with the
+  // files of each backup set that use them.  Returns non-zero if any damage is
+  // found.
+  int Scrub();
+
+ private:
+  const std::string backup_filename_;
+  const int num_threads_;
+  const uint64_t max_mb_per_sec_;
+
+  std::string ChangeBackupVolume(std::string needed_filename);
+
+  std::unique_ptr<BackupLibrary::VolumeChangeCallback> volume_change_callback_;
+
+  DISALLOW_COPY_AND_ASSIGN(ScrubDriver);
+};
+
+}  // namespace backup2
+
+#endif  // BACKUP2_SRC_SCRUB_DRIVER_H_
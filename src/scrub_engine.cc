@@ -0,0 +1,371 @@
+// Copyright (C) 2013, All Rights Reserved.
+// Author: Cory Maccarrone <darkstar6262@gmail.com>
+
+#include "src/scrub_engine.h"
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <map>
+#include <mutex>
+#include <set>
+#include <string>
+#include <thread>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+
+#include "boost/functional/hash.hpp"
+#include "glog/logging.h"
+#include "src/backup_library.h"
+#include "src/backup_volume_interface.h"
+#include "src/fileset.h"
+#include "src/status.h"
+
+using std::condition_variable;
+using std::deque;
+using std::lock_guard;
+using std::make_pair;
+using std::map;
+using std::mutex;
+using std::pair;
+using std::set;
+using std::string;
+using std::thread;
+using std::unique_lock;
+using std::unordered_set;
+using std::vector;
+
+namespace backup2 {
+namespace {
+
+// How often the progress callback is called.
+const std::chrono::milliseconds kProgressInterval(250);
+
+// How long the reader sleeps at a time when held back by the rate limit.
+const std::chrono::milliseconds kThrottleInterval(10);
+
+// Order damaged chunks by where they're stored.
+bool DamagedChunkLessThan(const DamagedChunk& lhs, const DamagedChunk& rhs) {
+  return lhs.volume_number < rhs.volume_number ||
+         (lhs.volume_number == rhs.volume_number && lhs.offset < rhs.offset);
+}
+
+}  // namespace
+
+struct ScrubEngine::State {
+  State()
+      : max_batches(0),
+        reading_done(false),
+        cancelled(false),
+        threads_running(0),
+        bytes_scrubbed(0),
+        chunks_scrubbed(0) {}
+
+  // Queue a batch of chunks for the checkers, waiting while the queue is full.
+  // Returns false if the scrub was cancelled.
+  bool Push(vector<StoredChunk>* batch) {
+    unique_lock<mutex> lock(state_mutex);
+    queue_changed.wait(lock, [this] {
+      return cancelled || queue.size() < max_batches;
+    });
+    if (cancelled) {
+      return false;
+    }
+    queue.push_back(vector<StoredChunk>());
+    queue.back().swap(*batch);
+    queue_changed.notify_all();
+    return true;
+  }
+
+  // Take the next batch of chunks to check, waiting for one.  Returns false
+  // once the reader is done and the queue is empty, or the scrub was
+  // cancelled.
+  bool Pop(vector<StoredChunk>* batch) {
+    unique_lock<mutex> lock(state_mutex);
+    queue_changed.wait(lock, [this] {
+      return cancelled || reading_done || !queue.empty();
+    });
+    if (cancelled || queue.empty()) {
+      return false;
+    }
+    batch->swap(queue.front());
+    queue.pop_front();
+    queue_changed.notify_all();
+    return true;
+  }
+
+  // Mark the reader as done, so the checkers stop once the queue is empty.
+  void ReadingDone() {
+    lock_guard<mutex> lock(state_mutex);
+    reading_done = true;
+    queue_changed.notify_all();
+  }
+
+  bool IsCancelled() {
+    lock_guard<mutex> lock(state_mutex);
+    return cancelled;
+  }
+
+  // Mark a thread as done.
+  void ThreadDone() {
+    {
+      lock_guard<mutex> lock(state_mutex);
+      --threads_running;
+    }
+    threads_done.notify_all();
+  }
+
+  // Everything here is protected by state_mutex.
+  mutex state_mutex;
+  condition_variable queue_changed;
+  condition_variable threads_done;
+
+  deque<vector<StoredChunk> > queue;
+  uint64_t max_batches;
+  bool reading_done;
+  bool cancelled;
+  int threads_running;
+
+  uint64_t bytes_scrubbed;
+  uint64_t chunks_scrubbed;
+  vector<DamagedChunk> damaged_chunks;
+  set<uint64_t> unreadable_volumes;
+
+  // Chunks found in each volume, by volume number.  Only the reader touches
+  // these until the scrub is done, so they're not protected.
+  vector<unordered_set<Uint128, boost::hash<Uint128> > > found_chunks;
+};
+
+const int ScrubEngine::kDefaultNumThreads = 4;
+const uint64_t ScrubEngine::kReadSize = 16 * 1048576ULL;
+
+ScrubEngine::ScrubEngine(BackupLibrary* library, int num_threads,
+                         uint64_t max_bytes_per_second)
+    : library_(library),
+      num_threads_(num_threads),
+      max_bytes_per_second_(max_bytes_per_second),
+      bytes_scrubbed_(0),
+      chunks_scrubbed_(0) {
+  if (num_threads_ <= 0) {
+    num_threads_ = thread::hardware_concurrency();
+    if (num_threads_ <= 0) {
+      num_threads_ = 1;
+    }
+  }
+}
+
+ScrubEngine::~ScrubEngine() {
+}
+
+Status ScrubEngine::Scrub(const vector<FileSet*>& filesets,
+                          ProgressCallback* progress) {
+  // Two batches per checker keeps them all busy while the reader reads the
+  // next one, without holding much of the library in memory.
+  State state;
+  state.max_batches = 2 * num_threads_;
+  state.found_chunks.resize(library_->num_volumes());
+  state.threads_running = num_threads_ + 1;
+  vector<thread> threads;
+  threads.push_back(thread(&ScrubEngine::ReadVolumes, this, &state));
+  for (int worker = 0; worker < num_threads_; ++worker) {
+    threads.push_back(thread(&ScrubEngine::CheckChunks, this, &state));
+  }
+
+  // Report progress until the threads are done.
+  bool cancelled = false;
+  while (true) {
+    uint64_t bytes_scrubbed = 0;
+    {
+      unique_lock<mutex> lock(state.state_mutex);
+      if (state.threads_done.wait_for(
+              lock, kProgressInterval,
+              [&state] { return state.threads_running == 0; })) {
+        break;
+      }
+      bytes_scrubbed = state.bytes_scrubbed;
+    }
+    if (progress && !cancelled && !progress->Run(bytes_scrubbed)) {
+      LOG(INFO) << "Scrub cancelled";
+      cancelled = true;
+      lock_guard<mutex> lock(state.state_mutex);
+      state.cancelled = true;
+      state.queue_changed.notify_all();
+    }
+  }
+
+  for (uint64_t index = 0; index < threads.size(); ++index) {
+    threads[index].join();
+  }
+
+  bytes_scrubbed_ = state.bytes_scrubbed;
+  chunks_scrubbed_ = state.chunks_scrubbed;
+  unreadable_volumes_ = state.unreadable_volumes;
+  damaged_chunks_.clear();
+  if (cancelled) {
+    return Status(kStatusGenericError, "Scrub cancelled");
+  }
+
+  FindDamagedFiles(filesets, &state);
+  damaged_chunks_.swap(state.damaged_chunks);
+  std::stable_sort(damaged_chunks_.begin(), damaged_chunks_.end(),
+                   DamagedChunkLessThan);
+  return Status::OK;
+}
+
+void ScrubEngine::ReadVolumes(State* state) {
+  std::chrono::steady_clock::time_point start =
+      std::chrono::steady_clock::now();
+  uint64_t bytes_read = 0;
+  for (uint64_t volume = 0; volume < state->found_chunks.size(); ++volume) {
+    uint64_t next_chunk = 0;
+    while (!state->IsCancelled()) {
+      vector<StoredChunk> batch;
+      Status retval = library_->ReadStoredChunks(volume, next_chunk, kReadSize,
+                                                 &batch);
+      if (!retval.ok()) {
+        LOG(ERROR) << "Could not read volume " << volume << ": "
+                   << retval.ToString();
+        lock_guard<mutex> lock(state->state_mutex);
+        state->unreadable_volumes.insert(volume);
+        break;
+      }
+      if (batch.empty()) {
+        break;
+      }
+      next_chunk += batch.size();
+
+      uint64_t batch_bytes = 0;
+      for (const StoredChunk& stored : batch) {
+        state->found_chunks[volume].insert(stored.descriptor.md5sum);
+        batch_bytes += sizeof(ChunkHeader) + stored.data.size();
+      }
+      {
+        lock_guard<mutex> lock(state->state_mutex);
+        state->bytes_scrubbed += batch_bytes;
+      }
+      if (!state->Push(&batch)) {
+        break;
+      }
+
+      // Hold the reads to the rate limit by waiting until the bytes read so
+      // far should have taken, a little at a time so a cancel isn't held up.
+      bytes_read += batch_bytes;
+      if (max_bytes_per_second_ > 0) {
+        std::chrono::steady_clock::time_point until =
+            start + std::chrono::duration_cast<std::chrono::microseconds>(
+                std::chrono::duration<double>(
+                    static_cast<double>(bytes_read) / max_bytes_per_second_));
+        while (!state->IsCancelled() &&
+               std::chrono::steady_clock::now() < until) {
+          std::this_thread::sleep_for(kThrottleInterval);
+        }
+      }
+    }
+  }
+  state->ReadingDone();
+  state->ThreadDone();
+}
+
+void ScrubEngine::CheckChunks(State* state) {
+  vector<StoredChunk> batch;
+  while (state->Pop(&batch)) {
+    vector<DamagedChunk> damaged_chunks;
+    for (uint64_t index = 0; index < batch.size(); ++index) {
+      StoredChunk* stored = &batch[index];
+      string problem;
+      if (!CheckChunk(stored, &problem)) {
+        DamagedChunk damaged;
+        damaged.md5sum = stored->descriptor.md5sum;
+        damaged.volume_number = stored->descriptor.volume_number;
+        damaged.offset = stored->descriptor.offset;
+        damaged.problem = problem;
+        damaged_chunks.push_back(damaged);
+      }
+    }
+
+    lock_guard<mutex> lock(state->state_mutex);
+    state->chunks_scrubbed += batch.size();
+    state->damaged_chunks.insert(state->damaged_chunks.end(),
+                                 damaged_chunks.begin(), damaged_chunks.end());
+  }
+  state->ThreadDone();
+}
+
+bool ScrubEngine::CheckChunk(StoredChunk* stored, string* problem) {
+  if (!stored->status.ok()) {
+    *problem = stored->status.description();
+    return false;
+  }
+
+  FileChunk chunk;
+  chunk.md5sum = stored->header.md5sum;
+  chunk.unencoded_size = stored->header.unencoded_size;
+  Status retval = library_->DecodeChunk(chunk, stored->header.encoding_type,
+                                        &stored->data);
+  if (!retval.ok()) {
+    *problem = retval.description();
+    return false;
+  }
+
+  // Raw chunks aren't otherwise checked against the size in their header.
+  if (stored->data.size() != stored->header.unencoded_size) {
+    LOG(ERROR) << "Chunk size mismatch: " << stored->data.size() << " / "
+               << stored->header.unencoded_size;
+    *problem = "Chunk size mismatch";
+    return false;
+  }
+  return true;
+}
+
+void ScrubEngine::FindDamagedFiles(const vector<FileSet*>& filesets,
+                                   State* state) {
+  vector<DamagedChunk>* damaged_chunks = &state->damaged_chunks;
+  map<pair<uint64_t, Uint128>, uint64_t> damage_index;
+  for (uint64_t index = 0; index < damaged_chunks->size(); ++index) {
+    const DamagedChunk& damaged = (*damaged_chunks)[index];
+    damage_index.insert(
+        make_pair(make_pair(damaged.volume_number, damaged.md5sum), index));
+  }
+
+  for (uint64_t set_index = 0; set_index < filesets.size(); ++set_index) {
+    for (const FileEntry* entry : filesets[set_index]->GetFiles()) {
+      for (const FileChunk& chunk : entry->GetChunks()) {
+        pair<uint64_t, Uint128> key = make_pair(chunk.volume_num,
+                                                chunk.md5sum);
+        auto iter = damage_index.find(key);
+        if (iter == damage_index.end()) {
+          if (chunk.volume_num < state->found_chunks.size() &&
+              state->found_chunks[chunk.volume_num].count(chunk.md5sum)) {
+            continue;
+          }
+          DamagedChunk missing;
+          missing.md5sum = chunk.md5sum;
+          missing.volume_number = chunk.volume_num;
+          missing.problem = state->unreadable_volumes.count(chunk.volume_num) ?
+              "Volume unreadable" : "Chunk missing from volume";
+          damaged_chunks->push_back(missing);
+          iter = damage_index.insert(
+              make_pair(key, damaged_chunks->size() - 1)).first;
+        }
+
+        // A file using a chunk more than once is only listed once.
+        vector<pair<uint64_t, string> >* files =
+            &(*damaged_chunks)[iter->second].files;
+        pair<uint64_t, string> file = make_pair(set_index,
+                                                entry->proper_filename());
+        if (files->empty() || files->back() != file) {
+          files->push_back(file);
+        }
+      }
+    }
+  }
+
+  for (uint64_t index = 0; index < damaged_chunks->size(); ++index) {
+    vector<pair<uint64_t, string> >* files = &(*damaged_chunks)[index].files;
+    std::sort(files->begin(), files->end());
+  }
+}
+
+}  // namespace backup2
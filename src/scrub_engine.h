@@ -0,0 +1,126 @@
+// Copyright (C) 2013, All Rights Reserved.
+// Author: Cory Maccarrone <darkstar6262@gmail.com>
+#ifndef BACKUP2_SRC_SCRUB_ENGINE_H_
+#define BACKUP2_SRC_SCRUB_ENGINE_H_
+
+#include <set>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "src/callback.h"
+#include "src/common.h"
+#include "src/status.h"
+
+namespace backup2 {
+class BackupLibrary;
+class FileSet;
+struct StoredChunk;
+
+// A chunk found damaged or missing by a scrub.
+struct DamagedChunk {
+  DamagedChunk() : volume_number(0), offset(0) {}
+
+  // The chunk, and where it is (or should be) stored.
+  Uint128 md5sum;
+  uint64_t volume_number;
+  uint64_t offset;
+
+  // What's wrong with it.
+  std::string problem;
+
+  // The files using the chunk, as pairs of the index of their backup set in
+  // the file sets scrubbed and their filename.
+  std::vector<std::pair<uint64_t, std::string> > files;
+};
+
+// The ScrubEngine checks every chunk stored in a backup library.  Each volume
+// is read front to back with long sequential reads, so a scrub runs at the
+// speed of the disk rather than seeking chunk by chunk as a restore would.
+// Every chunk is checked against the volume's descriptor 1, then decoded and
+// checked against its MD5 by a pool of threads, while the next part of the
+// volume is read.  The reads can be throttled to leave the disk to other work.
+//
+// Damaged chunks are reported along with the files of every backup set that
+// use them, as are chunks the backup sets use that are missing from their
+// volumes.
+class ScrubEngine {
+ public:
+  // Callback called periodically with the number of bytes read so far.
+  // Returning false cancels the scrub.
+  typedef ResultCallback1<bool, uint64_t> ProgressCallback;
+
+  // Default number of checker threads.
+  static const int kDefaultNumThreads;
+
+  // Create an engine scrubbing the given library, of which ownership is not
+  // taken.  If num_threads is zero, one thread is used per core.  If
+  // max_bytes_per_second is not zero, volumes are read no faster than that.
+  ScrubEngine(BackupLibrary* library, int num_threads,
+              uint64_t max_bytes_per_second);
+  ~ScrubEngine();
+
+  // Check every chunk in every volume of the library, and every chunk used by
+  // the given file sets, from BackupLibrary::LoadFileSets().  progress may be
+  // NULL.  Damage is reported in damaged_chunks() and unreadable_volumes();
+  // the scrub itself only fails if cancelled.
+  Status Scrub(const std::vector<FileSet*>& filesets,
+               ProgressCallback* progress);
+
+  // Return the number of bytes of volume data read by the last scrub.
+  uint64_t bytes_scrubbed() const { return bytes_scrubbed_; }
+
+  // Return the number of chunks checked by the last scrub.
+  uint64_t chunks_scrubbed() const { return chunks_scrubbed_; }
+
+  // Return the chunks the last scrub found damaged or missing, ordered by
+  // volume and offset.
+  const std::vector<DamagedChunk>& damaged_chunks() const {
+    return damaged_chunks_;
+  }
+
+  // Return the volumes the last scrub couldn't open or read through.
+  const std::set<uint64_t>& unreadable_volumes() const {
+    return unreadable_volumes_;
+  }
+
+ private:
+  // State shared by the threads of one scrub.
+  struct State;
+
+  // Size of each read of a volume.
+  static const uint64_t kReadSize;
+
+  // Thread bodies of the scrub.  The reader reads the volumes in turn and
+  // queues their chunks for the checkers, which decode and check them.
+  void ReadVolumes(State* state);
+  void CheckChunks(State* state);
+
+  // Check one stored chunk, and return whether it's intact.  problem is set to
+  // what's wrong with it if not.
+  bool CheckChunk(StoredChunk* stored, std::string* problem);
+
+  // Add the chunks the file sets use but the scrub didn't find to the damaged
+  // chunks, and fill in the files using each damaged chunk.
+  void FindDamagedFiles(const std::vector<FileSet*>& filesets, State* state);
+
+  // Library to scrub.
+  BackupLibrary* library_;
+
+  // Number of checker threads.
+  int num_threads_;
+
+  // Limit on the rate volumes are read at, or zero for none.
+  uint64_t max_bytes_per_second_;
+
+  // Results of the last scrub.
+  uint64_t bytes_scrubbed_;
+  uint64_t chunks_scrubbed_;
+  std::vector<DamagedChunk> damaged_chunks_;
+  std::set<uint64_t> unreadable_volumes_;
+
+  DISALLOW_COPY_AND_ASSIGN(ScrubEngine);
+};
+
+}  // namespace backup2
+#endif  // BACKUP2_SRC_SCRUB_ENGINE_H_
@@ -0,0 +1,146 @@
+// Copyright (C) 2013, All Rights Reserved.
+// Author: Cory Maccarrone <darkstar6262@gmail.com>
+
+#include <map>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "src/backup_library.h"
+#include "src/callback.h"
+#include "src/fake_backup_volume.h"
+#include "src/fileset.h"
+#include "src/gzip_encoder.h"
+#include "src/md5_generator.h"
+#include "src/mock_backup_volume_factory.h"
+#include "src/mock_file.h"
+#include "src/scrub_engine.h"
+#include "src/status.h"
+#include "glog/logging.h"
+#include "gmock/gmock.h"
+#include "gtest/gtest.h"
+
+using std::make_pair;
+using std::map;
+using std::pair;
+using std::string;
+using std::unique_ptr;
+using std::vector;
+using testing::_;
+using testing::DoAll;
+using testing::Return;
+using testing::SetArgPointee;
+
+namespace backup2 {
+
+class ScrubEngineTest : public testing::Test {
+ public:
+  void SetUp() {
+    MockFile* file = new MockFile;
+    MockBackupVolumeFactory* volume_factory = new MockBackupVolumeFactory;
+    volume_change_callback_.reset(
+        NewPermanentCallback(this, &ScrubEngineTest::GetNextFilename));
+
+    EXPECT_CALL(*file, FindBasenameAndLastVolume(_, _, _))
+        .WillOnce(DoAll(
+            SetArgPointee<0>("/foo/bar"),
+            SetArgPointee<1>(0),
+            SetArgPointee<2>(1),
+            Return(Status::OK)));
+    library_.reset(new BackupLibrary(
+        file, volume_change_callback_.get(), new Md5Generator,
+        new GzipEncoder, volume_factory));
+
+    // The library keeps the one volume open, so chunks written to it here are
+    // the ones scrubbed.
+    volume_ = new FakeBackupVolume(file);
+    volume_->InitializeForExistingWithDescriptor2();
+    EXPECT_CALL(*volume_factory, Create("/foo/bar.0.bkp"))
+        .WillOnce(Return(volume_));
+    ASSERT_TRUE(library_->Init().ok());
+  }
+
+  string GetNextFilename(string /* original */) {
+    return "";
+  }
+
+ protected:
+  // Store a chunk of the given data in the volume, under the MD5 of
+  // checksum_data, and return the chunk.
+  FileChunk StoreChunk(const string& data, const string& checksum_data,
+                       EncodingType type) {
+    FileChunk chunk;
+    chunk.md5sum = md5_maker_.Checksum(checksum_data);
+    chunk.volume_num = 0;
+    chunk.unencoded_size = checksum_data.size();
+    EXPECT_TRUE(volume_->WriteChunk(chunk.md5sum, data, chunk.unencoded_size,
+                                    type, NULL).ok());
+    return chunk;
+  }
+
+  // Add a file using the given chunks to a file set.
+  void AddFile(FileSet* fileset, const string& filename,
+               const vector<FileChunk>& chunks) {
+    FileEntry* entry = fileset->AddFile(filename, BackupFile());
+    for (const FileChunk& chunk : chunks) {
+      entry->AddChunk(chunk);
+    }
+  }
+
+  unique_ptr<BackupLibrary::VolumeChangeCallback> volume_change_callback_;
+  unique_ptr<BackupLibrary> library_;
+  FakeBackupVolume* volume_;
+  Md5Generator md5_maker_;
+};
+
+TEST_F(ScrubEngineTest, FindsDamagedAndMissingChunks) {
+  FileChunk good = StoreChunk("hello world", "hello world", kEncodingTypeRaw);
+  FileChunk zero = StoreChunk("", string(4096, '\0'), kEncodingTypeZero);
+  FileChunk bad = StoreChunk("bad data", "good data", kEncodingTypeRaw);
+  FileChunk missing;
+  missing.md5sum = md5_maker_.Checksum("gone");
+  missing.volume_num = 0;
+  missing.unencoded_size = 4;
+
+  // The newest set uses every chunk; the older one only the damaged one, and
+  // more than once.
+  FileSet newest;
+  AddFile(&newest, "/a", {good, bad});
+  AddFile(&newest, "/b", {zero, missing});
+  FileSet oldest;
+  AddFile(&oldest, "/a", {bad, bad});
+  vector<FileSet*> filesets = {&newest, &oldest};
+
+  ScrubEngine engine(library_.get(), 3, 0);
+  Status retval = engine.Scrub(filesets, NULL);
+  ASSERT_TRUE(retval.ok()) << retval.ToString();
+
+  // The fake volume's own chunk doesn't have a real MD5, and no file uses it.
+  EXPECT_EQ(4, engine.chunks_scrubbed());
+  EXPECT_TRUE(engine.unreadable_volumes().empty());
+  map<Uint128, DamagedChunk> damaged;
+  for (const DamagedChunk& chunk : engine.damaged_chunks()) {
+    damaged.insert(make_pair(chunk.md5sum, chunk));
+  }
+  ASSERT_EQ(3, damaged.size());
+
+  Uint128 fake_md5;
+  fake_md5.hi = 0x123;
+  fake_md5.lo = 0x456;
+  ASSERT_EQ(1, damaged.count(fake_md5));
+  EXPECT_TRUE(damaged[fake_md5].files.empty());
+
+  ASSERT_EQ(1, damaged.count(bad.md5sum));
+  EXPECT_EQ("Chunk MD5 mismatch", damaged[bad.md5sum].problem);
+  EXPECT_EQ((vector<pair<uint64_t, string> >({make_pair(0, string("/a")),
+                                              make_pair(1, string("/a"))})),
+            damaged[bad.md5sum].files);
+
+  ASSERT_EQ(1, damaged.count(missing.md5sum));
+  EXPECT_EQ("Chunk missing from volume", damaged[missing.md5sum].problem);
+  EXPECT_EQ((vector<pair<uint64_t, string> >({make_pair(0, string("/b"))})),
+            damaged[missing.md5sum].files);
+}
+
+}  // namespace backup2
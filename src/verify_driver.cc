@@ -0,0 +1,100 @@
+// Copyright (C) 2013, All Rights Reserved.
+// Author: Cory Maccarrone <darkstar6262@gmail.com>
+
+#include "src/verify_driver.h"
+
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "boost/filesystem.hpp"
+#include "glog/logging.h"
+#include "src/backup_library.h"
+#include "src/backup_volume.h"
+#include "src/callback.h"
+#include "src/common.h"
+#include "src/file.h"
+#include "src/fileset.h"
+#include "src/gzip_encoder.h"
+#include "src/md5_generator.h"
+#include "src/status.h"
+#include "src/verify_engine.h"
+
+using std::pair;
+using std::string;
+using std::unique_ptr;
+using std::vector;
+
+namespace backup2 {
+
+VerifyDriver::VerifyDriver(
+    const string& backup_filename,
+    const string& compare_path,
+    const uint64_t set_number,
+    const int num_threads)
+    : backup_filename_(backup_filename),
+      compare_path_(compare_path),
+      set_number_(set_number),
+      num_threads_(num_threads),
+      volume_change_callback_(
+          NewPermanentCallback(this, &VerifyDriver::ChangeBackupVolume)) {
+}
+
+int VerifyDriver::Verify() {
+  // Only the file sets are loaded.  The chunk checksums they hold are all the
+  // verify needs.
+  BackupLibrary library(new File(backup_filename_),
+                        volume_change_callback_.get(),
+                        new Md5Generator(),
+                        new GzipEncoder(),
+                        new BackupVolumeFactory());
+  Status retval = library.Init();
+  LOG_IF(FATAL, !retval.ok())
+      << "Could not init library: " << retval.ToString();
+
+  StatusOr<vector<FileSet*> > filesets = library.LoadFileSets(true);
+  CHECK(filesets.ok()) << filesets.status().ToString();
+  FileSet* fileset = filesets.value()[set_number_];
+  LOG(INFO) << "Verifying " << fileset->num_files() << " files against "
+            << fileset->description();
+
+  unique_ptr<VerifyEngine::PathCallback> path_callback(
+      NewPermanentCallback(this, &VerifyDriver::ComparePath));
+  VerifyEngine engine(&library, path_callback.get(), num_threads_);
+  retval = engine.Verify(fileset->GetFiles(), NULL);
+  CHECK(retval.ok()) << retval.ToString();
+
+  LOG(INFO) << "Verified " << engine.bytes_verified() << " bytes.";
+  for (const string& filename : engine.missing_files()) {
+    LOG(ERROR) << "Missing: " << filename;
+  }
+  for (const pair<const string, string>& unreadable :
+           engine.unreadable_files()) {
+    LOG(ERROR) << "Unreadable: " << unreadable.first << ": "
+               << unreadable.second;
+  }
+  for (const string& filename : engine.different_files()) {
+    LOG(ERROR) << "Different: " << filename;
+  }
+  if (!engine.missing_files().empty() ||
+      !engine.unreadable_files().empty() ||
+      !engine.different_files().empty()) {
+    return 1;
+  }
+
+  return 0;
+}
+
+string VerifyDriver::ComparePath(const FileEntry& entry) {
+  boost::filesystem::path dest(compare_path_);
+  dest /= boost::filesystem::path(entry.proper_filename());
+  return dest.string();
+}
+
+string VerifyDriver::ChangeBackupVolume(string /* needed_filename */) {
+  // TODO(darkstar62): The implementation of this will depend on the UI in use.
+  return "";
+}
+
+}  // namespace backup2
@@ -0,0 +1,50 @@
+// Copyright (C) 2013, All Rights Reserved.
+// Author: Cory Maccarrone <darkstar6262@gmail.com>
+#ifndef BACKUP2_SRC_VERIFY_DRIVER_H_
+#define BACKUP2_SRC_VERIFY_DRIVER_H_
+
+#include <memory>
+#include <string>
+
+#include "src/backup_library.h"
+#include "src/common.h"
+
+namespace backup2 {
+class FileEntry;
+
+// The VerifyDriver checks the files of a backup set against those on disk,
+// using only the checksums recorded in the backup.  No backup volume data is
+// read.
+class VerifyDriver {
+ public:
+  // Files are compared against those under compare_path; a path of / checks
+  // the live filesystem.  If num_threads is zero, one thread is used per core.
+  VerifyDriver(
+      const std::string& backup_filename,
+      const std::string& compare_path,
+      const uint64_t set_number,
+      const int num_threads);
+
+  // Perform the verify.  Returns non-zero if any file is missing, unreadable
+  // or differs.
+  int Verify();
+
+ private:
+  const std::string backup_filename_;
+  const std::string compare_path_;
+  const uint64_t set_number_;
+  const int num_threads_;
+
+  std::string ChangeBackupVolume(std::string needed_filename);
+
+  // Return the path a file is compared against.
+  std::string ComparePath(const FileEntry& entry);
+
+  std::unique_ptr<BackupLibrary::VolumeChangeCallback> volume_change_callback_;
+
+  DISALLOW_COPY_AND_ASSIGN(VerifyDriver);
+};
+
+}  // namespace backup2
+
+#endif  // BACKUP2_SRC_VERIFY_DRIVER_H_
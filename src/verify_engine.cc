@@ -0,0 +1,279 @@
+// Copyright (C) 2013, All Rights Reserved.
+// Author: Cory Maccarrone <darkstar6262@gmail.com>
+
+#include "src/verify_engine.h"
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <map>
+#include <mutex>
+#include <set>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "glog/logging.h"
+#include "src/backup_library.h"
+#include "src/file.h"
+#include "src/fileset.h"
+#include "src/status.h"
+
+using std::condition_variable;
+using std::lock_guard;
+using std::map;
+using std::mutex;
+using std::set;
+using std::string;
+using std::thread;
+using std::unique_lock;
+using std::vector;
+
+namespace backup2 {
+namespace {
+
+// How often the progress callback is called.
+const std::chrono::milliseconds kProgressInterval(250);
+
+// Order files largest first, so the big files don't all end up last.
+bool FileSizeGreaterThan(const FileEntry* lhs, const FileEntry* rhs) {
+  return lhs->GetBackupFile()->file_size > rhs->GetBackupFile()->file_size;
+}
+
+}  // namespace
+
+struct VerifyEngine::State {
+  State()
+      : next_file(0),
+        bytes_verified(0),
+        cancelled(false),
+        threads_running(0) {}
+
+  // Take the index of the next file to check, or return false if there are
+  // none left.
+  bool NextFile(uint64_t num_files, uint64_t* index) {
+    lock_guard<mutex> lock(state_mutex);
+    if (cancelled || next_file >= num_files) {
+      return false;
+    }
+    *index = next_file++;
+    return true;
+  }
+
+  // Count bytes checked.
+  void AddBytes(uint64_t bytes) {
+    lock_guard<mutex> lock(state_mutex);
+    bytes_verified += bytes;
+  }
+
+  bool IsCancelled() {
+    lock_guard<mutex> lock(state_mutex);
+    return cancelled;
+  }
+
+  // Mark a worker thread as done.
+  void ThreadDone() {
+    {
+      lock_guard<mutex> lock(state_mutex);
+      --threads_running;
+    }
+    threads_done.notify_all();
+  }
+
+  // Everything here is protected by state_mutex.
+  mutex state_mutex;
+  condition_variable threads_done;
+
+  uint64_t next_file;
+  uint64_t bytes_verified;
+  set<string> missing_files;
+  map<string, string> unreadable_files;
+  set<string> different_files;
+  bool cancelled;
+  int threads_running;
+};
+
+const int VerifyEngine::kDefaultNumThreads = 4;
+
+VerifyEngine::VerifyEngine(BackupLibrary* library,
+                           PathCallback* path_callback,
+                           int num_threads)
+    : library_(library),
+      path_callback_(path_callback),
+      num_threads_(num_threads),
+      bytes_verified_(0) {
+  if (num_threads_ <= 0) {
+    num_threads_ = thread::hardware_concurrency();
+    if (num_threads_ <= 0) {
+      num_threads_ = 1;
+    }
+  }
+}
+
+VerifyEngine::~VerifyEngine() {
+}
+
+Status VerifyEngine::Verify(const FileEntrySet& files,
+                            ProgressCallback* progress) {
+  vector<const FileEntry*> ordered_files(files.begin(), files.end());
+  std::stable_sort(ordered_files.begin(), ordered_files.end(),
+                   FileSizeGreaterThan);
+
+  State state;
+  state.threads_running = num_threads_;
+  vector<thread> threads;
+  for (int worker = 0; worker < num_threads_; ++worker) {
+    threads.push_back(thread(&VerifyEngine::VerifyFiles, this,
+                             std::cref(ordered_files), &state));
+  }
+
+  // Report progress until the workers are done.
+  bool cancelled = false;
+  while (true) {
+    uint64_t bytes_verified = 0;
+    {
+      unique_lock<mutex> lock(state.state_mutex);
+      if (state.threads_done.wait_for(
+              lock, kProgressInterval,
+              [&state] { return state.threads_running == 0; })) {
+        break;
+      }
+      bytes_verified = state.bytes_verified;
+    }
+    if (progress && !cancelled && !progress->Run(bytes_verified)) {
+      LOG(INFO) << "Verify cancelled";
+      cancelled = true;
+      lock_guard<mutex> lock(state.state_mutex);
+      state.cancelled = true;
+    }
+  }
+
+  for (uint64_t index = 0; index < threads.size(); ++index) {
+    threads[index].join();
+  }
+
+  bytes_verified_ = state.bytes_verified;
+  missing_files_ = state.missing_files;
+  unreadable_files_ = state.unreadable_files;
+  different_files_ = state.different_files;
+  if (cancelled) {
+    return Status(kStatusGenericError, "Verify cancelled");
+  }
+  return Status::OK;
+}
+
+void VerifyEngine::VerifyFiles(const vector<const FileEntry*>& files,
+                               State* state) {
+  uint64_t index = 0;
+  while (state->NextFile(files.size(), &index)) {
+    const FileEntry& entry = *files[index];
+    string path = path_callback_->Run(entry);
+    Status error = Status::OK;
+    FileResult result = VerifyFile(entry, path, state, &error);
+    if (result == kFileSame) {
+      continue;
+    }
+
+    lock_guard<mutex> lock(state->state_mutex);
+    if (result == kFileMissing) {
+      state->missing_files.insert(path);
+    } else if (result == kFileUnreadable) {
+      state->unreadable_files[path] = error.ToString();
+    } else if (!state->cancelled) {
+      state->different_files.insert(path);
+    }
+  }
+  state->ThreadDone();
+}
+
+VerifyEngine::FileResult VerifyEngine::VerifyFile(const FileEntry& entry,
+                                                  const string& path,
+                                                  State* state,
+                                                  Status* error) {
+  File file(path);
+  if (!file.Exists() && !file.IsSymlink()) {
+    return kFileMissing;
+  }
+
+  const BackupFile* metadata = entry.GetBackupFile();
+  switch (metadata->file_type) {
+    case BackupFile::kFileTypeDirectory:
+      return file.IsDirectory() ? kFileSame : kFileDifferent;
+    case BackupFile::kFileTypeSymlink:
+      return file.IsSymlink() ? kFileSame : kFileDifferent;
+    case BackupFile::kFileTypeRegularFile:
+      break;
+    default:
+      LOG(WARNING) << "Cannot verify file type " << metadata->file_type;
+      return kFileSame;
+  }
+
+  if (!file.IsRegularFile()) {
+    return kFileDifferent;
+  }
+  uint64_t size = 0;
+  Status retval = file.size(&size);
+  if (!retval.ok()) {
+    LOG(WARNING) << "Could not get size of " << path << ": "
+                 << retval.ToString();
+    *error = retval;
+    return kFileUnreadable;
+  }
+  // A file of the wrong size can't match, so isn't read.
+  if (size != metadata->file_size) {
+    return kFileDifferent;
+  }
+
+  // The file exists, so failing to open it is reported as such rather than as
+  // a missing file.
+  retval = file.Open(File::Mode::kModeRead);
+  if (!retval.ok()) {
+    LOG(WARNING) << "Could not open " << path << ": " << retval.ToString();
+    *error = retval;
+    return kFileUnreadable;
+  }
+
+  FileChunkSpan entry_chunks = entry.GetChunks();
+  vector<FileChunk> chunks(entry_chunks.begin(), entry_chunks.end());
+  std::sort(chunks.begin(), chunks.end(), ChunkOffsetLessThan);
+  string data;
+  uint64_t position = 0;
+  FileResult result = kFileSame;
+  for (const FileChunk& chunk : chunks) {
+    if (chunk.unencoded_size == 0) {
+      continue;
+    }
+    if (state->IsCancelled() ||
+        chunk.chunk_offset + chunk.unencoded_size > size) {
+      result = kFileDifferent;
+      break;
+    }
+
+    // Chunks usually follow one another, so this mostly reads straight
+    // through the file.
+    if (chunk.chunk_offset != position) {
+      retval = file.Seek(chunk.chunk_offset);
+    }
+    data.resize(chunk.unencoded_size);
+    if (retval.ok()) {
+      retval = file.Read(&data.at(0), data.size(), NULL);
+    }
+    if (!retval.ok()) {
+      LOG(WARNING) << "Error reading " << path << ": " << retval.ToString();
+      *error = retval;
+      result = kFileUnreadable;
+      break;
+    }
+    position = chunk.chunk_offset + chunk.unencoded_size;
+    state->AddBytes(chunk.unencoded_size);
+
+    if (!library_->MatchesChunk(chunk, data)) {
+      result = kFileDifferent;
+      break;
+    }
+  }
+  file.Close();
+  return result;
+}
+
+}  // namespace backup2
@@ -0,0 +1,113 @@
+// Copyright (C) 2013, All Rights Reserved.
+// Author: Cory Maccarrone <darkstar6262@gmail.com>
+#ifndef BACKUP2_SRC_VERIFY_ENGINE_H_
+#define BACKUP2_SRC_VERIFY_ENGINE_H_
+
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+
+#include "src/callback.h"
+#include "src/common.h"
+#include "src/fileset.h"
+#include "src/status.h"
+
+namespace backup2 {
+class BackupLibrary;
+class FileEntry;
+
+// The VerifyEngine checks files on disk against a backup using only the
+// backup's metadata.  Each chunk range of a file is read from disk and its MD5
+// compared with the one recorded for the chunk, so no backup volume is read;
+// a verify runs at the speed of the disk being checked.  Files are checked in
+// parallel by a pool of threads, one file per thread at a time.
+class VerifyEngine {
+ public:
+  // Callback returning the path on disk of a file.  This is called from the
+  // worker threads, and so must be safe to call from multiple threads.
+  typedef ResultCallback1<std::string, const FileEntry&> PathCallback;
+
+  // Callback called periodically with the number of bytes checked so far.
+  // Returning false cancels the verify.
+  typedef ResultCallback1<bool, uint64_t> ProgressCallback;
+
+  // Default number of worker threads.
+  static const int kDefaultNumThreads;
+
+  // Create an engine checking files against the chunk checksums of the given
+  // library, with files found where path_callback says.  Ownership of neither
+  // is taken.  If num_threads is zero, one thread is used per core.
+  VerifyEngine(BackupLibrary* library, PathCallback* path_callback,
+               int num_threads);
+  ~VerifyEngine();
+
+  // Check the given files against the disk.  Directories and symlinks only
+  // have their type checked; regular files must match their backed-up size
+  // and the checksum of every chunk.  progress may be NULL.  Differences are
+  // reported in missing_files(), unreadable_files() and different_files(); the
+  // verify itself only fails if cancelled.
+  Status Verify(const FileEntrySet& files,
+                ProgressCallback* progress);
+
+  // Return the number of bytes of file data checked by the last verify.
+  uint64_t bytes_verified() const { return bytes_verified_; }
+
+  // Return the paths of the files the last verify couldn't find.
+  const std::set<std::string>& missing_files() const {
+    return missing_files_;
+  }
+
+  // Return the paths of the files the last verify found but couldn't open or
+  // read, with the error for each.
+  const std::map<std::string, std::string>& unreadable_files() const {
+    return unreadable_files_;
+  }
+
+  // Return the paths of the files the last verify found to differ from the
+  // backup.
+  const std::set<std::string>& different_files() const {
+    return different_files_;
+  }
+
+ private:
+  // State shared by the threads of one verify.
+  struct State;
+
+  // Thread body of Verify().  Checks files until none are left.
+  void VerifyFiles(const std::vector<const FileEntry*>& files,
+                   State* state);
+
+  // Result of checking one file.
+  enum FileResult {
+    kFileSame,
+    kFileDifferent,
+    kFileMissing,
+    kFileUnreadable,
+  };
+
+  // Check one file, adding the bytes checked to state as it goes.  If the file
+  // can't be opened or read, *error is set to why.
+  FileResult VerifyFile(const FileEntry& entry, const std::string& path,
+                        State* state, Status* error);
+
+  // Library holding the chunk checksums.
+  BackupLibrary* library_;
+
+  // Callback returning the path on disk of a file.
+  PathCallback* path_callback_;
+
+  // Number of worker threads.
+  int num_threads_;
+
+  // Results of the last verify.
+  uint64_t bytes_verified_;
+  std::set<std::string> missing_files_;
+  std::map<std::string, std::string> unreadable_files_;
+  std::set<std::string> different_files_;
+
+  DISALLOW_COPY_AND_ASSIGN(VerifyEngine);
+};
+
+}  // namespace backup2
+#endif  // BACKUP2_SRC_VERIFY_ENGINE_H_
@@ -0,0 +1,160 @@
+// Copyright (C) 2013, All Rights Reserved.
+// Author: Cory Maccarrone <darkstar6262@gmail.com>
+
+#include <memory>
+#include <set>
+#include <string>
+
+#include "boost/filesystem.hpp"
+#include "src/backup_library.h"
+#include "src/callback.h"
+#include "src/fake_backup_volume.h"
+#include "src/file.h"
+#include "src/fileset.h"
+#include "src/gzip_encoder.h"
+#include "src/md5_generator.h"
+#include "src/mock_backup_volume_factory.h"
+#include "src/mock_file.h"
+#include "src/status.h"
+#include "src/verify_engine.h"
+#include "glog/logging.h"
+#include "gmock/gmock.h"
+#include "gtest/gtest.h"
+
+using std::set;
+using std::string;
+using std::unique_ptr;
+using testing::_;
+using testing::DoAll;
+using testing::Return;
+using testing::SetArgPointee;
+
+namespace backup2 {
+
+class VerifyEngineTest : public testing::Test {
+ public:
+  static const char* kVerifyPath;
+
+  void SetUp() {
+    boost::filesystem::remove_all(boost::filesystem::path(kVerifyPath));
+    boost::filesystem::create_directories(
+        boost::filesystem::path(kVerifyPath));
+
+    MockFile* file = new MockFile;
+    MockBackupVolumeFactory* volume_factory = new MockBackupVolumeFactory;
+    volume_change_callback_.reset(
+        NewPermanentCallback(this, &VerifyEngineTest::GetNextFilename));
+    path_callback_.reset(
+        NewPermanentCallback(this, &VerifyEngineTest::VerifyPath));
+
+    EXPECT_CALL(*file, FindBasenameAndLastVolume(_, _, _))
+        .WillOnce(DoAll(
+            SetArgPointee<0>("/foo/bar"),
+            SetArgPointee<1>(0),
+            SetArgPointee<2>(1),
+            Return(Status::OK)));
+    library_.reset(new BackupLibrary(
+        file, volume_change_callback_.get(), new Md5Generator,
+        new GzipEncoder, volume_factory));
+
+    // No volume is read by a verify, beyond the library finding its first.
+    FakeBackupVolume* volume = new FakeBackupVolume(file);
+    volume->InitializeForExistingWithDescriptor2();
+    EXPECT_CALL(*volume_factory, Create("/foo/bar.0.bkp"))
+        .WillOnce(Return(volume));
+    ASSERT_TRUE(library_->Init().ok());
+  }
+
+  void TearDown() {
+    library_.reset();
+    boost::filesystem::remove_all(boost::filesystem::path(kVerifyPath));
+  }
+
+  string GetNextFilename(string /* original */) {
+    return "";
+  }
+
+  string VerifyPath(const FileEntry& entry) {
+    return string(kVerifyPath) + entry.proper_filename();
+  }
+
+ protected:
+  // Create a file entry of the given type, with the given data backed up in
+  // chunks of chunk_size bytes.
+  FileEntry* AddFile(const string& filename, const string& data,
+                     BackupFile::FileType file_type, uint64_t chunk_size) {
+    BackupFile metadata;
+    metadata.file_type = file_type;
+    metadata.file_size = data.size();
+    FileEntry* entry = fileset_.AddFile(filename, metadata);
+    for (uint64_t offset = 0; offset < data.size(); offset += chunk_size) {
+      string chunk_data = data.substr(offset, chunk_size);
+      FileChunk chunk;
+      chunk.md5sum = md5_maker_.Checksum(chunk_data);
+      chunk.volume_num = 0;
+      chunk.chunk_offset = offset;
+      chunk.unencoded_size = chunk_data.size();
+      entry->AddChunk(chunk);
+    }
+    files_.insert(entry);
+    return entry;
+  }
+
+  // Write a file to disk.
+  void WriteFile(const string& filename, const string& data) {
+    File file(string(kVerifyPath) + filename);
+    ASSERT_TRUE(file.Open(File::Mode::kModeAppend).ok());
+    if (!data.empty()) {
+      ASSERT_TRUE(file.Write(&data.at(0), data.size()).ok());
+    }
+    ASSERT_TRUE(file.Close().ok());
+  }
+
+  unique_ptr<BackupLibrary::VolumeChangeCallback> volume_change_callback_;
+  unique_ptr<VerifyEngine::PathCallback> path_callback_;
+  unique_ptr<BackupLibrary> library_;
+  Md5Generator md5_maker_;
+  FileSet fileset_;
+  FileEntrySet files_;
+};
+
+const char* VerifyEngineTest::kVerifyPath = "__verify_engine_test__";
+
+TEST_F(VerifyEngineTest, VerifyFiles) {
+  // Files are checked chunk by chunk against their checksums, and differences
+  // in content, size and type are all found.
+  string data = string(4096, 'a') + string(4096, 'b') + "tail";
+  AddFile("/same", data, BackupFile::kFileTypeRegularFile, 4096);
+  AddFile("/changed", data, BackupFile::kFileTypeRegularFile, 4096);
+  AddFile("/grown", data, BackupFile::kFileTypeRegularFile, 4096);
+  AddFile("/empty", "", BackupFile::kFileTypeRegularFile, 4096);
+  AddFile("/missing", data, BackupFile::kFileTypeRegularFile, 4096);
+  AddFile("/dir", "", BackupFile::kFileTypeDirectory, 4096);
+  AddFile("/not_dir", "", BackupFile::kFileTypeDirectory, 4096);
+
+  WriteFile("/same", data);
+  WriteFile("/changed", string(4096, 'a') + string(4096, 'x') + "tail");
+  WriteFile("/grown", data + "more");
+  WriteFile("/empty", "");
+  WriteFile("/not_dir", "");
+  boost::filesystem::create_directories(
+      boost::filesystem::path(string(kVerifyPath) + "/dir"));
+
+  VerifyEngine engine(library_.get(), path_callback_.get(), 3);
+  Status retval = engine.Verify(files_, NULL);
+  ASSERT_TRUE(retval.ok()) << retval.ToString();
+
+  EXPECT_EQ(set<string>({string(kVerifyPath) + "/missing"}),
+            engine.missing_files());
+  EXPECT_TRUE(engine.unreadable_files().empty());
+  EXPECT_EQ(set<string>({string(kVerifyPath) + "/changed",
+                         string(kVerifyPath) + "/grown",
+                         string(kVerifyPath) + "/not_dir"}),
+            engine.different_files());
+
+  // The changed file stops at its first bad chunk, and the grown one isn't
+  // read at all.
+  EXPECT_EQ(data.size() + 2 * 4096, engine.bytes_verified());
+}
+
+}  // namespace backup2
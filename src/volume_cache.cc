@@ -0,0 +1,158 @@
+// Copyright (C) 2013, All Rights Reserved.
+// Author: Cory Maccarrone <darkstar6262@gmail.com>
+
+#include "src/volume_cache.h"
+
+#include <list>
+#include <memory>
+#include <mutex>
+
+#include "glog/logging.h"
+#include "src/backup_volume_interface.h"
+
+using std::lock_guard;
+using std::mutex;
+using std::shared_ptr;
+
+namespace backup2 {
+
+VolumeCache::VolumeCache(uint64_t max_volumes, uint64_t max_bytes)
+    : max_volumes_(0),
+      max_bytes_(0),
+      unpinned_volumes_(0),
+      unpinned_bytes_(0),
+      hits_(0),
+      misses_(0),
+      evictions_(0) {
+  Reset(max_volumes, max_bytes);
+}
+
+VolumeCache::~VolumeCache() {
+}
+
+shared_ptr<CachedVolume> VolumeCache::Find(uint64_t volume_number) {
+  lock_guard<mutex> lock(mutex_);
+  auto location_iter = locations_.find(volume_number);
+  if (location_iter == locations_.end()) {
+    ++misses_;
+    return shared_ptr<CachedVolume>();
+  }
+
+  ++hits_;
+  entries_.splice(entries_.begin(), entries_, location_iter->second);
+  return location_iter->second->volume;
+}
+
+shared_ptr<CachedVolume> VolumeCache::Insert(uint64_t volume_number,
+                                             BackupVolumeInterface* volume) {
+  shared_ptr<CachedVolume> cached(new CachedVolume(volume));
+  Entry entry;
+  entry.volume_number = volume_number;
+  entry.memory = volume->EstimatedMemoryUsage();
+  entry.pinned = false;
+  entry.volume = cached;
+
+  lock_guard<mutex> lock(mutex_);
+  auto location_iter = locations_.find(entry.volume_number);
+  if (location_iter != locations_.end()) {
+    EraseLocked(location_iter->second);
+  }
+  entries_.push_front(entry);
+  locations_[entry.volume_number] = entries_.begin();
+  ++unpinned_volumes_;
+  unpinned_bytes_ += entry.memory;
+
+  EvictLocked();
+  return cached;
+}
+
+void VolumeCache::Erase(uint64_t volume_number) {
+  lock_guard<mutex> lock(mutex_);
+  auto location_iter = locations_.find(volume_number);
+  if (location_iter != locations_.end()) {
+    EraseLocked(location_iter->second);
+  }
+}
+
+void VolumeCache::SetPinned(uint64_t volume_number, bool pinned) {
+  lock_guard<mutex> lock(mutex_);
+  auto location_iter = locations_.find(volume_number);
+  if (location_iter == locations_.end()) {
+    return;
+  }
+
+  Entry& entry = *location_iter->second;
+  if (entry.pinned == pinned) {
+    return;
+  }
+  entry.pinned = pinned;
+  if (pinned) {
+    --unpinned_volumes_;
+    unpinned_bytes_ -= entry.memory;
+  } else {
+    // A volume written while pinned may have grown since it was inserted.
+    entry.memory = entry.volume->volume->EstimatedMemoryUsage();
+    ++unpinned_volumes_;
+    unpinned_bytes_ += entry.memory;
+    EvictLocked();
+  }
+}
+
+void VolumeCache::Reset(uint64_t max_volumes, uint64_t max_bytes) {
+  lock_guard<mutex> lock(mutex_);
+  entries_.clear();
+  locations_.clear();
+  unpinned_volumes_ = 0;
+  unpinned_bytes_ = 0;
+  max_volumes_ = max_volumes;
+  max_bytes_ = max_bytes;
+}
+
+uint64_t VolumeCache::hits() const {
+  lock_guard<mutex> lock(mutex_);
+  return hits_;
+}
+
+uint64_t VolumeCache::misses() const {
+  lock_guard<mutex> lock(mutex_);
+  return misses_;
+}
+
+uint64_t VolumeCache::evictions() const {
+  lock_guard<mutex> lock(mutex_);
+  return evictions_;
+}
+
+uint64_t VolumeCache::size() const {
+  lock_guard<mutex> lock(mutex_);
+  return entries_.size();
+}
+
+void VolumeCache::EraseLocked(EntryList::iterator entry) {
+  if (!entry->pinned) {
+    --unpinned_volumes_;
+    unpinned_bytes_ -= entry->memory;
+  }
+  locations_.erase(entry->volume_number);
+  entries_.erase(entry);
+}
+
+void VolumeCache::EvictLocked() {
+  // Walk from the least recently used end, skipping pinned volumes.  The most
+  // recently used unpinned volume is never evicted, so the volume just asked
+  // for stays open however large it is.
+  auto entry = entries_.end();
+  while (unpinned_volumes_ > 1 &&
+         (unpinned_volumes_ > max_volumes_ || unpinned_bytes_ > max_bytes_)) {
+    --entry;
+    if (entry->pinned) {
+      continue;
+    }
+    VLOG(3) << "Evicting backup volume " << entry->volume_number;
+    auto evicted = entry++;
+    EraseLocked(evicted);
+    ++evictions_;
+  }
+}
+
+}  // namespace backup2
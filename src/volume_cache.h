@@ -0,0 +1,112 @@
+// Copyright (C) 2013, All Rights Reserved.
+// Author: Cory Maccarrone <darkstar6262@gmail.com>
+#ifndef BACKUP2_SRC_VOLUME_CACHE_H_
+#define BACKUP2_SRC_VOLUME_CACHE_H_
+
+#include <list>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+
+#include "src/backup_volume_interface.h"
+#include "src/common.h"
+
+namespace backup2 {
+
+// A volume held by a VolumeCache.  A volume's reads share its file position,
+// so the mutex must be held while the volume is used.
+struct CachedVolume {
+  explicit CachedVolume(BackupVolumeInterface* volume) : volume(volume) {}
+
+  std::unique_ptr<BackupVolumeInterface> volume;
+  std::mutex mutex;
+};
+
+// A VolumeCache keeps initialized backup volumes open, keyed by volume number,
+// so that alternating between volumes doesn't re-open them and re-read their
+// descriptors.  The least recently used volumes are closed to keep within a
+// limit on the number open, which bounds the file descriptors held, and a
+// budget of the memory their chunk maps take.  At least the most recently used
+// volume is always kept.
+//
+// Volumes are handed out shared, so a volume stays valid after it's evicted
+// until its users are done with it.  Pinned volumes, such as one being written,
+// are never evicted, and don't count against the limits.
+//
+// The cache is safe to use from multiple threads.
+class VolumeCache {
+ public:
+  // Create a cache keeping up to max_volumes volumes open, with up to
+  // max_bytes of estimated memory use between them.
+  VolumeCache(uint64_t max_volumes, uint64_t max_bytes);
+  ~VolumeCache();
+
+  // Return the volume with the given number, or NULL if it isn't cached.
+  std::shared_ptr<CachedVolume> Find(uint64_t volume_number);
+
+  // Add an initialized volume to the cache under the given volume number,
+  // replacing any volume already there, and evict others as needed.  Ownership
+  // of the volume is taken.  Its memory use is estimated here, and again when
+  // it's unpinned.
+  std::shared_ptr<CachedVolume> Insert(uint64_t volume_number,
+                                       BackupVolumeInterface* volume);
+
+  // Drop the volume with the given number, if cached.
+  void Erase(uint64_t volume_number);
+
+  // Set whether the volume with the given number can be evicted.  Unpinning a
+  // volume may evict others.
+  void SetPinned(uint64_t volume_number, bool pinned);
+
+  // Drop all volumes, and change the limits.  The counters are kept.
+  void Reset(uint64_t max_volumes, uint64_t max_bytes);
+
+  // Counters of lookups that found their volume, lookups that didn't, and
+  // volumes evicted to make room for others.
+  uint64_t hits() const;
+  uint64_t misses() const;
+  uint64_t evictions() const;
+
+  // Return the number of volumes cached, pinned or not.
+  uint64_t size() const;
+
+ private:
+  struct Entry {
+    uint64_t volume_number;
+    uint64_t memory;
+    bool pinned;
+    std::shared_ptr<CachedVolume> volume;
+  };
+
+  typedef std::list<Entry> EntryList;
+
+  // Drop the given entry.  Must be called with the lock held.
+  void EraseLocked(EntryList::iterator entry);
+
+  // Evict unpinned volumes until the cache is within its limits.  Must be
+  // called with the lock held.
+  void EvictLocked();
+
+  mutable std::mutex mutex_;
+
+  uint64_t max_volumes_;
+  uint64_t max_bytes_;
+
+  // Volumes, most recently used first, and the number and memory of those not
+  // pinned.
+  EntryList entries_;
+  uint64_t unpinned_volumes_;
+  uint64_t unpinned_bytes_;
+
+  // Location of every volume in entries_.
+  std::unordered_map<uint64_t, EntryList::iterator> locations_;
+
+  uint64_t hits_;
+  uint64_t misses_;
+  uint64_t evictions_;
+
+  DISALLOW_COPY_AND_ASSIGN(VolumeCache);
+};
+
+}  // namespace backup2
+#endif  // BACKUP2_SRC_VOLUME_CACHE_H_
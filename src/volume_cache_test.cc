@@ -0,0 +1,129 @@
+// Copyright (C) 2013, All Rights Reserved.
+// Author: Cory Maccarrone <darkstar6262@gmail.com>
+
+#include <memory>
+
+#include "src/backup_volume_defs.h"
+#include "src/common.h"
+#include "src/fake_backup_volume.h"
+#include "src/volume_cache.h"
+#include "glog/logging.h"
+#include "gtest/gtest.h"
+
+using std::shared_ptr;
+
+namespace backup2 {
+
+class VolumeCacheTest : public testing::Test {
+ protected:
+  // Return a volume with one chunk, and so one chunk's worth of memory use.
+  FakeBackupVolume* Volume(uint64_t volume_number) {
+    FakeBackupVolume* volume = new FakeBackupVolume;
+    volume->set_volume_number(volume_number);
+    volume->InitializeForExistingWithDescriptor2();
+    return volume;
+  }
+};
+
+TEST_F(VolumeCacheTest, FindAndInsert) {
+  VolumeCache cache(4, 1000000);
+  EXPECT_FALSE(cache.Find(1));
+
+  FakeBackupVolume* volume = Volume(1);
+  shared_ptr<CachedVolume> cached = cache.Insert(1, volume);
+  EXPECT_EQ(volume, cached->volume.get());
+  EXPECT_EQ(cached.get(), cache.Find(1).get());
+  EXPECT_FALSE(cache.Find(2));
+  EXPECT_EQ(1, cache.size());
+
+  // Inserting a volume again replaces the cached one.
+  cached = cache.Insert(1, Volume(1));
+  EXPECT_NE(volume, cached->volume.get());
+  EXPECT_EQ(cached.get(), cache.Find(1).get());
+  EXPECT_EQ(1, cache.size());
+
+  EXPECT_EQ(2, cache.hits());
+  EXPECT_EQ(2, cache.misses());
+  EXPECT_EQ(0, cache.evictions());
+}
+
+TEST_F(VolumeCacheTest, EvictsLeastRecentlyUsed) {
+  VolumeCache cache(3, 1000000);
+  shared_ptr<CachedVolume> first = cache.Insert(1, Volume(1));
+  cache.Insert(2, Volume(2));
+  cache.Insert(3, Volume(3));
+
+  // Using volume 1 makes volume 2 the one to go.
+  EXPECT_TRUE(cache.Find(1));
+  cache.Insert(4, Volume(4));
+  EXPECT_EQ(3, cache.size());
+  EXPECT_EQ(1, cache.evictions());
+  EXPECT_TRUE(cache.Find(1));
+  EXPECT_FALSE(cache.Find(2));
+  EXPECT_TRUE(cache.Find(3));
+  EXPECT_TRUE(cache.Find(4));
+
+  // Evicted volumes stay valid for those still using them.
+  cache.Erase(1);
+  EXPECT_FALSE(cache.Find(1));
+  EXPECT_EQ(1, first->volume->volume_number());
+}
+
+TEST_F(VolumeCacheTest, MemoryBudget) {
+  // Room for two volumes of one chunk each.
+  VolumeCache cache(10, 2 * sizeof(BackupDescriptor1Chunk));
+  cache.Insert(1, Volume(1));
+  cache.Insert(2, Volume(2));
+  EXPECT_EQ(2, cache.size());
+  cache.Insert(3, Volume(3));
+  EXPECT_EQ(2, cache.size());
+  EXPECT_FALSE(cache.Find(1));
+
+  // The most recently used volume is kept, however large.
+  VolumeCache small_cache(10, 0);
+  small_cache.Insert(1, Volume(1));
+  EXPECT_TRUE(small_cache.Find(1));
+  small_cache.Insert(2, Volume(2));
+  EXPECT_EQ(1, small_cache.size());
+  EXPECT_TRUE(small_cache.Find(2));
+}
+
+TEST_F(VolumeCacheTest, Pinning) {
+  VolumeCache cache(2, 1000000);
+  cache.Insert(1, Volume(1));
+  cache.SetPinned(1, true);
+
+  // Pinned volumes aren't evicted, and don't count against the limit.
+  cache.Insert(2, Volume(2));
+  cache.Insert(3, Volume(3));
+  cache.Insert(4, Volume(4));
+  EXPECT_EQ(3, cache.size());
+  EXPECT_TRUE(cache.Find(1));
+  EXPECT_FALSE(cache.Find(2));
+
+  // Unpinning brings the cache back within its limit.
+  cache.SetPinned(1, false);
+  EXPECT_EQ(2, cache.size());
+  EXPECT_TRUE(cache.Find(1));
+  EXPECT_FALSE(cache.Find(3));
+  EXPECT_TRUE(cache.Find(4));
+}
+
+TEST_F(VolumeCacheTest, Reset) {
+  VolumeCache cache(4, 1000000);
+  cache.Insert(1, Volume(1));
+  cache.Insert(2, Volume(2));
+  EXPECT_TRUE(cache.Find(1));
+
+  cache.Reset(1, 1000000);
+  EXPECT_EQ(0, cache.size());
+  EXPECT_FALSE(cache.Find(1));
+  EXPECT_EQ(1, cache.hits());
+
+  cache.Insert(1, Volume(1));
+  cache.Insert(2, Volume(2));
+  EXPECT_EQ(1, cache.size());
+  EXPECT_TRUE(cache.Find(2));
+}
+
+}  // namespace backup2